@@ -0,0 +1,43 @@
+//**************************************************************************
+//*
+//* Title:		Enter the SOTA bootloader from the application
+//* Filename:		sota_mailbox.c
+//*
+//**************************************************************************
+
+#include	<inttypes.h>
+#include	<avr/io.h>
+#include	<avr/interrupt.h>
+#include	<avr/wdt.h>
+#include	"../mailbox.h"
+#include	"sota_mailbox.h"
+
+//*****************************************************************************
+/*
+ * leave the request in the mailbox and reset through the watchdog
+ */
+void sota_mailbox_request(uint8_t baudSelect, const uint8_t *nonce)
+{
+volatile sota_mailbox_t	*mailbox	=	SOTA_MAILBOX;
+uint8_t					ii;
+
+	cli();
+	mailbox->flags		=	SOTA_MAILBOX_ENTER_UPDATE;
+	mailbox->baudSelect	=	baudSelect;
+	for (ii=0; ii<SOTA_MAILBOX_NONCE_SIZE; ii++)
+	{
+		mailbox->nonce[ii]	=	nonce ? nonce[ii] : 0;
+	}
+	if (nonce)
+	{
+		mailbox->flags	|=	SOTA_MAILBOX_SESSION;
+	}
+	mailbox->magic		=	SOTA_MAILBOX_MAGIC;
+	mailbox->check		=	sota_mailbox_check(mailbox);
+
+	wdt_enable(WDTO_15MS);
+	for (;;)
+	{
+		// wait for the watchdog reset
+	}
+}
@@ -0,0 +1,22 @@
+//**************************************************************************
+//*
+//* Title:		Enter the SOTA bootloader from the application
+//* Filename:		sota_mailbox.h
+//*
+//*	sota_mailbox_request(baudSelect, nonce);	// does not return
+//*
+//* baudSelect is the value for the bootloader's UART baud rate register
+//* (0 keeps the bootloader default), nonce is the 16 byte session nonce the
+//* application agreed on with the update host, or 0 to leave authentication
+//* to the host. See mailbox.h for the linker option the application needs.
+//*
+//**************************************************************************
+
+#ifndef _SOTA_MAILBOX_H_
+#define _SOTA_MAILBOX_H_
+
+#include	<inttypes.h>
+
+void	sota_mailbox_request(uint8_t baudSelect, const uint8_t *nonce) __attribute__ ((noreturn));
+
+#endif	//	_SOTA_MAILBOX_H_
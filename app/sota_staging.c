@@ -0,0 +1,112 @@
+//**************************************************************************
+//*
+//* Title:		SOTA staging in external SPI flash, application side
+//* Filename:		sota_staging.c
+//*
+//* Layout and SPI access are shared with the bootloader through spiflash.h,
+//* the CRC32 matches crc32_update() in stk500boot.c.
+//*
+//**************************************************************************
+
+#include	<inttypes.h>
+#include	<avr/io.h>
+#include	"../spiflash.h"
+#include	"sota_staging.h"
+
+#define	SOTA_STAGING_MAX_LENGTH		0x1000000UL
+
+uint32_t	stagingLength;		//*	bytes of the stream written so far
+uint32_t	stagingCrc;
+
+//*****************************************************************************
+static uint32_t staging_crc32_update(uint32_t crc, unsigned char data)
+{
+unsigned char	ii;
+
+	crc	^=	data;
+	for (ii=0; ii<8; ii++)
+	{
+		crc	=	(crc >> 1) ^ ((crc & 1) ? 0xEDB88320UL : 0);
+	}
+	return crc;
+}
+
+//*****************************************************************************
+/*
+ * start a new stream, the header sector is erased so a reset from here on
+ * leaves nothing the bootloader would pick up
+ */
+void sota_staging_begin(void)
+{
+	spiflash_init();
+	spiflash_sector_erase(SPIFLASH_STAGING_BASE);
+	stagingLength	=	0;
+	stagingCrc		=	0xFFFFFFFF;
+}
+
+//*****************************************************************************
+/*
+ * append received frames to the stream, sectors are erased as they are reached
+ * returns 0 if the stream would not fit
+ */
+unsigned char sota_staging_write(const unsigned char *data, unsigned int length)
+{
+uint32_t		flashAddress;
+unsigned int	chunk;
+unsigned int	ii;
+
+	if ((SOTA_STAGING_MAX_LENGTH - stagingLength) < length)
+	{
+		return 0;
+	}
+	for (ii=0; ii<length; ii++)
+	{
+		stagingCrc	=	staging_crc32_update(stagingCrc, data[ii]);
+	}
+	while (length)
+	{
+		flashAddress	=	SOTA_STAGING_STREAM + stagingLength;
+		if ((flashAddress % SPIFLASH_SECTOR_SIZE) == 0)
+		{
+			spiflash_sector_erase(flashAddress);
+		}
+		//*	a page program must not wrap around the end of the page
+		chunk	=	SPIFLASH_PAGE_SIZE - (flashAddress % SPIFLASH_PAGE_SIZE);
+		if (chunk > length)
+		{
+			chunk	=	length;
+		}
+		spiflash_program(flashAddress, data, chunk);
+		data			+=	chunk;
+		length			-=	chunk;
+		stagingLength	+=	chunk;
+	}
+	return 1;
+}
+
+//*****************************************************************************
+/*
+ * write the header, the stream is handed to the bootloader on the next reset
+ */
+unsigned char sota_staging_commit(void)
+{
+unsigned char	header[SOTA_STAGING_HEADER_SIZE];
+uint32_t		crc;
+unsigned char	ii;
+
+	if (stagingLength == 0)
+	{
+		return 0;
+	}
+	crc	=	~stagingCrc;
+	for (ii=0; ii<4; ii++)
+	{
+		header[SOTA_STAGING_OFFSET_MAGIC + ii]	=	(SOTA_STAGING_MAGIC >> (24 - (8 * ii))) & 0xFF;
+		header[SOTA_STAGING_OFFSET_LENGTH + ii]	=	(stagingLength >> (24 - (8 * ii))) & 0xFF;
+		header[SOTA_STAGING_OFFSET_CRC + ii]	=	(crc >> (24 - (8 * ii))) & 0xFF;
+	}
+	header[SOTA_STAGING_OFFSET_STATE]	=	SOTA_STAGING_STATE_READY;
+	spiflash_program(SPIFLASH_STAGING_BASE, header, SOTA_STAGING_HEADER_SIZE);
+	spiflash_release();
+	return 1;
+}
@@ -0,0 +1,28 @@
+//**************************************************************************
+//*
+//* Title:		SOTA staging in external SPI flash, application side
+//* Filename:		sota_staging.h
+//*
+//* Lets the running application store a SOTA frame stream in SPI flash
+//* while it keeps working. After sota_staging_commit() a reset hands the
+//* stream to the bootloader (built with ENABLE_SPIFLASH_STAGING), which
+//* programs it without using the radio link.
+//*
+//*	sota_staging_begin();
+//*	while (frames arrive)
+//*		sota_staging_write(frame, frameLength);
+//*	if (sota_staging_commit())
+//*		reset through the watchdog
+//*
+//**************************************************************************
+
+#ifndef _SOTA_STAGING_H_
+#define _SOTA_STAGING_H_
+
+#include	<inttypes.h>
+
+void			sota_staging_begin(void);
+unsigned char	sota_staging_write(const unsigned char *data, unsigned int length);
+unsigned char	sota_staging_commit(void);
+
+#endif	//	_SOTA_STAGING_H_
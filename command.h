@@ -118,3 +118,19 @@
 #define CMD_AUTH                            0x67
 #define CMD_AUTH_SECOND_PHASE               0x68
 #define SOTA_MESSAGE_START                  0x58
+#define CMD_VERIFY_IMAGE                    0x69
+#define CMD_IMAGE_SIGNATURE                 0x6A
+#define CMD_RESUME                          0x6B
+#define CMD_SELECT_SLOT                     0x6C
+#define CMD_ACTIVATE_SLOT                   0x6D
+#define CMD_READ_FLASH_BULK                 0x6E
+#define CMD_AUTH_FAST                       0x6F
+#define CMD_AUTH_TICKET                     0x70
+#define CMD_COMMIT_IMAGE                    0x71
+#define CMD_GET_STATS                       0x72
+#define CMD_GET_TRACE                       0x73
+
+// *****************[ SOTA verify modes ]***************************
+
+#define VERIFY_MODE_CRC32                   0x00
+#define VERIFY_MODE_SHA256                  0x01
@@ -0,0 +1,59 @@
+//**************************************************************************
+//*
+//* Title:		Hardware abstraction of the SOTA bootloader
+//* Filename:		hal.h
+//*
+//* The framing, STK500 parser, AES engine and command handlers in
+//* stk500boot.c reach the hardware only through the calls below, so the
+//* same code builds for the AVR (hal_avr.h) and natively on a workstation
+//* against simulated flash and EEPROM (host/hal_host.h, make host).
+//*
+//*	hal_init()							before anything else in main()
+//*
+//*	UART
+//*	hal_uart_init(baudSelect)			baud rate register value, see HAL_UART_BAUD_SELECT()
+//*	hal_uart_enable()					receiver and transmitter on
+//*	hal_uart_release()					back to reset state before the application starts
+//*	hal_uart_available()				nonzero when a received byte is waiting
+//*	hal_uart_get()						waits for the next byte
+//*	hal_uart_put(c)						sends one byte, returns once it is out
+//*
+//*	Flash, addresses in bytes, the SPM calls may be made with interrupts on
+//*	hal_flash_read_byte(address)
+//*	hal_flash_read_word(address)
+//*	hal_flash_read_block(address, dest, count)
+//*	hal_flash_page_fill(address, data)	one word into the page buffer
+//*	hal_flash_page_erase(address)		the page buffer survives an erase
+//*	hal_flash_page_write(address)		writes and clears the page buffer
+//*	hal_flash_busy_wait()				waits for erase or write to finish
+//*	hal_flash_rww_enable()				application section readable again, drops the page buffer
+//*	hal_fuse_read(which)				HAL_FUSE_LOW, HAL_FUSE_HIGH, HAL_FUSE_EXTENDED, HAL_LOCK_BITS
+//*	hal_lock_bits_set(bits)
+//*
+//*	EEPROM, the write path is the eeprom_queue in stk500boot.c
+//*	hal_eeprom_read_byte(address)
+//*	hal_eeprom_read_block(dest, address, count)
+//*
+//*	System
+//*	hal_irq_enable(), hal_irq_disable()
+//*	hal_vectors_boot(), hal_vectors_app()	interrupt vectors in the boot or application section
+//*	hal_watchdog_disarm()				stops the watchdog, nonzero if it caused the reset
+//*	hal_delay_us(us)					constant delays only
+//*	hal_start_application()				does not return
+//*
+//* Timer1 (the cycle clock and the entropy pool), the EEPROM ready interrupt
+//* and the other interrupt driven parts stay in stk500boot.c, the host build
+//* replaces them there.
+//*
+//**************************************************************************
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#ifdef HOST_BUILD
+	#include	"host/hal_host.h"
+#else
+	#include	"hal_avr.h"
+#endif
+
+#endif	//	_HAL_H_
@@ -0,0 +1,306 @@
+//**************************************************************************
+//*
+//* Title:		AVR implementation of the bootloader HAL
+//* Filename:		hal_avr.h
+//*
+//* Included through hal.h. Everything is inline or a macro so the bootloader
+//* compiles to the same register accesses as before. The UART calls are
+//* macros because UART_BAUDRATE_DOUBLE_SPEED is settled by the board
+//* selection in stk500boot.c, after this file.
+//*
+//**************************************************************************
+
+#ifndef _HAL_AVR_H_
+#define _HAL_AVR_H_
+
+#include	<inttypes.h>
+#include	<avr/io.h>
+#include	<avr/interrupt.h>
+#include	<avr/boot.h>
+#include	<avr/pgmspace.h>
+#include	<util/delay.h>
+#include	<avr/eeprom.h>
+#include	<avr/common.h>
+
+/*
+ * use 16bit address variable for ATmegas with <= 64K flash
+ */
+#if defined(RAMPZ)
+	#define	HAL_FAR_FLASH
+	typedef uint32_t address_t;
+#else
+	typedef uint16_t address_t;
+#endif
+
+/*
+ * register holding IVSEL/IVCE, used to move the interrupt vectors into the boot section
+ */
+#if defined(GICR)
+	#define	INTERRUPT_SELECT_REG	GICR
+#else
+	#define	INTERRUPT_SELECT_REG	MCUCR
+#endif
+
+#ifndef EEWE
+	#define EEWE    1
+#endif
+#ifndef EEMWE
+	#define EEMWE   2
+#endif
+#if !defined(EE_READY_vect) && defined(EE_RDY_vect)
+	#define EE_READY_vect	EE_RDY_vect
+#endif
+
+#if defined(_BOARD_ROBOTX_) || defined(__AVR_AT90USB1287__) || defined(__AVR_AT90USB1286__)
+	#define	UART_BAUD_RATE_LOW			UBRR1L
+	#define	UART_STATUS_REG				UCSR1A
+	#define	UART_CONTROL_REG			UCSR1B
+	#define	UART_ENABLE_TRANSMITTER		TXEN1
+	#define	UART_ENABLE_RECEIVER		RXEN1
+	#define	UART_TRANSMIT_COMPLETE		TXC1
+	#define	UART_RECEIVE_COMPLETE		RXC1
+	#define	UART_DATA_REG				UDR1
+	#define	UART_DOUBLE_SPEED			U2X1
+
+#elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega16__) || defined(__AVR_ATmega32__) \
+	|| defined(__AVR_ATmega8515__) || defined(__AVR_ATmega8535__)
+	/* ATMega8 with one USART */
+	#define	UART_BAUD_RATE_LOW			UBRRL
+	#define	UART_STATUS_REG				UCSRA
+	#define	UART_CONTROL_REG			UCSRB
+	#define	UART_ENABLE_TRANSMITTER		TXEN
+	#define	UART_ENABLE_RECEIVER		RXEN
+	#define	UART_TRANSMIT_COMPLETE		TXC
+	#define	UART_RECEIVE_COMPLETE		RXC
+	#define	UART_DATA_REG				UDR
+	#define	UART_DOUBLE_SPEED			U2X
+
+#elif defined(__AVR_ATmega64__) || defined(__AVR_ATmega128__) || defined(__AVR_ATmega162__) \
+	 || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega2561__)
+	/* ATMega with two USART, use UART0 */
+	#define	UART_BAUD_RATE_LOW			UBRR0L
+	#define	UART_STATUS_REG				UCSR0A
+	#define	UART_CONTROL_REG			UCSR0B
+	#define	UART_ENABLE_TRANSMITTER		TXEN0
+	#define	UART_ENABLE_RECEIVER		RXEN0
+	#define	UART_TRANSMIT_COMPLETE		TXC0
+	#define	UART_RECEIVE_COMPLETE		RXC0
+	#define	UART_DATA_REG				UDR0
+	#define	UART_DOUBLE_SPEED			U2X0
+#elif defined(UBRR0L) && defined(UCSR0A) && defined(TXEN0)
+	/* ATMega with two USART, use UART0 */
+	#define	UART_BAUD_RATE_LOW			UBRR0L
+	#define	UART_STATUS_REG				UCSR0A
+	#define	UART_CONTROL_REG			UCSR0B
+	#define	UART_ENABLE_TRANSMITTER		TXEN0
+	#define	UART_ENABLE_RECEIVER		RXEN0
+	#define	UART_TRANSMIT_COMPLETE		TXC0
+	#define	UART_RECEIVE_COMPLETE		RXC0
+	#define	UART_DATA_REG				UDR0
+	#define	UART_DOUBLE_SPEED			U2X0
+#elif defined(UBRRL) && defined(UCSRA) && defined(UCSRB) && defined(TXEN) && defined(RXEN)
+	//* catch all
+	#define	UART_BAUD_RATE_LOW			UBRRL
+	#define	UART_STATUS_REG				UCSRA
+	#define	UART_CONTROL_REG			UCSRB
+	#define	UART_ENABLE_TRANSMITTER		TXEN
+	#define	UART_ENABLE_RECEIVER		RXEN
+	#define	UART_TRANSMIT_COMPLETE		TXC
+	#define	UART_RECEIVE_COMPLETE		RXC
+	#define	UART_DATA_REG				UDR
+	#define	UART_DOUBLE_SPEED			U2X
+#else
+	#error "no UART definition for MCU available"
+#endif
+
+/*
+ * Macro to calculate UBBR from XTAL and baudrate
+ */
+#if defined(__AVR_ATmega32__)
+	#define HAL_UART_BAUD_SELECT(baudRate)	(UART_BAUDRATE_DOUBLE_SPEED ? ((F_CPU / 4 / (baudRate) - 1) / 2) : ((F_CPU / 8 / (baudRate) - 1) / 2))
+#else
+	#define HAL_UART_BAUD_SELECT(baudRate)	(((float)(F_CPU))/(((float)(baudRate))*(UART_BAUDRATE_DOUBLE_SPEED ? 8.0 : 16.0))-1.0+0.5)
+#endif
+
+#define	hal_init()
+
+//*****************************************************************************
+//*	UART
+
+#define	hal_uart_init(baudSelect)											\
+	do																		\
+	{																		\
+		if (UART_BAUDRATE_DOUBLE_SPEED)										\
+		{																	\
+			UART_STATUS_REG	|=	(1 << UART_DOUBLE_SPEED);					\
+		}																	\
+		UART_BAUD_RATE_LOW	=	(baudSelect);								\
+	} while (0)
+
+#define	hal_uart_enable()		(UART_CONTROL_REG	=	(1 << UART_ENABLE_RECEIVER) | (1 << UART_ENABLE_TRANSMITTER))
+#define	hal_uart_release()		(UART_STATUS_REG	&=	0xfd)
+#define	hal_uart_available()	(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE))
+
+static inline unsigned char hal_uart_get(void)
+{
+	while (!(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE)))
+	{
+		// wait for data
+	}
+	return UART_DATA_REG;
+}
+
+static inline void hal_uart_put(unsigned char c)
+{
+	UART_DATA_REG	=	c;										// prepare transmission
+	while (!(UART_STATUS_REG & (1 << UART_TRANSMIT_COMPLETE)));	// wait until byte sent
+	UART_STATUS_REG |= (1 << UART_TRANSMIT_COMPLETE);			// delete TXCflag
+}
+
+//*****************************************************************************
+//*	Flash
+
+static inline unsigned char hal_flash_read_byte(address_t flashAddress)
+{
+#if (FLASHEND > 0x10000)
+	return pgm_read_byte_far(flashAddress);
+#else
+	return pgm_read_byte_near(flashAddress);
+#endif
+}
+
+static inline unsigned int hal_flash_read_word(address_t flashAddress)
+{
+#if (FLASHEND > 0x10000)
+	return pgm_read_word_far(flashAddress);
+#else
+	return pgm_read_word_near(flashAddress);
+#endif
+}
+
+/*
+ * copy a run of flash bytes to RAM, the (E)LPM Z+ post increment walks the
+ * whole range after a single address setup, 64K boundaries included
+ */
+static inline void hal_flash_read_block(address_t flashAddress, unsigned char *dest, unsigned int count)
+{
+uint16_t	zAddress	=	flashAddress;
+
+	if (count == 0)
+	{
+		return;
+	}
+#if (FLASHEND > 0x10000)
+	RAMPZ	=	flashAddress >> 16;
+	asm volatile(
+			"1:	elpm	__tmp_reg__, Z+	\n\t"
+			"	st		X+, __tmp_reg__	\n\t"
+			"	sbiw	%[count], 1		\n\t"
+			"	brne	1b				\n\t"
+			: "+z" (zAddress), "+x" (dest), [count] "+w" (count)
+			:
+			: "memory"
+			);
+#else
+	asm volatile(
+			"1:	lpm		__tmp_reg__, Z+	\n\t"
+			"	st		X+, __tmp_reg__	\n\t"
+			"	sbiw	%[count], 1		\n\t"
+			"	brne	1b				\n\t"
+			: "+z" (zAddress), "+x" (dest), [count] "+w" (count)
+			:
+			: "memory"
+			);
+#endif
+}
+
+/*
+ * SPM must follow the SPMCSR write within four cycles, an interrupt in
+ * between (EE_READY, the entropy pool's WDT/ADC/Timer1 sources, the cycle
+ * clock) makes the CPU drop the operation. Every SPM sequence runs with
+ * interrupts off and restores SREG afterwards, so the callers need not
+ * know which interrupts are live.
+ */
+#define	HAL_SPM_ATOMIC(operation)											\
+	do																		\
+	{																		\
+		uint8_t	spmSreg	=	SREG;											\
+		__asm__ __volatile__ ("cli" ::: "memory");							\
+		operation;															\
+		SREG	=	spmSreg;												\
+	} while (0)
+
+#define	hal_flash_page_fill(flashAddress, data)		HAL_SPM_ATOMIC(boot_page_fill(flashAddress, data))
+#define	hal_flash_page_erase(flashAddress)			HAL_SPM_ATOMIC(boot_page_erase(flashAddress))
+#define	hal_flash_page_write(flashAddress)			HAL_SPM_ATOMIC(boot_page_write(flashAddress))
+#define	hal_flash_busy_wait()						boot_spm_busy_wait()
+#define	hal_flash_rww_enable()						HAL_SPM_ATOMIC(boot_rww_enable())
+
+#define	HAL_FUSE_LOW			GET_LOW_FUSE_BITS
+#define	HAL_FUSE_HIGH			GET_HIGH_FUSE_BITS
+#define	HAL_FUSE_EXTENDED		GET_EXTENDED_FUSE_BITS
+#define	HAL_LOCK_BITS			GET_LOCK_BITS
+
+static inline unsigned char hal_fuse_read(unsigned char which)
+{
+unsigned char	fuseBits;
+
+	HAL_SPM_ATOMIC(fuseBits = boot_lock_fuse_bits_get(which));
+	return fuseBits;
+}
+
+#define	hal_lock_bits_set(lockBits)					HAL_SPM_ATOMIC(boot_lock_bits_set(lockBits))
+
+//*****************************************************************************
+//*	EEPROM
+
+#define	hal_eeprom_read_byte(eeAddress)					eeprom_read_byte((const uint8_t *)(uintptr_t)(eeAddress))
+#define	hal_eeprom_read_block(dest, eeAddress, count)	eeprom_read_block(dest, (const void *)(uintptr_t)(eeAddress), count)
+
+//*****************************************************************************
+//*	System
+
+#define	hal_irq_enable()		__asm__ __volatile__ ("sei")
+#define	hal_irq_disable()		__asm__ __volatile__ ("cli")
+#define	hal_delay_us(us)		_delay_us(us)
+
+static inline void hal_vectors_boot(void)
+{
+	INTERRUPT_SELECT_REG	=	(1 << IVCE);
+	INTERRUPT_SELECT_REG	=	(1 << IVSEL);
+}
+
+static inline void hal_vectors_app(void)
+{
+	INTERRUPT_SELECT_REG	=	(1 << IVCE);
+	INTERRUPT_SELECT_REG	=	0;
+}
+
+//*	Dec 29,	2011	<MLS> Issue #181, added watch dog timmer support
+static inline unsigned char hal_watchdog_disarm(void)
+{
+uint8_t	mcuStatusReg	=	MCUSR;
+
+	__asm__ __volatile__ ("cli");
+	__asm__ __volatile__ ("wdr");
+	MCUSR	=	0;
+	WDTCSR	|=	_BV(WDCE) | _BV(WDE);
+	WDTCSR	=	0;
+	__asm__ __volatile__ ("sei");
+	return mcuStatusReg & _BV(WDRF);
+}
+
+static inline void hal_start_application(void) __attribute__ ((noreturn));
+static inline void hal_start_application(void)
+{
+	asm volatile(
+			"clr	r30		\n\t"
+			"clr	r31		\n\t"
+			"ijmp	\n\t"
+			);
+	for (;;)
+	{
+	}
+}
+
+#endif	//	_HAL_AVR_H_
@@ -0,0 +1,465 @@
+//**************************************************************************
+//*
+//* Title:		AES known answer tests and microbenchmark
+//* Filename:		aes_bench.c
+//*
+//* Builds the AES engine of stk500boot.c, as it is, into a small program
+//* that checks it against FIPS-197 and SP800-38A vectors and against a
+//* packet sized CBC vector (16 to 288 bytes, cross-checked with OpenSSL),
+//* then times every mode the bootloader uses with its own cycle clock.
+//* With ENABLE_IMAGE_SIGNATURE it also checks an RSA-2048 signature made by
+//* openssl under the development key of image_key.h, and times the SHA-256
+//* of a programmed page and the signature check CMD_IMAGE_SIGNATURE runs.
+//*
+//*	make bench_aes_host		natively, times in ns
+//*	make bench_aes			on the AVR under simavr, times in CPU cycles
+//*	make bench_aes_host HOST_EXTRA=-DENABLE_IMAGE_SIGNATURE
+//*	make bench_aes EXTRA_CFLAGS=-DENABLE_IMAGE_SIGNATURE AES_BENCH_MCU=atmega2561
+//*
+//* The output goes to the UART (stdout on the host). The last line is
+//* "KAT passed" or "KAT FAILED", the host build also exits nonzero.
+//*
+//**************************************************************************
+
+#define	ENABLE_STATS				//*	brings in the cycle clock
+#define	main	stk500boot_main
+#include	"../stk500boot.c"
+#undef	main
+
+#ifndef HOST_BUILD
+	#include	<avr/sleep.h>
+#endif
+
+#ifdef HOST_BUILD
+	#define	BENCH_REPEAT	1000
+	#define	BENCH_UNIT		"ns"
+#else
+	#define	BENCH_REPEAT	4
+	#define	BENCH_UNIT		"cycles"
+#endif
+
+#define	PACKET_MAX		288			//*	receivedPacket[], aes_buffer[]
+#define	GUARD			0xA5		//*	fills the bytes after the output, must survive
+
+//*	FIPS-197 appendix C.1 and appendix B
+static const unsigned char	fipsC1Key[BLOCKLEN]		=	{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const unsigned char	fipsC1Plain[BLOCKLEN]	=	{0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+static const unsigned char	fipsC1Cipher[BLOCKLEN]	=	{0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+static const unsigned char	fipsBPlain[BLOCKLEN]	=	{0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34};
+static const unsigned char	fipsBCipher[BLOCKLEN]	=	{0x39, 0x25, 0x84, 0x1d, 0x02, 0xdc, 0x09, 0xfb, 0xdc, 0x11, 0x85, 0x97, 0x19, 0x6a, 0x0b, 0x32};
+
+//*	SP800-38A F.2.1 CBC-AES128, same key and IV as the link (key[], iv[])
+static const unsigned char	sp800Plain[64]	=	{
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+static const unsigned char	sp800Cipher[64]	=	{
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7 };
+
+//*	plaintext byte n = n, CBC with key[] and iv[], every shorter packet is a prefix
+static const unsigned char	packetCipher[PACKET_MAX]	=	{
+	0x7d, 0xf7, 0x6b, 0x0c, 0x1a, 0xb8, 0x99, 0xb3, 0x3e, 0x42, 0xf0, 0x47, 0xb9, 0x1b, 0x54, 0x6f,
+	0x1c, 0xaa, 0x80, 0x18, 0xc8, 0x0b, 0x15, 0xb8, 0xe7, 0xae, 0xa8, 0x27, 0x94, 0xad, 0xcb, 0x00,
+	0xbb, 0xc1, 0xe2, 0x95, 0x91, 0x0b, 0x9d, 0xe4, 0xf1, 0x35, 0x8d, 0xcb, 0x42, 0x13, 0xbd, 0xd8,
+	0xee, 0xfa, 0x31, 0x54, 0x21, 0x5f, 0x47, 0x09, 0xaf, 0x46, 0x57, 0x3f, 0xc8, 0xcb, 0x07, 0xb9,
+	0x86, 0x0d, 0xc1, 0xdd, 0x67, 0xdd, 0xfd, 0x95, 0x2b, 0x41, 0xe3, 0xaa, 0x0c, 0xc4, 0x7a, 0x96,
+	0x48, 0x73, 0x85, 0x34, 0xd3, 0x7e, 0x5e, 0x29, 0xae, 0x21, 0x35, 0xaf, 0x75, 0x32, 0xe4, 0x1c,
+	0x14, 0x28, 0xb8, 0x47, 0xec, 0x62, 0x48, 0xfa, 0x03, 0x56, 0x8d, 0x55, 0x16, 0x3a, 0xa8, 0x98,
+	0x85, 0xe7, 0x57, 0xfd, 0x9c, 0x61, 0x99, 0x91, 0x78, 0xf9, 0x6a, 0x3c, 0x78, 0xf2, 0x6b, 0xef,
+	0xff, 0x9a, 0x03, 0x69, 0x1d, 0x10, 0xad, 0x99, 0x2b, 0x32, 0xf6, 0x74, 0xd0, 0x30, 0x94, 0xa6,
+	0x9b, 0x14, 0x87, 0x41, 0x26, 0x56, 0x3f, 0x8f, 0xf0, 0xa3, 0x03, 0x37, 0x8a, 0x36, 0xcb, 0xdd,
+	0x86, 0x1a, 0xa9, 0x23, 0x42, 0x86, 0xfa, 0xc8, 0x75, 0xae, 0xe4, 0x98, 0xd4, 0xf0, 0xaa, 0x1f,
+	0x39, 0x68, 0xad, 0x1a, 0x8d, 0x0b, 0x19, 0x07, 0xb2, 0xb9, 0x70, 0xe5, 0x50, 0x14, 0x60, 0x0b,
+	0x02, 0x0a, 0x1d, 0x3b, 0xd5, 0x9d, 0x55, 0xa9, 0xea, 0xae, 0xf6, 0x7e, 0xe2, 0x05, 0x74, 0x08,
+	0x0b, 0xc9, 0xeb, 0xc7, 0xe2, 0x63, 0x85, 0xcd, 0x4a, 0x63, 0x33, 0xb4, 0x32, 0xf4, 0x28, 0xbf,
+	0xa1, 0x9e, 0x1a, 0x6b, 0xa1, 0xca, 0xad, 0xee, 0xc5, 0x16, 0xae, 0x5b, 0xcf, 0x66, 0x2e, 0x8f,
+	0x13, 0xf5, 0xcb, 0xa1, 0x61, 0x43, 0xbf, 0x2b, 0xe8, 0x2c, 0xaf, 0xc3, 0x6c, 0x65, 0xe8, 0x74,
+	0xac, 0x61, 0x5e, 0x7b, 0x19, 0x9a, 0xf6, 0x3a, 0xf9, 0xda, 0xfa, 0xd6, 0xf7, 0x48, 0x89, 0xfa,
+	0x21, 0x1d, 0x15, 0xe5, 0xc4, 0x01, 0x9d, 0x31, 0x37, 0x3e, 0x92, 0x18, 0xb1, 0x28, 0xcc, 0x21 };
+
+#ifdef ENABLE_IMAGE_SIGNATURE
+//*	SHA-256 of "abc" (FIPS 180-2 B.1) and its signature, openssl dgst -sha256 -sign
+//*	with the key of host/image_key_dev.txt
+static const unsigned char	abcDigest[32]	=	{
+	0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+	0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+static const unsigned char	abcSignature[RSA_BYTES]	=	{
+	0x0f, 0x4b, 0xee, 0xcf, 0x1f, 0xd4, 0x74, 0x63, 0x04, 0xbc, 0xf5, 0xf1, 0x4c, 0x7d, 0x8e, 0xff,
+	0x70, 0xf1, 0xb8, 0x25, 0x9d, 0x90, 0xd4, 0x54, 0xf6, 0xbd, 0xc4, 0x47, 0x5c, 0x7e, 0x5c, 0x6c,
+	0xdc, 0x92, 0x8f, 0x48, 0x06, 0xab, 0xe3, 0xc6, 0x9a, 0xbe, 0xb5, 0xb5, 0x63, 0x10, 0x2a, 0x99,
+	0xae, 0xbb, 0x68, 0x66, 0x25, 0x06, 0xb6, 0xe9, 0xbd, 0xb9, 0xf6, 0x0d, 0x56, 0xb5, 0xb3, 0x33,
+	0xac, 0xcf, 0x1b, 0xd5, 0xbc, 0xb0, 0x5b, 0x7f, 0x1c, 0x33, 0xac, 0xfb, 0x79, 0x9b, 0x8e, 0xf9,
+	0xdc, 0x3e, 0x08, 0x23, 0x40, 0xb7, 0x9c, 0xaf, 0x7e, 0x48, 0x21, 0x1a, 0x98, 0x36, 0x3f, 0x20,
+	0xba, 0xc0, 0x79, 0x59, 0xb1, 0xac, 0x71, 0xf4, 0xb5, 0xf2, 0xd8, 0xbd, 0x5d, 0xd0, 0xe9, 0x6d,
+	0x57, 0x5c, 0xdc, 0xd7, 0x3f, 0xbc, 0xbf, 0x8f, 0x16, 0x9e, 0x7b, 0x78, 0x91, 0xed, 0xc0, 0xe5,
+	0x41, 0xe8, 0x68, 0x95, 0x92, 0x4f, 0xf6, 0xe4, 0xa6, 0x11, 0xff, 0x15, 0xcd, 0x92, 0xea, 0x67,
+	0x24, 0x6a, 0xba, 0x7e, 0x0e, 0xf0, 0xbd, 0x8b, 0xd6, 0x68, 0x55, 0x2b, 0xc7, 0xf0, 0x60, 0x5a,
+	0xa8, 0x77, 0x25, 0xc6, 0xba, 0x61, 0xb9, 0x50, 0x42, 0x59, 0x01, 0x69, 0x1f, 0xf1, 0x46, 0x55,
+	0x8c, 0x72, 0xb4, 0xa3, 0x43, 0x06, 0xa7, 0xbc, 0x34, 0x33, 0x60, 0x3f, 0xde, 0x6f, 0xe5, 0x5f,
+	0xa6, 0xfc, 0x00, 0x63, 0x89, 0xa0, 0x72, 0xde, 0x4f, 0x42, 0x01, 0x6c, 0xe3, 0x25, 0x93, 0x9a,
+	0x96, 0x2b, 0x63, 0x08, 0x0b, 0x0e, 0x5e, 0x6e, 0x17, 0xe5, 0x96, 0xc5, 0xbb, 0xcd, 0xf8, 0x8f,
+	0x42, 0x97, 0x94, 0x3e, 0x4a, 0x83, 0x23, 0xf2, 0x1a, 0x1b, 0x61, 0x19, 0x11, 0x3b, 0x5c, 0x09,
+	0xf2, 0x7f, 0xb3, 0x28, 0xf6, 0x4f, 0x60, 0x67, 0x3b, 0x9d, 0x44, 0x19, 0x13, 0x77, 0xb2, 0xd5 };
+static unsigned char		signature[RSA_BYTES];
+#endif
+
+static unsigned char	input[PACKET_MAX + BLOCKLEN];
+static unsigned char	output[PACKET_MAX + BLOCKLEN];
+static unsigned char	failures	=	0;
+
+//*****************************************************************************
+static void print_text(const char *text)
+{
+	while (*text)
+	{
+		sendchar(*text++);
+	}
+}
+
+//*****************************************************************************
+static void print_right(const char *text, unsigned char width)
+{
+	while (width-- > strlen(text))
+	{
+		sendchar(' ');
+	}
+	print_text(text);
+}
+
+//*****************************************************************************
+/*
+ * right aligned in width characters, hundredths != 0 prints value/100 with two decimals
+ */
+static void print_number(uint32_t value, unsigned char width, unsigned char hundredths)
+{
+char			digits[14];
+unsigned char	count	=	0;
+
+	do
+	{
+		digits[count++]	=	'0' + (value % 10);
+		value			/=	10;
+		if (hundredths && (count == 2))
+		{
+			digits[count++]	=	'.';
+			if (value == 0)
+			{
+				digits[count++]	=	'0';
+			}
+		}
+	} while (value || (hundredths && (count < 4)));
+	while (width-- > count)
+	{
+		sendchar(' ');
+	}
+	while (count)
+	{
+		sendchar(digits[--count]);
+	}
+}
+
+//*****************************************************************************
+static void check(const char *name, const unsigned char *result, const unsigned char *expected, unsigned int length)
+{
+	print_text("KAT ");
+	print_text(name);
+	if (memcmp(result, expected, length) == 0)
+	{
+		print_text(" ok\r\n");
+	}
+	else
+	{
+		print_text(" FAILED\r\n");
+		failures++;
+	}
+}
+
+//*****************************************************************************
+/*
+ * the guard bytes behind length must not have been touched
+ */
+static void check_guard(const char *name, unsigned int length)
+{
+unsigned int	ii;
+
+	for (ii=length; ii<sizeof(output); ii++)
+	{
+		if (output[ii] != GUARD)
+		{
+			print_text("KAT ");
+			print_text(name);
+			print_text(" wrote past the end\r\n");
+			failures++;
+			return;
+		}
+	}
+}
+
+//*****************************************************************************
+static void kat_run(void)
+{
+unsigned char	block[BLOCKLEN];
+unsigned int	length;
+unsigned int	ii;
+unsigned char	mismatch;
+
+	//*	single block engine, Cipher() and InvCipher() with a key of our own
+	key_select(fipsC1Key);
+	memcpy(block, fipsC1Plain, BLOCKLEN);
+	state	=	(state_t*)block;
+	Cipher();
+	check("FIPS-197 C.1 encrypt", block, fipsC1Cipher, BLOCKLEN);
+	InvCipher();
+	check("FIPS-197 C.1 decrypt", block, fipsC1Plain, BLOCKLEN);
+
+	key_select(key);
+	memcpy(block, fipsBPlain, BLOCKLEN);
+	state	=	(state_t*)block;
+	Cipher();
+	check("FIPS-197 B encrypt", block, fipsBCipher, BLOCKLEN);
+	InvCipher();
+	check("FIPS-197 B decrypt", block, fipsBPlain, BLOCKLEN);
+
+	//*	CBC as the link uses it outside a session
+	memcpy(input, sp800Plain, sizeof(sp800Plain));
+	aes_encrypt(output, input, sizeof(sp800Plain));
+	check("SP800-38A F.2.1 CBC encrypt", output, sp800Cipher, sizeof(sp800Cipher));
+	memcpy(input, sp800Cipher, sizeof(sp800Cipher));
+	aes_decrypt(output, input, sizeof(sp800Cipher));
+	check("SP800-38A F.2.2 CBC decrypt", output, sp800Plain, sizeof(sp800Plain));
+
+	//*	every packet size the bootloader handles
+	mismatch	=	0;
+	for (length=BLOCKLEN; length<=PACKET_MAX; length+=BLOCKLEN)
+	{
+		for (ii=0; ii<length; ii++)
+		{
+			input[ii]	=	ii;
+		}
+		memset(output, GUARD, sizeof(output));
+		aes_encrypt(output, input, length);
+		mismatch	|=	memcmp(output, packetCipher, length) != 0;
+		check_guard("CBC encrypt", length);
+
+		memcpy(input, packetCipher, length);
+		memset(output, GUARD, sizeof(output));
+		aes_decrypt(output, input, length);
+		for (ii=0; ii<length; ii++)
+		{
+			mismatch	|=	output[ii] != (ii & 0xFF);
+		}
+		check_guard("CBC decrypt", length);
+	}
+	check("CBC packets 16..288", &mismatch, (const unsigned char *)"", 1);
+
+	//*	a partial block is not CBC, it must be left alone
+	memcpy(input, packetCipher, BLOCKLEN + 4);
+	memset(output, GUARD, sizeof(output));
+	aes_decrypt(output, input, BLOCKLEN + 4);
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		block[ii]	=	ii;
+	}
+	check("CBC decrypt 20 bytes", output, block, BLOCKLEN);
+	check_guard("CBC decrypt 20 bytes", BLOCKLEN);
+
+#ifdef ENABLE_SESSION_KEYS
+	//*	chained IVs, two packets continue one CBC stream
+	memcpy(sessionKey, key, BLOCKLEN);
+	memcpy(txIv, iv, BLOCKLEN);
+	memcpy(rxIv, iv, BLOCKLEN);
+	sessionActive	=	1;
+	for (ii=0; ii<PACKET_MAX; ii++)
+	{
+		input[ii]	=	ii;
+	}
+	aes_encrypt(output, input, 32);
+	aes_encrypt(output + 32, input + 32, PACKET_MAX - 32);
+	check("CBC encrypt chained 32+256", output, packetCipher, PACKET_MAX);
+	memcpy(input, packetCipher, PACKET_MAX);
+	aes_decrypt(output, input, 48);
+	memcpy(rxIv, input + 32, BLOCKLEN);		//*	frame_taken() moves the chain on
+	aes_decrypt(output + 48, input + 48, PACKET_MAX - 48);
+	for (ii=0; ii<PACKET_MAX; ii++)
+	{
+		input[ii]	=	ii;
+	}
+	check("CBC decrypt chained 48+240", output, input, PACKET_MAX);
+	sessionActive	=	0;
+#endif
+
+#ifdef ENABLE_IMAGE_SIGNATURE
+	//*	the streamed digest, then the signature over it, and one bit off
+	sha256_init(&imageHash);
+	sha256_update(&imageHash, 'a');
+	sha256_update(&imageHash, 'b');
+	sha256_update(&imageHash, 'c');
+	sha256_final(&imageHash, output);
+	check("SHA-256 abc", output, abcDigest, sizeof(abcDigest));
+	memcpy(signature, abcSignature, RSA_BYTES);
+	mismatch	=	!image_signature_valid(abcDigest, signature);
+	check("RSA-2048 signature", &mismatch, (const unsigned char *)"", 1);
+	signature[RSA_BYTES - 1]	^=	0x01;
+	mismatch	=	image_signature_valid(abcDigest, signature);
+	check("RSA-2048 signature, one bit off", &mismatch, (const unsigned char *)"", 1);
+	memcpy(signature, imageKeyModulus, RSA_BYTES);
+	mismatch	=	image_signature_valid(abcDigest, signature);
+	check("RSA-2048 signature, s = n", &mismatch, (const unsigned char *)"", 1);
+#endif
+}
+
+#define	MODE_KEY_SCHEDULE		0
+#define	MODE_ECB_ENCRYPT		1
+#define	MODE_ECB_DECRYPT		2
+#define	MODE_CBC_ENCRYPT		3
+#define	MODE_CBC_DECRYPT		4
+#define	MODE_CBC_DECRYPT_COLD	5		//*	key schedule included, the first packet after a key change
+#define	MODE_CBC_DECRYPT_CHAIN	6		//*	session, chained IVs
+#define	MODE_SHA256				7		//*	what a programmed page adds with ENABLE_IMAGE_SIGNATURE
+#define	MODE_SIGNATURE			8		//*	CMD_IMAGE_SIGNATURE, once per upload
+
+//*****************************************************************************
+static void bench_op(unsigned char mode, unsigned int length)
+{
+	switch (mode)
+	{
+		case MODE_KEY_SCHEDULE:
+			expandedKey	=	0;
+			key_select(key);
+			break;
+
+		case MODE_ECB_ENCRYPT:
+			key_select(key);
+			state	=	(state_t*)output;
+			Cipher();
+			break;
+
+		case MODE_ECB_DECRYPT:
+			key_select(key);
+			state	=	(state_t*)output;
+			InvCipher();
+			break;
+
+		case MODE_CBC_ENCRYPT:
+			aes_encrypt(output, input, length);
+			break;
+
+		case MODE_CBC_DECRYPT_COLD:
+			expandedKey	=	0;
+			aes_decrypt(output, input, length);
+			break;
+
+	#ifdef ENABLE_IMAGE_SIGNATURE
+		case MODE_SHA256:
+			while (length--)
+			{
+				sha256_update(&imageHash, input[length]);
+			}
+			break;
+
+		case MODE_SIGNATURE:
+			image_signature_valid(abcDigest, abcSignature);
+			break;
+	#endif
+
+		default:
+			aes_decrypt(output, input, length);
+			break;
+	}
+}
+
+//*****************************************************************************
+static void bench_row(const char *name, unsigned char mode, unsigned int length)
+{
+uint32_t		start;
+uint32_t		elapsed;
+unsigned int	rep;
+
+	bench_op(mode, length);				//*	warm up, key schedule in place
+	start	=	cycle_clock_now();
+	for (rep=0; rep<BENCH_REPEAT; rep++)
+	{
+		bench_op(mode, length);
+	}
+	elapsed	=	(cycle_clock_now() - start) / BENCH_REPEAT;
+
+	print_text(name);
+	print_number(length, 24 - strlen(name), 0);
+	print_number(elapsed, 12, 0);
+	print_number((elapsed * 100ULL) / length, 14, 1);
+	print_text("\r\n");
+}
+
+//*****************************************************************************
+static void bench_run(void)
+{
+static const unsigned int	sizes[]	=	{ 16, 64, 128, 256, 272, 288 };
+unsigned char				ii;
+
+	print_text("\r\nengine tiny-AES (stk500boot.c), F_CPU ");
+	print_number(F_CPU, 1, 0);
+	print_text(", ");
+	print_number(BENCH_REPEAT, 1, 0);
+	print_text(" runs each\r\n");
+	print_text("mode");
+	print_right("bytes", 20);
+	print_right(BENCH_UNIT, 12);
+	print_right(BENCH_UNIT "/byte", 14);
+	print_text("\r\n");
+
+	memset(input, 0x5A, sizeof(input));
+	bench_row("key schedule", MODE_KEY_SCHEDULE, BLOCKLEN);
+	bench_row("ecb encrypt", MODE_ECB_ENCRYPT, BLOCKLEN);
+	bench_row("ecb decrypt", MODE_ECB_DECRYPT, BLOCKLEN);
+	for (ii=0; ii<sizeof(sizes)/sizeof(sizes[0]); ii++)
+	{
+		bench_row("cbc encrypt", MODE_CBC_ENCRYPT, sizes[ii]);
+	}
+	for (ii=0; ii<sizeof(sizes)/sizeof(sizes[0]); ii++)
+	{
+		bench_row("cbc decrypt", MODE_CBC_DECRYPT, sizes[ii]);
+	}
+	bench_row("cbc decrypt, new key", MODE_CBC_DECRYPT_COLD, PACKET_MAX);
+#ifdef ENABLE_SESSION_KEYS
+	memcpy(sessionKey, key, BLOCKLEN);
+	memcpy(rxIv, iv, BLOCKLEN);
+	sessionActive	=	1;
+	bench_row("cbc decrypt, chained", MODE_CBC_DECRYPT_CHAIN, PACKET_MAX);
+	sessionActive	=	0;
+#endif
+#ifdef ENABLE_IMAGE_SIGNATURE
+	sha256_init(&imageHash);
+	bench_row("sha256, streamed", MODE_SHA256, 256);
+	bench_row("rsa-2048 verify", MODE_SIGNATURE, RSA_BYTES);
+#endif
+}
+
+//*****************************************************************************
+int main(void)
+{
+	hal_init();
+	hal_uart_init(HAL_UART_BAUD_SELECT(BAUDRATE));
+	hal_uart_enable();
+	cycle_clock_init();
+	hal_irq_enable();
+
+	kat_run();
+	bench_run();
+	print_text(failures ? "\r\nKAT FAILED\r\n" : "\r\nKAT passed\r\n");
+
+#ifdef HOST_BUILD
+	return failures != 0;
+#else
+	//*	sleeping with interrupts off ends the simulation
+	hal_irq_disable();
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_mode();
+	for (;;)
+	{
+	}
+#endif
+}
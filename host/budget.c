@@ -0,0 +1,907 @@
+//**************************************************************************
+//*
+//* Title:		RAM budget of a bootloader build
+//* Filename:		budget.c
+//*
+//* Reads what the AVR build leaves behind and prints a RAM map: static
+//* data from the symbol table, the worst case stack from the -fstack-usage
+//* frames and the call graph in the listing, and what is left between
+//* them. Every board target runs it (make ramcheck).
+//*
+//*	budget -r [-n name] [-m headroom] stk500boot.sym stk500boot.lss stk500boot.su
+//*
+//* With -s it prints the flash the build takes from the boot section
+//* instead, per module and per function, and the difference to the block
+//* of the same name in an earlier report (make sizes, make size_baseline).
+//*
+//*	budget -s [-n name] [-f flavor] [-b bootsize] [-c baseline] [-g growth] ...
+//*
+//* The stack starts at __stack, the value main() loads into SP. Every call
+//* adds the return address (3 bytes on parts with more than 128K flash),
+//* the deepest interrupt handler is added on top of the deepest path of
+//* main(). Indirect calls are not followed, they are listed.
+//*
+//* Exits 1 when less than headroom bytes are free, when the build does not
+//* fit the boot section or grew by more than growth bytes.
+//*
+//**************************************************************************
+
+#include	<inttypes.h>
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<unistd.h>
+
+#define	DATA_SPACE		0x800000UL		//*	avr-ld places SRAM here
+#define	DATA_SPACE_END	0x810000UL
+#define	TOP_SYMBOLS		10				//*	largest static objects listed
+#define	MAX_DEPTH		64				//*	longest call chain printed
+
+//*****************************************************************************
+//*	Symbol table, nm -n [-S]
+
+typedef struct
+{
+	char		name[64];
+	uint32_t	address;
+	uint32_t	size;			//*	0 if nm did not give one
+	char		type;
+} budget_symbol_t;
+
+static budget_symbol_t	*symbols;
+static unsigned int		symbolCount;
+
+//*****************************************************************************
+static int symbols_load(const char *fileName)
+{
+FILE			*file;
+char			line[256];
+char			field[3][64];
+budget_symbol_t	*sym;
+int				fields;
+unsigned int	capacity	=	0;
+
+	if (!(file = fopen(fileName, "r")))
+	{
+		perror(fileName);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), file))
+	{
+		if (symbolCount == capacity)
+		{
+			capacity	=	capacity ? (capacity * 2) : 256;
+			symbols		=	realloc(symbols, capacity * sizeof(*symbols));
+		}
+		sym		=	&symbols[symbolCount];
+		fields	=	sscanf(line, "%63s %63s %63s %63s", field[0], field[1], field[2], sym->name);
+		if (fields == 4)							//*	address size type name
+		{
+			sym->address	=	strtoul(field[0], NULL, 16);
+			sym->size		=	strtoul(field[1], NULL, 16);
+			sym->type		=	field[2][0];
+		}
+		else if (fields == 3)						//*	address type name
+		{
+			sym->address	=	strtoul(field[0], NULL, 16);
+			sym->size		=	0;
+			sym->type		=	field[1][0];
+			strcpy(sym->name, field[2]);
+		}
+		else
+		{
+			continue;
+		}
+		symbolCount++;
+	}
+	fclose(file);
+	return 1;
+}
+
+//*****************************************************************************
+static const budget_symbol_t *symbol_find(const char *name, const char *types)
+{
+unsigned int	ii;
+
+	for (; *types; types++)
+	{
+		for (ii=0; ii<symbolCount; ii++)
+		{
+			if ((symbols[ii].type == *types) && (strcmp(symbols[ii].name, name) == 0))
+			{
+				return &symbols[ii];
+			}
+		}
+	}
+	return NULL;
+}
+
+//*****************************************************************************
+static int symbol_is_data(const budget_symbol_t *sym)
+{
+	return (sym->address >= DATA_SPACE) && (sym->address < DATA_SPACE_END) && strchr("dDbBvV", sym->type)
+		&& (strncmp(sym->name, "__", 2) != 0) && (strcmp(sym->name, "_edata") != 0);	//*	linker markers
+}
+
+//*****************************************************************************
+/*
+ * an nm -n table without sizes, every object reaches up to the next symbol
+ */
+static void symbols_fill_sizes(uint32_t staticEnd)
+{
+unsigned int	ii;
+unsigned int	jj;
+
+	for (ii=0; ii<symbolCount; ii++)
+	{
+		if (symbols[ii].size || !symbol_is_data(&symbols[ii]))
+		{
+			continue;
+		}
+		symbols[ii].size	=	staticEnd - symbols[ii].address;
+		for (jj=0; jj<symbolCount; jj++)
+		{
+			if ((symbols[jj].address > symbols[ii].address) && (symbols[jj].address < (symbols[ii].address + symbols[ii].size))
+				&& (symbols[jj].address >= DATA_SPACE) && (symbols[jj].address < DATA_SPACE_END))
+			{
+				symbols[ii].size	=	symbols[jj].address - symbols[ii].address;
+			}
+		}
+	}
+}
+
+//*****************************************************************************
+//*	Call graph, objdump -S listing and -fstack-usage
+
+#define	STACK_UNKNOWN	0			//*	not in the .su, assembly or libgcc
+#define	STACK_STATIC	1
+#define	STACK_DYNAMIC	2			//*	alloca or variable length arrays
+
+typedef struct
+{
+	unsigned int	callee;
+	unsigned char	isCall;			//*	pushes a return address, jmp/rjmp tail calls do not
+} budget_edge_t;
+
+typedef struct
+{
+	char			name[64];
+	unsigned int	frame;
+	unsigned char	stackKind;
+	unsigned char	indirect;		//*	icall/eicall seen
+	budget_edge_t	*edges;
+	unsigned int	edgeCount;
+	unsigned char	visit;			//*	0 new, 1 on the path, 2 done
+	unsigned long	depth;			//*	deepest stack from the entry of this function
+	int				deepest;		//*	edge of the deepest path, -1 none
+	unsigned long	start;			//*	address of its label in the listing
+	unsigned char	placed;			//*	start is known
+	unsigned long	flash;			//*	bytes up to the next function
+} budget_function_t;
+
+static budget_function_t	*functions;
+static unsigned int			functionCount;
+static unsigned int			pcSize		=	2;
+static int					recursive	=	-1;
+static unsigned long		textStart;
+static unsigned long		textSize;
+static unsigned long		dataSize;		//*	initial values of .data, stored behind .text
+
+//*****************************************************************************
+static int function_find(const char *name, int create)
+{
+unsigned int	ii;
+
+	for (ii=0; ii<functionCount; ii++)
+	{
+		if (strcmp(functions[ii].name, name) == 0)
+		{
+			return ii;
+		}
+	}
+	if (!create)
+	{
+		return -1;
+	}
+	functions	=	realloc(functions, (functionCount + 1) * sizeof(*functions));
+	memset(&functions[functionCount], 0, sizeof(*functions));
+	snprintf(functions[functionCount].name, sizeof(functions[0].name), "%s", name);
+	functions[functionCount].deepest	=	-1;
+	return functionCount++;
+}
+
+//*****************************************************************************
+/*
+ * lines like "stk500boot.c:2795:5:main	312	static"
+ */
+static int stack_usage_load(const char *fileName)
+{
+FILE	*file;
+char	line[512];
+char	*name;
+char	*tab;
+int		index;
+
+	if (!(file = fopen(fileName, "r")))
+	{
+		perror(fileName);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), file))
+	{
+		if (!(tab = strchr(line, '\t')))
+		{
+			continue;
+		}
+		*tab	=	0;
+		name	=	strrchr(line, ':');
+		name	=	name ? (name + 1) : line;
+		index	=	function_find(name, 1);
+		functions[index].frame		=	strtoul(tab + 1, &tab, 10);
+		functions[index].stackKind	=	strstr(tab, "dynamic") ? STACK_DYNAMIC : STACK_STATIC;
+	}
+	fclose(file);
+	return 1;
+}
+
+//*****************************************************************************
+static void edge_add(int caller, int callee, unsigned char isCall)
+{
+budget_function_t	*function	=	&functions[caller];
+unsigned int		ii;
+
+	for (ii=0; ii<function->edgeCount; ii++)
+	{
+		if ((function->edges[ii].callee == (unsigned int)callee) && (function->edges[ii].isCall == isCall))
+		{
+			return;
+		}
+	}
+	function->edges	=	realloc(function->edges, (function->edgeCount + 1) * sizeof(budget_edge_t));
+	function->edges[function->edgeCount].callee	=	callee;
+	function->edges[function->edgeCount].isCall	=	isCall;
+	function->edgeCount++;
+}
+
+//*****************************************************************************
+/*
+ * "0003e6e2 <main>:" starts a function, "   3e11e:	0f 94 71 f3 	call	0x3e6e2	; 0x3e6e2 <main>"
+ * is an edge. Assembly labels like __udivmodhi4_loop or .do_clear_bss_loop
+ * belong to the routine around them, jumps count only between C functions.
+ * Targets with an offset (<main+0x12>, rcall .+0) stay inside the function.
+ * The section headers in front give the size of .text and .data.
+ */
+static int listing_load(const char *fileName)
+{
+FILE			*file;
+char			line[512];
+char			label[64];
+char			*mnemonic;
+char			*target;
+char			*end;
+unsigned long	address;
+unsigned long	size;
+int				current	=	-1;
+int				callee;
+unsigned char	isCall;
+
+	if (!(file = fopen(fileName, "r")))
+	{
+		perror(fileName);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), file))
+	{
+		//*	section headers, "  1 .text         00000f8a  0003e000  0003e000 ..."
+		if ((current < 0) && (sscanf(line, " %*u %63s %lx %lx", label, &size, &address) == 3))
+		{
+			if (strcmp(label, ".text") == 0)
+			{
+				textStart	=	address;
+				textSize	=	size;
+			}
+			else if (strcmp(label, ".data") == 0)
+			{
+				dataSize	=	size;
+			}
+			continue;
+		}
+		if ((sscanf(line, "%lx <%63[^>]>:", &address, label) == 2) && strstr(line, ">:"))
+		{
+			if (address > 0x1FFFF)
+			{
+				pcSize	=	3;				//*	22 bit program counter
+			}
+			callee	=	function_find(label, 0);
+			if ((label[0] != '.') && ((current < 0) || ((callee >= 0) && (functions[callee].stackKind != STACK_UNKNOWN))
+				|| (strncmp(label, functions[current].name, strlen(functions[current].name)) != 0)))
+			{
+				current	=	function_find(label, 1);
+				if (!functions[current].placed)
+				{
+					functions[current].start	=	address;
+					functions[current].placed	=	1;
+				}
+			}
+			continue;
+		}
+		if ((current < 0) || (line[0] != ' ') || !(mnemonic = strchr(line, '\t')) || !(mnemonic = strchr(mnemonic + 1, '\t')))
+		{
+			continue;
+		}
+		mnemonic++;
+		if ((strncmp(mnemonic, "icall", 5) == 0) || (strncmp(mnemonic, "eicall", 6) == 0))
+		{
+			functions[current].indirect	=	1;
+			continue;
+		}
+		if (strncmp(mnemonic, "call\t", 5) == 0 || strncmp(mnemonic, "rcall\t", 6) == 0)
+		{
+			isCall	=	1;
+		}
+		else if (strncmp(mnemonic, "jmp\t", 4) == 0 || strncmp(mnemonic, "rjmp\t", 5) == 0)
+		{
+			isCall	=	0;
+		}
+		else
+		{
+			continue;
+		}
+		if (!(target = strchr(mnemonic, '<')) || !(end = strchr(target, '>')) || memchr(target, '+', end - target))
+		{
+			continue;
+		}
+		*end	=	0;
+		target++;
+		callee	=	function_find(target, 0);
+		if (isCall && (callee < 0))
+		{
+			callee	=	function_find(target, 1);
+		}
+		if ((callee >= 0) && (callee != current) && (isCall || (functions[callee].stackKind != STACK_UNKNOWN)))
+		{
+			edge_add(current, callee, isCall);
+		}
+	}
+	fclose(file);
+	return 1;
+}
+
+//*****************************************************************************
+static unsigned long stack_depth(unsigned int index)
+{
+budget_function_t	*function	=	&functions[index];
+unsigned long		depth;
+unsigned int		ii;
+
+	if (function->visit == 2)
+	{
+		return function->depth;
+	}
+	if (function->visit == 1)
+	{
+		recursive	=	index;				//*	no bound without knowing the recursion depth
+		return 0;
+	}
+	function->visit	=	1;
+	function->depth	=	function->frame;
+	for (ii=0; ii<function->edgeCount; ii++)
+	{
+		depth	=	function->frame + stack_depth(function->edges[ii].callee) + (function->edges[ii].isCall ? pcSize : 0);
+		if (depth > function->depth)
+		{
+			function->depth		=	depth;
+			function->deepest	=	ii;
+		}
+	}
+	function->visit	=	2;
+	return function->depth;
+}
+
+//*****************************************************************************
+static void stack_path_print(unsigned int index)
+{
+unsigned int	count	=	0;
+
+	while (count++ < MAX_DEPTH)
+	{
+		printf(" %s %u", functions[index].name, functions[index].frame);
+		if (functions[index].deepest < 0)
+		{
+			break;
+		}
+		index	=	functions[index].edges[functions[index].deepest].callee;
+		printf(" >");
+	}
+	printf("\n");
+}
+
+//*****************************************************************************
+static int compare_size(const void *a, const void *b)
+{
+const budget_symbol_t	*symA	=	*(const budget_symbol_t * const *)a;
+const budget_symbol_t	*symB	=	*(const budget_symbol_t * const *)b;
+
+	return (symA->size < symB->size) - (symA->size > symB->size);
+}
+
+//*****************************************************************************
+static int ram_report(const char *name, long headroom)
+{
+const budget_symbol_t	*sym;
+const budget_symbol_t	**largest;
+uint32_t				ramStart;
+uint32_t				staticEnd	=	0;
+uint32_t				stackTop;
+uint32_t				dataSize	=	0;
+uint32_t				bssSize		=	0;
+unsigned long			mainDepth;
+unsigned long			isrDepth	=	0;
+int						isr			=	-1;
+int						mainIndex;
+long					freeBytes;
+unsigned int			ii;
+unsigned int			count		=	0;
+int						failed		=	0;
+
+	if (!(sym = symbol_find("__data_start", "Dd")))
+	{
+		fprintf(stderr, "%s: no __data_start in the symbol table\n", name);
+		return 1;
+	}
+	ramStart	=	sym->address - DATA_SPACE;
+	//*	the value main() loads into SP, a local absolute symbol, the weak one is RAMEND from the crt
+	if (!(sym = symbol_find("__stack", "aAW")))
+	{
+		fprintf(stderr, "%s: no __stack in the symbol table\n", name);
+		return 1;
+	}
+	stackTop	=	sym->address;
+	for (ii=0; ii<symbolCount; ii++)
+	{
+		if (((strcmp(symbols[ii].name, "__bss_end") == 0) || (strcmp(symbols[ii].name, "__noinit_end") == 0)
+			|| (strcmp(symbols[ii].name, "__data_end") == 0)) && ((symbols[ii].address - DATA_SPACE) > staticEnd))
+		{
+			staticEnd	=	symbols[ii].address - DATA_SPACE;
+		}
+	}
+	symbols_fill_sizes(staticEnd + DATA_SPACE);
+
+	largest	=	malloc(symbolCount * sizeof(*largest));
+	for (ii=0; ii<symbolCount; ii++)
+	{
+		if (symbol_is_data(&symbols[ii]))
+		{
+			largest[count++]	=	&symbols[ii];
+			if (strchr("bB", symbols[ii].type))
+			{
+				bssSize		+=	symbols[ii].size;
+			}
+			else
+			{
+				dataSize	+=	symbols[ii].size;
+			}
+		}
+	}
+	qsort(largest, count, sizeof(*largest), compare_size);
+
+	if ((mainIndex = function_find("main", 0)) < 0)
+	{
+		fprintf(stderr, "%s: no main() in the listing\n", name);
+		free(largest);
+		return 1;
+	}
+	mainDepth	=	stack_depth(mainIndex);
+	for (ii=0; ii<functionCount; ii++)
+	{
+		if ((strncmp(functions[ii].name, "__vector_", 9) == 0) && ((stack_depth(ii) + pcSize) > isrDepth))
+		{
+			isrDepth	=	stack_depth(ii) + pcSize;
+			isr			=	ii;
+		}
+	}
+	freeBytes	=	(long)stackTop + 1 - (long)staticEnd - (long)mainDepth - (long)isrDepth;
+
+	printf("%s RAM 0x%04" PRIx32 "..0x%04" PRIx32 ", %" PRIu32 " bytes\n", name, ramStart, stackTop, stackTop + 1 - ramStart);
+	printf("  static  %6" PRIu32 "  .data %" PRIu32 " .bss %" PRIu32 ", up to 0x%04" PRIx32 "\n",
+			staticEnd - ramStart, dataSize, bssSize, staticEnd);
+	for (ii=0; (ii<count) && (ii<TOP_SYMBOLS); ii++)
+	{
+		printf("          %6" PRIu32 "  %s\n", largest[ii]->size, largest[ii]->name);
+	}
+	printf("  stack   %6lu ", mainDepth + isrDepth);
+	stack_path_print(mainIndex);
+	if (isr >= 0)
+	{
+		printf("          %6lu  interrupt", isrDepth);
+		stack_path_print(isr);
+	}
+	printf("  free    %6ld  headroom %ld\n", freeBytes, headroom);
+
+	for (ii=0; ii<functionCount; ii++)
+	{
+		if (functions[ii].indirect && functions[ii].visit)
+		{
+			printf("  note: indirect calls in %s are not followed\n", functions[ii].name);
+		}
+		if ((functions[ii].stackKind == STACK_DYNAMIC) && functions[ii].visit)
+		{
+			printf("  note: %s has a dynamic frame, its size is a lower bound\n", functions[ii].name);
+		}
+		if ((functions[ii].stackKind == STACK_UNKNOWN) && functions[ii].visit && (strncmp(functions[ii].name, "__vector", 8) != 0))
+		{
+			printf("  note: no stack usage for %s, counted as 0\n", functions[ii].name);
+		}
+	}
+	if (recursive >= 0)
+	{
+		printf("  %s is recursive, the stack has no static bound\n", functions[recursive].name);
+		failed	=	1;
+	}
+	if (freeBytes < headroom)
+	{
+		printf("  less than %ld bytes left between static data and stack\n", headroom);
+		failed	=	1;
+	}
+	free(largest);
+	return failed;
+}
+
+//*****************************************************************************
+//*	Flash, size of every function and module in the boot section
+
+/*
+ * first matching prefix wins, so the longer ones come first
+ */
+static const char	*modules[][2]	=	{
+	{ "__vector_",				"interrupts"	},
+	{ "__vectors",				"startup"		},
+	{ "__ctors_end",			"startup"		},
+	{ "__do_copy_data",			"startup"		},
+	{ "__do_clear_bss",			"startup"		},
+	{ "__jumpMain",				"startup"		},
+	{ "__bad_interrupt",		"startup"		},
+	{ "__",						"libgcc"		},
+	{ "_exit",					"libgcc"		},
+	{ "XorWithIv",				"aes"			},
+	{ "KeyExpansion",			"aes"			},
+	{ "AddRoundKey",			"aes"			},
+	{ "SubBytes",				"aes"			},
+	{ "ShiftRows",				"aes"			},
+	{ "MixColumns",				"aes"			},
+	{ "InvMixColumns",			"aes"			},
+	{ "InvSubBytes",			"aes"			},
+	{ "InvShiftRows",			"aes"			},
+	{ "Cipher",					"aes"			},
+	{ "InvCipher",				"aes"			},
+	{ "BlockCopy",				"aes"			},
+	{ "Multiply",				"aes"			},
+	{ "xtime",					"aes"			},
+	{ "getSBox",				"aes"			},
+	{ "key_select",				"aes"			},
+	{ "aes_",					"aes"			},
+	{ "auth_",					"auth"			},
+	{ "session_",				"auth"			},
+	{ "entropy_",				"auth"			},
+	{ "sha256_",				"image"			},
+	{ "image_",					"image"			},
+	{ "crc32_",					"image"			},
+	{ "flash_crc32",			"image"			},
+	{ "app_",					"image"			},
+	{ "read_flash_",			"image"			},
+	{ "eeprom_queue_",			"programming"	},
+	{ "erase_page_once",		"programming"	},
+	{ "resume_page_done",		"programming"	},
+	{ "page_",					"programming"	},
+	{ "program_page_inline",	"programming"	},
+	{ "slot_",					"staging"		},
+	{ "spiflash_",				"staging"		},
+	{ "staging_",				"staging"		},
+	{ "mailbox_",				"staging"		},
+	{ "cycle_clock_",			"stats"			},
+	{ "stats_",					"stats"			},
+	{ "trace_",					"stats"			},
+	{ "sendchar",				"uart"			},
+	{ "recchar",				"uart"			},
+	{ "send_response",			"uart"			},
+	{ "getData",				"uart"			},
+	{ "main",					"stk500"		},
+	{ "Print",					"monitor"		},
+	{ "DumpHex",				"monitor"		},
+	{ "RunMonitor",				"monitor"		},
+	{ "VectorDisplay",			"monitor"		},
+	{ "EEPROMtest",				"monitor"		},
+	{ "ListAvailablePorts",		"monitor"		},
+	{ "AVR_PortOutput",			"monitor"		},
+	{ "Serial_Available",		"monitor"		},
+	{ "BlinkLED",				"monitor"		},
+	{ "delay_ms",				"stk500"		},
+	{ "bootloader_cleanup",		"stk500"		},
+	{ "mem",					"libc"			},
+	{ "eeprom_",				"libc"			},
+	{ "str",					"libc"			},
+};
+
+#define	MODULE_COUNT	(sizeof(modules) / sizeof(modules[0]))
+
+//*****************************************************************************
+static const char *module_of(const char *name)
+{
+unsigned int	ii;
+
+	for (ii=0; ii<MODULE_COUNT; ii++)
+	{
+		if (strncmp(name, modules[ii][0], strlen(modules[ii][0])) == 0)
+		{
+			return modules[ii][1];
+		}
+	}
+	return "other";
+}
+
+//*****************************************************************************
+//*	A previous report, the lines of one "[name]" block
+
+typedef struct
+{
+	char			kind[16];
+	char			name[64];
+	unsigned long	bytes;
+	unsigned char	seen;
+} budget_line_t;
+
+static budget_line_t	*baseline;
+static unsigned int		baselineCount;
+
+//*****************************************************************************
+static int baseline_load(const char *fileName, const char *name)
+{
+FILE			*file;
+char			line[256];
+char			header[80];
+int				inBlock	=	0;
+int				found	=	0;
+budget_line_t	*entry;
+
+	if (!(file = fopen(fileName, "r")))
+	{
+		perror(fileName);
+		return -1;
+	}
+	snprintf(header, sizeof(header), "[%s]", name);
+	while (fgets(line, sizeof(line), file))
+	{
+		if (line[0] == '[')
+		{
+			inBlock	=	(strncmp(line, header, strlen(header)) == 0) && (line[strlen(header)] == ' ');
+			found	|=	inBlock;
+			continue;
+		}
+		if (!inBlock)
+		{
+			continue;
+		}
+		baseline	=	realloc(baseline, (baselineCount + 1) * sizeof(*baseline));
+		entry		=	&baseline[baselineCount];
+		memset(entry, 0, sizeof(*entry));
+		if (sscanf(line, "%15s %63s %lu", entry->kind, entry->name, &entry->bytes) == 3)
+		{
+			baselineCount++;
+		}
+	}
+	fclose(file);
+	return found;
+}
+
+//*****************************************************************************
+/*
+ * one report line, "kind      name                       bytes [delta]"
+ */
+static long size_line(const char *kind, const char *name, unsigned long bytes)
+{
+unsigned int	ii;
+long			delta	=	0;
+
+	printf("%-9s %-26s %6lu", kind, name, bytes);
+	for (ii=0; ii<baselineCount; ii++)
+	{
+		if ((strcmp(baseline[ii].kind, kind) == 0) && (strcmp(baseline[ii].name, name) == 0))
+		{
+			baseline[ii].seen	=	1;
+			delta				=	(long)bytes - (long)baseline[ii].bytes;
+			if (delta)
+			{
+				printf(" %+ld", delta);
+			}
+			break;
+		}
+	}
+	if (baselineCount && (ii == baselineCount))
+	{
+		printf(" new");
+		delta	=	bytes;
+	}
+	printf("\n");
+	return delta;
+}
+
+//*****************************************************************************
+static int compare_flash(const void *a, const void *b)
+{
+const budget_function_t	*funcA	=	*(const budget_function_t * const *)a;
+const budget_function_t	*funcB	=	*(const budget_function_t * const *)b;
+
+	if (funcA->flash != funcB->flash)
+	{
+		return (funcA->flash < funcB->flash) - (funcA->flash > funcB->flash);
+	}
+	return strcmp(funcA->name, funcB->name);
+}
+
+//*****************************************************************************
+static int compare_start(const void *a, const void *b)
+{
+const budget_function_t	*funcA	=	*(const budget_function_t * const *)a;
+const budget_function_t	*funcB	=	*(const budget_function_t * const *)b;
+
+	return (funcA->start > funcB->start) - (funcA->start < funcB->start);
+}
+
+//*****************************************************************************
+/*
+ * functions reach up to the next label of the listing, the last one up to
+ * the end of .text, so the module and function lines add up to the text line
+ */
+static int size_report(const char *name, const char *flavor, unsigned long bootSize, const char *baselineFile, long growth)
+{
+budget_function_t	**placed;
+const char			*module;
+unsigned long		moduleBytes;
+unsigned long		used;
+long				freeBytes;
+long				delta;
+unsigned int		count	=	0;
+unsigned int		ii;
+unsigned int		jj;
+int					failed	=	0;
+
+	if (textSize == 0)
+	{
+		fprintf(stderr, "%s: no .text section in the listing\n", name);
+		return 1;
+	}
+	if (bootSize == 0)
+	{
+		//*	the boot section runs from BOOTLOADER_ADDRESS to the end of flash, a power of 2
+		for (bootSize=1; bootSize<=textStart; bootSize<<=1)
+		{
+		}
+		bootSize	-=	textStart;
+	}
+	if (baselineFile && (baseline_load(baselineFile, name) == 0))
+	{
+		fprintf(stderr, "%s: not in %s, nothing to compare\n", name, baselineFile);
+	}
+
+	placed	=	malloc((functionCount + 1) * sizeof(*placed));
+	for (ii=0; ii<functionCount; ii++)
+	{
+		if (functions[ii].placed)
+		{
+			placed[count++]	=	&functions[ii];
+		}
+	}
+	qsort(placed, count, sizeof(*placed), compare_start);
+	for (ii=0; ii<count; ii++)
+	{
+		placed[ii]->flash	=	((ii + 1) < count ? placed[ii + 1]->start : (textStart + textSize)) - placed[ii]->start;
+	}
+	used		=	textSize + dataSize;
+	freeBytes	=	(long)bootSize - (long)used;
+
+	printf("[%s] %s, boot 0x%05lx..0x%05lx, %lu bytes\n", name, flavor, textStart, textStart + bootSize - 1, bootSize);
+	delta	=	size_line("size", "total", used);
+	size_line("size", "text", textSize);
+	size_line("size", "data", dataSize);
+	size_line("size", "free", freeBytes < 0 ? 0 : freeBytes);
+	for (ii=0; ii<MODULE_COUNT + 1; ii++)
+	{
+		module	=	(ii < MODULE_COUNT) ? modules[ii][1] : "other";
+		for (jj=0; (jj<ii) && (jj<MODULE_COUNT) && strcmp(modules[jj][1], module); jj++)
+		{
+		}
+		if ((jj < ii) && (jj < MODULE_COUNT))
+		{
+			continue;					//*	listed already
+		}
+		moduleBytes	=	0;
+		for (jj=0; jj<count; jj++)
+		{
+			if (strcmp(module_of(placed[jj]->name), module) == 0)
+			{
+				moduleBytes	+=	placed[jj]->flash;
+			}
+		}
+		if (moduleBytes)
+		{
+			size_line("module", module, moduleBytes);
+		}
+	}
+	qsort(placed, count, sizeof(*placed), compare_flash);
+	for (ii=0; ii<count; ii++)
+	{
+		size_line("function", placed[ii]->name, placed[ii]->flash);
+	}
+	for (ii=0; ii<baselineCount; ii++)
+	{
+		if (!baseline[ii].seen && (strcmp(baseline[ii].kind, "size") != 0))
+		{
+			printf("%-9s %-26s %6u %+ld gone\n", baseline[ii].kind, baseline[ii].name, 0, -(long)baseline[ii].bytes);
+		}
+	}
+
+	if (freeBytes < 0)
+	{
+		printf("  %ld bytes over the boot section\n", -freeBytes);
+		failed	=	1;
+	}
+	if ((growth >= 0) && baselineCount && (delta > growth))
+	{
+		printf("  grew by %ld bytes, more than %ld\n", delta, growth);
+		failed	=	1;
+	}
+	free(placed);
+	return failed;
+}
+
+//*****************************************************************************
+static void usage(void)
+{
+	fprintf(stderr,	"usage: budget -r [-n name] [-m headroom] stk500boot.sym stk500boot.lss stk500boot.su\n"
+					"       budget -s [-n name] [-f flavor] [-b bootsize] [-c baseline] [-g growth]\n"
+					"                 stk500boot.sym stk500boot.lss stk500boot.su\n");
+	exit(2);
+}
+
+//*****************************************************************************
+int main(int argc, char *argv[])
+{
+const char		*name		=	"stk500boot";
+const char		*flavor		=	"default";
+const char		*baseline	=	NULL;
+long			headroom	=	0;
+long			growth		=	-1;
+unsigned long	bootSize	=	0;
+int				ram			=	0;
+int				size		=	0;
+int				opt;
+
+	while ((opt = getopt(argc, argv, "rsn:m:f:b:c:g:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r':	ram			=	1;							break;
+			case 's':	size		=	1;							break;
+			case 'n':	name		=	optarg;						break;
+			case 'm':	headroom	=	strtol(optarg, NULL, 0);	break;
+			case 'f':	flavor		=	optarg;						break;
+			case 'b':	bootSize	=	strtoul(optarg, NULL, 0);	break;
+			case 'c':	baseline	=	optarg;						break;
+			case 'g':	growth		=	strtol(optarg, NULL, 0);	break;
+			default:	usage();
+		}
+	}
+	if ((ram == size) || ((argc - optind) != 3))
+	{
+		usage();
+	}
+	if (!symbols_load(argv[optind]) || !stack_usage_load(argv[optind + 2]) || !listing_load(argv[optind + 1]))
+	{
+		return 1;
+	}
+	if (size)
+	{
+		return size_report(name, flavor, bootSize, baseline, growth);
+	}
+	return ram_report(name, headroom);
+}
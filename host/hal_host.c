@@ -0,0 +1,389 @@
+//**************************************************************************
+//*
+//* Title:		Host implementation of the bootloader HAL
+//* Filename:		hal_host.c
+//*
+//* Simulated flash, EEPROM and SPI flash for the native build, see hal_host.h.
+//* Flash follows the SPM rules the bootloader depends on: a page write can
+//* only clear bits, the page buffer survives an erase, and a write or
+//* hal_flash_rww_enable() drops it.
+//*
+//**************************************************************************
+
+#define	_POSIX_C_SOURCE		200809L
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<time.h>
+#include	<poll.h>
+#include	<unistd.h>
+#include	"hal_host.h"
+#include	"../spiflash.h"
+#include	"../mailbox.h"
+
+static unsigned char	flash[FLASHEND + 1];
+static unsigned char	eeprom[E2END + 1];
+static unsigned char	pageBuffer[SPM_PAGESIZE];
+static const char		*flashFile;
+static const char		*eepromFile;
+static unsigned char	spiFlash[SPIFLASH_HOST_SIZE];
+static const char		*spiFlashFile;
+sota_mailbox_t			halHostMailbox;				//*	the RAM that survives a watchdog reset
+static const char		*mailboxFile;
+static int				rxPending	=	-1;		//*	byte hal_uart_available() has already read
+static const unsigned char	*feedData;				//*	hal_host_uart_feed()
+static size_t			feedLength;
+static jmp_buf			*feedEnd;
+
+//*****************************************************************************
+static void image_load(const char *fileName, unsigned char *image, size_t size)
+{
+FILE	*file;
+
+	memset(image, 0xFF, size);
+	if (fileName && (file = fopen(fileName, "rb")))
+	{
+		if (fread(image, 1, size, file) == 0 && ferror(file))
+		{
+			perror(fileName);
+		}
+		fclose(file);
+	}
+}
+
+//*****************************************************************************
+static void image_save(const char *fileName, const unsigned char *image, size_t size)
+{
+FILE	*file;
+
+	if (!fileName)
+	{
+		return;
+	}
+	if (!(file = fopen(fileName, "wb")) || (fwrite(image, 1, size, file) != size))
+	{
+		perror(fileName);
+	}
+	if (file)
+	{
+		fclose(file);
+	}
+}
+
+//*****************************************************************************
+static void hal_host_exit(void)
+{
+	fflush(stdout);
+	image_save(flashFile, flash, sizeof(flash));
+	image_save(eepromFile, eeprom, sizeof(eeprom));
+	image_save(spiFlashFile, spiFlash, sizeof(spiFlash));
+	image_save(mailboxFile, (unsigned char *)&halHostMailbox, sizeof(halHostMailbox));
+}
+
+//*****************************************************************************
+void hal_init(void)
+{
+static int	registered	=	0;
+
+	flashFile	=	getenv("SOTA_HOST_FLASH");
+	eepromFile	=	getenv("SOTA_HOST_EEPROM");
+	spiFlashFile	=	getenv("SOTA_HOST_SPIFLASH");
+	mailboxFile	=	getenv("SOTA_HOST_MAILBOX");
+	image_load(flashFile, flash, sizeof(flash));
+	image_load(eepromFile, eeprom, sizeof(eeprom));
+	image_load(spiFlashFile, spiFlash, sizeof(spiFlash));
+	image_load(mailboxFile, (unsigned char *)&halHostMailbox, sizeof(halHostMailbox));
+	memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+	rxPending	=	-1;
+	if (!registered)
+	{
+		atexit(hal_host_exit);
+		registered	=	1;
+	}
+}
+
+//*****************************************************************************
+//*	UART on stdin/stdout, the link closing ends the bootloader
+
+void hal_uart_init(unsigned char baudSelect)
+{
+	(void)baudSelect;
+}
+
+void hal_uart_enable(void)
+{
+}
+
+void hal_uart_release(void)
+{
+}
+
+//*****************************************************************************
+static int uart_receive(int timeout)
+{
+struct pollfd	input	=	{ STDIN_FILENO, POLLIN, 0 };
+unsigned char	c;
+ssize_t			n;
+
+	if (rxPending >= 0)
+	{
+		return rxPending;
+	}
+	if (feedEnd)
+	{
+		if (feedLength == 0)
+		{
+			longjmp(*feedEnd, 1);				//*	never wait on a buffer that ran dry
+		}
+		feedLength--;
+		rxPending	=	*feedData++;
+		return rxPending;
+	}
+	fflush(stdout);							//*	the host waits for our answer before it sends
+	if (poll(&input, 1, timeout) <= 0)
+	{
+		return -1;
+	}
+	n	=	read(STDIN_FILENO, &c, 1);
+	if (n <= 0)
+	{
+		exit(0);							//*	link closed
+	}
+	rxPending	=	c;
+	return rxPending;
+}
+
+int hal_uart_available(void)
+{
+	return uart_receive(0) >= 0;
+}
+
+unsigned char hal_uart_get(void)
+{
+unsigned char	c;
+
+	while (uart_receive(-1) < 0)
+	{
+		// wait for data
+	}
+	c			=	rxPending;
+	rxPending	=	-1;
+	return c;
+}
+
+void hal_uart_put(unsigned char c)
+{
+	if (!feedEnd)
+	{
+		putchar(c);
+	}
+}
+
+void hal_host_uart_feed(const unsigned char *data, size_t length, jmp_buf *end)
+{
+	feedData	=	data;
+	feedLength	=	length;
+	feedEnd		=	end;
+	rxPending	=	-1;
+}
+
+//*****************************************************************************
+//*	Flash
+
+unsigned char hal_flash_read_byte(address_t flashAddress)
+{
+	return flash[flashAddress & FLASHEND];
+}
+
+unsigned int hal_flash_read_word(address_t flashAddress)
+{
+	return hal_flash_read_byte(flashAddress) | (hal_flash_read_byte(flashAddress + 1) << 8);
+}
+
+void hal_flash_read_block(address_t flashAddress, unsigned char *dest, unsigned int count)
+{
+	while (count--)
+	{
+		*dest++	=	hal_flash_read_byte(flashAddress++);
+	}
+}
+
+void hal_flash_page_fill(address_t flashAddress, unsigned int data)
+{
+unsigned int	offset	=	flashAddress & (SPM_PAGESIZE - 2);
+
+	pageBuffer[offset]		=	data & 0xFF;
+	pageBuffer[offset + 1]	=	data >> 8;
+}
+
+void hal_flash_page_erase(address_t flashAddress)
+{
+	memset(flash + (flashAddress & FLASHEND & ~(SPM_PAGESIZE - 1)), 0xFF, SPM_PAGESIZE);
+}
+
+void hal_flash_page_write(address_t flashAddress)
+{
+unsigned char	*page	=	flash + (flashAddress & FLASHEND & ~(SPM_PAGESIZE - 1));
+unsigned int	ii;
+
+	for (ii=0; ii<SPM_PAGESIZE; ii++)
+	{
+		page[ii]	&=	pageBuffer[ii];		//*	programming only clears bits
+	}
+	memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+}
+
+void hal_flash_rww_enable(void)
+{
+	memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+}
+
+unsigned char hal_fuse_read(unsigned char which)
+{
+	(void)which;
+	return 0xFF;							//*	unprogrammed
+}
+
+void hal_lock_bits_set(unsigned char lockBits)
+{
+	(void)lockBits;
+}
+
+//*****************************************************************************
+//*	SPI NOR flash, the commands spiflash.h uses, each starts with a select
+
+static struct
+{
+	int				selected;
+	int				count;				//*	bytes clocked since the select
+	unsigned char	command;
+	uint32_t		address;
+	int				writeEnabled;
+} spi;
+
+void spiflash_init(void)
+{
+	spi.selected	=	0;
+}
+
+void spiflash_release(void)
+{
+	spi.selected	=	0;
+}
+
+void spiflash_select(void)
+{
+	spi.selected	=	1;
+	spi.count		=	0;
+}
+
+void spiflash_deselect(void)
+{
+uint32_t	ii;
+
+	if (spi.selected && (spi.command == SPIFLASH_CMD_SECTOR_ERASE) && (spi.count >= 4) && spi.writeEnabled)
+	{
+		spi.address	&=	~(SPIFLASH_SECTOR_SIZE - 1);
+		for (ii=0; ii<SPIFLASH_SECTOR_SIZE; ii++)
+		{
+			spiFlash[(spi.address + ii) & (SPIFLASH_HOST_SIZE - 1)]	=	0xFF;
+		}
+	}
+	if (spi.selected && ((spi.command == SPIFLASH_CMD_SECTOR_ERASE) || (spi.command == SPIFLASH_CMD_PAGE_PROGRAM)))
+	{
+		spi.writeEnabled	=	0;
+	}
+	spi.selected	=	0;
+}
+
+unsigned char spiflash_transfer(unsigned char data)
+{
+unsigned char	answer	=	0xFF;
+uint32_t		at;
+
+	if (!spi.selected)
+	{
+		return answer;
+	}
+	if (spi.count == 0)
+	{
+		spi.command	=	data;
+		spi.address	=	0;
+		if (data == SPIFLASH_CMD_WRITE_ENABLE)
+		{
+			spi.writeEnabled	=	1;
+		}
+	}
+	else if (spi.command == SPIFLASH_CMD_READ_STATUS)
+	{
+		answer	=	spi.writeEnabled ? 0x02 : 0;		//*	WEL, never busy
+	}
+	else if (spi.count < 4)
+	{
+		spi.address	=	(spi.address << 8) | data;
+	}
+	else if (spi.command == SPIFLASH_CMD_READ)
+	{
+		answer		=	spiFlash[spi.address & (SPIFLASH_HOST_SIZE - 1)];
+		spi.address++;
+	}
+	else if ((spi.command == SPIFLASH_CMD_PAGE_PROGRAM) && spi.writeEnabled)
+	{
+		//*	wraps within the page and can only clear bits, like NOR flash
+		at	=	(spi.address & ~(SPIFLASH_PAGE_SIZE - 1)) | ((spi.address + spi.count - 4) & (SPIFLASH_PAGE_SIZE - 1));
+		spiFlash[at & (SPIFLASH_HOST_SIZE - 1)]	&=	data;
+	}
+	spi.count++;
+	return answer;
+}
+
+//*****************************************************************************
+//*	EEPROM
+
+unsigned char hal_eeprom_read_byte(uint16_t eeAddress)
+{
+	return eeprom[eeAddress & E2END];
+}
+
+void hal_eeprom_read_block(void *dest, uint16_t eeAddress, unsigned int count)
+{
+unsigned char	*p	=	dest;
+
+	while (count--)
+	{
+		*p++	=	hal_eeprom_read_byte(eeAddress++);
+	}
+}
+
+void hal_host_eeprom_write(uint16_t eeAddress, unsigned char data)
+{
+	eeprom[eeAddress & E2END]	=	data;
+}
+
+//*****************************************************************************
+//*	System
+
+unsigned char hal_watchdog_disarm(void)
+{
+const char	*cause	=	getenv("SOTA_HOST_RESET");
+
+	return cause && (strcmp(cause, "watchdog") == 0);	//*	otherwise a power on reset
+}
+
+void hal_start_application(void)
+{
+	if (feedEnd)
+	{
+		longjmp(*feedEnd, 1);
+	}
+	exit(0);
+}
+
+uint32_t hal_host_cycles(void)
+{
+struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
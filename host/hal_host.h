@@ -0,0 +1,94 @@
+//**************************************************************************
+//*
+//* Title:		Host implementation of the bootloader HAL
+//* Filename:		hal_host.h
+//*
+//* Included through hal.h when stk500boot.c is built with HOST_BUILD
+//* (make host). The simulated part is laid out like an ATmega2560: 256K
+//* flash with 256 byte pages, 4K EEPROM. -DSPM_PAGESIZE=128 (make host
+//* HOST_PAGESIZE=128) gives it the pages of the smaller parts instead. The
+//* UART is stdin/stdout, so a host client can drive the bootloader through
+//* a pipe or a pty.
+//*
+//*	SOTA_HOST_FLASH		file holding the flash image, loaded at start and
+//*						written back when the bootloader exits
+//*	SOTA_HOST_EEPROM	the same for the EEPROM
+//*	SOTA_HOST_SPIFLASH	the same for a 1M SPI NOR flash behind spiflash.h,
+//*						for ENABLE_SPIFLASH_STAGING
+//*	SOTA_HOST_RESET		"watchdog" makes this start look like a watchdog
+//*						reset, which goes straight to a bootable application
+//*	SOTA_HOST_MAILBOX	the RAM mailbox of mailbox.h (ENABLE_MAILBOX), what an
+//*						application left there before its watchdog reset
+//*
+//* Files that do not exist yet start erased (0xFF). The cycle clock counts
+//* nanoseconds, F_CPU is set to match.
+//*
+//* hal_host_uart_feed() puts a buffer in place of stdin for harnesses that
+//* run the bootloader in process (host/parser_fuzz.c). Answers are dropped,
+//* and running dry or starting the application longjmp()s to end instead
+//* of exiting.
+//*
+//**************************************************************************
+
+#ifndef _HAL_HOST_H_
+#define _HAL_HOST_H_
+
+#include	<inttypes.h>
+#include	<stddef.h>
+#include	<setjmp.h>
+
+#define	F_CPU					1000000000UL
+#define	FLASHEND				0x3FFFF
+#ifndef SPM_PAGESIZE
+	#define	SPM_PAGESIZE		256
+#endif
+#define	E2END					0x0FFF
+#define	RAMEND					0x21FF
+
+#define	HAL_FAR_FLASH
+typedef uint32_t address_t;
+
+#define	HAL_UART_BAUD_SELECT(baudRate)	0
+
+#define	HAL_FUSE_LOW			0
+#define	HAL_FUSE_HIGH			3
+#define	HAL_FUSE_EXTENDED		2
+#define	HAL_LOCK_BITS			1
+
+void			hal_init(void);
+
+void			hal_uart_init(unsigned char baudSelect);
+void			hal_uart_enable(void);
+void			hal_uart_release(void);
+int				hal_uart_available(void);
+unsigned char	hal_uart_get(void);
+void			hal_uart_put(unsigned char c);
+void			hal_host_uart_feed(const unsigned char *data, size_t length, jmp_buf *end);
+
+unsigned char	hal_flash_read_byte(address_t flashAddress);
+unsigned int	hal_flash_read_word(address_t flashAddress);
+void			hal_flash_read_block(address_t flashAddress, unsigned char *dest, unsigned int count);
+void			hal_flash_page_fill(address_t flashAddress, unsigned int data);
+void			hal_flash_page_erase(address_t flashAddress);
+void			hal_flash_page_write(address_t flashAddress);
+void			hal_flash_rww_enable(void);
+unsigned char	hal_fuse_read(unsigned char which);
+void			hal_lock_bits_set(unsigned char lockBits);
+
+unsigned char	hal_eeprom_read_byte(uint16_t eeAddress);
+void			hal_eeprom_read_block(void *dest, uint16_t eeAddress, unsigned int count);
+void			hal_host_eeprom_write(uint16_t eeAddress, unsigned char data);
+
+unsigned char	hal_watchdog_disarm(void);
+void			hal_start_application(void) __attribute__ ((noreturn));
+uint32_t		hal_host_cycles(void);
+
+//*	nothing to wait for or to mask on the workstation
+#define	hal_flash_busy_wait()
+#define	hal_irq_enable()
+#define	hal_irq_disable()
+#define	hal_vectors_boot()
+#define	hal_vectors_app()
+#define	hal_delay_us(us)
+
+#endif	//	_HAL_HOST_H_
@@ -0,0 +1,571 @@
+//**************************************************************************
+//*
+//* Title:		Intel HEX merge of application and bootloader images
+//* Filename:		hexmerge.cpp
+//*
+//* Takes the place of merge.lua: reads any number of application and
+//* bootloader images record by record, checks every record, and writes
+//* one Intel HEX or raw binary image.
+//*
+//*	hexmerge [-a bootaddr] [-f flashsize] [-t trailer] [-b] [-p fill] [-o out] [-v]
+//*			[app.hex ...] [-B boot.hex ...]
+//*
+//*	-a	BOOTLOADER_ADDRESS in hex, application bytes must lie below it,
+//*		bootloader bytes (-B) at or above it
+//*	-f	size of the flash, nothing may lie beyond it
+//*	-t	APP_TRAILER in hex, appends the trailer ENABLE_APP_TRAILER checks:
+//*		"SOTA", length and CRC32 of the application from address 0 up to
+//*		its last byte, gaps counted as 0xFF, all little endian
+//*	-b	raw binary from address 0, gaps filled with -p (0xFF)
+//*	-o	output file, stdout without it
+//*	-v	address ranges of every input on stderr
+//*
+//* Data (00), end of file (01), extended segment (02) and extended linear
+//* (04) address records are understood. Start address records (03, 05)
+//* are checked and dropped, an AVR starts at its reset vector. A record
+//* with a bad checksum or length, a file without an end of file record and
+//* a byte written twice, within one file or by two of them, are errors.
+//*
+//* Records are kept as runs of consecutive bytes, so memory and time grow
+//* with the image, not with the address space.
+//*
+//**************************************************************************
+
+#include	<algorithm>
+#include	<cinttypes>
+#include	<cstdint>
+#include	<cstdio>
+#include	<cstdlib>
+#include	<cstring>
+#include	<string>
+#include	<vector>
+#include	<unistd.h>
+
+#define	RECORD_DATA				0x00
+#define	RECORD_EOF				0x01
+#define	RECORD_SEGMENT			0x02
+#define	RECORD_START_SEGMENT	0x03
+#define	RECORD_LINEAR			0x04
+#define	RECORD_START_LINEAR		0x05
+
+#define	TRAILER_MAGIC			0x41544F53UL	//*	APP_TRAILER_MAGIC in stk500boot.c
+#define	TRAILER_SIZE			12
+
+#define	OUTPUT_RECORD_SIZE		16			//*	what avr-objcopy writes
+#define	LINE_MAX				(1 + (2 * (5 + 255)) + 3)
+
+//*****************************************************************************
+//*	A run of consecutive bytes from one input
+
+struct hex_run_t
+{
+	uint32_t				start;
+	std::vector<uint8_t>	data;
+	unsigned int			source;		//*	index into sources
+};
+
+struct hex_source_t
+{
+	const char		*fileName;
+	bool			isBoot;
+	uint32_t		low;
+	uint32_t		high;				//*	last byte, valid if bytes
+	unsigned long	bytes;
+};
+
+static std::vector<hex_source_t>	sources;
+static std::vector<hex_run_t>		runs;
+
+//*****************************************************************************
+static int hex_nibble(char c)
+{
+	if ((c >= '0') && (c <= '9'))
+	{
+		return c - '0';
+	}
+	if ((c >= 'A') && (c <= 'F'))
+	{
+		return c - 'A' + 10;
+	}
+	if ((c >= 'a') && (c <= 'f'))
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+//*****************************************************************************
+/*
+ * appends a byte to the run of the source, a new run starts at every jump
+ */
+static void run_put(unsigned int source, uint32_t address, uint8_t value, hex_run_t *&current)
+{
+	if (!current || (current->source != source) || ((current->start + current->data.size()) != address))
+	{
+		runs.push_back(hex_run_t());
+		current			=	&runs.back();
+		current->start	=	address;
+		current->source	=	source;
+	}
+	current->data.push_back(value);
+}
+
+//*****************************************************************************
+/*
+ * one file, ":LLAAAATT<data>CC" per line, blank lines and CR/LF endings are fine
+ */
+static bool hex_load(unsigned int source)
+{
+const char		*fileName	=	sources[source].fileName;
+FILE			*file;
+char			line[LINE_MAX + 2];
+uint8_t			record[5 + 255];
+unsigned int	lineNumber	=	0;
+unsigned int	length;
+unsigned int	count;
+unsigned int	offset;
+unsigned int	ii;
+uint32_t		base		=	0;
+bool			segmented	=	false;		//*	02 records wrap the offset at 64K
+bool			ended		=	false;
+uint8_t			checksum;
+hex_run_t		*current	=	NULL;
+int				high;
+int				low;
+
+	if (!(file = fopen(fileName, "r")))
+	{
+		perror(fileName);
+		return false;
+	}
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+		length	=	strlen(line);
+		if ((length == (sizeof(line) - 1)) && (line[length - 1] != '\n'))
+		{
+			fprintf(stderr, "%s:%u: line too long\n", fileName, lineNumber);
+			fclose(file);
+			return false;
+		}
+		while (length && ((line[length - 1] == '\n') || (line[length - 1] == '\r') || (line[length - 1] == ' ')))
+		{
+			length--;
+		}
+		if (length == 0)
+		{
+			continue;
+		}
+		if (ended)
+		{
+			fprintf(stderr, "%s:%u: record after the end of file record\n", fileName, lineNumber);
+			fclose(file);
+			return false;
+		}
+		if ((line[0] != ':') || (length < 11) || !(length & 1))
+		{
+			fprintf(stderr, "%s:%u: not an Intel HEX record\n", fileName, lineNumber);
+			fclose(file);
+			return false;
+		}
+		count		=	(length - 1) / 2;
+		checksum	=	0;
+		for (ii=0; ii<count; ii++)
+		{
+			high	=	hex_nibble(line[1 + (2 * ii)]);
+			low		=	hex_nibble(line[2 + (2 * ii)]);
+			if ((high < 0) || (low < 0))
+			{
+				fprintf(stderr, "%s:%u: not a hex digit\n", fileName, lineNumber);
+				fclose(file);
+				return false;
+			}
+			record[ii]	=	(high << 4) | low;
+			checksum	+=	record[ii];
+		}
+		if (count != (5U + record[0]))
+		{
+			fprintf(stderr, "%s:%u: record holds %u bytes, its length says %u\n", fileName, lineNumber, count - 5, record[0]);
+			fclose(file);
+			return false;
+		}
+		if (checksum != 0)
+		{
+			fprintf(stderr, "%s:%u: bad checksum 0x%02X, expected 0x%02X\n", fileName, lineNumber,
+					record[count - 1], (uint8_t)(record[count - 1] - checksum));
+			fclose(file);
+			return false;
+		}
+		offset	=	(record[1] << 8) | record[2];
+		switch (record[3])
+		{
+			case RECORD_DATA:
+				for (ii=0; ii<record[0]; ii++)
+				{
+					run_put(source, base + (segmented ? ((offset + ii) & 0xFFFF) : (offset + ii)), record[4 + ii], current);
+				}
+				break;
+
+			case RECORD_EOF:
+				ended	=	true;
+				break;
+
+			case RECORD_SEGMENT:
+			case RECORD_LINEAR:
+				if (record[0] != 2)
+				{
+					fprintf(stderr, "%s:%u: address record with %u bytes\n", fileName, lineNumber, record[0]);
+					fclose(file);
+					return false;
+				}
+				segmented	=	(record[3] == RECORD_SEGMENT);
+				base		=	(uint32_t)((record[4] << 8) | record[5]) << (segmented ? 4 : 16);
+				break;
+
+			case RECORD_START_SEGMENT:
+			case RECORD_START_LINEAR:
+				if (record[0] != 4)
+				{
+					fprintf(stderr, "%s:%u: start address record with %u bytes\n", fileName, lineNumber, record[0]);
+					fclose(file);
+					return false;
+				}
+				break;
+
+			default:
+				fprintf(stderr, "%s:%u: unknown record type 0x%02X\n", fileName, lineNumber, record[3]);
+				fclose(file);
+				return false;
+		}
+	}
+	fclose(file);
+	if (!ended)
+	{
+		fprintf(stderr, "%s: no end of file record, truncated?\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+//*****************************************************************************
+static bool run_before(const hex_run_t &a, const hex_run_t &b)
+{
+	return a.start < b.start;
+}
+
+//*****************************************************************************
+/*
+ * sorts the runs, fails on bytes written twice or outside their section,
+ * merges runs that touch so the output has as few gaps as possible
+ */
+static bool runs_check(uint32_t bootAddress, uint64_t flashSize)
+{
+std::vector<hex_run_t>	merged;
+hex_source_t			*source;
+uint64_t				end;
+bool					ok	=	true;
+
+	std::stable_sort(runs.begin(), runs.end(), run_before);
+	for (size_t ii=0; ii<runs.size(); ii++)
+	{
+		hex_run_t	&run	=	runs[ii];
+
+		end		=	(uint64_t)run.start + run.data.size();
+		source	=	&sources[run.source];
+		if (source->bytes == 0)
+		{
+			source->low	=	run.start;
+		}
+		source->high	=	std::max<uint64_t>(source->high, end - 1);
+		source->bytes	+=	run.data.size();
+		if (bootAddress && !source->isBoot && (end > bootAddress))
+		{
+			fprintf(stderr, "%s: 0x%05" PRIX64 "..0x%05" PRIX64 " reaches into the bootloader at 0x%05X\n",
+					source->fileName, (uint64_t)std::max(run.start, bootAddress), end - 1, bootAddress);
+			ok	=	false;
+		}
+		if (bootAddress && source->isBoot && (run.start < bootAddress))
+		{
+			fprintf(stderr, "%s: 0x%05X lies below the bootloader at 0x%05X\n", source->fileName, run.start, bootAddress);
+			ok	=	false;
+		}
+		if (flashSize && (end > flashSize))
+		{
+			fprintf(stderr, "%s: 0x%05" PRIX64 " lies beyond the flash end at 0x%05" PRIX64 "\n",
+					source->fileName, end - 1, flashSize - 1);
+			ok	=	false;
+		}
+		if (!merged.empty() && (run.start < (merged.back().start + merged.back().data.size())))
+		{
+			fprintf(stderr, "%s: 0x%05X..0x%05" PRIX64 " overlaps %s\n", source->fileName, run.start,
+					std::min(end, (uint64_t)merged.back().start + merged.back().data.size()) - 1,
+					sources[merged.back().source].fileName);
+			ok	=	false;
+			continue;
+		}
+		if (!merged.empty() && (run.start == (merged.back().start + merged.back().data.size())))
+		{
+			merged.back().data.insert(merged.back().data.end(), run.data.begin(), run.data.end());
+		}
+		else
+		{
+			merged.push_back(hex_run_t());
+			merged.back().start		=	run.start;
+			merged.back().source	=	run.source;
+			merged.back().data.swap(run.data);
+		}
+	}
+	runs.swap(merged);
+	return ok;
+}
+
+//*****************************************************************************
+static uint32_t crc32_update(uint32_t crc, uint8_t data)
+{
+unsigned int	ii;
+
+	crc	^=	data;
+	for (ii=0; ii<8; ii++)
+	{
+		crc	=	(crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+	}
+	return crc;
+}
+
+//*****************************************************************************
+/*
+ * the trailer the bootloader writes after CMD_COMMIT_IMAGE, for images that
+ * go in by ISP or avrdude. The runs are sorted and merged, the application
+ * must end below the trailer page
+ */
+static bool trailer_append(uint32_t trailerAddress, uint32_t bootAddress)
+{
+hex_source_t	trailer		=	{ "trailer", false, 0, 0, 0 };
+hex_run_t		*current	=	NULL;
+uint32_t		length		=	0;
+uint32_t		crc			=	0xFFFFFFFF;
+uint32_t		address		=	0;
+uint32_t		value;
+unsigned int	ii;
+
+	if (bootAddress && (trailerAddress + TRAILER_SIZE > bootAddress))
+	{
+		fprintf(stderr, "trailer: 0x%05X lies in the bootloader at 0x%05X\n", trailerAddress, bootAddress);
+		return false;
+	}
+	for (size_t jj=0; jj<runs.size(); jj++)
+	{
+		if (sources[runs[jj].source].isBoot)
+		{
+			continue;
+		}
+		if ((runs[jj].start + runs[jj].data.size()) > trailerAddress)
+		{
+			fprintf(stderr, "%s: reaches 0x%05X, the trailer page at 0x%05X holds no code\n",
+					sources[runs[jj].source].fileName, (uint32_t)(runs[jj].start + runs[jj].data.size() - 1), trailerAddress);
+			return false;
+		}
+		for (; address<runs[jj].start; address++)
+		{
+			crc	=	crc32_update(crc, 0xFF);
+		}
+		for (size_t kk=0; kk<runs[jj].data.size(); kk++, address++)
+		{
+			crc	=	crc32_update(crc, runs[jj].data[kk]);
+		}
+		length	=	address;
+	}
+	if (length == 0)
+	{
+		fprintf(stderr, "trailer: no application to vouch for\n");
+		return false;
+	}
+	crc	=	~crc;
+
+	sources.push_back(trailer);
+	for (ii=0; ii<TRAILER_SIZE; ii++)
+	{
+		value	=	(ii < 4) ? TRAILER_MAGIC : ((ii < 8) ? length : crc);
+		run_put(sources.size() - 1, trailerAddress + ii, (value >> (8 * (ii & 3))) & 0xFF, current);
+	}
+	sources.back().low		=	trailerAddress;
+	sources.back().high		=	trailerAddress + TRAILER_SIZE - 1;
+	sources.back().bytes	=	TRAILER_SIZE;
+	std::stable_sort(runs.begin(), runs.end(), run_before);
+	return true;
+}
+
+//*****************************************************************************
+static void hex_record(std::string &out, uint8_t type, uint16_t offset, const uint8_t *data, unsigned int count)
+{
+static const char	digits[]	=	"0123456789ABCDEF";
+uint8_t				checksum	=	count + (offset >> 8) + (offset & 0xFF) + type;
+char				line[LINE_MAX + 1];
+char				*next		=	line;
+unsigned int		ii;
+
+	*next++	=	':';
+	*next++	=	digits[count >> 4];
+	*next++	=	digits[count & 0x0F];
+	*next++	=	digits[offset >> 12];
+	*next++	=	digits[(offset >> 8) & 0x0F];
+	*next++	=	digits[(offset >> 4) & 0x0F];
+	*next++	=	digits[offset & 0x0F];
+	*next++	=	digits[type >> 4];
+	*next++	=	digits[type & 0x0F];
+	for (ii=0; ii<count; ii++)
+	{
+		*next++		=	digits[data[ii] >> 4];
+		*next++		=	digits[data[ii] & 0x0F];
+		checksum	+=	data[ii];
+	}
+	checksum	=	-checksum;
+	*next++	=	digits[checksum >> 4];
+	*next++	=	digits[checksum & 0x0F];
+	*next++	=	'\n';
+	out.append(line, next - line);
+}
+
+//*****************************************************************************
+/*
+ * 16 byte data records that never cross a 64K boundary, an 04 record
+ * whenever the upper 16 address bits change
+ */
+static void hex_write(std::string &out)
+{
+uint32_t		upper	=	0;
+uint32_t		address;
+uint8_t			upperBytes[2];
+size_t			index;
+unsigned int	count;
+
+	for (size_t ii=0; ii<runs.size(); ii++)
+	{
+		for (index=0; index<runs[ii].data.size(); index+=count)
+		{
+			address	=	runs[ii].start + index;
+			count	=	std::min<size_t>(OUTPUT_RECORD_SIZE, runs[ii].data.size() - index);
+			count	=	std::min<uint32_t>(count, 0x10000 - (address & 0xFFFF));
+			if ((address >> 16) != upper)
+			{
+				upper			=	address >> 16;
+				upperBytes[0]	=	upper >> 8;
+				upperBytes[1]	=	upper & 0xFF;
+				hex_record(out, RECORD_LINEAR, 0, upperBytes, 2);
+			}
+			hex_record(out, RECORD_DATA, address & 0xFFFF, &runs[ii].data[index], count);
+		}
+	}
+	hex_record(out, RECORD_EOF, 0, NULL, 0);
+}
+
+//*****************************************************************************
+static void binary_write(std::string &out, uint8_t fill)
+{
+	if (runs.empty())
+	{
+		return;
+	}
+	out.assign(runs.back().start + runs.back().data.size(), (char)fill);
+	for (size_t ii=0; ii<runs.size(); ii++)
+	{
+		memcpy(&out[runs[ii].start], runs[ii].data.data(), runs[ii].data.size());
+	}
+}
+
+//*****************************************************************************
+static void usage(void)
+{
+	fprintf(stderr,	"usage: hexmerge [-a bootaddr] [-f flashsize] [-t trailer] [-b] [-p fill] [-o out] [-v] [app.hex ...] [-B boot.hex ...]\n");
+	exit(2);
+}
+
+//*****************************************************************************
+int main(int argc, char *argv[])
+{
+const char		*outName	=	NULL;
+uint32_t		bootAddress	=	0;
+uint64_t		flashSize	=	0;
+uint32_t		trailerAddress	=	0;
+bool			trailer		=	false;
+uint8_t			fill		=	0xFF;
+bool			binary		=	false;
+bool			verbose		=	false;
+bool			ok			=	true;
+std::string		out;
+FILE			*file;
+hex_source_t	source		=	{ NULL, false, 0, 0, 0 };
+int				opt;
+
+	//*	leading '-' keeps the order of the file arguments, they come back as opt 1
+	while ((opt = getopt(argc, argv, "-a:f:t:bp:o:vB:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'a':	bootAddress	=	strtoul(optarg, NULL, 16);	break;
+			case 'f':	flashSize	=	strtoull(optarg, NULL, 0);	break;
+			case 't':	trailerAddress	=	strtoul(optarg, NULL, 16);
+						trailer			=	true;					break;
+			case 'b':	binary		=	true;						break;
+			case 'p':	fill		=	strtoul(optarg, NULL, 0);	break;
+			case 'o':	outName		=	optarg;						break;
+			case 'v':	verbose		=	true;						break;
+			case 1:
+			case 'B':
+				source.fileName	=	optarg;
+				source.isBoot	=	(opt == 'B');
+				sources.push_back(source);
+				break;
+			default:	usage();
+		}
+	}
+	if ((optind != argc) || sources.empty())
+	{
+		usage();
+	}
+	for (unsigned int ii=0; ii<sources.size(); ii++)
+	{
+		ok	=	hex_load(ii) && ok;
+	}
+	ok	=	ok && runs_check(bootAddress, flashSize);
+	ok	=	ok && (!trailer || trailer_append(trailerAddress, bootAddress));
+	if (verbose)
+	{
+		for (unsigned int ii=0; ii<sources.size(); ii++)
+		{
+			if (sources[ii].bytes)
+			{
+				fprintf(stderr, "%-4s %-32s 0x%05X..0x%05X %8lu bytes\n", sources[ii].isBoot ? "boot" : "app",
+						sources[ii].fileName, sources[ii].low, sources[ii].high, sources[ii].bytes);
+			}
+		}
+	}
+	if (!ok)
+	{
+		return 1;
+	}
+
+	if (binary)
+	{
+		binary_write(out, fill);
+	}
+	else
+	{
+		hex_write(out);
+	}
+	if (!(file = outName ? fopen(outName, binary ? "wb" : "w") : stdout))
+	{
+		perror(outName);
+		return 1;
+	}
+	if ((fwrite(out.data(), 1, out.size(), file) != out.size()) || (fflush(file) != 0))
+	{
+		perror(outName ? outName : "stdout");
+		return 1;
+	}
+	if (outName)
+	{
+		fclose(file);
+	}
+	return 0;
+}
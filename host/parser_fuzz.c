@@ -0,0 +1,389 @@
+//**************************************************************************
+//*
+//* Title:		Protocol parser fuzz harness and throughput benchmark
+//* Filename:		parser_fuzz.c
+//*
+//* Runs main() of stk500boot.c in process on byte streams fed through
+//* hal_host_uart_feed(), so the SOTA framing and the STK500 parser see
+//* exactly what a UART would deliver.
+//*
+//*	make fuzz			libFuzzer (clang), ASan and UBSan, corpus in FUZZ_CORPUS
+//*	make bench_parser	frames per second for answered and rejected frames
+//*	host/parser_fuzz_replay file ...	replays fuzzer inputs without libFuzzer
+//*
+//* Fuzzer input: bit 0 of the first byte clear, the rest goes to the UART
+//* as it is. Bit 0 set, the rest is a list of plaintext payloads, each a
+//* two byte big endian length (at most 288) and the bytes, which are
+//* encrypted on the link key and framed, so the fuzzer reaches the STK500
+//* parser and the commands behind it. Bit 1 set also fixes up the XOR
+//* checksum of every payload that starts like an envelope. Bit 2 set
+//* starts authenticated, so the fuzzer gets past the handshakes.
+//*
+//* Every input starts from a power on state: erased flash and EEPROM, no
+//* session, sequence number 0.
+//*
+//* Without arguments the replay build first runs the regression inputs, the
+//* envelopes that once read or wrote past msgBuffer, then the benchmark.
+//*
+//**************************************************************************
+
+#define	main	stk500boot_main
+#include	"../stk500boot.c"
+#undef	main
+
+#include	<stdio.h>
+#include	<stdlib.h>
+
+#define	FRAME_MAX		288			//*	receivedPacket[]
+#define	BENCH_FRAMES	2000
+#define	BENCH_RUNS		5
+#define	WIRE_MAX		(BENCH_FRAMES * (FRAME_MAX + 4))
+
+static jmp_buf			linkClosed;
+static unsigned char	wire[WIRE_MAX];
+
+//*****************************************************************************
+static void parser_reset(unsigned char authenticated)
+{
+	isAuthenticated	=	authenticated;
+	seqNum			=	0;
+	isLeave			=	0;
+	packetSize		=	0;
+	address			=	0;
+	slotOffset		=	0;
+	assemblyPending	=	0;
+	answerCacheSize	=	0;
+	frameTailSize	=	0;
+#ifdef ENABLE_SESSION_KEYS
+	sessionActive	=	0;
+#endif
+#ifdef ENABLE_APP_TRAILER
+	appCheck		=	APP_CHECK_UNKNOWN;
+#endif
+}
+
+//*****************************************************************************
+/*
+ * runs the bootloader until the stream is used up or it starts the application
+ */
+static void parser_run(const unsigned char *data, size_t length, unsigned char authenticated)
+{
+	parser_reset(authenticated);
+	if (setjmp(linkClosed) == 0)
+	{
+		hal_host_uart_feed(data, length, &linkClosed);
+		stk500boot_main();
+	}
+	hal_host_uart_feed(NULL, 0, NULL);
+}
+
+//*****************************************************************************
+/*
+ * pads plain with 0xFF to whole blocks, encrypts it on the link key and
+ * frames it like a host does, returns the bytes used on the wire
+ */
+static size_t frame_build(unsigned char *dest, const unsigned char *plain, unsigned int length)
+{
+unsigned char	block[FRAME_MAX];
+unsigned int	size	=	(length + BLOCKLEN - 1) & ~(BLOCKLEN - 1);
+
+	memset(block, 0xFF, size);
+	memcpy(block, plain, length);
+#ifdef ENABLE_SESSION_KEYS
+	sessionActive	=	0;
+#endif
+	aes_encrypt(dest + 3, block, size);
+	dest[0]			=	SOTA_MESSAGE_START;
+	dest[1]			=	size >> 8;
+	dest[2]			=	size & 0xFF;
+	dest[size + 3]	=	0xFF;				//*	the bootloader reads one byte past the payload
+	return size + 4;
+}
+
+//*****************************************************************************
+/*
+ * XOR checksum behind the message an envelope header announces, if it fits
+ */
+static void checksum_fix(unsigned char *plain, unsigned int length)
+{
+unsigned int	end;
+unsigned int	ii;
+unsigned char	checksum	=	0;
+
+	if ((length < 6) || (plain[0] != MESSAGE_START))
+	{
+		return;
+	}
+	end	=	5 + ((plain[2] << 8) | plain[3]);
+	if (end >= length)
+	{
+		return;
+	}
+	for (ii=0; ii<end; ii++)
+	{
+		checksum	^=	plain[ii];
+	}
+	plain[end]	=	checksum;
+}
+
+//*****************************************************************************
+static unsigned int envelope_build(unsigned char *plain, unsigned char seq, const unsigned char *message, unsigned int length)
+{
+	plain[0]	=	MESSAGE_START;
+	plain[1]	=	seq;
+	plain[2]	=	length >> 8;
+	plain[3]	=	length & 0xFF;
+	plain[4]	=	TOKEN;
+	memcpy(plain + 5, message, length);
+	checksum_fix(plain, length + 6);
+	return length + 6;
+}
+
+//*****************************************************************************
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+unsigned char	plain[FRAME_MAX];
+size_t			wireLength	=	0;
+size_t			index		=	1;
+unsigned int	length;
+
+	if (size == 0)
+	{
+		return 0;
+	}
+	if (!(data[0] & 1))
+	{
+		parser_run(data + 1, size - 1, (data[0] >> 2) & 1);
+		return 0;
+	}
+	while ((index + 2) < size)
+	{
+		length	=	((data[index] << 8) | data[index + 1]) % (FRAME_MAX + 1);
+		index	+=	2;
+		if (length > (size - index))
+		{
+			length	=	size - index;
+		}
+		if ((length == 0) || ((wireLength + FRAME_MAX + 4) > sizeof(wire)))
+		{
+			break;
+		}
+		memcpy(plain, data + index, length);
+		index	+=	length;
+		if (data[0] & 2)
+		{
+			checksum_fix(plain, length);
+		}
+		wireLength	+=	frame_build(wire + wireLength, plain, length);
+	}
+	parser_run(wire, wireLength, (data[0] >> 2) & 1);
+	return 0;
+}
+
+#ifndef WITH_LIBFUZZER
+//*****************************************************************************
+/*
+ * frames are cut from a list of envelopes, count of them in turn
+ */
+typedef struct
+{
+	const char		*name;
+	unsigned char	message[FRAME_MAX];
+	unsigned int	length;			//*	of message
+	unsigned char	flaw;			//*	what to break after the envelope is built
+	unsigned char	answered;		//*	the bootloader must answer every frame
+} bench_frame_t;
+
+#define	FLAW_NONE		0
+#define	FLAW_CHECKSUM	1
+#define	FLAW_TOKEN		2
+#define	FLAW_LENGTH		3			//*	msgLength beyond msgBuffer
+#define	FLAW_NO_START	4			//*	random payload, no envelope at all
+#define	FLAW_SIZE_ODD	5			//*	SOTA size not a multiple of 16, header only
+#define	FLAW_SIZE_BIG	6			//*	SOTA size beyond receivedPacket, header only
+
+//*****************************************************************************
+static size_t bench_stream(const bench_frame_t *frame)
+{
+unsigned char	plain[FRAME_MAX];
+unsigned int	length;
+size_t			wireLength	=	0;
+unsigned int	ii;
+unsigned int	jj;
+
+	for (ii=0; ii<BENCH_FRAMES; ii++)
+	{
+		if ((frame->flaw == FLAW_SIZE_ODD) || (frame->flaw == FLAW_SIZE_BIG))
+		{
+			wire[wireLength++]	=	SOTA_MESSAGE_START;
+			wire[wireLength++]	=	(frame->flaw == FLAW_SIZE_BIG) ? 0x7F : 0x00;
+			wire[wireLength++]	=	(frame->flaw == FLAW_SIZE_BIG) ? 0xF0 : 0x11;
+			continue;
+		}
+		length	=	envelope_build(plain, frame->answered ? ii : 0, frame->message, frame->length);
+		switch (frame->flaw)
+		{
+			case FLAW_CHECKSUM:	plain[length - 1]	^=	0x01;		break;
+			case FLAW_TOKEN:	plain[4]			=	0x00;		break;
+			case FLAW_LENGTH:	plain[2]			=	0x0F;		break;
+			case FLAW_NO_START:
+				for (jj=0; jj<length; jj++)
+				{
+					plain[jj]	=	(ii * 31 + jj * 7) | 0x80;
+				}
+				break;
+		}
+		wireLength	+=	frame_build(wire + wireLength, plain, length);
+	}
+	return wireLength;
+}
+
+//*****************************************************************************
+/*
+ * fastest of BENCH_RUNS, the others were disturbed by something else
+ */
+static uint32_t bench_time(size_t wireLength)
+{
+uint32_t		best	=	UINT32_MAX;
+uint32_t		start;
+unsigned int	run;
+
+	for (run=0; run<BENCH_RUNS; run++)
+	{
+		start	=	hal_host_cycles();
+		parser_run(wire, wireLength, 0);
+		start	=	hal_host_cycles() - start;
+		if (start < best)
+		{
+			best	=	start;
+		}
+	}
+	return best;
+}
+
+//*****************************************************************************
+static int bench_run(void)
+{
+static bench_frame_t	frames[]	=	{
+	{ "sign on, answered",		{ CMD_SIGN_ON }, 1, FLAW_NONE, 1 },
+	{ "bad checksum",			{ CMD_SIGN_ON }, 1, FLAW_CHECKSUM, 0 },
+	{ "bad token",				{ CMD_SIGN_ON }, 1, FLAW_TOKEN, 0 },
+	{ "msgLength too big",		{ CMD_SIGN_ON }, 1, FLAW_LENGTH, 0 },
+	{ "no envelope",			{ CMD_SIGN_ON }, 1, FLAW_NO_START, 0 },
+	{ "bad checksum, 288",		{ CMD_SIGN_ON }, 282, FLAW_CHECKSUM, 0 },
+	{ "bad token, 288",			{ CMD_SIGN_ON }, 282, FLAW_TOKEN, 0 },
+	{ "no envelope, 288",		{ CMD_SIGN_ON }, 282, FLAW_NO_START, 0 },
+	{ "size not whole blocks",	{ 0 }, 0, FLAW_SIZE_ODD, 0 },
+	{ "size over 288",			{ 0 }, 0, FLAW_SIZE_BIG, 0 },
+};
+uint32_t		startup;
+uint32_t		elapsed;
+size_t			wireLength;
+unsigned int	ii;
+int				failed	=	0;
+
+	startup	=	bench_time(0);				//*	power on state and main() up to the first byte
+	printf("%-24s %6s %12s %12s\n", "frame", "bytes", "ns/frame", "frames/s");
+	for (ii=0; ii<sizeof(frames)/sizeof(frames[0]); ii++)
+	{
+		wireLength	=	bench_stream(&frames[ii]);
+		elapsed		=	bench_time(wireLength);
+		elapsed		=	(elapsed > startup) ? (elapsed - startup) : 1;
+		printf("%-24s %6zu %12.1f %12.0f", frames[ii].name, wireLength / BENCH_FRAMES,
+				(double)elapsed / BENCH_FRAMES, BENCH_FRAMES * 1e9 / elapsed);
+		//*	answered frames advance the sequence number, dropped ones must not
+		if (seqNum != (frames[ii].answered ? (BENCH_FRAMES & 0xFF) : 0))
+		{
+			printf("  FAILED, sequence number %u", seqNum);
+			failed	=	1;
+		}
+		printf("\n");
+	}
+	return failed;
+}
+
+//*****************************************************************************
+/*
+ * envelopes that must be refused with a two byte answer and leave the
+ * address alone, authenticated or not; before they were bounded each used
+ * bytes past the request, msgBuffer or receivedPacket
+ */
+static int regression_run(void)
+{
+static const bench_frame_t	frames[]	=	{
+	{ "read flash 1024",		{ CMD_READ_FLASH_ISP, 0x04, 0x00, 0x00 }, 4, FLAW_NONE, 1 },
+	{ "read flash 280",			{ CMD_READ_FLASH_ISP, 0x01, 0x18 }, 3, FLAW_NONE, 1 },
+	{ "read eeprom 0",			{ CMD_READ_EEPROM_ISP, 0x00, 0x00 }, 3, FLAW_NONE, 1 },
+	{ "program past request",	{ CMD_PROGRAM_FLASH_ISP, 0x01, 0x00 }, 12, FLAW_NONE, 1 },
+};
+unsigned char	plain[FRAME_MAX];
+size_t			wireLength;
+unsigned int	ii;
+unsigned char	authenticated;
+int				failed	=	0;
+
+	for (ii=0; ii<sizeof(frames)/sizeof(frames[0]); ii++)
+	{
+		for (authenticated=0; authenticated<2; authenticated++)
+		{
+			wireLength	=	frame_build(wire, plain, envelope_build(plain, 0, frames[ii].message, frames[ii].length));
+			parser_run(wire, wireLength, authenticated);
+			//*	STATUS_CMD_FAILED and the command byte fit one block
+			if ((seqNum != 1) || (answerCacheSize != BLOCKLEN) || (address != 0))
+			{
+				printf("regression %s%s: FAILED, answer of %u bytes\n", frames[ii].name,
+						authenticated ? ", authenticated" : "", answerCacheSize);
+				failed	=	1;
+			}
+		}
+	}
+	printf("regressions: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
+
+//*****************************************************************************
+static int replay(const char *fileName)
+{
+FILE			*file;
+unsigned char	*data;
+long			size;
+
+	if (!(file = fopen(fileName, "rb")) || (fseek(file, 0, SEEK_END) != 0) || ((size = ftell(file)) < 0))
+	{
+		perror(fileName);
+		return 1;
+	}
+	rewind(file);
+	data	=	malloc(size + 1);
+	if (!data || (fread(data, 1, size, file) != (size_t)size))
+	{
+		perror(fileName);
+		fclose(file);
+		free(data);
+		return 1;
+	}
+	fclose(file);
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	printf("%s: ok\n", fileName);
+	return 0;
+}
+
+//*****************************************************************************
+int main(int argc, char *argv[])
+{
+int	failed	=	0;
+int	ii;
+
+	if (argc < 2)
+	{
+		failed	=	regression_run();
+		return bench_run() | failed;
+	}
+	for (ii=1; ii<argc; ii++)
+	{
+		failed	|=	replay(argv[ii]);
+	}
+	return failed;
+}
+#endif
@@ -0,0 +1,1628 @@
+//**************************************************************************
+//*
+//* Title:		End to end upload benchmark
+//* Filename:		sota_bench.c
+//*
+//* Boots the bootloader, connects like a SOTA host (CMD_AUTH_FAST, session
+//* key, chained IVs), uploads reference images page by page, commits them
+//* and reads CMD_GET_STATS. Reports connect latency, time per page, total
+//* upload time and how the bootloader spent it (AES, SPM, UART waits).
+//*
+//*	sota_bench [-n name] -m mcu -f F_CPU [-a bootaddress] stk500boot.elf image ...
+//*		runs the AVR build under simavr, all times are in CPU cycles
+//*	sota_bench [-n name] -x host/sota_host image ...
+//*		drives the native build (make host) through a pipe, times in ns
+//*	sota_bench -c -m mcu -f F_CPU program.elf
+//*		only runs an ELF under simavr and copies its UART output to stdout,
+//*		until it sleeps with interrupts off (make bench_aes)
+//*
+//*	-V	after the upload, time CMD_VERIFY_IMAGE (CRC32, SHA-256 if built)
+//*		against reading the image back, with the bytes each puts on the wire
+//*	-E	time CMD_PROGRAM_EEPROM_ISP of a 64 byte configuration block, new,
+//*		unchanged and partly changed, and the wait for the EEPROM queue
+//*	-R	time a backup of all readable flash (everything below the boot
+//*		section) with CMD_READ_FLASH_BULK and with CMD_READ_FLASH_ISP frames
+//*	-B	after leaving, time a watchdog reset until the application starts,
+//*		twice; CMD_COMMIT_IMAGE already checked the ENABLE_APP_TRAILER
+//*		trailer, both boots find the result in EEPROM (a page written
+//*		after the commit would keep the image from booting at all)
+//*	-M	after leaving, time the mailbox entry (ENABLE_MAILBOX): the
+//*		application's request in the mailbox, a watchdog reset, then the
+//*		first page programmed under the session from the mailbox nonce
+//*
+//* An image is either a file (raw binary) or a size in bytes, which uploads
+//* that many pseudo random bytes. The breakdown needs ENABLE_STATS in the
+//* bootloader, make bench and make bench_host take care of that.
+//*
+//**************************************************************************
+
+#define	_POSIX_C_SOURCE		200809L
+
+#include	<inttypes.h>
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<time.h>
+#include	<poll.h>
+#include	<signal.h>
+#include	<unistd.h>
+#include	<sys/wait.h>
+#include	"../command.h"
+
+#ifdef WITH_SIMAVR
+	#include	<sim_avr.h>
+	#include	<sim_elf.h>
+	#include	<sim_irq.h>
+	#include	<sim_io.h>
+	#include	<avr_uart.h>
+#endif
+
+#define	BLOCKLEN		16
+#define	CHUNK_SIZE		256			//*	data bytes per CMD_PROGRAM_FLASH_ISP frame
+#define	FRAME_MAX		288			//*	receivedPacket[] in the bootloader
+#define	ANSWER_TIMEOUT	2			//*	seconds (simulated under simavr)
+#define	LINE_BAUD		115200		//*	BAUDRATE of stk500boot.c
+#define	CONFIG_BLOCK	64			//*	bytes, -E
+#define	FLASH_MAX		0x40000		//*	the largest AVR flash, 256 KB, -R
+#define	SIM_MCUSR		0x54		//*	data address of MCUSR, -B
+#define	SIM_WDRF		0x08
+#define	SIM_UCSR0B		0xC1		//*	data address of UCSR0B, -M
+#define	SIM_RXEN		0x10
+#define	MAILBOX_SIZE	23			//*	sota_mailbox_t of mailbox.h
+
+//*	link key, CBC IV and authentication token of stk500boot.c
+static const unsigned char	linkKey[BLOCKLEN]	=	{0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const unsigned char	linkIv[BLOCKLEN]	=	{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const unsigned char	authToken[4]		=	{0x53, 0xef, 0x34, 0x23};
+
+static const char	*phaseNames[]	=	{ "idle", "receive", "decrypt", "parse", "spm", "encrypt", "transmit" };
+#define	PHASES		7
+
+//*****************************************************************************
+//*	AES-128, the host side of the link
+
+static const unsigned char	sbox[256]	=	{
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+
+static unsigned char	rsbox[256];
+
+typedef struct
+{
+	unsigned char	roundKey[176];
+} aes_key_t;
+
+//*****************************************************************************
+static unsigned char xtime(unsigned char x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+//*****************************************************************************
+static unsigned char gmul(unsigned char x, unsigned char y)
+{
+unsigned char	product	=	0;
+
+	while (y)
+	{
+		if (y & 1)
+		{
+			product	^=	x;
+		}
+		x	=	xtime(x);
+		y	>>=	1;
+	}
+	return product;
+}
+
+//*****************************************************************************
+static void aes_key_expand(aes_key_t *ctx, const unsigned char *key)
+{
+unsigned char	rcon	=	1;
+unsigned char	temp[4];
+unsigned char	t;
+int				ii;
+
+	for (ii=0; ii<256; ii++)
+	{
+		rsbox[sbox[ii]]	=	ii;
+	}
+	memcpy(ctx->roundKey, key, BLOCKLEN);
+	for (ii=BLOCKLEN; ii<176; ii+=4)
+	{
+		memcpy(temp, ctx->roundKey + ii - 4, 4);
+		if ((ii % BLOCKLEN) == 0)
+		{
+			t		=	temp[0];
+			temp[0]	=	sbox[temp[1]] ^ rcon;
+			temp[1]	=	sbox[temp[2]];
+			temp[2]	=	sbox[temp[3]];
+			temp[3]	=	sbox[t];
+			rcon	=	xtime(rcon);
+		}
+		ctx->roundKey[ii]		=	ctx->roundKey[ii - 16] ^ temp[0];
+		ctx->roundKey[ii + 1]	=	ctx->roundKey[ii - 15] ^ temp[1];
+		ctx->roundKey[ii + 2]	=	ctx->roundKey[ii - 14] ^ temp[2];
+		ctx->roundKey[ii + 3]	=	ctx->roundKey[ii - 13] ^ temp[3];
+	}
+}
+
+//*****************************************************************************
+static void aes_encrypt_block(const aes_key_t *ctx, unsigned char *s)
+{
+unsigned char	t[BLOCKLEN];
+int				round;
+int				ii;
+
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		s[ii]	^=	ctx->roundKey[ii];
+	}
+	for (round=1; round<=10; round++)
+	{
+		for (ii=0; ii<BLOCKLEN; ii++)		//*	SubBytes and ShiftRows
+		{
+			t[ii]	=	sbox[s[(ii + 4 * (ii % 4)) % BLOCKLEN]];
+		}
+		for (ii=0; ii<BLOCKLEN; ii+=4)		//*	MixColumns
+		{
+			if (round < 10)
+			{
+				unsigned char	all	=	t[ii] ^ t[ii + 1] ^ t[ii + 2] ^ t[ii + 3];
+				unsigned char	a0	=	t[ii];
+
+				s[ii]		=	t[ii] ^ all ^ xtime(t[ii] ^ t[ii + 1]);
+				s[ii + 1]	=	t[ii + 1] ^ all ^ xtime(t[ii + 1] ^ t[ii + 2]);
+				s[ii + 2]	=	t[ii + 2] ^ all ^ xtime(t[ii + 2] ^ t[ii + 3]);
+				s[ii + 3]	=	t[ii + 3] ^ all ^ xtime(t[ii + 3] ^ a0);
+			}
+			else
+			{
+				memcpy(s + ii, t + ii, 4);
+			}
+		}
+		for (ii=0; ii<BLOCKLEN; ii++)
+		{
+			s[ii]	^=	ctx->roundKey[round * BLOCKLEN + ii];
+		}
+	}
+}
+
+//*****************************************************************************
+static void aes_decrypt_block(const aes_key_t *ctx, unsigned char *s)
+{
+unsigned char	t[BLOCKLEN];
+int				round;
+int				ii;
+
+	for (round=10; round>=1; round--)
+	{
+		for (ii=0; ii<BLOCKLEN; ii++)
+		{
+			s[ii]	^=	ctx->roundKey[round * BLOCKLEN + ii];
+		}
+		if (round < 10)
+		{
+			for (ii=0; ii<BLOCKLEN; ii+=4)	//*	InvMixColumns
+			{
+				t[ii]		=	gmul(s[ii], 14) ^ gmul(s[ii + 1], 11) ^ gmul(s[ii + 2], 13) ^ gmul(s[ii + 3], 9);
+				t[ii + 1]	=	gmul(s[ii], 9) ^ gmul(s[ii + 1], 14) ^ gmul(s[ii + 2], 11) ^ gmul(s[ii + 3], 13);
+				t[ii + 2]	=	gmul(s[ii], 13) ^ gmul(s[ii + 1], 9) ^ gmul(s[ii + 2], 14) ^ gmul(s[ii + 3], 11);
+				t[ii + 3]	=	gmul(s[ii], 11) ^ gmul(s[ii + 1], 13) ^ gmul(s[ii + 2], 9) ^ gmul(s[ii + 3], 14);
+			}
+			memcpy(s, t, BLOCKLEN);
+		}
+		for (ii=0; ii<BLOCKLEN; ii++)		//*	InvShiftRows and InvSubBytes
+		{
+			t[(ii + 4 * (ii % 4)) % BLOCKLEN]	=	rsbox[s[ii]];
+		}
+		memcpy(s, t, BLOCKLEN);
+	}
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		s[ii]	^=	ctx->roundKey[ii];
+	}
+}
+
+//*****************************************************************************
+//*	Transports, the simulated AVR or the native build behind a pipe
+
+typedef struct
+{
+	const char	*unit;							//*	what now() counts
+	uint64_t	frequency;						//*	units per second
+	void		(*send)(const unsigned char *data, unsigned int length);
+	int			(*receive)(void);				//*	next byte, -1 when none came in time
+	uint64_t	(*now)(void);
+	void		(*close)(void);
+	uint64_t	(*boot)(void);					//*	watchdog reset to application start, UINT64_MAX if it stays
+	uint64_t	(*mailbox)(const unsigned char *request);	//*	leave a mailbox request and reset, now() of the reset
+} bench_link_t;
+
+static pid_t	child;
+static int		childIn		=	-1;
+static int		childOut	=	-1;
+static const char	*childProgram;
+static char		hostState[]	=	"/tmp/sota_bench.XXXXXX";	//*	-B -M, flash, EEPROM and mailbox kept between starts
+static int		hostKeep	=	0;
+
+//*****************************************************************************
+static void pipe_send(const unsigned char *data, unsigned int length)
+{
+ssize_t	n;
+
+	while (length)
+	{
+		n	=	write(childIn, data, length);
+		if (n <= 0)
+		{
+			return;
+		}
+		data	+=	n;
+		length	-=	n;
+	}
+}
+
+static int pipe_receive(void)
+{
+struct pollfd	input	=	{ 0, POLLIN, 0 };
+unsigned char	c;
+
+	input.fd	=	childOut;
+	if ((poll(&input, 1, ANSWER_TIMEOUT * 1000) <= 0) || (read(childOut, &c, 1) != 1))
+	{
+		return -1;
+	}
+	return c;
+}
+
+static uint64_t pipe_now(void)
+{
+struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void pipe_close(void)
+{
+	if (child > 0)
+	{
+		close(childIn);
+		close(childOut);
+		waitpid(child, NULL, 0);
+		child	=	0;
+	}
+}
+
+//*****************************************************************************
+static int pipe_spawn(const char *reset)
+{
+int	toChild[2];
+int	fromChild[2];
+
+	if ((pipe(toChild) != 0) || (pipe(fromChild) != 0))
+	{
+		perror("pipe");
+		return 0;
+	}
+	child	=	fork();
+	if (child < 0)
+	{
+		perror("fork");
+		return 0;
+	}
+	if (child == 0)
+	{
+		dup2(toChild[0], STDIN_FILENO);
+		dup2(fromChild[1], STDOUT_FILENO);
+		close(toChild[1]);
+		close(fromChild[0]);
+		if (reset)
+		{
+			setenv("SOTA_HOST_RESET", reset, 1);
+		}
+		execl(childProgram, childProgram, (char *)NULL);
+		perror(childProgram);
+		_exit(127);
+	}
+	close(toChild[0]);
+	close(fromChild[1]);
+	childIn		=	toChild[1];
+	childOut	=	fromChild[0];
+	return 1;
+}
+
+//*****************************************************************************
+/*
+ * the bootloader left after the upload and saved its flash and EEPROM, start
+ * it again as after a watchdog reset; the link stays open, so a bootloader
+ * that does not start the application keeps waiting on it
+ */
+static uint64_t pipe_boot(void)
+{
+struct pollfd	output	=	{ 0, POLLIN, 0 };
+unsigned char	c;
+uint64_t		start;
+uint64_t		booted	=	UINT64_MAX;
+int				ready;
+
+	pipe_close();
+	start	=	pipe_now();
+	if (!pipe_spawn("watchdog"))
+	{
+		return UINT64_MAX;
+	}
+	output.fd	=	childOut;
+	while (((ready = poll(&output, 1, ANSWER_TIMEOUT * 1000)) > 0) && (read(childOut, &c, 1) == 1))
+	{
+		//*	nothing is expected before it exits
+	}
+	if (ready > 0)
+	{
+		booted	=	pipe_now() - start;		//*	its output closed, it started the application
+	}
+	else
+	{
+		kill(child, SIGKILL);
+	}
+	pipe_close();
+	return booted;
+}
+
+//*****************************************************************************
+/*
+ * the application left the request in the mailbox file and reset
+ */
+static uint64_t pipe_mailbox(const unsigned char *request)
+{
+FILE		*file;
+uint64_t	start;
+
+	pipe_close();
+	if (!(file = fopen(getenv("SOTA_HOST_MAILBOX"), "wb")) || (fwrite(request, 1, MAILBOX_SIZE, file) != MAILBOX_SIZE))
+	{
+		perror("SOTA_HOST_MAILBOX");
+	}
+	if (file)
+	{
+		fclose(file);
+	}
+	start	=	pipe_now();
+	pipe_spawn("watchdog");
+	return start;
+}
+
+//*****************************************************************************
+static int pipe_open(bench_link_t *link, const char *program)
+{
+char	fileName[sizeof(hostState) + 16];
+
+	//*	every run starts erased, -B and -M keep the state of this one for the restarts
+	unsetenv("SOTA_HOST_FLASH");
+	unsetenv("SOTA_HOST_EEPROM");
+	unsetenv("SOTA_HOST_MAILBOX");
+	if (hostKeep)
+	{
+		snprintf(fileName, sizeof(fileName), "%s/flash.bin", hostState);
+		unlink(fileName);
+		setenv("SOTA_HOST_FLASH", fileName, 1);
+		snprintf(fileName, sizeof(fileName), "%s/eeprom.bin", hostState);
+		unlink(fileName);
+		setenv("SOTA_HOST_EEPROM", fileName, 1);
+		snprintf(fileName, sizeof(fileName), "%s/mailbox.bin", hostState);
+		unlink(fileName);
+		setenv("SOTA_HOST_MAILBOX", fileName, 1);
+	}
+	childProgram	=	program;
+	if (!pipe_spawn(NULL))
+	{
+		return 0;
+	}
+
+	link->unit		=	"ns";
+	link->frequency	=	1000000000ULL;
+	link->send		=	pipe_send;
+	link->receive	=	pipe_receive;
+	link->now		=	pipe_now;
+	link->close		=	pipe_close;
+	link->boot		=	pipe_boot;
+	link->mailbox	=	pipe_mailbox;
+	return 1;
+}
+
+#ifdef WITH_SIMAVR
+static avr_t			*avr;
+static avr_irq_t		*uartInput;
+static unsigned char	txQueue[1024];			//*	host to AVR, pushed while the UART takes them
+static unsigned int		txHead, txTail;
+static unsigned char	rxQueue[1024];			//*	AVR to host
+static unsigned int		rxHead, rxTail;
+static int				uartXon	=	1;
+
+//*****************************************************************************
+static void sim_uart_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	rxQueue[rxTail++ % sizeof(rxQueue)]	=	value;
+}
+
+static void sim_uart_xon(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	uartXon	=	1;
+}
+
+static void sim_uart_xoff(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	uartXon	=	0;
+}
+
+//*****************************************************************************
+static void sim_send(const unsigned char *data, unsigned int length)
+{
+	while (length--)
+	{
+		txQueue[txTail++ % sizeof(txQueue)]	=	*data++;
+	}
+}
+
+static int sim_receive(void)
+{
+avr_cycle_count_t	deadline	=	avr->cycle + (avr_cycle_count_t)ANSWER_TIMEOUT * avr->frequency;
+int					state		=	cpu_Running;
+
+	while ((rxHead == rxTail) && (avr->cycle < deadline))
+	{
+		while (uartXon && (txHead != txTail))
+		{
+			avr_raise_irq(uartInput, txQueue[txHead++ % sizeof(txQueue)]);
+		}
+		state	=	avr_run(avr);
+		if ((state == cpu_Done) || (state == cpu_Crashed))
+		{
+			break;
+		}
+	}
+	if (rxHead == rxTail)
+	{
+		return -1;
+	}
+	return rxQueue[rxHead++ % sizeof(rxQueue)];
+}
+
+static uint64_t sim_now(void)
+{
+	return avr->cycle;
+}
+
+static void sim_close(void)
+{
+	avr_terminate(avr);
+	avr	=	NULL;
+}
+
+//*****************************************************************************
+/*
+ * reset with WDRF set in MCUSR, run until the jump to the application at 0
+ */
+static uint64_t sim_boot(void)
+{
+avr_cycle_count_t	start;
+avr_cycle_count_t	deadline;
+int					state	=	cpu_Running;
+
+	avr_reset(avr);
+	avr->state			=	cpu_Running;
+	avr->data[SIM_MCUSR]	|=	SIM_WDRF;
+	start		=	avr->cycle;
+	deadline	=	start + (avr_cycle_count_t)ANSWER_TIMEOUT * avr->frequency;
+	while ((avr->pc != 0) && (avr->cycle < deadline) && (state != cpu_Done) && (state != cpu_Crashed))
+	{
+		state	=	avr_run(avr);
+	}
+	return (avr->pc == 0) ? (uint64_t)(avr->cycle - start) : UINT64_MAX;
+}
+
+//*****************************************************************************
+/*
+ * watchdog reset with the request in the mailbox at the top of the RAM,
+ * written after avr_reset() since simavr does not keep the RAM; the host
+ * starts sending once the bootloader has turned its receiver on
+ */
+static uint64_t sim_mailbox(const unsigned char *request)
+{
+avr_cycle_count_t	start;
+avr_cycle_count_t	deadline;
+int					state	=	cpu_Running;
+
+	avr_reset(avr);
+	avr->state			=	cpu_Running;
+	avr->data[SIM_MCUSR]	|=	SIM_WDRF;
+	memcpy(&avr->data[avr->ramend + 1 - MAILBOX_SIZE], request, MAILBOX_SIZE);
+	start		=	avr->cycle;
+	deadline	=	start + (avr_cycle_count_t)ANSWER_TIMEOUT * avr->frequency;
+	while (!(avr->data[SIM_UCSR0B] & SIM_RXEN) && (avr->cycle < deadline) && (state != cpu_Done) && (state != cpu_Crashed))
+	{
+		state	=	avr_run(avr);
+	}
+	return start;
+}
+
+//*****************************************************************************
+static int sim_open(bench_link_t *link, const char *elfFile, const char *mcu, uint32_t frequency, uint32_t bootAddress)
+{
+elf_firmware_t	firmware;
+uint32_t		flags	=	0;
+
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(elfFile, &firmware) != 0)
+	{
+		fprintf(stderr, "%s: cannot load\n", elfFile);
+		return 0;
+	}
+	avr	=	avr_make_mcu_by_name(mcu);
+	if (!avr)
+	{
+		fprintf(stderr, "simavr does not know %s\n", mcu);
+		return 0;
+	}
+	avr_init(avr);
+	firmware.frequency	=	frequency;
+	avr_load_firmware(avr, &firmware);
+	avr->frequency	=	frequency;
+	if (bootAddress)
+	{
+		avr->reset_pc	=	bootAddress;	//*	BOOTRST programmed
+		avr->pc			=	bootAddress;
+	}
+
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags	&=	~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	uartInput	=	avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), sim_uart_output, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), sim_uart_xon, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), sim_uart_xoff, NULL);
+	txHead	=	txTail	=	rxHead	=	rxTail	=	0;
+	uartXon	=	1;
+
+	link->unit		=	"cycles";
+	link->frequency	=	frequency;
+	link->send		=	sim_send;
+	link->receive	=	sim_receive;
+	link->now		=	sim_now;
+	link->close		=	sim_close;
+	link->boot		=	sim_boot;
+	link->mailbox	=	sim_mailbox;
+	return 1;
+}
+
+//*****************************************************************************
+static int sim_console(const char *elfFile, const char *mcu, uint32_t frequency)
+{
+bench_link_t	link;
+int				c;
+
+	if (!sim_open(&link, elfFile, mcu, frequency, 0))
+	{
+		return 0;
+	}
+	while ((c = sim_receive()) >= 0)
+	{
+		putchar(c);
+	}
+	fflush(stdout);
+	c	=	avr->state;
+	sim_close();
+	if (c != cpu_Done)
+	{
+		fprintf(stderr, "%s: %s\n", elfFile, (c == cpu_Crashed) ? "crashed" : "no output for too long");
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+//*****************************************************************************
+//*	SOTA framing around the STK500 envelope
+
+typedef struct
+{
+	bench_link_t	*link;
+	aes_key_t		baseKey;
+	aes_key_t		sessionKey;
+	unsigned char	session;
+	unsigned char	txIv[BLOCKLEN];				//*	the bootloader's rxIv
+	unsigned char	rxIv[BLOCKLEN];				//*	the bootloader's txIv
+	unsigned char	seqNum;
+	uint64_t		wireOut;					//*	bytes, SOTA framing included
+	uint64_t		wireIn;
+} sota_t;
+
+//*****************************************************************************
+static void sota_send(sota_t *sota, const unsigned char *message, unsigned int length)
+{
+unsigned char	frame[3 + FRAME_MAX + 1];
+unsigned char	*body	=	frame + 3;
+const unsigned char	*iv	=	sota->session ? sota->txIv : linkIv;
+unsigned int	size	=	(length + 6 + BLOCKLEN - 1) & ~(BLOCKLEN - 1);
+unsigned char	checksum;
+unsigned int	ii;
+
+	memset(body, 0xFF, size);
+	body[0]	=	MESSAGE_START;
+	body[1]	=	sota->seqNum;
+	body[2]	=	length >> 8;
+	body[3]	=	length;
+	body[4]	=	TOKEN;
+	memcpy(body + 5, message, length);
+	checksum	=	0;
+	for (ii=0; ii<length + 5; ii++)
+	{
+		checksum	^=	body[ii];
+	}
+	body[length + 5]	=	checksum;
+
+	for (ii=0; ii<size; ii+=BLOCKLEN)
+	{
+		unsigned char	jj;
+
+		for (jj=0; jj<BLOCKLEN; jj++)
+		{
+			body[ii + jj]	^=	iv[jj];
+		}
+		aes_encrypt_block(sota->session ? &sota->sessionKey : &sota->baseKey, body + ii);
+		iv	=	body + ii;
+	}
+	if (sota->session)
+	{
+		memcpy(sota->txIv, iv, BLOCKLEN);
+		memcpy(sota->rxIv, iv, BLOCKLEN);		//*	the answer chains on from the request
+	}
+	frame[0]			=	SOTA_MESSAGE_START;
+	frame[1]			=	size >> 8;
+	frame[2]			=	size;
+	frame[3 + size]		=	0;					//*	the bootloader reads one byte past the payload
+	sota->wireOut		+=	size + 4;
+	sota->link->send(frame, size + 4);
+}
+
+//*****************************************************************************
+/*
+ * decrypt an answer with the given key and chain, 1 if the envelope checks out
+ */
+static int sota_open(const aes_key_t *key, const unsigned char *iv, const unsigned char *cipher, unsigned int size,
+					unsigned char seqNum, unsigned char *plain)
+{
+unsigned char	checksum	=	0;
+unsigned int	length;
+unsigned int	ii;
+unsigned char	jj;
+
+	memcpy(plain, cipher, size);
+	for (ii=0; ii<size; ii+=BLOCKLEN)
+	{
+		aes_decrypt_block(key, plain + ii);
+		for (jj=0; jj<BLOCKLEN; jj++)
+		{
+			plain[ii + jj]	^=	iv[jj];
+		}
+		iv	=	cipher + ii;
+	}
+	length	=	(plain[2] << 8) | plain[3];
+	if ((plain[0] != MESSAGE_START) || (plain[1] != seqNum) || (plain[4] != TOKEN) || ((length + 6) > size))
+	{
+		return 0;
+	}
+	for (ii=0; ii<length + 6; ii++)
+	{
+		checksum	^=	plain[ii];
+	}
+	return checksum == 0;
+}
+
+//*****************************************************************************
+/*
+ * wait for the next answer, returns its message length or -1
+ */
+static int sota_receive(sota_t *sota, unsigned char *message)
+{
+unsigned char	cipher[FRAME_MAX];
+unsigned char	plain[FRAME_MAX];
+unsigned int	size;
+unsigned int	ii;
+int				c;
+
+	do
+	{
+		c	=	sota->link->receive();
+	} while ((c >= 0) && (c != SOTA_MESSAGE_START));
+	if (c < 0)
+	{
+		return -1;
+	}
+	size	=	sota->link->receive() << 8;
+	size	|=	sota->link->receive();
+	if ((size == 0) || (size > FRAME_MAX) || (size % BLOCKLEN))
+	{
+		return -1;
+	}
+	for (ii=0; ii<size; ii++)
+	{
+		if ((c = sota->link->receive()) < 0)
+		{
+			return -1;
+		}
+		cipher[ii]	=	c;
+	}
+	sota->wireIn	+=	size + 3;
+
+	if (sota->session && sota_open(&sota->sessionKey, sota->rxIv, cipher, size, sota->seqNum, plain))
+	{
+		memcpy(sota->rxIv, cipher + size - BLOCKLEN, BLOCKLEN);
+	}
+	else if (sota_open(&sota->baseKey, linkIv, cipher, size, sota->seqNum, plain))
+	{
+		sota->session	=	0;				//*	the bootloader dropped the session
+	}
+	else
+	{
+		return -1;
+	}
+	sota->seqNum++;
+	memcpy(message, plain + 5, (plain[2] << 8) | plain[3]);
+	return (plain[2] << 8) | plain[3];
+}
+
+//*****************************************************************************
+static int sota_command(sota_t *sota, const unsigned char *message, unsigned int length, unsigned char *answer)
+{
+	sota_send(sota, message, length);
+	return sota_receive(sota, answer);
+}
+
+//*****************************************************************************
+/*
+ * the session session_start() in the bootloader derives from a nonce
+ */
+static void sota_session(sota_t *sota, const unsigned char *nonce)
+{
+unsigned char	block[BLOCKLEN];
+int				ii;
+
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		block[ii]	=	nonce[ii] ^ 0x36;
+	}
+	aes_encrypt_block(&sota->baseKey, block);
+	aes_key_expand(&sota->sessionKey, block);
+	memset(sota->txIv, 0, BLOCKLEN);
+	memset(sota->rxIv, 0, BLOCKLEN);
+	sota->txIv[0]	=	1;
+	sota->rxIv[0]	=	2;
+	aes_encrypt_block(&sota->sessionKey, sota->txIv);
+	aes_encrypt_block(&sota->sessionKey, sota->rxIv);
+}
+
+//*****************************************************************************
+/*
+ * CMD_AUTH_FAST, on success the answer carries the device nonce and the
+ * session starts from it and the MAC with the next frame
+ */
+static int sota_connect(sota_t *sota)
+{
+unsigned char	request[21];
+unsigned char	answer[FRAME_MAX];
+unsigned char	mac[BLOCKLEN];
+uint32_t		counter	=	1;
+int				attempt;
+int				length;
+int				ii;
+
+	aes_key_expand(&sota->baseKey, linkKey);
+	sota->session	=	0;
+	sota->seqNum	=	0;
+	for (attempt=0; attempt<2; attempt++)
+	{
+		memset(mac, 0, BLOCKLEN);
+		memcpy(mac, authToken, 4);
+		mac[4]	=	counter >> 24;
+		mac[5]	=	counter >> 16;
+		mac[6]	=	counter >> 8;
+		mac[7]	=	counter;
+		mac[8]	=	CMD_AUTH_FAST;
+		aes_encrypt_block(&sota->baseKey, mac);
+
+		request[0]	=	CMD_AUTH_FAST;
+		request[1]	=	counter >> 24;
+		request[2]	=	counter >> 16;
+		request[3]	=	counter >> 8;
+		request[4]	=	counter;
+		memcpy(request + 5, mac, BLOCKLEN);
+
+		sota->session	=	0;
+		sota_send(sota, request, sizeof(request));
+		if ((length = sota_receive(sota, answer)) < 2)
+		{
+			return 0;
+		}
+		if ((answer[1] == STATUS_CMD_OK) && (length == (2 + BLOCKLEN)))
+		{
+			//*	the session the bootloader starts after its answer
+			for (ii=0; ii<BLOCKLEN; ii++)
+			{
+				mac[ii]	^=	answer[2 + ii];
+			}
+			sota_session(sota, mac);
+			sota->session	=	1;
+			return 1;
+		}
+		if (answer[1] == STATUS_CMD_OK)
+		{
+			return 1;					//*	no ENABLE_SESSION_KEYS
+		}
+		//*	the device is further along, retry above its counter
+		counter	=	(((uint32_t)answer[2] << 24) | ((uint32_t)answer[3] << 16) | ((uint32_t)answer[4] << 8) | answer[5]) + 1;
+	}
+	return 0;
+}
+
+//*****************************************************************************
+static uint32_t crc32(const unsigned char *data, uint32_t length)
+{
+uint32_t	crc	=	0xFFFFFFFF;
+int			bit;
+
+	while (length--)
+	{
+		crc	^=	*data++;
+		for (bit=0; bit<8; bit++)
+		{
+			crc	=	(crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+		}
+	}
+	return ~crc;
+}
+
+//*****************************************************************************
+//*	Benchmark
+
+static int		benchVerify	=	0;		//*	-V
+static int		benchEeprom	=	0;		//*	-E
+static int		benchRead	=	0;		//*	-R
+static int		benchBoot	=	0;		//*	-B
+static int		benchMailbox	=	0;	//*	-M
+
+typedef struct
+{
+	const char		*name;
+	unsigned char	*data;
+	uint32_t		length;
+} bench_image_t;
+
+//*****************************************************************************
+static int image_load(bench_image_t *image, const char *spec)
+{
+FILE		*file;
+uint32_t	seed	=	0x2545F491;
+uint32_t	ii;
+long		size;
+
+	image->name	=	spec;
+	if (isdigit((unsigned char)spec[0]) && (strspn(spec, "0123456789") == strlen(spec)))
+	{
+		image->length	=	strtoul(spec, NULL, 10);
+		image->data		=	malloc(image->length + 1);
+		for (ii=0; ii<image->length; ii++)		//*	xorshift, the same image every run
+		{
+			seed			^=	seed << 13;
+			seed			^=	seed >> 17;
+			seed			^=	seed << 5;
+			image->data[ii]	=	seed;
+		}
+		return 1;
+	}
+	if (!(file = fopen(spec, "rb")) || (fseek(file, 0, SEEK_END) != 0) || ((size = ftell(file)) < 0))
+	{
+		perror(spec);
+		return 0;
+	}
+	rewind(file);
+	image->length	=	size;
+	image->data		=	malloc(image->length + 1);
+	if (fread(image->data, 1, image->length, file) != image->length)
+	{
+		perror(spec);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+	return 1;
+}
+
+//*****************************************************************************
+static uint64_t get_be(const unsigned char *p, int size)
+{
+uint64_t	value	=	0;
+
+	while (size--)
+	{
+		value	=	(value << 8) | *p++;
+	}
+	return value;
+}
+
+//*****************************************************************************
+static double to_ms(const bench_link_t *link, uint64_t t)
+{
+	return (double)t * 1000.0 / (double)link->frequency;
+}
+
+//*****************************************************************************
+/*
+ * line time of a byte count at the bootloader's default 115200 baud, 8N1
+ */
+static double wire_ms(uint64_t bytes)
+{
+	return bytes * 10 * 1000.0 / LINE_BAUD;
+}
+
+//*****************************************************************************
+/*
+ * one CMD_VERIFY_IMAGE over the uploaded image, its answer length or 0
+ */
+static int bench_digest(sota_t *sota, unsigned char mode, uint32_t length, unsigned char *answer)
+{
+unsigned char	message[10];
+int				answerLength;
+
+	message[0]	=	CMD_VERIFY_IMAGE;
+	message[1]	=	mode;
+	message[2]	=	message[3]	=	message[4]	=	message[5]	=	0;
+	message[6]	=	length >> 24;
+	message[7]	=	length >> 16;
+	message[8]	=	length >> 8;
+	message[9]	=	length;
+	answerLength	=	sota_command(sota, message, 10, answer);
+	return ((answerLength >= 2) && (answer[1] == STATUS_CMD_OK)) ? answerLength : 0;
+}
+
+//*****************************************************************************
+/*
+ * -V: the two ways a host can check an upload, CMD_VERIFY_IMAGE (the
+ * device digests the flash, one short answer) and reading it all back with
+ * CMD_READ_FLASH_ISP. A full ATmega2560 image is BENCH_IMAGES=245760.
+ */
+static void bench_verify(sota_t *sota, const bench_image_t *image)
+{
+unsigned char	message[5];
+unsigned char	answer[FRAME_MAX];
+uint64_t		start, wire, crcTime, shaTime, readTime;
+uint64_t		crcWire, shaWire, readWire;
+uint32_t		offset;
+unsigned int	chunk;
+int				crcOk, shaOk;
+int				readOk	=	1;
+
+	wire		=	sota->wireOut + sota->wireIn;
+	start		=	sota->link->now();
+	crcOk		=	(bench_digest(sota, VERIFY_MODE_CRC32, image->length, answer) == 6)
+					&& (get_be(answer + 2, 4) == crc32(image->data, image->length));
+	crcTime		=	sota->link->now() - start;
+	crcWire		=	sota->wireOut + sota->wireIn - wire;
+
+	//*	SHA-256 only with ENABLE_VERIFY_SHA256, otherwise the answer is STATUS_CMD_FAILED
+	wire		=	sota->wireOut + sota->wireIn;
+	start		=	sota->link->now();
+	shaOk		=	(bench_digest(sota, VERIFY_MODE_SHA256, image->length, answer) == 34);
+	shaTime		=	sota->link->now() - start;
+	shaWire		=	sota->wireOut + sota->wireIn - wire;
+
+	wire		=	sota->wireOut + sota->wireIn;
+	start		=	sota->link->now();
+	message[0]	=	CMD_LOAD_ADDRESS;
+	message[1]	=	message[2]	=	message[3]	=	message[4]	=	0;
+	sota_command(sota, message, 5, answer);
+	for (offset=0; readOk && (offset<image->length); offset+=chunk)
+	{
+		chunk		=	image->length - offset;
+		if (chunk > CHUNK_SIZE)
+		{
+			chunk	=	CHUNK_SIZE;
+		}
+		message[0]	=	CMD_READ_FLASH_ISP;
+		message[1]	=	chunk >> 8;
+		message[2]	=	chunk;
+		readOk		=	(sota_command(sota, message, 3, answer) == (int)(chunk + 3)) && (answer[1] == STATUS_CMD_OK)
+						&& (memcmp(answer + 2, image->data + offset, chunk) == 0);
+	}
+	readTime	=	sota->link->now() - start;
+	readWire	=	sota->wireOut + sota->wireIn - wire;
+
+	printf("%-10s %-10s  verify crc32 %9.3f ms %4" PRIu64 " bytes%s | sha256 ",
+			"", "", to_ms(sota->link, crcTime), crcWire, crcOk ? "" : " FAILED");
+	if (shaOk)
+	{
+		printf("%9.3f ms %4" PRIu64 " bytes", to_ms(sota->link, shaTime), shaWire);
+	}
+	else
+	{
+		printf("not built");
+	}
+	printf(" | read-back %9.3f ms %7" PRIu64 " bytes%s\n",
+			to_ms(sota->link, readTime), readWire, readOk ? "" : " FAILED");
+	printf("%-10s %-10s  on the wire at %u baud: verify %.1f ms, read-back %.1f ms\n",
+			"", "", LINE_BAUD, wire_ms(crcWire), wire_ms(readWire));
+}
+
+//*****************************************************************************
+/*
+ * one CMD_PROGRAM_EEPROM_ISP of a configuration block at EEPROM address 0,
+ * the time until its answer
+ */
+static uint64_t bench_eeprom_write(sota_t *sota, const unsigned char *block, unsigned int length, int *ok)
+{
+unsigned char	message[10 + CONFIG_BLOCK];
+unsigned char	answer[FRAME_MAX];
+uint64_t		start	=	sota->link->now();
+
+	message[0]	=	CMD_LOAD_ADDRESS;
+	message[1]	=	message[2]	=	message[3]	=	message[4]	=	0;
+	sota_command(sota, message, 5, answer);
+	memset(message, 0, 10);
+	message[0]	=	CMD_PROGRAM_EEPROM_ISP;
+	message[1]	=	length >> 8;
+	message[2]	=	length;
+	memcpy(message + 10, block, length);
+	*ok			&=	(sota_command(sota, message, 10 + length, answer) >= 2) && (answer[1] == STATUS_CMD_OK);
+	return sota->link->now() - start;
+}
+
+//*****************************************************************************
+/*
+ * -E: a typical configuration block update, written new, rewritten
+ * unchanged (every byte skipped) and with four bytes changed, each timed
+ * to its answer while the queue drains in the background, then timed to a
+ * read-back, which waits until the queue is empty
+ */
+static void bench_eeprom(sota_t *sota)
+{
+unsigned char	block[CONFIG_BLOCK];
+unsigned char	message[5];
+unsigned char	answer[FRAME_MAX];
+uint64_t		fresh, same, changed, start, drained;
+unsigned int	ii;
+int				ok	=	1;
+
+	for (ii=0; ii<CONFIG_BLOCK; ii++)
+	{
+		block[ii]	=	(ii * 37 + 11) ^ (uint8_t)sota->link->now();
+	}
+	fresh		=	bench_eeprom_write(sota, block, CONFIG_BLOCK, &ok);
+	same		=	bench_eeprom_write(sota, block, CONFIG_BLOCK, &ok);
+	for (ii=0; ii<4; ii++)
+	{
+		block[ii * 16]	^=	0x5A;
+	}
+	changed		=	bench_eeprom_write(sota, block, CONFIG_BLOCK, &ok);
+
+	start		=	sota->link->now();
+	message[0]	=	CMD_LOAD_ADDRESS;
+	message[1]	=	message[2]	=	message[3]	=	message[4]	=	0;
+	sota_command(sota, message, 5, answer);
+	message[0]	=	CMD_READ_EEPROM_ISP;
+	message[1]	=	0;
+	message[2]	=	CONFIG_BLOCK;
+	ok			&=	(sota_command(sota, message, 3, answer) == CONFIG_BLOCK + 3) && (memcmp(answer + 2, block, CONFIG_BLOCK) == 0);
+	drained		=	sota->link->now() - start;
+
+	printf("%-10s %-10s  eeprom %u byte block: new %.3f ms, unchanged %.3f ms, 4 changed %.3f ms, read-back after %.3f ms%s\n",
+			"", "", CONFIG_BLOCK, to_ms(sota->link, fresh), to_ms(sota->link, same), to_ms(sota->link, changed),
+			to_ms(sota->link, drained), ok ? "" : " FAILED");
+}
+
+//*****************************************************************************
+/*
+ * CMD_READ_FLASH_BULK of a range into data, its answers all carry the
+ * request's sequence number and a bare status frame ends them; the bytes
+ * read or -1
+ */
+static long bench_bulk_read(sota_t *sota, uint32_t address, uint32_t length, unsigned char *data)
+{
+unsigned char	message[9];
+unsigned char	answer[FRAME_MAX];
+long			total	=	0;
+int				answerLength;
+
+	message[0]	=	CMD_READ_FLASH_BULK;
+	message[1]	=	address >> 24;
+	message[2]	=	address >> 16;
+	message[3]	=	address >> 8;
+	message[4]	=	address;
+	message[5]	=	length >> 24;
+	message[6]	=	length >> 16;
+	message[7]	=	length >> 8;
+	message[8]	=	length;
+	sota_send(sota, message, 9);
+	while ((answerLength = sota_receive(sota, answer)) > 2)
+	{
+		if ((answer[1] != STATUS_CMD_OK) || ((uint32_t)(total + answerLength - 2) > length))
+		{
+			return -1;
+		}
+		memcpy(data + total, answer + 2, answerLength - 2);
+		total	+=	answerLength - 2;
+		sota->seqNum--;
+	}
+	return ((answerLength == 2) && (answer[1] == STATUS_CMD_OK)) ? total : -1;
+}
+
+//*****************************************************************************
+/*
+ * -R: back up all the flash a host may read, from 0 up to the boot section,
+ * once streamed with CMD_READ_FLASH_BULK and once the way an STK500 host
+ * does it, CMD_READ_FLASH_ISP frame by frame, and compare both with the
+ * image just uploaded. The end of the readable flash is found with zero
+ * length bulk reads, which the bootloader accepts up to APP_END.
+ */
+static void bench_readout(sota_t *sota, const bench_image_t *image)
+{
+unsigned char	message[5];
+unsigned char	answer[FRAME_MAX];
+unsigned char	*bulk	=	malloc(FLASH_MAX);
+unsigned char	*frames	=	malloc(FLASH_MAX);
+uint64_t		start, wire, bulkTime, frameTime, bulkWire, frameWire;
+uint32_t		low		=	0;
+uint32_t		high	=	FLASH_MAX + CHUNK_SIZE;
+uint32_t		middle;
+uint32_t		offset;
+unsigned int	chunk;
+int				bulkOk;
+int				frameOk	=	1;
+
+	//*	low is readable, high is not
+	while ((high - low) > CHUNK_SIZE)
+	{
+		middle	=	(low + (high - low) / 2) & ~(CHUNK_SIZE - 1);
+		if (bench_bulk_read(sota, middle, 0, bulk) == 0)
+		{
+			low		=	middle;
+		}
+		else
+		{
+			high	=	middle;
+		}
+	}
+
+	wire		=	sota->wireOut + sota->wireIn;
+	start		=	sota->link->now();
+	bulkOk		=	(bench_bulk_read(sota, 0, low, bulk) == (long)low);
+	bulkTime	=	sota->link->now() - start;
+	bulkWire	=	sota->wireOut + sota->wireIn - wire;
+
+	wire		=	sota->wireOut + sota->wireIn;
+	start		=	sota->link->now();
+	message[0]	=	CMD_LOAD_ADDRESS;
+	message[1]	=	message[2]	=	message[3]	=	message[4]	=	0;
+	sota_command(sota, message, 5, answer);
+	for (offset=0; frameOk && (offset<low); offset+=chunk)
+	{
+		chunk		=	low - offset;
+		if (chunk > CHUNK_SIZE)
+		{
+			chunk	=	CHUNK_SIZE;
+		}
+		message[0]	=	CMD_READ_FLASH_ISP;
+		message[1]	=	chunk >> 8;
+		message[2]	=	chunk;
+		frameOk		=	(sota_command(sota, message, 3, answer) == (int)(chunk + 3)) && (answer[1] == STATUS_CMD_OK);
+		if (frameOk)
+		{
+			memcpy(frames + offset, answer + 2, chunk);
+		}
+	}
+	frameTime	=	sota->link->now() - start;
+	frameWire	=	sota->wireOut + sota->wireIn - wire;
+
+	//*	both must hold the image, and agree on the rest
+	bulkOk		&=	(image->length <= low) && (memcmp(bulk, image->data, image->length) == 0);
+	frameOk		&=	(image->length <= low) && (memcmp(frames, image->data, image->length) == 0);
+	if (bulkOk && frameOk && (memcmp(frames, bulk, low) != 0))
+	{
+		bulkOk	=	frameOk	=	0;
+	}
+
+	printf("%-10s %-10s  read-out %" PRIu32 " of %u bytes: bulk %9.3f ms %7" PRIu64 " bytes %7.2f kB/s%s"
+			" | read frames %9.3f ms %7" PRIu64 " bytes %7.2f kB/s%s\n",
+			"", "", low, FLASH_MAX,
+			to_ms(sota->link, bulkTime), bulkWire, low / 1024.0 / (to_ms(sota->link, bulkTime) / 1000.0), bulkOk ? "" : " FAILED",
+			to_ms(sota->link, frameTime), frameWire, low / 1024.0 / (to_ms(sota->link, frameTime) / 1000.0), frameOk ? "" : " FAILED");
+	printf("%-10s %-10s  on the wire at %u baud: bulk %.1f ms, read frames %.1f ms\n",
+			"", "", LINE_BAUD, wire_ms(bulkWire), wire_ms(frameWire));
+	free(bulk);
+	free(frames);
+}
+
+//*****************************************************************************
+/*
+ * one boot, connect, upload, commit and stats read, 0 on protocol failure
+ */
+static int bench_run(const char *board, bench_link_t *link, const bench_image_t *image)
+{
+sota_t			sota;
+unsigned char	message[FRAME_MAX];
+unsigned char	answer[FRAME_MAX];
+uint64_t		start, connected, pageStart, pageTime, uploaded;
+uint64_t		pageMin	=	UINT64_MAX;
+uint64_t		pageMax	=	0;
+uint32_t		offset;
+uint32_t		crc;
+unsigned int	chunk;
+unsigned int	pages	=	0;
+int				length;
+int				committed;
+
+	memset(&sota, 0, sizeof(sota));
+	sota.link	=	link;
+	start		=	link->now();
+	if (!sota_connect(&sota))
+	{
+		fprintf(stderr, "%s %s: authentication failed\n", board, image->name);
+		return 0;
+	}
+	connected	=	link->now();
+
+	//*	count the upload only
+	message[0]	=	CMD_GET_STATS;
+	message[1]	=	0x01;
+	sota_command(&sota, message, 2, answer);
+
+	message[0]	=	CMD_LOAD_ADDRESS;
+	message[1]	=	message[2]	=	message[3]	=	message[4]	=	0;
+	if ((sota_command(&sota, message, 5, answer) < 2) || (answer[1] != STATUS_CMD_OK))
+	{
+		fprintf(stderr, "%s %s: CMD_LOAD_ADDRESS failed\n", board, image->name);
+		return 0;
+	}
+	for (offset=0; offset<image->length; offset+=chunk)
+	{
+		chunk	=	image->length - offset;
+		if (chunk > CHUNK_SIZE)
+		{
+			chunk	=	CHUNK_SIZE;
+		}
+		memset(message, 0, 10);
+		message[0]	=	CMD_PROGRAM_FLASH_ISP;
+		message[1]	=	chunk >> 8;
+		message[2]	=	chunk;
+		memcpy(message + 10, image->data + offset, chunk);
+
+		pageStart	=	link->now();
+		if ((sota_command(&sota, message, chunk + 10, answer) < 2) || (answer[1] != STATUS_CMD_OK))
+		{
+			fprintf(stderr, "%s %s: CMD_PROGRAM_FLASH_ISP failed at 0x%05" PRIX32 "\n", board, image->name, offset);
+			return 0;
+		}
+		pageTime	=	link->now() - pageStart;
+		pageMin		=	(pageTime < pageMin) ? pageTime : pageMin;
+		pageMax		=	(pageTime > pageMax) ? pageTime : pageMax;
+		pages++;
+	}
+
+	crc			=	crc32(image->data, image->length);
+	message[0]	=	CMD_COMMIT_IMAGE;
+	message[1]	=	image->length >> 24;
+	message[2]	=	image->length >> 16;
+	message[3]	=	image->length >> 8;
+	message[4]	=	image->length;
+	message[5]	=	crc >> 24;
+	message[6]	=	crc >> 16;
+	message[7]	=	crc >> 8;
+	message[8]	=	crc;
+	committed	=	(sota_command(&sota, message, 9, answer) >= 2) && (answer[1] == STATUS_CMD_OK);
+	uploaded	=	link->now();
+
+	printf("%-10s %-10s %7" PRIu32 " bytes  connect %8.3f ms  %4u pages %7.3f ms/page (%.3f..%.3f)  total %9.3f ms  %6.2f kB/s%s\n",
+			board, image->name, image->length,
+			to_ms(link, connected - start),
+			pages, to_ms(link, (uploaded - connected) / (pages ? pages : 1)), to_ms(link, pageMin), to_ms(link, pageMax),
+			to_ms(link, uploaded - connected),
+			(double)image->length / 1024.0 / (to_ms(link, uploaded - connected) / 1000.0),
+			committed ? "" : "  (not committed)");
+
+	message[0]	=	CMD_GET_STATS;
+	message[1]	=	0;
+	length		=	sota_command(&sota, message, 2, answer);
+	if ((length >= 3 + 4 + 4 + 4 + 6 + 1 + PHASES * 8) && (answer[1] == STATUS_CMD_OK) && (answer[2] == 1))
+	{
+		const unsigned char	*p		=	answer + 3 + 4 + 4 + 4 + 6 + 1;
+		uint64_t			cycles[PHASES];
+		uint64_t			total	=	0;
+		uint64_t			frames;
+		int					ii;
+
+		for (ii=0; ii<PHASES; ii++)
+		{
+			cycles[ii]	=	get_be(p + ii * 8, 8);
+			total		+=	cycles[ii];
+		}
+		if (total == 0)
+		{
+			total	=	1;
+		}
+		printf("%-10s %-10s ", "", "");
+		for (ii=0; ii<PHASES; ii++)
+		{
+			printf(" %s %.1f%%", phaseNames[ii], 100.0 * cycles[ii] / total);
+		}
+		printf("  | aes %.1f%%  spm %.1f%%  uart %.1f%%  (%" PRIu64 " cycles at %" PRIu64 " Hz, %" PRIu64 " frames, %" PRIu64 " checksum errors)\n",
+				100.0 * (cycles[2] + cycles[5]) / total,
+				100.0 * cycles[4] / total,
+				100.0 * (cycles[0] + cycles[1] + cycles[6]) / total,
+				total, get_be(answer + 3, 4), get_be(answer + 7, 4), get_be(answer + 15, 2));
+		//*	what the bootloader spends on a page once it is in, the line aside
+		frames	=	get_be(answer + 7, 4);
+		printf("%-10s %-10s  per frame: decrypt %.0f  parse %.0f  spm %.0f  encrypt %.0f cycles, %.0f in all\n", "", "",
+				(double)cycles[2] / (frames ? frames : 1), (double)cycles[3] / (frames ? frames : 1),
+				(double)cycles[4] / (frames ? frames : 1), (double)cycles[5] / (frames ? frames : 1),
+				(double)(cycles[2] + cycles[3] + cycles[4] + cycles[5]) / (frames ? frames : 1));
+	}
+	else
+	{
+		printf("%-10s %-10s  no CMD_GET_STATS, build the bootloader with ENABLE_STATS for the breakdown\n", "", "");
+	}
+	if (benchVerify)
+	{
+		bench_verify(&sota, image);
+	}
+	if (benchEeprom)
+	{
+		bench_eeprom(&sota);
+	}
+	if (benchRead)
+	{
+		bench_readout(&sota, image);
+	}
+
+	message[0]	=	CMD_LEAVE_PROGMODE_ISP;
+	message[1]	=	message[2]	=	0;
+	sota_command(&sota, message, 3, answer);
+	return 1;
+}
+
+//*****************************************************************************
+/*
+ * -B, two watchdog resets after the upload and commit
+ */
+static void bench_boot(const char *board, bench_link_t *link, const bench_image_t *image)
+{
+uint64_t	first	=	link->boot();
+uint64_t	second	=	(first == UINT64_MAX) ? UINT64_MAX : link->boot();
+
+	if (second == UINT64_MAX)
+	{
+		printf("%-10s %-10s  watchdog reset: %s does not start the application\n", board, image->name,
+				(first == UINT64_MAX) ? "the first boot" : "the second boot");
+		return;
+	}
+	printf("%-10s %-10s  watchdog reset to application: %.3f ms first boot, %.3f ms second (%" PRIu64 ", %" PRIu64 " %s)\n",
+			board, image->name, to_ms(link, first), to_ms(link, second), first, second, link->unit);
+}
+
+//*****************************************************************************
+/*
+ * -M, what sota_mailbox_request() leaves for the bootloader, then the time
+ * from the watchdog reset to the answer for the first page. The watchdog
+ * timeout the application waits before that (WDTO_15MS) comes on top
+ */
+static void bench_mailbox(const char *board, bench_link_t *link, const bench_image_t *image)
+{
+static const unsigned char	nonce[BLOCKLEN]	=	{0x6d, 0x62, 0x6f, 0x78, 0x20, 0x6e, 0x6f, 0x6e, 0x63, 0x65, 0x20, 0x62, 0x65, 0x6e, 0x63, 0x68};
+sota_t			sota;
+unsigned char	request[MAILBOX_SIZE];
+unsigned char	message[FRAME_MAX];
+unsigned char	answer[FRAME_MAX];
+unsigned char	check	=	0xA5;
+unsigned int	chunk	=	(image->length < CHUNK_SIZE) ? image->length : CHUNK_SIZE;
+uint64_t		start;
+uint64_t		programmed;
+int				ok;
+int				ii;
+
+	//*	magic, flags, baudSelect, nonce, check (sota_mailbox_check())
+	request[0]	=	0x58;
+	request[1]	=	0x4F;
+	request[2]	=	0x42;
+	request[3]	=	0x4D;
+	request[4]	=	0x03;				//*	SOTA_MAILBOX_ENTER_UPDATE | SOTA_MAILBOX_SESSION
+	request[5]	=	0;
+	memcpy(request + 6, nonce, BLOCKLEN);
+	for (ii=0; ii<MAILBOX_SIZE - 1; ii++)
+	{
+		check	=	((check << 1) | (check >> 7)) ^ request[ii];
+	}
+	request[MAILBOX_SIZE - 1]	=	check;
+
+	memset(&sota, 0, sizeof(sota));
+	sota.link	=	link;
+	aes_key_expand(&sota.baseKey, linkKey);
+	sota_session(&sota, nonce);
+	sota.session	=	1;
+	start		=	link->mailbox(request);
+
+	memset(message, 0, 10);
+	message[0]	=	CMD_LOAD_ADDRESS;
+	ok			=	(sota_command(&sota, message, 5, answer) >= 2) && (answer[1] == STATUS_CMD_OK) && sota.session;
+	message[0]	=	CMD_PROGRAM_FLASH_ISP;
+	message[1]	=	chunk >> 8;
+	message[2]	=	chunk;
+	memcpy(message + 10, image->data, chunk);
+	ok			=	ok && (sota_command(&sota, message, chunk + 10, answer) >= 2) && (answer[1] == STATUS_CMD_OK);
+	programmed	=	link->now();
+	if (!ok)
+	{
+		printf("%-10s %-10s  mailbox entry: no session from the mailbox, build the bootloader with ENABLE_MAILBOX\n",
+				board, image->name);
+		return;
+	}
+	printf("%-10s %-10s  mailbox entry: watchdog reset to first page programmed %.3f ms (%" PRIu64 " %s), no boot wait or authentication\n",
+			board, image->name, to_ms(link, programmed - start), programmed - start, link->unit);
+
+	message[0]	=	CMD_LEAVE_PROGMODE_ISP;
+	message[1]	=	message[2]	=	0;
+	sota_command(&sota, message, 3, answer);
+}
+
+//*****************************************************************************
+static void usage(void)
+{
+	fprintf(stderr,	"usage: sota_bench [-VERBM] [-n name] -m mcu -f F_CPU [-a bootaddress] stk500boot.elf image ...\n"
+					"       sota_bench [-VERBM] [-n name] -x host/sota_host image ...\n"
+					"       sota_bench -c -m mcu -f F_CPU program.elf\n"
+					"an image is a raw binary file or a size in bytes\n");
+	exit(2);
+}
+
+//*****************************************************************************
+int main(int argc, char *argv[])
+{
+const char		*board		=	"host";
+const char		*program	=	NULL;
+const char		*mcu		=	NULL;
+const char		*elfFile	=	NULL;
+uint32_t		frequency	=	16000000;
+uint32_t		bootAddress	=	0;
+bench_image_t	image;
+bench_link_t	link;
+int				console		=	0;
+int				failed		=	0;
+int				opt;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((opt = getopt(argc, argv, "cVERBMn:m:f:a:x:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':	console		=	1;								break;
+			case 'V':	benchVerify	=	1;								break;
+			case 'E':	benchEeprom	=	1;								break;
+			case 'R':	benchRead	=	1;								break;
+			case 'B':	benchBoot	=	1;								break;
+			case 'M':	benchMailbox	=	1;							break;
+			case 'n':	board		=	optarg;							break;
+			case 'm':	mcu			=	optarg;							break;
+			case 'f':	frequency	=	strtoul(optarg, NULL, 0);		break;
+			case 'a':	bootAddress	=	strtoul(optarg, NULL, 16);		break;
+			case 'x':	program		=	optarg;							break;
+			default:	usage();
+		}
+	}
+	if (!program)
+	{
+		if (!mcu || (optind >= argc))
+		{
+			usage();
+		}
+		elfFile	=	argv[optind++];
+	}
+	if (console)
+	{
+		if (program)
+		{
+			usage();
+		}
+	#ifdef WITH_SIMAVR
+		return !sim_console(elfFile, mcu, frequency);
+	#else
+		fprintf(stderr, "built without simavr\n");
+		return 1;
+	#endif
+	}
+	if (optind >= argc)
+	{
+		usage();
+	}
+	if ((benchBoot || benchMailbox) && program)
+	{
+		if (!mkdtemp(hostState))
+		{
+			perror(hostState);
+			return 1;
+		}
+		hostKeep	=	1;
+	}
+
+	for (; optind<argc; optind++)
+	{
+		if (!image_load(&image, argv[optind]))
+		{
+			return 1;
+		}
+		if (program)
+		{
+			if (!pipe_open(&link, program))
+			{
+				return 1;
+			}
+		}
+		else
+		{
+		#ifdef WITH_SIMAVR
+			if (!sim_open(&link, elfFile, mcu, frequency, bootAddress))
+			{
+				return 1;
+			}
+		#else
+			(void)elfFile;
+			(void)frequency;
+			(void)bootAddress;
+			fprintf(stderr, "built without simavr, use -x with the host build\n");
+			return 1;
+		#endif
+		}
+		if (!bench_run(board, &link, &image))
+		{
+			failed	=	1;
+		}
+		else
+		{
+			if (benchBoot)
+			{
+				bench_boot(board, &link, &image);
+			}
+			if (benchMailbox)
+			{
+				bench_mailbox(board, &link, &image);
+			}
+		}
+		link.close();
+		free(image.data);
+	}
+	if (hostKeep)
+	{
+		char	fileName[sizeof(hostState) + 16];
+
+		snprintf(fileName, sizeof(fileName), "%s/flash.bin", hostState);
+		unlink(fileName);
+		snprintf(fileName, sizeof(fileName), "%s/eeprom.bin", hostState);
+		unlink(fileName);
+		snprintf(fileName, sizeof(fileName), "%s/mailbox.bin", hostState);
+		unlink(fileName);
+		rmdir(hostState);
+	}
+	return failed;
+}
@@ -0,0 +1,1911 @@
+//**************************************************************************
+//*
+//* Title:		Host side of the SOTA protocol
+//* Filename:		sota_client.cpp
+//*
+//* See sota_client.h. Keys and tokens are those compiled into stk500boot.c.
+//*
+//* Pipelining: the next frame is built and encrypted while the bootloader
+//* works on the current one, and with a window above 1 up to that many
+//* frames are sent before the first answer is read. The AVR build polls its
+//* UART only while it receives a frame, so against real hardware the window
+//* stays at 1; links that buffer (the host build behind a pipe, a bootloader
+//* with an interrupt driven receive buffer) can take more.
+//*
+//**************************************************************************
+
+#include	"sota_client.h"
+#include	"../command.h"
+
+#include	<algorithm>
+#include	<cctype>
+#include	<cerrno>
+#include	<cstdarg>
+#include	<cstdio>
+#include	<cstdlib>
+#include	<cstring>
+#include	<ctime>
+#include	<fcntl.h>
+#include	<poll.h>
+#include	<signal.h>
+#include	<termios.h>
+#include	<unistd.h>
+#include	<sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include	<immintrin.h>
+	#define	SOTA_AESNI
+#endif
+
+//*	link key, CBC IV, authentication token and CMD_AUTH secret of stk500boot.c
+static const uint8_t	linkKey[SOTA_BLOCKLEN]	=	{0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const uint8_t	linkIv[SOTA_BLOCKLEN]	=	{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const uint8_t	authToken[4]			=	{0x53, 0xef, 0x34, 0x23};
+static const uint32_t	authSecret				=	0x2132af45;		//*	secretKeyBytes 45 af 32 21, little endian
+
+//*****************************************************************************
+//*	AES-128
+
+static const uint8_t	sbox[256]	=	{
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+
+static uint8_t	rsbox[256];
+static int		aesHardware	=	-1;			//*	-1 not probed yet
+
+//*****************************************************************************
+static uint8_t xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+//*****************************************************************************
+static uint8_t gmul(uint8_t x, uint8_t y)
+{
+uint8_t	product	=	0;
+
+	while (y)
+	{
+		if (y & 1)
+		{
+			product	^=	x;
+		}
+		x	=	xtime(x);
+		y	>>=	1;
+	}
+	return product;
+}
+
+#ifdef SOTA_AESNI
+//*****************************************************************************
+__attribute__ ((target ("aes,sse2")))
+static void aesni_inverse_keys(const uint8_t *roundKey, uint8_t *inverseKey)
+{
+	_mm_storeu_si128((__m128i *)inverseKey, _mm_loadu_si128((const __m128i *)(roundKey + 160)));
+	for (int round=1; round<10; round++)
+	{
+		_mm_storeu_si128((__m128i *)(inverseKey + round * SOTA_BLOCKLEN),
+				_mm_aesimc_si128(_mm_loadu_si128((const __m128i *)(roundKey + (10 - round) * SOTA_BLOCKLEN))));
+	}
+	_mm_storeu_si128((__m128i *)(inverseKey + 160), _mm_loadu_si128((const __m128i *)roundKey));
+}
+
+//*****************************************************************************
+/*
+ * CBC encryption is a chain, one block after the other
+ */
+__attribute__ ((target ("aes,sse2")))
+static void aesni_cbc_encrypt(const uint8_t *roundKey, uint8_t *data, size_t blocks, const uint8_t *iv)
+{
+__m128i	key[11];
+__m128i	chain	=	_mm_loadu_si128((const __m128i *)iv);
+
+	for (int round=0; round<11; round++)
+	{
+		key[round]	=	_mm_loadu_si128((const __m128i *)(roundKey + round * SOTA_BLOCKLEN));
+	}
+	for (; blocks; blocks--, data+=SOTA_BLOCKLEN)
+	{
+		chain	=	_mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)data), chain), key[0]);
+		for (int round=1; round<10; round++)
+		{
+			chain	=	_mm_aesenc_si128(chain, key[round]);
+		}
+		chain	=	_mm_aesenclast_si128(chain, key[10]);
+		_mm_storeu_si128((__m128i *)data, chain);
+	}
+}
+
+//*****************************************************************************
+/*
+ * CBC decryption of every block is independent, four at a time
+ */
+__attribute__ ((target ("aes,sse2")))
+static void aesni_cbc_decrypt(const uint8_t *inverseKey, uint8_t *data, size_t blocks, const uint8_t *iv)
+{
+__m128i	key[11];
+__m128i	previous	=	_mm_loadu_si128((const __m128i *)iv);
+__m128i	cipher[4];
+__m128i	state[4];
+size_t	count;
+size_t	ii;
+
+	for (int round=0; round<11; round++)
+	{
+		key[round]	=	_mm_loadu_si128((const __m128i *)(inverseKey + round * SOTA_BLOCKLEN));
+	}
+	while (blocks)
+	{
+		count	=	(blocks < 4) ? blocks : 4;
+		for (ii=0; ii<count; ii++)
+		{
+			cipher[ii]	=	_mm_loadu_si128((const __m128i *)(data + ii * SOTA_BLOCKLEN));
+			state[ii]	=	_mm_xor_si128(cipher[ii], key[0]);
+		}
+		for (int round=1; round<10; round++)
+		{
+			for (ii=0; ii<count; ii++)
+			{
+				state[ii]	=	_mm_aesdec_si128(state[ii], key[round]);
+			}
+		}
+		for (ii=0; ii<count; ii++)
+		{
+			state[ii]	=	_mm_xor_si128(_mm_aesdeclast_si128(state[ii], key[10]), ii ? cipher[ii - 1] : previous);
+			_mm_storeu_si128((__m128i *)(data + ii * SOTA_BLOCKLEN), state[ii]);
+		}
+		previous	=	cipher[count - 1];
+		data		+=	count * SOTA_BLOCKLEN;
+		blocks		-=	count;
+	}
+}
+#endif
+
+//*****************************************************************************
+bool sota_aes_t::hardware(void)
+{
+	if (aesHardware < 0)
+	{
+	#ifdef SOTA_AESNI
+		__builtin_cpu_init();
+		aesHardware	=	__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+	#else
+		aesHardware	=	0;
+	#endif
+	}
+	return aesHardware;
+}
+
+//*****************************************************************************
+void sota_aes_t::hardware_disable(void)
+{
+	aesHardware	=	0;
+}
+
+//*****************************************************************************
+void sota_aes_t::key_expand(const uint8_t *key)
+{
+uint8_t	rcon	=	1;
+uint8_t	temp[4];
+uint8_t	t;
+int		ii;
+
+	for (ii=0; ii<256; ii++)
+	{
+		rsbox[sbox[ii]]	=	ii;
+	}
+	memcpy(roundKey, key, SOTA_BLOCKLEN);
+	for (ii=SOTA_BLOCKLEN; ii<176; ii+=4)
+	{
+		memcpy(temp, roundKey + ii - 4, 4);
+		if ((ii % SOTA_BLOCKLEN) == 0)
+		{
+			t		=	temp[0];
+			temp[0]	=	sbox[temp[1]] ^ rcon;
+			temp[1]	=	sbox[temp[2]];
+			temp[2]	=	sbox[temp[3]];
+			temp[3]	=	sbox[t];
+			rcon	=	xtime(rcon);
+		}
+		roundKey[ii]		=	roundKey[ii - 16] ^ temp[0];
+		roundKey[ii + 1]	=	roundKey[ii - 15] ^ temp[1];
+		roundKey[ii + 2]	=	roundKey[ii - 14] ^ temp[2];
+		roundKey[ii + 3]	=	roundKey[ii - 13] ^ temp[3];
+	}
+#ifdef SOTA_AESNI
+	if (hardware())
+	{
+		aesni_inverse_keys(roundKey, inverseKey);
+	}
+#endif
+}
+
+//*****************************************************************************
+void sota_aes_t::encrypt_block(uint8_t *s) const
+{
+uint8_t	t[SOTA_BLOCKLEN];
+int		round;
+int		ii;
+
+#ifdef SOTA_AESNI
+	if (hardware())
+	{
+		static const uint8_t	zero[SOTA_BLOCKLEN]	=	{ 0 };
+
+		aesni_cbc_encrypt(roundKey, s, 1, zero);
+		return;
+	}
+#endif
+	for (ii=0; ii<SOTA_BLOCKLEN; ii++)
+	{
+		s[ii]	^=	roundKey[ii];
+	}
+	for (round=1; round<=10; round++)
+	{
+		for (ii=0; ii<SOTA_BLOCKLEN; ii++)		//*	SubBytes and ShiftRows
+		{
+			t[ii]	=	sbox[s[(ii + 4 * (ii % 4)) % SOTA_BLOCKLEN]];
+		}
+		for (ii=0; ii<SOTA_BLOCKLEN; ii+=4)		//*	MixColumns
+		{
+			if (round < 10)
+			{
+				uint8_t	all	=	t[ii] ^ t[ii + 1] ^ t[ii + 2] ^ t[ii + 3];
+				uint8_t	a0	=	t[ii];
+
+				s[ii]		=	t[ii] ^ all ^ xtime(t[ii] ^ t[ii + 1]);
+				s[ii + 1]	=	t[ii + 1] ^ all ^ xtime(t[ii + 1] ^ t[ii + 2]);
+				s[ii + 2]	=	t[ii + 2] ^ all ^ xtime(t[ii + 2] ^ t[ii + 3]);
+				s[ii + 3]	=	t[ii + 3] ^ all ^ xtime(t[ii + 3] ^ a0);
+			}
+			else
+			{
+				memcpy(s + ii, t + ii, 4);
+			}
+		}
+		for (ii=0; ii<SOTA_BLOCKLEN; ii++)
+		{
+			s[ii]	^=	roundKey[round * SOTA_BLOCKLEN + ii];
+		}
+	}
+}
+
+//*****************************************************************************
+void sota_aes_t::cbc_encrypt(uint8_t *data, size_t length, const uint8_t *iv) const
+{
+size_t	ii;
+int		jj;
+
+#ifdef SOTA_AESNI
+	if (hardware())
+	{
+		aesni_cbc_encrypt(roundKey, data, length / SOTA_BLOCKLEN, iv);
+		return;
+	}
+#endif
+	for (ii=0; ii<length; ii+=SOTA_BLOCKLEN)
+	{
+		for (jj=0; jj<SOTA_BLOCKLEN; jj++)
+		{
+			data[ii + jj]	^=	iv[jj];
+		}
+		encrypt_block(data + ii);
+		iv	=	data + ii;
+	}
+}
+
+//*****************************************************************************
+void sota_aes_t::cbc_decrypt(uint8_t *data, size_t length, const uint8_t *iv) const
+{
+uint8_t	chain[SOTA_BLOCKLEN];
+uint8_t	cipher[SOTA_BLOCKLEN];
+uint8_t	t[SOTA_BLOCKLEN];
+uint8_t	*s;
+size_t	ii;
+int		round;
+int		jj;
+
+#ifdef SOTA_AESNI
+	if (hardware())
+	{
+		aesni_cbc_decrypt(inverseKey, data, length / SOTA_BLOCKLEN, iv);
+		return;
+	}
+#endif
+	memcpy(chain, iv, SOTA_BLOCKLEN);
+	for (ii=0; ii<length; ii+=SOTA_BLOCKLEN)
+	{
+		s	=	data + ii;
+		memcpy(cipher, s, SOTA_BLOCKLEN);
+		for (round=10; round>=1; round--)
+		{
+			for (jj=0; jj<SOTA_BLOCKLEN; jj++)
+			{
+				s[jj]	^=	roundKey[round * SOTA_BLOCKLEN + jj];
+			}
+			if (round < 10)
+			{
+				for (jj=0; jj<SOTA_BLOCKLEN; jj+=4)	//*	InvMixColumns
+				{
+					t[jj]		=	gmul(s[jj], 14) ^ gmul(s[jj + 1], 11) ^ gmul(s[jj + 2], 13) ^ gmul(s[jj + 3], 9);
+					t[jj + 1]	=	gmul(s[jj], 9) ^ gmul(s[jj + 1], 14) ^ gmul(s[jj + 2], 11) ^ gmul(s[jj + 3], 13);
+					t[jj + 2]	=	gmul(s[jj], 13) ^ gmul(s[jj + 1], 9) ^ gmul(s[jj + 2], 14) ^ gmul(s[jj + 3], 11);
+					t[jj + 3]	=	gmul(s[jj], 11) ^ gmul(s[jj + 1], 13) ^ gmul(s[jj + 2], 9) ^ gmul(s[jj + 3], 14);
+				}
+				memcpy(s, t, SOTA_BLOCKLEN);
+			}
+			for (jj=0; jj<SOTA_BLOCKLEN; jj++)		//*	InvShiftRows and InvSubBytes
+			{
+				t[(jj + 4 * (jj % 4)) % SOTA_BLOCKLEN]	=	rsbox[s[jj]];
+			}
+			memcpy(s, t, SOTA_BLOCKLEN);
+		}
+		for (jj=0; jj<SOTA_BLOCKLEN; jj++)
+		{
+			s[jj]	^=	roundKey[jj] ^ chain[jj];
+		}
+		memcpy(chain, cipher, SOTA_BLOCKLEN);
+	}
+}
+
+//*****************************************************************************
+//*	Links
+
+static const struct
+{
+	unsigned long	baudRate;
+	speed_t			speed;
+} speeds[]	=	{
+	{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	{ 230400, B230400 },
+#ifdef B460800
+	{ 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 }, { 921600, B921600 },
+	{ 1000000, B1000000 }, { 2000000, B2000000 },
+#endif
+};
+
+//*****************************************************************************
+sota_fd_link_t::sota_fd_link_t(int input, int output, pid_t child, unsigned long baudRate)
+	: input(input), output(output), child(child), baudRate(baudRate)
+{
+}
+
+//*****************************************************************************
+sota_fd_link_t::~sota_fd_link_t()
+{
+	if (output != input)
+	{
+		close(output);
+	}
+	close(input);
+	if (child > 0)
+	{
+		waitpid(child, NULL, 0);
+	}
+}
+
+//*****************************************************************************
+/*
+ * raw 8N1 without flow control, a pty takes the same settings and ignores the rate
+ */
+sota_fd_link_t *sota_fd_link_t::open_serial(const char *path, unsigned long baudRate, std::string &error)
+{
+struct termios	settings;
+unsigned int	ii;
+int				fd;
+
+	for (ii=0; (ii<sizeof(speeds)/sizeof(speeds[0])) && (speeds[ii].baudRate != baudRate); ii++)
+	{
+	}
+	if (ii == sizeof(speeds)/sizeof(speeds[0]))
+	{
+		error	=	"unsupported baud rate " + std::to_string(baudRate);
+		return NULL;
+	}
+	if ((fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+	{
+		error	=	std::string(path) + ": " + strerror(errno);
+		return NULL;
+	}
+	if (tcgetattr(fd, &settings) == 0)
+	{
+		cfmakeraw(&settings);
+		settings.c_cflag		|=	CLOCAL | CREAD;
+		settings.c_cflag		&=	~(CSTOPB | CRTSCTS);
+		settings.c_cc[VMIN]		=	0;
+		settings.c_cc[VTIME]	=	0;
+		cfsetispeed(&settings, speeds[ii].speed);
+		cfsetospeed(&settings, speeds[ii].speed);
+		if (tcsetattr(fd, TCSANOW, &settings) != 0)
+		{
+			error	=	std::string(path) + ": " + strerror(errno);
+			close(fd);
+			return NULL;
+		}
+		tcflush(fd, TCIOFLUSH);
+	}
+	return new sota_fd_link_t(fd, fd, 0, baudRate);
+}
+
+//*****************************************************************************
+/*
+ * the host build (make host) talks the protocol on stdin/stdout
+ */
+sota_fd_link_t *sota_fd_link_t::spawn(const char *program, std::string &error)
+{
+int		toChild[2];
+int		fromChild[2];
+pid_t	child;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(toChild) != 0)
+	{
+		error	=	std::string("pipe: ") + strerror(errno);
+		return NULL;
+	}
+	if (pipe(fromChild) != 0)
+	{
+		error	=	std::string("pipe: ") + strerror(errno);
+		close(toChild[0]);
+		close(toChild[1]);
+		return NULL;
+	}
+	if ((child = fork()) < 0)
+	{
+		error	=	std::string("fork: ") + strerror(errno);
+		return NULL;
+	}
+	if (child == 0)
+	{
+		dup2(toChild[0], STDIN_FILENO);
+		dup2(fromChild[1], STDOUT_FILENO);
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+		execl(program, program, (char *)NULL);
+		perror(program);
+		_exit(127);
+	}
+	close(toChild[0]);
+	close(fromChild[1]);
+	return new sota_fd_link_t(fromChild[0], toChild[1], child, 0);
+}
+
+//*****************************************************************************
+bool sota_fd_link_t::send(const uint8_t *data, size_t length)
+{
+ssize_t	n;
+
+	while (length)
+	{
+		n	=	write(output, data, length);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data	+=	n;
+		length	-=	n;
+	}
+	return true;
+}
+
+//*****************************************************************************
+int sota_fd_link_t::receive(uint8_t *data, size_t length, int timeoutMs)
+{
+struct pollfd	ready	=	{ input, POLLIN, 0 };
+ssize_t			n;
+
+	if (poll(&ready, 1, timeoutMs) <= 0)
+	{
+		return 0;
+	}
+	n	=	read(input, data, length);
+	return (n > 0) ? n : -1;				//*	end of file, the other side is gone
+}
+
+//*****************************************************************************
+//*	Protocol
+
+//*****************************************************************************
+uint64_t sota_now_ns(void)
+{
+struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//*****************************************************************************
+sota_client_t::sota_client_t(sota_link_t *link)
+	: link(link), session(false), staged(false), slotBase(0), imageSignature(NULL), txSeq(0), rxSeq(0), timeoutMs(2000), retries(3), rxHead(0), rxTail(0)
+{
+	memset(&statistics, 0, sizeof(statistics));
+	memset(txIv, 0, sizeof(txIv));
+	memset(answerIv, 0, sizeof(answerIv));
+	statistics.rttMinNs	=	UINT64_MAX;
+	statistics.window	=	1;
+	baseKey.key_expand(linkKey);
+}
+
+//*****************************************************************************
+bool sota_client_t::fail(const char *format, ...)
+{
+char	text[256];
+va_list	args;
+
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	lastError	=	text;
+	return false;
+}
+
+//*****************************************************************************
+bool sota_client_t::link_send(const uint8_t *data, size_t length)
+{
+	statistics.wireOut	+=	length;
+	if (!link->send(data, length))
+	{
+		return fail("link closed while sending");
+	}
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * next byte from the link, -1 when none came within the timeout, -2 when
+ * the link is gone
+ */
+int sota_client_t::link_byte(void)
+{
+int	n;
+
+	if (rxHead == rxTail)
+	{
+		n	=	link->receive(rxBuffer, sizeof(rxBuffer), timeoutMs);
+		if (n <= 0)
+		{
+			return (n < 0) ? -2 : -1;
+		}
+		rxHead	=	0;
+		rxTail	=	n;
+		statistics.wireIn	+=	n;
+	}
+	return rxBuffer[rxHead++];
+}
+
+//*****************************************************************************
+/*
+ * envelope, padding and encryption for the next sequence number, the
+ * session chain moves on as if the frame had been sent already and its
+ * answer will chain on from its last block
+ */
+unsigned int sota_client_t::frame_build(uint8_t *frame, const uint8_t *message, unsigned int length)
+{
+uint8_t			*body	=	frame + 3;
+unsigned int	size	=	(length + 6 + SOTA_BLOCKLEN - 1) & ~(SOTA_BLOCKLEN - 1);
+uint8_t			checksum	=	0;
+uint8_t			seq		=	txSeq++;
+uint64_t		start;
+unsigned int	ii;
+
+	memset(body, 0xFF, size);
+	body[0]	=	MESSAGE_START;
+	body[1]	=	seq;
+	body[2]	=	length >> 8;
+	body[3]	=	length & 0xFF;
+	body[4]	=	TOKEN;
+	memcpy(body + 5, message, length);
+	for (ii=0; ii<length + 5; ii++)
+	{
+		checksum	^=	body[ii];
+	}
+	body[length + 5]	=	checksum;
+
+	start	=	sota_now_ns();
+	if (session)
+	{
+		sessionKey.cbc_encrypt(body, size, txIv);
+		memcpy(txIv, body + size - SOTA_BLOCKLEN, SOTA_BLOCKLEN);
+		memcpy(answerIv[seq], txIv, SOTA_BLOCKLEN);
+	}
+	else
+	{
+		baseKey.cbc_encrypt(body, size, linkIv);
+	}
+	statistics.aesNs	+=	sota_now_ns() - start;
+
+	frame[0]			=	SOTA_MESSAGE_START;
+	frame[1]			=	size >> 8;
+	frame[2]			=	size & 0xFF;
+	frame[3 + size]		=	0;					//*	the bootloader reads one byte past the payload
+	statistics.framesSent++;
+	return size + 4;
+}
+
+//*****************************************************************************
+/*
+ * decrypt an answer with the given key and chain, true if the envelope
+ * checks out and answers sequence number seq
+ */
+bool sota_client_t::envelope_open(const sota_aes_t &key, const uint8_t *iv, const uint8_t *cipher,
+									unsigned int size, uint8_t seq, uint8_t *plain) const
+{
+uint8_t			checksum	=	0;
+unsigned int	length;
+unsigned int	ii;
+
+	memcpy(plain, cipher, size);
+	key.cbc_decrypt(plain, size, iv);
+	length	=	(plain[2] << 8) | plain[3];
+	if ((plain[0] != MESSAGE_START) || (plain[1] != seq) || (plain[4] != TOKEN) || ((length + 6) > size))
+	{
+		return false;
+	}
+	for (ii=0; ii<length + 6; ii++)
+	{
+		checksum	^=	plain[ii];
+	}
+	return checksum == 0;
+}
+
+//*****************************************************************************
+/*
+ * wait for the answer to the oldest frame not answered yet, or to one sent
+ * after it, which answers all before it too. Anything that does not open
+ * is line noise or a late answer and is skipped. Returns the message
+ * length, -1 when nothing came within the timeout and the frames can be
+ * sent again, -2 when the link is gone
+ */
+int sota_client_t::frame_receive(uint8_t *message)
+{
+uint8_t			cipher[SOTA_FRAME_MAX];
+uint8_t			plain[SOTA_FRAME_MAX];
+unsigned int	size;
+unsigned int	length;
+unsigned int	ii;
+uint64_t		start;
+uint8_t			seq;
+bool			opened;
+int				c;
+
+	while (1)
+	{
+		do
+		{
+			c	=	link_byte();
+		} while ((c >= 0) && (c != SOTA_MESSAGE_START));
+		size	=	0;
+		for (ii=0; (c >= 0) && (ii<2); ii++)
+		{
+			c		=	link_byte();
+			size	=	(size << 8) | c;
+		}
+		if ((c >= 0) && ((size == 0) || (size > SOTA_FRAME_MAX) || (size % SOTA_BLOCKLEN)))
+		{
+			continue;						//*	no answer of ours, hunt for the next start byte
+		}
+		for (ii=0; (c >= 0) && (ii<size); ii++)
+		{
+			c			=	link_byte();
+			cipher[ii]	=	c;
+		}
+		if (c < 0)
+		{
+			(c == -1) ? fail("no answer within %d ms", timeoutMs) : fail("link closed");
+			return c;
+		}
+
+		start	=	sota_now_ns();
+		opened	=	false;
+		for (seq=rxSeq; !opened && (seq != txSeq); seq++)
+		{
+			if (session && envelope_open(sessionKey, answerIv[seq], cipher, size, seq, plain))
+			{
+				opened	=	true;
+			}
+			else if (envelope_open(baseKey, linkIv, cipher, size, seq, plain))
+			{
+				session	=	false;				//*	the bootloader dropped the session
+				opened	=	true;
+			}
+		}
+		statistics.aesNs	+=	sota_now_ns() - start;
+		if (opened)
+		{
+			break;
+		}
+	}
+	rxSeq	=	seq;						//*	one past the answered frame
+	statistics.answers++;
+	length	=	(plain[2] << 8) | plain[3];
+	memcpy(message, plain + 5, length);
+	return length;
+}
+
+//*****************************************************************************
+/*
+ * one command and its answer, the same frame again while none comes
+ */
+int sota_client_t::command(const uint8_t *message, unsigned int length, uint8_t *answer)
+{
+uint8_t			frame[3 + SOTA_FRAME_MAX + 1];
+unsigned int	size;
+int				attempt;
+int				result;
+
+	if ((length + 6) > SOTA_FRAME_MAX)
+	{
+		fail("message of %u bytes does not fit a frame", length);
+		return -1;
+	}
+	size	=	frame_build(frame, message, length);
+	for (attempt=0; attempt<=retries; attempt++)
+	{
+		if (attempt > 0)
+		{
+			statistics.retransmits++;
+		}
+		if (!link_send(frame, size))
+		{
+			return -2;
+		}
+		if ((result = frame_receive(answer)) != -1)
+		{
+			return result;
+		}
+	}
+	return -1;
+}
+
+//*****************************************************************************
+/*
+ * CMD_AUTH_FAST, on success the answer carries the device nonce and the
+ * session starts with the next frame
+ *	mac			= AES_k(token[4] | counter[4] | CMD_AUTH_FAST | 0 ...)
+ *	sessionKey	= AES_k(mac ^ deviceNonce ^ 0x36 ...)
+ * 1 authenticated, 0 failed, -1 the bootloader does not know the command
+ */
+int sota_client_t::connect_fast(uint32_t counter)
+{
+uint8_t	request[5 + SOTA_BLOCKLEN];
+uint8_t	answer[SOTA_FRAME_MAX];
+uint8_t	mac[SOTA_BLOCKLEN];
+uint8_t	block[SOTA_BLOCKLEN];
+int		length;
+int		attempt;
+int		ii;
+
+	for (attempt=0; attempt<2; attempt++)
+	{
+		memset(mac, 0, SOTA_BLOCKLEN);
+		memcpy(mac, authToken, 4);
+		mac[4]	=	counter >> 24;
+		mac[5]	=	counter >> 16;
+		mac[6]	=	counter >> 8;
+		mac[7]	=	counter;
+		mac[8]	=	CMD_AUTH_FAST;
+		baseKey.encrypt_block(mac);
+
+		request[0]	=	CMD_AUTH_FAST;
+		request[1]	=	counter >> 24;
+		request[2]	=	counter >> 16;
+		request[3]	=	counter >> 8;
+		request[4]	=	counter;
+		memcpy(request + 5, mac, SOTA_BLOCKLEN);
+
+		//*	request and answer go under the link key, a lost answer comes again
+		session	=	false;
+		if ((length = command(request, sizeof(request), answer)) < 0)
+		{
+			return 0;
+		}
+		if ((length == (2 + SOTA_BLOCKLEN)) && (answer[0] == CMD_AUTH_FAST) && (answer[1] == STATUS_CMD_OK))
+		{
+			//*	the session the bootloader starts after its answer
+			for (ii=0; ii<SOTA_BLOCKLEN; ii++)
+			{
+				block[ii]	=	mac[ii] ^ answer[2 + ii] ^ 0x36;
+			}
+			baseKey.encrypt_block(block);
+			sessionKey.key_expand(block);
+			memset(txIv, 0, SOTA_BLOCKLEN);
+			txIv[0]	=	1;
+			sessionKey.encrypt_block(txIv);
+			session	=	true;
+			return 1;
+		}
+		if ((length == 2) && (answer[0] == CMD_AUTH_FAST) && (answer[1] == STATUS_CMD_FAILED))
+		{
+			fail("no CMD_AUTH_FAST in this bootloader");
+			return -1;
+		}
+		if ((length != 6) || (answer[0] != CMD_AUTH_FAST) || (answer[1] != STATUS_CMD_FAILED))
+		{
+			fail("CMD_AUTH_FAST answer of %d bytes is not from the bootloader", length);
+			return 0;
+		}
+		//*	the device is further along, retry above its counter
+		counter	=	(((uint32_t)answer[2] << 24) | ((uint32_t)answer[3] << 16) | ((uint32_t)answer[4] << 8) | answer[5]) + 1;
+	}
+	fail("CMD_AUTH_FAST refused");
+	return 0;
+}
+
+//*****************************************************************************
+/*
+ * the original two phase handshake,
+ *	CMD_AUTH n[4] token[4]				-> STATUS_CMD_OK, n + secret, r
+ *	CMD_AUTH_SECOND_PHASE r + secret token[4]	-> STATUS_CMD_OK
+ * numbers are 32 bit little endian, as the AVR keeps them
+ */
+bool sota_client_t::connect_legacy(void)
+{
+uint8_t		request[9];
+uint8_t		answer[SOTA_FRAME_MAX];
+uint32_t	challenge	=	(uint32_t)sota_now_ns() ^ ((uint32_t)getpid() << 16);
+uint32_t	value;
+int			length;
+int			ii;
+
+	session		=	false;
+	request[0]	=	CMD_AUTH;
+	for (ii=0; ii<4; ii++)
+	{
+		request[1 + ii]	=	challenge >> (8 * ii);
+	}
+	memcpy(request + 5, authToken, 4);
+	if ((length = command(request, sizeof(request), answer)) < 0)
+	{
+		return false;
+	}
+	if ((length < 9) || (answer[0] != STATUS_CMD_OK))
+	{
+		return fail("CMD_AUTH refused");
+	}
+	value	=	answer[1] | (answer[2] << 8) | (answer[3] << 16) | ((uint32_t)answer[4] << 24);
+	if (value != (uint32_t)(challenge + authSecret))
+	{
+		return fail("CMD_AUTH answer does not prove the shared secret");
+	}
+	value	=	(answer[5] | (answer[6] << 8) | (answer[7] << 16) | ((uint32_t)answer[8] << 24)) + authSecret;
+
+	request[0]	=	CMD_AUTH_SECOND_PHASE;
+	for (ii=0; ii<4; ii++)
+	{
+		request[1 + ii]	=	value >> (8 * ii);
+	}
+	if ((length = command(request, sizeof(request), answer)) < 0)
+	{
+		return false;
+	}
+	if ((length < 1) || (answer[0] != STATUS_CMD_OK))
+	{
+		return fail("CMD_AUTH_SECOND_PHASE refused");
+	}
+	return true;
+}
+
+//*****************************************************************************
+bool sota_client_t::connect(uint32_t counter, bool legacyOnly)
+{
+uint64_t	start	=	sota_now_ns();
+int			fast	=	-1;
+bool		ok;
+
+	txSeq	=	0;
+	rxSeq	=	0;
+	if (!legacyOnly)
+	{
+		fast	=	connect_fast(counter);
+	}
+	ok	=	(fast > 0) || ((fast < 0) && connect_legacy());
+	statistics.session		=	session;
+	statistics.connectNs	=	sota_now_ns() - start;
+	return ok;
+}
+
+//*****************************************************************************
+/*
+ * CMD_PROGRAM_FLASH_ISP frame for chunk index of the image
+ */
+unsigned int sota_client_t::chunk_frame(const std::vector<uint8_t> &image, size_t index, uint8_t *frame)
+{
+uint8_t			message[10 + SOTA_CHUNK_SIZE];
+size_t			offset	=	index * SOTA_CHUNK_SIZE;
+unsigned int	chunk	=	((image.size() - offset) < SOTA_CHUNK_SIZE) ? (image.size() - offset) : SOTA_CHUNK_SIZE;
+
+	memset(message, 0, 10);
+	message[0]	=	CMD_PROGRAM_FLASH_ISP;
+	message[1]	=	chunk >> 8;
+	message[2]	=	chunk & 0xFF;
+	memcpy(message + 10, &image[offset], chunk);
+	return frame_build(frame, message, chunk + 10);
+}
+
+//*****************************************************************************
+/*
+ * a chunk is still needed when any device page it touches is flagged in
+ * the completion map, pages past the map are always sent
+ */
+bool sota_client_t::resume(const std::vector<uint8_t> &image, unsigned int pageSize, std::vector<bool> &missing)
+{
+uint8_t		message[5];
+uint8_t		answer[SOTA_FRAME_MAX];
+uint32_t	crc		=	sota_crc32(image.data(), image.size());
+size_t		chunkCount	=	(image.size() + SOTA_CHUNK_SIZE - 1) / SOTA_CHUNK_SIZE;
+size_t		mapPages;
+size_t		offset;
+size_t		page;
+size_t		last;
+size_t		index;
+int			length;
+
+	message[0]	=	CMD_RESUME;
+	message[1]	=	crc >> 24;
+	message[2]	=	crc >> 16;
+	message[3]	=	crc >> 8;
+	message[4]	=	crc;
+	if ((length = command(message, sizeof(message), answer)) < 0)
+	{
+		return false;
+	}
+	if ((length < 2) || (answer[0] != CMD_RESUME) || (answer[1] != STATUS_CMD_OK) || (pageSize == 0))
+	{
+		return fail("CMD_RESUME refused, bootloader built without ENABLE_RESUME?");
+	}
+	mapPages	=	(length - 2) * 8;
+	missing.assign(chunkCount, false);
+	statistics.resumed	=	0;
+	for (index=0; index<chunkCount; index++)
+	{
+		offset	=	index * SOTA_CHUNK_SIZE;
+		last	=	(std::min(offset + SOTA_CHUNK_SIZE, image.size()) - 1) / pageSize;
+		for (page=offset / pageSize; !missing[index] && (page<=last); page++)
+		{
+			missing[index]	=	(page >= mapPages) || (answer[2 + page / 8] & (1 << (page & 7)));
+		}
+		if (!missing[index])
+		{
+			statistics.resumed	+=	std::min((size_t)SOTA_CHUNK_SIZE, image.size() - offset);
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+bool sota_client_t::select_slot(unsigned int slot, uint32_t *base)
+{
+uint8_t		message[2];
+uint8_t		answer[SOTA_FRAME_MAX];
+int			length;
+
+	message[0]	=	CMD_SELECT_SLOT;
+	message[1]	=	slot;
+	if ((length = command(message, sizeof(message), answer)) < 0)
+	{
+		return false;
+	}
+	if ((length != 6) || (answer[0] != CMD_SELECT_SLOT) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_SELECT_SLOT %u refused, bootloader built without ENABLE_DUAL_SLOT?", slot);
+	}
+	staged	=	(slot != 0);
+	if (staged)
+	{
+		slotBase	=	((uint32_t)answer[2] << 24) | ((uint32_t)answer[3] << 16) | ((uint32_t)answer[4] << 8) | answer[5];
+	}
+	if (base)
+	{
+		*base	=	((uint32_t)answer[2] << 24) | ((uint32_t)answer[3] << 16) | ((uint32_t)answer[4] << 8) | answer[5];
+	}
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * CMD_LOAD_ADDRESS of chunk first, then count chunks in SOTA_CHUNK_SIZE
+ * frames with up to window of them unanswered. When no answer comes in
+ * time all unanswered frames go out again as they were, the bootloader
+ * drops those it has taken already, bar the last, which it answers again.
+ */
+bool sota_client_t::upload_run(const std::vector<uint8_t> &image, size_t first, size_t count, unsigned int window)
+{
+uint8_t					frames[SOTA_WINDOW_MAX + 1][3 + SOTA_FRAME_MAX + 1];
+unsigned int			frameSize[SOTA_WINDOW_MAX + 1];
+uint64_t				sentAt[SOTA_WINDOW_MAX + 1];
+uint8_t					loadAddress[5];
+uint8_t					answer[SOTA_FRAME_MAX];
+uint32_t				wordAddress	=	(first * SOTA_CHUNK_SIZE) >> 1;
+size_t					end			=	first + count;
+size_t					built		=	first;		//*	frames encrypted, at most one more than sent
+size_t					sent		=	first;
+size_t					answered	=	first;
+size_t					index;
+unsigned int			slot;
+uint64_t				rtt;
+uint8_t					oldest;
+int						attempt		=	0;
+int						length;
+
+	loadAddress[0]	=	CMD_LOAD_ADDRESS;
+	loadAddress[1]	=	wordAddress >> 24;
+	loadAddress[2]	=	wordAddress >> 16;
+	loadAddress[3]	=	wordAddress >> 8;
+	loadAddress[4]	=	wordAddress;
+	if (((length = command(loadAddress, sizeof(loadAddress), answer)) < 2) || (answer[1] != STATUS_CMD_OK))
+	{
+		return (length < 0) ? false : fail("CMD_LOAD_ADDRESS refused, not authenticated?");
+	}
+
+	while (answered < end)
+	{
+		//*	fill the window, then encrypt one frame more while the device is busy
+		while ((sent < end) && (sent < (answered + window)))
+		{
+			slot	=	sent % (SOTA_WINDOW_MAX + 1);
+			if (built == sent)
+			{
+				frameSize[slot]	=	chunk_frame(image, built++, frames[slot]);
+			}
+			sentAt[slot]	=	sota_now_ns();
+			if (!link_send(frames[slot], frameSize[slot]))
+			{
+				return false;
+			}
+			statistics.dataSent	+=	std::min((size_t)SOTA_CHUNK_SIZE, image.size() - sent * SOTA_CHUNK_SIZE);
+			sent++;
+		}
+		if ((built == sent) && (built < end))
+		{
+			slot			=	built % (SOTA_WINDOW_MAX + 1);
+			frameSize[slot]	=	chunk_frame(image, built++, frames[slot]);
+		}
+		oldest	=	rxSeq;
+		if ((length = frame_receive(answer)) == -1)
+		{
+			if (attempt++ == retries)
+			{
+				return fail("%s, frame at 0x%05zX", lastError.c_str(), answered * SOTA_CHUNK_SIZE);
+			}
+			for (index=answered; index<sent; index++)
+			{
+				slot	=	index % (SOTA_WINDOW_MAX + 1);
+				if (!link_send(frames[slot], frameSize[slot]))
+				{
+					return false;
+				}
+				statistics.retransmits++;
+			}
+			continue;
+		}
+		if (length < 0)
+		{
+			return fail("%s, frame at 0x%05zX", lastError.c_str(), answered * SOTA_CHUNK_SIZE);
+		}
+		if ((length != 2) || (answer[0] != CMD_PROGRAM_FLASH_ISP) || (answer[1] != STATUS_CMD_OK))
+		{
+			return fail("CMD_PROGRAM_FLASH_ISP failed at 0x%05zX", answered * SOTA_CHUNK_SIZE);
+		}
+		attempt	=	0;
+		//*	an answer to a later frame stands for the lost answers before it
+		for (; oldest != rxSeq; oldest++)
+		{
+			rtt		=	sota_now_ns() - sentAt[answered % (SOTA_WINDOW_MAX + 1)];
+			statistics.rttMinNs	=	(rtt < statistics.rttMinNs) ? rtt : statistics.rttMinNs;
+			statistics.rttMaxNs	=	(rtt > statistics.rttMaxNs) ? rtt : statistics.rttMaxNs;
+			statistics.rttSumNs	+=	rtt;
+			statistics.payload	+=	std::min((size_t)SOTA_CHUNK_SIZE, image.size() - answered * SOTA_CHUNK_SIZE);
+			answered++;
+			statistics.chunks++;
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * the image, or the runs of chunks missing flags, then CMD_COMMIT_IMAGE
+ * with its length and CRC32
+ */
+bool sota_client_t::upload(const std::vector<uint8_t> &image, unsigned int window, bool commit,
+							const std::vector<bool> *missing)
+{
+uint8_t					message[9];
+uint8_t					answer[SOTA_FRAME_MAX];
+size_t					chunkCount	=	(image.size() + SOTA_CHUNK_SIZE - 1) / SOTA_CHUNK_SIZE;
+size_t					first;
+size_t					next;
+uint64_t				start;
+uint32_t				crc;
+int						length;
+
+	window	=	(window < 1) ? 1 : ((window > SOTA_WINDOW_MAX) ? SOTA_WINDOW_MAX : window);
+	statistics.window	=	window;
+
+	start	=	sota_now_ns();
+	for (first=0; first<chunkCount; first=next)
+	{
+		if (missing && (first < missing->size()) && !(*missing)[first])
+		{
+			next	=	first + 1;
+			continue;
+		}
+		for (next=first + 1; (next < chunkCount) && (!missing || (next >= missing->size()) || (*missing)[next]); next++)
+		{
+		}
+		if (!upload_run(image, first, next - first, window))
+		{
+			return false;
+		}
+	}
+	statistics.uploadNs	=	sota_now_ns() - start;
+	if (imageSignature && !sign(image.size(), imageSignature))
+	{
+		return false;
+	}
+	if (!commit)
+	{
+		return true;
+	}
+
+	//*	the staged image is checked and copied over the running one, the
+	//*	only time the application is not there
+	start		=	sota_now_ns();
+	crc			=	sota_crc32(image.data(), image.size());
+	message[0]	=	staged ? CMD_ACTIVATE_SLOT : CMD_COMMIT_IMAGE;
+	message[1]	=	image.size() >> 24;
+	message[2]	=	image.size() >> 16;
+	message[3]	=	image.size() >> 8;
+	message[4]	=	image.size();
+	message[5]	=	crc >> 24;
+	message[6]	=	crc >> 16;
+	message[7]	=	crc >> 8;
+	message[8]	=	crc;
+	length		=	command(message, 9, answer);
+	statistics.commitNs	=	sota_now_ns() - start;
+	if (length < 0)
+	{
+		return false;
+	}
+	if ((length < 2) || (answer[0] != message[0]) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("%s refused, CRC32 0x%08X over %zu bytes does not match the flash",
+					staged ? "CMD_ACTIVATE_SLOT" : "CMD_COMMIT_IMAGE", crc, image.size());
+	}
+	staged	=	false;			//*	the bootloader is back on slot A
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * the bootloader reads the flash back, only the digest comes over the link
+ */
+bool sota_client_t::verify(uint32_t address, const uint8_t *data, size_t length)
+{
+uint8_t		message[10];
+uint8_t		answer[SOTA_FRAME_MAX];
+uint32_t	crc		=	sota_crc32(data, length);
+uint32_t	deviceCrc;
+uint64_t	start	=	sota_now_ns();
+int			answerLength;
+
+	message[0]	=	CMD_VERIFY_IMAGE;
+	message[1]	=	VERIFY_MODE_CRC32;
+	message[2]	=	address >> 24;
+	message[3]	=	address >> 16;
+	message[4]	=	address >> 8;
+	message[5]	=	address;
+	message[6]	=	length >> 24;
+	message[7]	=	length >> 16;
+	message[8]	=	length >> 8;
+	message[9]	=	length;
+	answerLength		=	command(message, sizeof(message), answer);
+	statistics.verifyNs	=	sota_now_ns() - start;
+	if (answerLength < 0)
+	{
+		return false;
+	}
+	if ((answerLength != 6) || (answer[0] != CMD_VERIFY_IMAGE) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_VERIFY_IMAGE 0x%05X+%zu refused, bootloader built without ENABLE_IMAGE_VERIFY?", address, length);
+	}
+	deviceCrc	=	((uint32_t)answer[2] << 24) | ((uint32_t)answer[3] << 16) | ((uint32_t)answer[4] << 8) | answer[5];
+	if (deviceCrc != crc)
+	{
+		return fail("CMD_VERIFY_IMAGE 0x%05X+%zu: CRC32 0x%08X, expected 0x%08X", address, length, deviceCrc, crc);
+	}
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * the bootloader checks the signature against the SHA-256 it took of the
+ * pages while they were programmed
+ */
+bool sota_client_t::sign(size_t length, const uint8_t *signature)
+{
+uint8_t		message[5 + SOTA_SIGNATURE_SIZE];
+uint8_t		answer[SOTA_FRAME_MAX];
+uint64_t	start	=	sota_now_ns();
+int			answerLength;
+
+	message[0]	=	CMD_IMAGE_SIGNATURE;
+	message[1]	=	length >> 24;
+	message[2]	=	length >> 16;
+	message[3]	=	length >> 8;
+	message[4]	=	length;
+	memcpy(message + 5, signature, SOTA_SIGNATURE_SIZE);
+	answerLength		=	command(message, sizeof(message), answer);
+	statistics.signNs	=	sota_now_ns() - start;
+	if (answerLength < 0)
+	{
+		return false;
+	}
+	if ((answerLength != 2) || (answer[0] != CMD_IMAGE_SIGNATURE) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_IMAGE_SIGNATURE over %zu bytes refused, wrong key or bootloader built without ENABLE_IMAGE_SIGNATURE?", length);
+	}
+	return true;
+}
+
+//*****************************************************************************
+bool sota_client_t::leave(void)
+{
+static const uint8_t	request[3]	=	{ CMD_LEAVE_PROGMODE_ISP, 0, 0 };
+uint8_t					answer[SOTA_FRAME_MAX];
+int						length;
+
+	if ((length = command(request, sizeof(request), answer)) < 0)
+	{
+		return false;
+	}
+	if ((length < 2) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_LEAVE_PROGMODE_ISP refused, the application is not bootable");
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	Images
+
+//*****************************************************************************
+uint32_t sota_crc32(const uint8_t *data, size_t length)
+{
+static uint32_t	table[256];
+uint32_t		crc	=	0xFFFFFFFF;
+uint32_t		value;
+int				bit;
+
+	if (table[1] == 0)
+	{
+		for (value=0; value<256; value++)
+		{
+			table[value]	=	value;
+			for (bit=0; bit<8; bit++)
+			{
+				table[value]	=	(table[value] >> 1) ^ ((table[value] & 1) ? 0xEDB88320 : 0);
+			}
+		}
+	}
+	while (length--)
+	{
+		crc	=	(crc >> 8) ^ table[(crc ^ *data++) & 0xFF];
+	}
+	return ~crc;
+}
+
+//*****************************************************************************
+static int hex_byte(const char *text)
+{
+int	value	=	0;
+int	ii;
+
+	for (ii=0; ii<2; ii++)
+	{
+		value	<<=	4;
+		if ((text[ii] >= '0') && (text[ii] <= '9'))
+		{
+			value	|=	text[ii] - '0';
+		}
+		else if ((text[ii] >= 'A') && (text[ii] <= 'F'))
+		{
+			value	|=	text[ii] - 'A' + 10;
+		}
+		else if ((text[ii] >= 'a') && (text[ii] <= 'f'))
+		{
+			value	|=	text[ii] - 'a' + 10;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return value;
+}
+
+//*****************************************************************************
+/*
+ * data, end of file, extended segment and linear address records, every
+ * checksum checked, host/hexmerge does the same for whole batches
+ */
+static bool hex_load(FILE *file, const char *fileName, std::vector<uint8_t> &image, std::string &error)
+{
+char			line[1 + 2 * (5 + 255) + 4];
+uint8_t			record[5 + 255];
+unsigned int	lineNumber	=	0;
+unsigned int	length;
+unsigned int	count;
+unsigned int	ii;
+uint32_t		base		=	0;
+uint32_t		address;
+uint8_t			checksum;
+int				value;
+
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+		length	=	strlen(line);
+		while (length && ((line[length - 1] == '\n') || (line[length - 1] == '\r') || (line[length - 1] == ' ')))
+		{
+			length--;
+		}
+		if (length == 0)
+		{
+			continue;
+		}
+		count		=	(length - 1) / 2;
+		checksum	=	0;
+		for (ii=0; (line[0] == ':') && (length & 1) && (ii<count); ii++)
+		{
+			if ((value = hex_byte(line + 1 + 2 * ii)) < 0)
+			{
+				break;
+			}
+			record[ii]	=	value;
+			checksum	+=	value;
+		}
+		if ((count < 5) || (ii != count) || (count != (5U + record[0])) || (checksum != 0))
+		{
+			error	=	std::string(fileName) + ":" + std::to_string(lineNumber) + ": bad record or checksum";
+			return false;
+		}
+		switch (record[3])
+		{
+			case 0x00:
+				address	=	base + ((record[1] << 8) | record[2]);
+				if ((address + record[0]) > (16UL << 20))
+				{
+					error	=	std::string(fileName) + ":" + std::to_string(lineNumber) + ": address beyond 16M";
+					return false;
+				}
+				if (image.size() < (address + record[0]))
+				{
+					image.resize(address + record[0], 0xFF);
+				}
+				memcpy(&image[address], record + 4, record[0]);
+				break;
+
+			case 0x01:
+				return true;
+
+			case 0x02:
+				base	=	((record[4] << 8) | record[5]) << 4;
+				break;
+
+			case 0x04:
+				base	=	(uint32_t)((record[4] << 8) | record[5]) << 16;
+				break;
+		}
+	}
+	error	=	std::string(fileName) + ": no end of file record";
+	return false;
+}
+
+//*****************************************************************************
+bool sota_image_load(const char *spec, std::vector<uint8_t> &image, std::string &error)
+{
+const char	*suffix	=	strrchr(spec, '.');
+FILE		*file;
+uint32_t	seed	=	0x2545F491;
+size_t		n;
+uint8_t		buffer[65536];
+bool		ok		=	true;
+
+	image.clear();
+	if (strspn(spec, "0123456789") == strlen(spec))
+	{
+		image.resize(strtoul(spec, NULL, 10));
+		for (size_t ii=0; ii<image.size(); ii++)	//*	xorshift, the image sota_bench uploads
+		{
+			seed		^=	seed << 13;
+			seed		^=	seed >> 17;
+			seed		^=	seed << 5;
+			image[ii]	=	seed;
+		}
+		return true;
+	}
+	if (!(file = fopen(spec, "rb")))
+	{
+		error	=	std::string(spec) + ": " + strerror(errno);
+		return false;
+	}
+	if (suffix && ((strcmp(suffix, ".hex") == 0) || (strcmp(suffix, ".ihex") == 0)))
+	{
+		ok	=	hex_load(file, spec, image, error);
+	}
+	else
+	{
+		while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			image.insert(image.end(), buffer, buffer + n);
+		}
+		if (ferror(file))
+		{
+			error	=	std::string(spec) + ": " + strerror(errno);
+			ok		=	false;
+		}
+	}
+	fclose(file);
+	if (ok && image.empty())
+	{
+		error	=	std::string(spec) + ": empty image";
+		ok		=	false;
+	}
+	return ok;
+}
+
+//*****************************************************************************
+//*	Image signatures
+
+//*	numbers mod the 2048 bit modulus, 32 bit limbs, least significant first
+#define	RSA_LIMBS		(SOTA_SIGNATURE_SIZE / 4)
+
+typedef uint32_t	rsa_number_t[RSA_LIMBS];
+
+//*	SHA-256 DigestInfo of EMSA-PKCS1-v1_5 (RFC 8017 section 9.2)
+static const uint8_t	sha256DigestInfo[19]	=	{
+	0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+
+//*****************************************************************************
+static void rsa_from_bytes(rsa_number_t x, const uint8_t *bytes)
+{
+	for (int ii=0; ii<RSA_LIMBS; ii++)
+	{
+		const uint8_t	*p	=	bytes + SOTA_SIGNATURE_SIZE - 4 * (ii + 1);
+
+		x[ii]	=	((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	}
+}
+
+//*****************************************************************************
+static void rsa_to_bytes(uint8_t *bytes, const rsa_number_t x)
+{
+	for (int ii=0; ii<SOTA_SIGNATURE_SIZE; ii++)
+	{
+		bytes[SOTA_SIGNATURE_SIZE - 1 - ii]	=	x[ii / 4] >> (8 * (ii % 4));
+	}
+}
+
+//*****************************************************************************
+/*
+ * x -= n when x >= n or carry says x overflowed
+ */
+static void rsa_reduce(rsa_number_t x, uint32_t carry, const rsa_number_t n)
+{
+uint64_t	borrow	=	0;
+int			ii;
+
+	if (!carry)
+	{
+		for (ii=RSA_LIMBS - 1; (ii >= 0) && (x[ii] == n[ii]); ii--)
+		{
+		}
+		if ((ii >= 0) && (x[ii] < n[ii]))
+		{
+			return;
+		}
+	}
+	for (ii=0; ii<RSA_LIMBS; ii++)
+	{
+		borrow	=	(uint64_t)x[ii] - n[ii] - borrow;
+		x[ii]	=	borrow;
+		borrow	=	(borrow >> 32) & 1;
+	}
+}
+
+//*****************************************************************************
+/*
+ * out = a b / 2^2048 mod n, n0inv = -1/n mod 2^32
+ */
+static void rsa_mont_mul(rsa_number_t out, const rsa_number_t a, const rsa_number_t b, const rsa_number_t n, uint32_t n0inv)
+{
+uint32_t	t[RSA_LIMBS + 2];
+uint64_t	carry;
+uint32_t	m;
+int			ii;
+int			jj;
+
+	memset(t, 0, sizeof(t));
+	for (ii=0; ii<RSA_LIMBS; ii++)
+	{
+		carry	=	0;
+		for (jj=0; jj<RSA_LIMBS; jj++)
+		{
+			carry	+=	(uint64_t)a[ii] * b[jj] + t[jj];
+			t[jj]	=	carry;
+			carry	>>=	32;
+		}
+		carry			+=	t[RSA_LIMBS];
+		t[RSA_LIMBS]	=	carry;
+		t[RSA_LIMBS + 1]	=	carry >> 32;
+
+		m		=	t[0] * n0inv;
+		carry	=	((uint64_t)m * n[0] + t[0]) >> 32;
+		for (jj=1; jj<RSA_LIMBS; jj++)
+		{
+			carry		+=	(uint64_t)m * n[jj] + t[jj];
+			t[jj - 1]	=	carry;
+			carry		>>=	32;
+		}
+		carry				+=	t[RSA_LIMBS];
+		t[RSA_LIMBS - 1]	=	carry;
+		t[RSA_LIMBS]		=	t[RSA_LIMBS + 1] + (carry >> 32);
+	}
+	memcpy(out, t, sizeof(rsa_number_t));
+	rsa_reduce(out, t[RSA_LIMBS], n);
+}
+
+//*****************************************************************************
+static uint32_t rsa_n0inv(const rsa_number_t n)
+{
+uint32_t	inverse	=	n[0];		//*	right in the low 3 bits for any odd n
+
+	for (int ii=0; ii<4; ii++)
+	{
+		inverse	*=	2 - n[0] * inverse;
+	}
+	return -inverse;
+}
+
+//*****************************************************************************
+/*
+ * R^2 mod n, R = 2^2048, by doubling 1 4096 times
+ */
+static void rsa_rr(rsa_number_t rr, const rsa_number_t n)
+{
+uint32_t	carry;
+
+	memset(rr, 0, sizeof(rsa_number_t));
+	rr[0]	=	1;
+	for (int bit=0; bit<2 * 8 * SOTA_SIGNATURE_SIZE; bit++)
+	{
+		carry	=	0;
+		for (int ii=0; ii<RSA_LIMBS; ii++)
+		{
+			uint32_t	next	=	rr[ii] >> 31;
+
+			rr[ii]	=	(rr[ii] << 1) | carry;
+			carry	=	next;
+		}
+		rsa_reduce(rr, carry, n);
+	}
+}
+
+//*****************************************************************************
+/*
+ * out = x^exponent mod n, exponent big endian
+ */
+static void rsa_power(uint8_t *out, const uint8_t *x, const uint8_t *exponent, size_t exponentSize, const uint8_t *modulus)
+{
+rsa_number_t	n;
+rsa_number_t	rr;
+rsa_number_t	base;
+rsa_number_t	accumulator;
+rsa_number_t	scratch;
+rsa_number_t	one;
+uint32_t		n0inv;
+
+	rsa_from_bytes(n, modulus);
+	n0inv	=	rsa_n0inv(n);
+	rsa_rr(rr, n);
+	memset(one, 0, sizeof(one));
+	one[0]	=	1;
+
+	rsa_from_bytes(scratch, x);
+	rsa_mont_mul(base, scratch, rr, n, n0inv);				//*	x R
+	rsa_mont_mul(accumulator, one, rr, n, n0inv);			//*	R, 1 in Montgomery form
+	for (size_t ii=0; ii<8 * exponentSize; ii++)
+	{
+		rsa_mont_mul(scratch, accumulator, accumulator, n, n0inv);
+		if (exponent[ii / 8] & (0x80 >> (ii % 8)))
+		{
+			rsa_mont_mul(accumulator, scratch, base, n, n0inv);
+		}
+		else
+		{
+			memcpy(accumulator, scratch, sizeof(rsa_number_t));
+		}
+	}
+	rsa_mont_mul(scratch, accumulator, one, n, n0inv);
+	rsa_to_bytes(out, scratch);
+}
+
+//*****************************************************************************
+/*
+ * EMSA-PKCS1-v1_5 with SHA-256: 00 01 FF .. FF 00 DigestInfo digest
+ */
+static void rsa_encode(uint8_t *encoded, const uint8_t *digest)
+{
+size_t	padEnd	=	SOTA_SIGNATURE_SIZE - 32 - sizeof(sha256DigestInfo) - 1;
+
+	encoded[0]	=	0x00;
+	encoded[1]	=	0x01;
+	memset(encoded + 2, 0xFF, padEnd - 2);
+	encoded[padEnd]	=	0x00;
+	memcpy(encoded + padEnd + 1, sha256DigestInfo, sizeof(sha256DigestInfo));
+	memcpy(encoded + SOTA_SIGNATURE_SIZE - 32, digest, 32);
+}
+
+//*****************************************************************************
+/*
+ * hex bytes after the label, "00:c4:58:..." over as many lines as it takes
+ */
+static bool key_hex(const char *text, std::vector<uint8_t> &bytes)
+{
+int	value;
+
+	while (*text)
+	{
+		if ((*text == ':') || isspace((unsigned char)*text))
+		{
+			text++;
+			continue;
+		}
+		if ((value = hex_byte(text)) < 0)
+		{
+			return false;
+		}
+		bytes.push_back(value);
+		text	+=	2;
+	}
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * big endian, leading zero bytes dropped, then padded to SOTA_SIGNATURE_SIZE
+ */
+static bool key_number(std::vector<uint8_t> &bytes, uint8_t *number)
+{
+	while (!bytes.empty() && (bytes[0] == 0))
+	{
+		bytes.erase(bytes.begin());
+	}
+	if (bytes.size() > SOTA_SIGNATURE_SIZE)
+	{
+		return false;
+	}
+	memset(number, 0, SOTA_SIGNATURE_SIZE);
+	memcpy(number + SOTA_SIGNATURE_SIZE - bytes.size(), bytes.data(), bytes.size());
+	return true;
+}
+
+//*****************************************************************************
+bool sota_sign_key_load(const char *path, sota_sign_key_t &key, std::string &error)
+{
+static const uint8_t	exponent[3]	=	{ 0x01, 0x00, 0x01 };
+FILE					*file;
+char					line[256];
+char					*colon;
+std::string				label;
+std::vector<uint8_t>	modulus;
+std::vector<uint8_t>	privateExponent;
+unsigned long			publicExponent	=	0;
+uint8_t					probe[SOTA_SIGNATURE_SIZE];
+uint8_t					signature[SOTA_SIGNATURE_SIZE];
+uint8_t					check[SOTA_SIGNATURE_SIZE];
+bool					ok	=	true;
+
+	if (!(file = fopen(path, "r")))
+	{
+		error	=	std::string(path) + ": " + strerror(errno);
+		return false;
+	}
+	while (ok && fgets(line, sizeof(line), file))
+	{
+		if (!isspace((unsigned char)line[0]))
+		{
+			//*	"modulus:", "publicExponent: 65537 (0x10001)", "prime1:" ...
+			colon	=	strchr(line, ':');
+			label	=	colon ? std::string(line, colon - line) : std::string();
+			if (label == "publicExponent")
+			{
+				publicExponent	=	strtoul(colon + 1, NULL, 10);
+			}
+			continue;
+		}
+		if (label == "modulus")
+		{
+			ok	=	key_hex(line, modulus);
+		}
+		else if (label == "privateExponent")
+		{
+			ok	=	key_hex(line, privateExponent);
+		}
+	}
+	fclose(file);
+
+	if (!ok || !key_number(modulus, key.modulus) || !key_number(privateExponent, key.privateExponent))
+	{
+		error	=	std::string(path) + ": not the text of openssl rsa -text -noout";
+		return false;
+	}
+	if (!(key.modulus[0] & 0x80) || !(key.modulus[SOTA_SIGNATURE_SIZE - 1] & 1) || (publicExponent != 65537))
+	{
+		error	=	std::string(path) + ": not a 2048 bit RSA key with public exponent 65537";
+		return false;
+	}
+	//*	one signature and its check, the halves must belong together
+	memset(probe, 0, sizeof(probe));
+	probe[SOTA_SIGNATURE_SIZE - 1]	=	2;
+	rsa_power(signature, probe, key.privateExponent, SOTA_SIGNATURE_SIZE, key.modulus);
+	rsa_power(check, signature, exponent, sizeof(exponent), key.modulus);
+	if (memcmp(check, probe, SOTA_SIGNATURE_SIZE) != 0)
+	{
+		error	=	std::string(path) + ": the private exponent does not belong to the modulus";
+		return false;
+	}
+	return true;
+}
+
+//*****************************************************************************
+void sota_image_sign(const sota_sign_key_t &key, const uint8_t *data, size_t length, uint8_t *signature)
+{
+uint8_t	digest[32];
+uint8_t	encoded[SOTA_SIGNATURE_SIZE];
+
+	sota_sha256(data, length, digest);
+	rsa_encode(encoded, digest);
+	rsa_power(signature, encoded, key.privateExponent, SOTA_SIGNATURE_SIZE, key.modulus);
+}
+
+//*****************************************************************************
+static void key_array_print(FILE *out, const char *name, const uint8_t *bytes)
+{
+	fprintf(out, "static const unsigned char\t%s[%d]\t=\t{", name, SOTA_SIGNATURE_SIZE);
+	for (int ii=0; ii<SOTA_SIGNATURE_SIZE; ii++)
+	{
+		fprintf(out, "%s0x%02x%s", (ii % 16) ? " " : "\n\t", bytes[ii], (ii < (SOTA_SIGNATURE_SIZE - 1)) ? "," : " };\n");
+	}
+}
+
+//*****************************************************************************
+void sota_sign_key_header(const sota_sign_key_t &key, FILE *out)
+{
+rsa_number_t	n;
+rsa_number_t	rr;
+uint8_t			bytes[SOTA_SIGNATURE_SIZE];
+
+	rsa_from_bytes(n, key.modulus);
+	rsa_rr(rr, n);
+	rsa_to_bytes(bytes, rr);
+
+	fprintf(out,	"//**************************************************************************\n"
+					"//*\n"
+					"//* Title:\t\tImage signature key\n"
+					"//* Filename:\t\timage_key.h\n"
+					"//*\n"
+					"//* The RSA-2048 public key (e = 65537) stk500boot.c checks CMD_IMAGE_SIGNATURE\n"
+					"//* against with ENABLE_IMAGE_SIGNATURE, written by host/sota_upload -K.\n"
+					"//*\n"
+					"//**************************************************************************\n"
+					"\n"
+					"#ifndef _IMAGE_KEY_H_\n"
+					"#define _IMAGE_KEY_H_\n"
+					"\n"
+					"//*\tmodulus n, big endian\n");
+	key_array_print(out, "imageKeyModulus", key.modulus);
+	fprintf(out, "\n//*\tR^2 mod n with R = 2^2048, takes numbers into Montgomery form\n");
+	key_array_print(out, "imageKeyRR", bytes);
+	fprintf(out, "\n#endif\t//\t_IMAGE_KEY_H_\n");
+}
+
+//*****************************************************************************
+//*	SHA-256 (FIPS 180-4)
+
+static const uint32_t	sha256K[64]	=	{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#define	SHA_ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+//*****************************************************************************
+static void sha256_block(uint32_t *h, const uint8_t *block)
+{
+uint32_t	w[64];
+uint32_t	s[8];
+uint32_t	t1;
+uint32_t	t2;
+int			ii;
+
+	for (ii=0; ii<16; ii++)
+	{
+		w[ii]	=	((uint32_t)block[4 * ii] << 24) | ((uint32_t)block[4 * ii + 1] << 16) | ((uint32_t)block[4 * ii + 2] << 8) | block[4 * ii + 3];
+	}
+	for (ii=16; ii<64; ii++)
+	{
+		w[ii]	=	w[ii - 16] + (SHA_ROTR(w[ii - 15], 7) ^ SHA_ROTR(w[ii - 15], 18) ^ (w[ii - 15] >> 3))
+				+	w[ii - 7] + (SHA_ROTR(w[ii - 2], 17) ^ SHA_ROTR(w[ii - 2], 19) ^ (w[ii - 2] >> 10));
+	}
+	memcpy(s, h, sizeof(s));
+	for (ii=0; ii<64; ii++)
+	{
+		t1		=	s[7] + (SHA_ROTR(s[4], 6) ^ SHA_ROTR(s[4], 11) ^ SHA_ROTR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[ii] + w[ii];
+		t2		=	(SHA_ROTR(s[0], 2) ^ SHA_ROTR(s[0], 13) ^ SHA_ROTR(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(uint32_t));
+		s[4]	+=	t1;
+		s[0]	=	t1 + t2;
+	}
+	for (ii=0; ii<8; ii++)
+	{
+		h[ii]	+=	s[ii];
+	}
+}
+
+//*****************************************************************************
+void sota_sha256(const uint8_t *data, size_t length, uint8_t *digest)
+{
+uint32_t	h[8]	=	{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+uint8_t		tail[128];
+size_t		tailSize;
+uint64_t	bits	=	(uint64_t)length * 8;
+
+	for (; length >= 64; data+=64, length-=64)
+	{
+		sha256_block(h, data);
+	}
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data, length);
+	tail[length]	=	0x80;
+	tailSize		=	(length < 56) ? 64 : 128;
+	for (int ii=0; ii<8; ii++)
+	{
+		tail[tailSize - 1 - ii]	=	bits >> (8 * ii);
+	}
+	sha256_block(h, tail);
+	if (tailSize == 128)
+	{
+		sha256_block(h, tail + 64);
+	}
+	for (int ii=0; ii<32; ii++)
+	{
+		digest[ii]	=	h[ii / 4] >> (24 - 8 * (ii % 4));
+	}
+}
@@ -0,0 +1,230 @@
+//**************************************************************************
+//*
+//* Title:		Host side of the SOTA protocol
+//* Filename:		sota_client.h
+//*
+//* What a host needs to talk to stk500boot.c: AES-128 CBC (AES-NI where
+//* the CPU has it), the SOTA frame around the STK500 envelope, the chained
+//* session IVs, retransmission of lost or damaged frames, CMD_AUTH_FAST with the legacy CMD_AUTH/CMD_AUTH_SECOND_PHASE
+//* handshake as fallback, and a pipelined flash upload with statistics that
+//* can pick up where CMD_RESUME says an earlier one stopped, in place or
+//* staged in the second slot and activated.
+//* host/sota_upload.cpp is the command line front end.
+//*
+//* Frame on the wire, host to device and back:
+//*	SOTA_MESSAGE_START, size high, size low, AES-CBC(envelope padded with
+//*	0xFF to whole blocks), one pad byte
+//* Envelope:
+//*	MESSAGE_START, sequence number, length high, length low, TOKEN,
+//*	message, XOR checksum of everything before it
+//* Session chains:
+//*	a frame continues the chain from the last block of the frame before
+//*	it, its answer from the last block of the frame itself. Only frames the
+//*	bootloader takes move its chain, so a frame that got lost or damaged is
+//*	sent again byte for byte and one whose answer got lost is answered again.
+//*
+//**************************************************************************
+
+#ifndef _SOTA_CLIENT_H_
+#define _SOTA_CLIENT_H_
+
+#include	<cstddef>
+#include	<cstdint>
+#include	<cstdio>
+#include	<string>
+#include	<vector>
+#include	<sys/types.h>
+
+#define	SOTA_BLOCKLEN		16
+#define	SOTA_FRAME_MAX		288			//*	receivedPacket[] in the bootloader
+#define	SOTA_CHUNK_SIZE		256			//*	data bytes per CMD_PROGRAM_FLASH_ISP frame
+#define	SOTA_WINDOW_MAX		16
+
+//*****************************************************************************
+//*	AES-128
+
+class sota_aes_t
+{
+public:
+	void		key_expand(const uint8_t *key);
+	void		encrypt_block(uint8_t *block) const;
+	//*	in place, whole blocks, iv is the chain value in front of data
+	void		cbc_encrypt(uint8_t *data, size_t length, const uint8_t *iv) const;
+	void		cbc_decrypt(uint8_t *data, size_t length, const uint8_t *iv) const;
+
+	static bool	hardware(void);					//*	AES-NI in use
+	static void	hardware_disable(void);			//*	software only, for comparison
+
+private:
+	uint8_t		roundKey[176];
+	uint8_t		inverseKey[176];				//*	AES-NI equivalent inverse cipher
+};
+
+//*****************************************************************************
+//*	Byte stream to the bootloader
+
+class sota_link_t
+{
+public:
+	virtual			~sota_link_t() {}
+	virtual bool	send(const uint8_t *data, size_t length) = 0;
+	//*	what came in within timeoutMs, up to length bytes, 0 on timeout, -1 on error
+	virtual int		receive(uint8_t *data, size_t length, int timeoutMs) = 0;
+	//*	line rate in bytes per second, 0 if the link has none
+	virtual double	rate(void) const { return 0; }
+};
+
+//*	a serial port, a pty or a child process behind a pair of pipes
+class sota_fd_link_t : public sota_link_t
+{
+public:
+	static sota_fd_link_t	*open_serial(const char *path, unsigned long baudRate, std::string &error);
+	static sota_fd_link_t	*spawn(const char *program, std::string &error);
+
+	virtual			~sota_fd_link_t();
+	virtual bool	send(const uint8_t *data, size_t length);
+	virtual int		receive(uint8_t *data, size_t length, int timeoutMs);
+	virtual double	rate(void) const { return baudRate / 10.0; }
+
+private:
+					sota_fd_link_t(int input, int output, pid_t child, unsigned long baudRate);
+	int				input;
+	int				output;
+	pid_t			child;
+	unsigned long	baudRate;
+};
+
+//*****************************************************************************
+//*	Protocol
+
+struct sota_stats_t
+{
+	uint64_t		framesSent;
+	uint64_t		answers;
+	uint64_t		chunks;					//*	CMD_PROGRAM_FLASH_ISP frames answered
+	uint64_t		wireOut;				//*	bytes, SOTA framing included
+	uint64_t		wireIn;
+	uint64_t		payload;				//*	image bytes acknowledged
+	uint64_t		dataSent;				//*	image bytes sent, answered or not
+	uint64_t		retransmits;			//*	frames sent again after a timeout
+	uint64_t		resumed;				//*	bytes CMD_RESUME said the device already has
+	uint64_t		connectNs;
+	uint64_t		uploadNs;				//*	first CMD_PROGRAM_FLASH_ISP up to its last answer
+	uint64_t		commitNs;				//*	CMD_COMMIT_IMAGE, or the slot copy of CMD_ACTIVATE_SLOT
+	uint64_t		verifyNs;				//*	CMD_VERIFY_IMAGE
+	uint64_t		signNs;					//*	CMD_IMAGE_SIGNATURE
+	uint64_t		rttMinNs;				//*	send to answer of one program frame
+	uint64_t		rttMaxNs;
+	uint64_t		rttSumNs;
+	uint64_t		aesNs;					//*	host time in AES, both directions
+	unsigned int	window;
+	bool			session;				//*	CMD_AUTH_FAST session key
+};
+
+class sota_client_t
+{
+public:
+					sota_client_t(sota_link_t *link);
+
+	void			set_timeout(int milliSeconds)	{ timeoutMs = milliSeconds; }
+	//*	times a frame is sent again when no answer comes within the timeout
+	void			set_retries(int count)			{ retries = count; }
+	const std::string	&error(void) const			{ return lastError; }
+	const sota_stats_t	&stats(void) const			{ return statistics; }
+
+	//*	CMD_AUTH_FAST from counter on, retried above the device counter,
+	//*	the two phase handshake if the bootloader does not know it
+	bool			connect(uint32_t counter, bool legacyOnly);
+	//*	one command and its answer, the answer length or -1
+	int				command(const uint8_t *message, unsigned int length, uint8_t *answer);
+	//*	CMD_RESUME with the image CRC32 as its id, one flag per SOTA_CHUNK_SIZE
+	//*	chunk the device still needs, pageSize is its SPM_PAGESIZE
+	bool			resume(const std::vector<uint8_t> &image, unsigned int pageSize, std::vector<bool> &missing);
+	//*	CMD_SELECT_SLOT, 1 stages the next upload in slot B (ENABLE_DUAL_SLOT),
+	//*	0 goes back to programming the running image, base is where the slot starts
+	bool			select_slot(unsigned int slot, uint32_t *base = NULL);
+	//*	image from flash address 0 of the slot, window frames in flight, then
+	//*	CMD_COMMIT_IMAGE, or CMD_ACTIVATE_SLOT for a staged image, only the
+	//*	chunks flagged in missing if there is one
+	bool			upload(const std::vector<uint8_t> &image, unsigned int window, bool commit,
+							const std::vector<bool> *missing = NULL);
+	//*	upload() sends CMD_IMAGE_SIGNATURE with signature (SOTA_SIGNATURE_SIZE
+	//*	bytes, see sota_image_sign()) before it commits, NULL sends none
+	void			set_signature(const uint8_t *signature)	{ imageSignature = signature; }
+	//*	CMD_IMAGE_SIGNATURE for the first length bytes of the slot upload()
+	//*	wrote, the image may boot once the bootloader checked it (ENABLE_IMAGE_SIGNATURE)
+	bool			sign(size_t length, const uint8_t *signature);
+	//*	where upload() puts an image, slot B while it is staged, 0 otherwise
+	uint32_t		image_base(void) const			{ return staged ? slotBase : 0; }
+	//*	CMD_VERIFY_IMAGE, the CRC32 of length bytes of flash from address must
+	//*	be that of data (ENABLE_IMAGE_VERIFY)
+	bool			verify(uint32_t address, const uint8_t *data, size_t length);
+	bool			leave(void);
+	//*	the next frame of a stream nobody answers, the SPI flash staging area
+	//*	of ENABLE_SPIFLASH_STAGING; the frame size, frame holds 3 + SOTA_FRAME_MAX + 1
+	unsigned int	stream_frame(const uint8_t *message, unsigned int length, uint8_t *frame)
+										{ return frame_build(frame, message, length); }
+
+private:
+	unsigned int	frame_build(uint8_t *frame, const uint8_t *message, unsigned int length);
+	int				frame_receive(uint8_t *message);
+	unsigned int	chunk_frame(const std::vector<uint8_t> &image, size_t index, uint8_t *frame);
+	bool			upload_run(const std::vector<uint8_t> &image, size_t first, size_t count, unsigned int window);
+	bool			envelope_open(const sota_aes_t &key, const uint8_t *iv, const uint8_t *cipher,
+									unsigned int size, uint8_t seq, uint8_t *plain) const;
+	bool			link_send(const uint8_t *data, size_t length);
+	int				link_byte(void);
+	int				connect_fast(uint32_t counter);
+	bool			connect_legacy(void);
+	bool			fail(const char *format, ...);
+
+	sota_link_t		*link;
+	sota_aes_t		baseKey;
+	sota_aes_t		sessionKey;
+	bool			session;
+	bool			staged;					//*	slot B selected
+	uint32_t		slotBase;				//*	where CMD_SELECT_SLOT 1 said slot B starts
+	const uint8_t	*imageSignature;
+	uint8_t			txIv[SOTA_BLOCKLEN];	//*	the bootloader's rxIv
+	uint8_t			answerIv[256][SOTA_BLOCKLEN];	//*	the bootloader's txIv for the answer to each sequence number
+	uint8_t			txSeq;
+	uint8_t			rxSeq;					//*	oldest frame not answered yet
+	int				timeoutMs;
+	int				retries;
+	uint8_t			rxBuffer[4096];
+	size_t			rxHead;
+	size_t			rxTail;
+	std::string		lastError;
+	sota_stats_t	statistics;
+};
+
+//*****************************************************************************
+//*	Images
+
+//*	Intel HEX (by its ".hex" or ".ihex" name) or raw binary, hex images start at
+//*	address 0 and gaps are 0xFF; a plain number uploads that many pseudo random bytes
+bool		sota_image_load(const char *spec, std::vector<uint8_t> &image, std::string &error);
+uint32_t	sota_crc32(const uint8_t *data, size_t length);
+uint64_t	sota_now_ns(void);
+
+//*****************************************************************************
+//*	Image signatures, RSA-2048 PKCS#1 v1.5 with SHA-256 (ENABLE_IMAGE_SIGNATURE)
+
+#define	SOTA_SIGNATURE_SIZE		256
+
+//*	big endian, the public exponent is 65537
+struct sota_sign_key_t
+{
+	uint8_t		modulus[SOTA_SIGNATURE_SIZE];
+	uint8_t		privateExponent[SOTA_SIGNATURE_SIZE];
+};
+
+//*	what openssl rsa -text -noout prints for the key, checked by one signature
+bool		sota_sign_key_load(const char *path, sota_sign_key_t &key, std::string &error);
+//*	the signature openssl dgst -sha256 -sign makes of the image
+void		sota_image_sign(const sota_sign_key_t &key, const uint8_t *data, size_t length, uint8_t *signature);
+//*	image_key.h for stk500boot.c, the public half only
+void		sota_sign_key_header(const sota_sign_key_t &key, FILE *out);
+void		sota_sha256(const uint8_t *data, size_t length, uint8_t *digest);
+
+#endif	//	_SOTA_CLIENT_H_
@@ -0,0 +1,1333 @@
+//**************************************************************************
+//*
+//* Title:		Host tests of the bootloader
+//* Filename:		sota_test.cpp
+//*
+//* Drives the host build (make host) through host/sota_client.cpp and
+//* checks what ended up in its simulated flash. Every test starts the
+//* bootloader on a fresh flash file filled with a pattern, so pages the
+//* test never touched must come back unchanged and touched pages must
+//* hold exactly the data sent, whatever the order it came in.
+//*
+//*	sota_test -x host/sota_host [-P pagesize] [-k key] [-v] [test ...]
+//*
+//*	-P	SPM_PAGESIZE the host build was made with (make host HOST_PAGESIZE=)
+//*	-k	the signing key of image_key.h, host/image_key_dev.txt, for the
+//*		signed test against a build with ENABLE_IMAGE_SIGNATURE; without
+//*		it the signed test is skipped
+//*	-v	print the client statistics of every test
+//*
+//* Without test names all tests run. make host_test builds the host build
+//* and runs them, the exit code is the number of failed tests.
+//*
+//**************************************************************************
+
+#include	"sota_client.h"
+#include	"../command.h"
+#define	HOST_BUILD
+#include	"../spiflash.h"
+
+#include	<algorithm>
+#include	<cstdarg>
+#include	<cstdio>
+#include	<cstdlib>
+#include	<cstring>
+#include	<set>
+#include	<string>
+#include	<vector>
+#include	<unistd.h>
+
+#define	HOST_FLASH_SIZE		0x40000		//*	FLASHEND + 1 of host/hal_host.h
+#define	TEST_AREA			0x8000		//*	the tests write below this address
+
+static const char	*hostProgram;
+static unsigned int	pageSize	=	256;
+static bool			verbose		=	false;
+static std::string	flashFile;
+static std::string	eepromFile;
+static std::string	spiFlashFile;
+static std::string	failure;
+static const char	*signKeyFile;
+static sota_sign_key_t	signKey;
+
+//*****************************************************************************
+/*
+ * record why the current test failed, always false
+ */
+static bool fail(const char *format, ...)
+{
+char	text[256];
+va_list	args;
+
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	failure	=	text;
+	return false;
+}
+
+//*****************************************************************************
+static uint32_t test_random(uint32_t &seed)
+{
+	seed	^=	seed << 13;
+	seed	^=	seed >> 17;
+	seed	^=	seed << 5;
+	return seed;
+}
+
+//*****************************************************************************
+//*	The simulated part
+
+//*****************************************************************************
+/*
+ * a flash image that is neither erased nor anything the tests send
+ */
+static std::vector<uint8_t> flash_pattern(void)
+{
+std::vector<uint8_t>	flash(HOST_FLASH_SIZE);
+
+	for (size_t ii=0; ii<flash.size(); ii++)
+	{
+		flash[ii]	=	(ii * 7 + 3) & 0x7F;
+	}
+	return flash;
+}
+
+//*****************************************************************************
+static bool file_write(const std::string &fileName, const std::vector<uint8_t> &data)
+{
+FILE	*file	=	fopen(fileName.c_str(), "wb");
+bool	ok;
+
+	if (!file)
+	{
+		return fail("%s: cannot create", fileName.c_str());
+	}
+	ok	=	fwrite(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+	return ok ? true : fail("%s: short write", fileName.c_str());
+}
+
+//*****************************************************************************
+static bool file_read(const std::string &fileName, std::vector<uint8_t> &data, size_t size)
+{
+FILE	*file	=	fopen(fileName.c_str(), "rb");
+size_t	n;
+
+	data.assign(size, 0xFF);
+	if (!file)
+	{
+		return fail("%s: not written by the host build", fileName.c_str());
+	}
+	n	=	fread(data.data(), 1, size, file);
+	fclose(file);
+	return (n == size) ? true : fail("%s: %zu bytes instead of %zu", fileName.c_str(), n, size);
+}
+
+//*****************************************************************************
+/*
+ * fresh flash with the pattern and an erased EEPROM for the next test
+ */
+static bool part_reset(void)
+{
+	unlink(eepromFile.c_str());
+	unlink(spiFlashFile.c_str());
+	return file_write(flashFile, flash_pattern());
+}
+
+//*****************************************************************************
+/*
+ * the flash the host build saved against what it should hold
+ */
+static bool flash_check(const std::vector<uint8_t> &expect)
+{
+std::vector<uint8_t>	flash;
+
+	if (!file_read(flashFile, flash, HOST_FLASH_SIZE))
+	{
+		return false;
+	}
+	for (size_t ii=0; ii<flash.size(); ii++)
+	{
+		if (flash[ii] != expect[ii])
+		{
+			return fail("flash 0x%05zX is 0x%02X, expected 0x%02X", ii, flash[ii], expect[ii]);
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	A connection to the host build
+
+struct test_link_t
+{
+	sota_fd_link_t	*link;
+	sota_client_t	*client;
+
+	test_link_t() : link(NULL), client(NULL) {}
+	~test_link_t() { close(); }
+
+	//*	start the bootloader and authenticate
+	bool			open(void);
+	//*	end of the link, the host build saves flash and EEPROM and exits
+	void			close(void);
+};
+
+//*****************************************************************************
+bool test_link_t::open(void)
+{
+std::string	error;
+
+	close();
+	if (!(link = sota_fd_link_t::spawn(hostProgram, error)))
+	{
+		return fail("%s", error.c_str());
+	}
+	client	=	new sota_client_t(link);
+	client->set_timeout(2000);
+	if (!client->connect(1, false))
+	{
+		return fail("connect: %s", client->error().c_str());
+	}
+	return true;
+}
+
+//*****************************************************************************
+void test_link_t::close(void)
+{
+	delete client;
+	delete link;
+	client	=	NULL;
+	link	=	NULL;
+}
+
+//*****************************************************************************
+/*
+ * CMD_LOAD_ADDRESS and one CMD_PROGRAM_FLASH_ISP frame with data at address
+ */
+static bool program_at(sota_client_t &client, uint32_t address, const uint8_t *data, unsigned int length)
+{
+uint8_t	message[10 + SOTA_CHUNK_SIZE];
+uint8_t	answer[SOTA_FRAME_MAX];
+int		n;
+
+	message[0]	=	CMD_LOAD_ADDRESS;
+	message[1]	=	(address >> 1) >> 24;
+	message[2]	=	(address >> 1) >> 16;
+	message[3]	=	(address >> 1) >> 8;
+	message[4]	=	address >> 1;
+	if (((n = client.command(message, 5, answer)) != 2) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_LOAD_ADDRESS 0x%05X: %s", address, (n < 0) ? client.error().c_str() : "refused");
+	}
+	memset(message, 0, 10);
+	message[0]	=	CMD_PROGRAM_FLASH_ISP;
+	message[1]	=	length >> 8;
+	message[2]	=	length & 0xFF;
+	memcpy(message + 10, data, length);
+	if (((n = client.command(message, 10 + length, answer)) != 2) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_PROGRAM_FLASH_ISP 0x%05X+%u: %s", address, length, (n < 0) ? client.error().c_str() : "refused");
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	Program order
+
+struct test_chunk_t
+{
+	uint32_t		address;
+	unsigned int	length;
+};
+
+//*****************************************************************************
+/*
+ * send the chunks of image in the given order, then compare the flash with
+ * what SPM semantics allow: every page a chunk touched is erased once and
+ * holds the chunk data, every other page keeps the pattern
+ */
+static bool program_chunks(const std::vector<uint8_t> &image, const std::vector<test_chunk_t> &chunks)
+{
+std::vector<uint8_t>	expect	=	flash_pattern();
+test_link_t				test;
+size_t					ii;
+uint32_t				page;
+
+	for (ii=0; ii<chunks.size(); ii++)
+	{
+		for (page = chunks[ii].address & ~(pageSize - 1); page < (chunks[ii].address + chunks[ii].length); page += pageSize)
+		{
+			memset(&expect[page], 0xFF, pageSize);
+		}
+	}
+	for (ii=0; ii<chunks.size(); ii++)
+	{
+		memcpy(&expect[chunks[ii].address], &image[chunks[ii].address], chunks[ii].length);
+	}
+
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	for (ii=0; ii<chunks.size(); ii++)
+	{
+		if (!program_at(*test.client, chunks[ii].address, &image[chunks[ii].address], chunks[ii].length))
+		{
+			return false;
+		}
+	}
+	if (verbose)
+	{
+		printf("    %llu frames, %llu bytes out\n", (unsigned long long)test.client->stats().framesSent,
+				(unsigned long long)test.client->stats().wireOut);
+	}
+	test.close();
+	return flash_check(expect);
+}
+
+//*****************************************************************************
+/*
+ * the test area cut into chunks of random even length, 2 up to
+ * SOTA_CHUNK_SIZE bytes, so they start and end anywhere within a page
+ */
+static std::vector<test_chunk_t> chunks_random(uint32_t seed, uint32_t end)
+{
+std::vector<test_chunk_t>	chunks;
+test_chunk_t				chunk;
+uint32_t					address	=	0;
+
+	while (address < end)
+	{
+		chunk.address	=	address;
+		chunk.length	=	2 + 2 * (test_random(seed) % (SOTA_CHUNK_SIZE / 2));
+		if ((address + chunk.length) > end)
+		{
+			chunk.length	=	end - address;
+		}
+		chunks.push_back(chunk);
+		address	+=	chunk.length;
+	}
+	return chunks;
+}
+
+//*****************************************************************************
+static std::vector<uint8_t> image_random(uint32_t seed, size_t size)
+{
+std::vector<uint8_t>	image(size);
+
+	for (size_t ii=0; ii<size; ii++)
+	{
+		image[ii]	=	test_random(seed);
+	}
+	return image;
+}
+
+//*****************************************************************************
+/*
+ * pages written in a random order, several frames per page arriving apart
+ */
+static bool test_shuffled(void)
+{
+std::vector<uint8_t>		image	=	image_random(0x1234567, TEST_AREA);
+std::vector<test_chunk_t>	chunks	=	chunks_random(0xBADC0DE, TEST_AREA);
+uint32_t					seed	=	0x600DF00D;
+size_t						ii;
+
+	for (ii=chunks.size() - 1; ii>0; ii--)		//*	Fisher-Yates
+	{
+		std::swap(chunks[ii], chunks[test_random(seed) % (ii + 1)]);
+	}
+	return program_chunks(image, chunks);
+}
+
+//*****************************************************************************
+/*
+ * the image back to front, every page is entered from its end first
+ */
+static bool test_descending(void)
+{
+std::vector<uint8_t>		image	=	image_random(0x7654321, TEST_AREA);
+std::vector<test_chunk_t>	chunks	=	chunks_random(0xC0FFEE, TEST_AREA);
+
+	std::reverse(chunks.begin(), chunks.end());
+	return program_chunks(image, chunks);
+}
+
+//*****************************************************************************
+/*
+ * a sparse delta, every third chunk in a random order, the pages in
+ * between keep what was there
+ */
+static bool test_sparse(void)
+{
+std::vector<uint8_t>		image	=	image_random(0xABCDEF, TEST_AREA);
+std::vector<test_chunk_t>	all		=	chunks_random(0x5EED, TEST_AREA);
+std::vector<test_chunk_t>	chunks;
+uint32_t					seed	=	0xFACE;
+size_t						ii;
+
+	for (ii=0; ii<all.size(); ii+=3)
+	{
+		chunks.push_back(all[ii]);
+	}
+	for (ii=chunks.size() - 1; ii>0; ii--)
+	{
+		std::swap(chunks[ii], chunks[test_random(seed) % (ii + 1)]);
+	}
+	return program_chunks(image, chunks);
+}
+
+//*****************************************************************************
+//*	Resumed uploads
+
+//*****************************************************************************
+/*
+ * half an image, the link drops and the bootloader restarts, CMD_RESUME must
+ * then ask for exactly the other half; a different image starts over
+ */
+static bool test_resume(void)
+{
+std::vector<uint8_t>	image	=	image_random(0x2EE5, TEST_AREA);
+std::vector<uint8_t>	expect	=	flash_pattern();
+size_t					chunkCount	=	TEST_AREA / SOTA_CHUNK_SIZE;
+std::vector<bool>		firstHalf(chunkCount, false);
+std::vector<bool>		missing;
+test_link_t				test;
+size_t					ii;
+
+	for (ii=0; ii<chunkCount / 2; ii++)
+	{
+		firstHalf[ii]	=	true;
+	}
+	memcpy(expect.data(), image.data(), image.size());
+
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	if (!test.client->resume(image, pageSize, missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if (std::count(missing.begin(), missing.end(), true) != (long)chunkCount)
+	{
+		return fail("CMD_RESUME of a new image reports pages as sent");
+	}
+	if (!test.client->upload(image, 1, false, &firstHalf))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+
+	if (!test.open())
+	{
+		return false;
+	}
+	if (!test.client->resume(image, pageSize, missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	for (ii=0; ii<chunkCount; ii++)
+	{
+		if (missing[ii] == firstHalf[ii])
+		{
+			return fail("after the restart CMD_RESUME %s chunk %zu", missing[ii] ? "asks again for" : "skips", ii);
+		}
+	}
+	if (!test.client->upload(image, 4, false, &missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if (verbose)
+	{
+		printf("    %llu bytes resumed, %llu sent after the restart\n", (unsigned long long)test.client->stats().resumed,
+				(unsigned long long)test.client->stats().dataSent);
+	}
+	image[0]	^=	0xFF;
+	if (!test.client->resume(image, pageSize, missing) || (std::count(missing.begin(), missing.end(), false) != 0))
+	{
+		return fail("CMD_RESUME of another image does not start over");
+	}
+	test.close();
+	return flash_check(expect);
+}
+
+//*****************************************************************************
+/*
+ * 64 byte frames, the link drops with a page half written: a page only
+ * counts as sent once all of it came, so CMD_RESUME asks for that one again
+ */
+static bool test_resume_frames(void)
+{
+std::vector<uint8_t>	image	=	image_random(0xF4A3, TEST_AREA);
+std::vector<uint8_t>	expect	=	flash_pattern();
+size_t					chunkCount	=	TEST_AREA / SOTA_CHUNK_SIZE;
+uint32_t				half		=	TEST_AREA / 2;
+std::vector<bool>		missing;
+test_link_t				test;
+uint32_t				address;
+
+	memcpy(expect.data(), image.data(), image.size());
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	if (!test.client->resume(image, pageSize, missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	for (address=0; address<(half + 64); address+=64)
+	{
+		if (!program_at(*test.client, address, &image[address], 64))
+		{
+			return false;
+		}
+	}
+
+	if (!test.open())
+	{
+		return false;
+	}
+	if (!test.client->resume(image, pageSize, missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	for (size_t ii=0; ii<chunkCount; ii++)
+	{
+		if (missing[ii] != ((ii * SOTA_CHUNK_SIZE) >= half))
+		{
+			return fail("after the restart CMD_RESUME %s chunk %zu", missing[ii] ? "asks again for" : "skips", ii);
+		}
+	}
+	if (!test.client->upload(image, 1, false, &missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	test.close();
+	return flash_check(expect);
+}
+
+//*****************************************************************************
+/*
+ * the pattern has no trailer and boots; an upload over it that stops half
+ * way must not boot after a restart, nor before CMD_COMMIT_IMAGE finished it
+ */
+static bool test_interrupted(void)
+{
+std::vector<uint8_t>	image	=	image_random(0x1E77, TEST_AREA);
+std::vector<bool>		missing;
+test_link_t				test;
+
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	if (!test.client->leave())
+	{
+		return fail("the untrailered pattern: %s", test.client->error().c_str());
+	}
+	if (!test.open() || !program_at(*test.client, 0, image.data(), SOTA_CHUNK_SIZE))
+	{
+		return false;
+	}
+
+	if (!test.open())
+	{
+		return false;
+	}
+	if (test.client->leave())
+	{
+		return fail("an upload that stopped half way boots after a restart");
+	}
+	missing.assign(TEST_AREA / SOTA_CHUNK_SIZE, true);
+	missing[0]	=	false;
+	if (!test.client->upload(image, 1, false, &missing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if (test.client->leave())
+	{
+		return fail("an upload boots before CMD_COMMIT_IMAGE");
+	}
+	missing.assign(TEST_AREA / SOTA_CHUNK_SIZE, false);
+	if (!test.client->upload(image, 1, true, &missing) || !test.client->leave())
+	{
+		return fail("committed: %s", test.client->error().c_str());
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	Slot staging
+
+//*****************************************************************************
+/*
+ * a CMD_AUTH_FAST with a stale counter, one with a wrong MAC and a wrong
+ * CMD_AUTH_TICKET are refused, and the session they came in keeps working;
+ * a CMD_AUTH_SECOND_PHASE with the token but a wrong answer to the
+ * challenge is refused and leaves the bootloader unauthenticated, which
+ * may not read the EEPROM
+ */
+static bool test_auth(void)
+{
+static const uint8_t	authToken[4]	=	{0x53, 0xef, 0x34, 0x23};	//*	authenticationPreSharedToken
+std::vector<uint8_t>	flash	=	flash_pattern();
+uint8_t					message[5 + SOTA_BLOCKLEN];
+uint8_t					answer[SOTA_FRAME_MAX];
+test_link_t				test;
+int						n;
+
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	memset(message, 0, sizeof(message));
+	message[0]	=	CMD_AUTH_FAST;
+	message[4]	=	1;						//*	the counter test.open() used
+	if (((n = test.client->command(message, sizeof(message), answer)) != 6) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_AUTH_FAST with a used counter: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	message[1]	=	0x7F;
+	if (((n = test.client->command(message, sizeof(message), answer)) != 6) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_AUTH_FAST with a wrong MAC: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	message[0]	=	CMD_AUTH_TICKET;
+	if (((n = test.client->command(message, 1 + SOTA_BLOCKLEN, answer)) != 2) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_AUTH_TICKET with a wrong ticket: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	if (!test.client->verify(0, flash.data(), TEST_AREA))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	memset(message, 0, sizeof(message));
+	message[0]	=	CMD_READ_EEPROM_ISP;
+	message[2]	=	4;
+	if (((n = test.client->command(message, 3, answer)) != 7) || (answer[1] != STATUS_CMD_OK))
+	{
+		return fail("CMD_READ_EEPROM_ISP: %s", (n < 0) ? test.client->error().c_str() : "refused");
+	}
+	//*	sizes the answer or the request cannot hold
+	message[0]	=	CMD_READ_FLASH_ISP;
+	message[1]	=	0x04;
+	message[2]	=	0x00;
+	if (((n = test.client->command(message, 4, answer)) != 2) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_READ_FLASH_ISP of 1024 bytes: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	message[0]	=	CMD_READ_EEPROM_ISP;
+	message[1]	=	0;
+	if (((n = test.client->command(message, 3, answer)) != 2) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_READ_EEPROM_ISP of 0 bytes: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	message[0]	=	CMD_PROGRAM_FLASH_ISP;
+	message[1]	=	0x01;
+	if (((n = test.client->command(message, 12, answer)) != 2) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_PROGRAM_FLASH_ISP of 256 bytes in a 12 byte request: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	memset(message, 0, sizeof(message));
+
+	memset(message, 0, sizeof(message));
+	message[0]	=	CMD_AUTH;
+	memcpy(message + 5, authToken, 4);
+	if (((n = test.client->command(message, 9, answer)) != 9) || (answer[0] != STATUS_CMD_OK))
+	{
+		return fail("CMD_AUTH: %s", (n < 0) ? test.client->error().c_str() : "refused");
+	}
+	message[0]	=	CMD_AUTH_SECOND_PHASE;
+	if (((n = test.client->command(message, 9, answer)) != 2) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_AUTH_SECOND_PHASE with a wrong answer: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	if (test.client->verify(0, flash.data(), TEST_AREA))
+	{
+		return fail("CMD_VERIFY_IMAGE answered after a failed CMD_AUTH_SECOND_PHASE");
+	}
+	message[0]	=	CMD_READ_EEPROM_ISP;
+	message[1]	=	0;
+	message[2]	=	4;
+	if (((n = test.client->command(message, 3, answer)) != 2) || (answer[1] != STATUS_CMD_FAILED))
+	{
+		return fail("CMD_READ_EEPROM_ISP unauthenticated: %s", (n < 0) ? test.client->error().c_str() : "not refused");
+	}
+	return true;
+}
+
+//*****************************************************************************
+/*
+ * CMD_SELECT_SLOT 1, the image into slot B, CMD_VERIFY_IMAGE there, and
+ * the running image must not have changed; neither a staged nor an in
+ * place frame may write past its slot; after a restart
+ * CMD_ACTIVATE_SLOT copies slot B over it, trailer page included
+ */
+static bool test_staged(void)
+{
+std::vector<uint8_t>	image	=	image_random(0x51075, TEST_AREA);
+std::vector<uint8_t>	expect	=	flash_pattern();
+std::vector<uint8_t>	flash;
+std::vector<bool>		nothingMissing(image.size() / SOTA_CHUNK_SIZE, false);
+uint32_t				base;
+uint32_t				trailer;
+test_link_t				test;
+
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	if (!test.client->select_slot(1, &base) || !test.client->upload(image, 4, false))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if ((base < TEST_AREA) || (base & (pageSize - 1)))
+	{
+		return fail("CMD_SELECT_SLOT 1 answers slot B at 0x%05X", base);
+	}
+	if ((test.client->image_base() != base) || !test.client->verify(base, image.data(), image.size()))
+	{
+		return fail("slot B at 0x%05X: %s", base, test.client->error().c_str());
+	}
+	if (program_at(*test.client, base, image.data(), 64))
+	{
+		return fail("CMD_PROGRAM_FLASH_ISP past the end of slot B was taken");
+	}
+	test.close();
+	memcpy(&expect[base], image.data(), image.size());
+	if (!flash_check(expect))
+	{
+		return false;
+	}
+
+	//*	a restart selects slot A again, activation reads slot B anyway
+	if (!test.open())
+	{
+		return false;
+	}
+	if (program_at(*test.client, base, image.data(), 64))
+	{
+		return fail("CMD_PROGRAM_FLASH_ISP in place over slot B was taken");
+	}
+	if (!test.client->select_slot(1) || !test.client->upload(image, 1, true, &nothingMissing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if ((test.client->image_base() != 0) || !test.client->verify(0, image.data(), image.size()))
+	{
+		return fail("activated image: %s", test.client->error().c_str());
+	}
+	test.close();
+
+	//*	ENABLE_APP_TRAILER leaves the trailer in the last page of slot B, activation copies it
+	memcpy(expect.data(), image.data(), image.size());
+	trailer	=	base - pageSize;
+	if (!file_read(flashFile, flash, HOST_FLASH_SIZE))
+	{
+		return false;
+	}
+	if (memcmp(&flash[trailer], &flash[base + trailer], pageSize) != 0)
+	{
+		return fail("the trailer page at 0x%05X is not a copy of slot B's", trailer);
+	}
+	memcpy(&expect[trailer], &flash[trailer], pageSize);
+	memcpy(&expect[base + trailer], &flash[trailer], pageSize);
+	return flash_check(expect);
+}
+
+//*****************************************************************************
+//*	Signed images
+
+//*****************************************************************************
+/*
+ * against a build with ENABLE_IMAGE_SIGNATURE: an image without its
+ * signature, with one a bit off or one of other data must not boot, with
+ * its own it must, whether the digest was streamed or the pages came back
+ * to front and it is taken from flash; a staged image is not activated
+ * before its signature checked out
+ */
+static bool test_signed(void)
+{
+std::vector<uint8_t>		image	=	image_random(0x516E, TEST_AREA - 3);
+std::vector<uint8_t>		update	=	image_random(0x516F, TEST_AREA);
+std::vector<test_chunk_t>	chunks	=	chunks_random(0xDE5C, TEST_AREA);
+std::vector<bool>			nothingMissing(TEST_AREA / SOTA_CHUNK_SIZE, false);
+uint8_t						signature[SOTA_SIGNATURE_SIZE];
+uint8_t						wrong[SOTA_SIGNATURE_SIZE];
+test_link_t					test;
+
+	sota_image_sign(signKey, image.data(), image.size(), signature);
+	if (!part_reset() || !test.open())
+	{
+		return false;
+	}
+	if (!test.client->upload(image, 4, true))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if (test.client->leave())
+	{
+		return fail("an image without a signature boots");
+	}
+	memcpy(wrong, signature, sizeof(wrong));
+	wrong[100]	^=	0x10;
+	if (test.client->sign(image.size(), wrong))
+	{
+		return fail("CMD_IMAGE_SIGNATURE took a signature one bit off");
+	}
+	sota_image_sign(signKey, image.data(), image.size() - 1, wrong);
+	if (test.client->sign(image.size(), wrong))
+	{
+		return fail("CMD_IMAGE_SIGNATURE took the signature of one byte less");
+	}
+	if (test.client->leave())
+	{
+		return fail("an image whose signatures were refused boots");
+	}
+	if (!test.client->sign(image.size(), signature) || !test.client->leave())
+	{
+		return fail("signed image: %s", test.client->error().c_str());
+	}
+	test.close();
+
+	//*	a new upload takes that back until its own signature came
+	std::reverse(chunks.begin(), chunks.end());
+	sota_image_sign(signKey, update.data(), update.size(), signature);
+	if (!test.open())
+	{
+		return false;
+	}
+	for (size_t ii=0; ii<chunks.size(); ii++)
+	{
+		if (!program_at(*test.client, chunks[ii].address, &update[chunks[ii].address], chunks[ii].length))
+		{
+			return false;
+		}
+	}
+	if (!test.client->upload(update, 1, true, &nothingMissing))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if (test.client->leave())
+	{
+		return fail("an image programmed over a signed one boots without a signature");
+	}
+	if (!test.client->sign(update.size(), signature) || !test.client->leave())
+	{
+		return fail("image programmed back to front: %s", test.client->error().c_str());
+	}
+	test.close();
+
+	//*	staged, CMD_ACTIVATE_SLOT waits for the signature of slot B
+	sota_image_sign(signKey, image.data(), image.size(), signature);
+	if (!test.open())
+	{
+		return false;
+	}
+	if (!test.client->select_slot(1) || !test.client->upload(image, 4, false))
+	{
+		return fail("%s", test.client->error().c_str());
+	}
+	if (test.client->upload(image, 1, true, &nothingMissing))
+	{
+		return fail("CMD_ACTIVATE_SLOT copied an image without a signature");
+	}
+	test.client->set_signature(signature);
+	if (!test.client->upload(image, 1, true, &nothingMissing) || !test.client->verify(0, image.data(), image.size())
+		|| !test.client->leave())
+	{
+		return fail("staged image: %s", test.client->error().c_str());
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	SPI flash staging
+
+//*****************************************************************************
+static void put_be32(uint8_t *p, uint32_t value)
+{
+	p[0]	=	value >> 24;
+	p[1]	=	value >> 16;
+	p[2]	=	value >> 8;
+	p[3]	=	value;
+}
+
+//*****************************************************************************
+/*
+ * the frames of message appended to the stream
+ */
+static void stream_add(sota_client_t &client, std::vector<uint8_t> &stream, const uint8_t *message, unsigned int length)
+{
+uint8_t			frame[3 + SOTA_FRAME_MAX + 1];
+unsigned int	size	=	client.stream_frame(message, length, frame);
+
+	stream.insert(stream.end(), frame, frame + size);
+}
+
+//*****************************************************************************
+/*
+ * what the application leaves in SPI flash: header page, then an upload as
+ * frames, committed and ended with CMD_LEAVE_PROGMODE_ISP
+ */
+static std::vector<uint8_t> staging_area(const std::vector<uint8_t> &image, bool corrupt)
+{
+sota_client_t			client(NULL);
+std::vector<uint8_t>	stream;
+std::vector<uint8_t>	area(SPIFLASH_PAGE_SIZE, 0xFF);
+uint8_t					message[10 + SOTA_CHUNK_SIZE];
+uint32_t				crc		=	sota_crc32(image.data(), image.size());
+size_t					offset;
+unsigned int			chunk;
+
+	memset(message, 0, 5);
+	message[0]	=	CMD_LOAD_ADDRESS;
+	stream_add(client, stream, message, 5);
+	for (offset=0; offset<image.size(); offset+=chunk)
+	{
+		chunk		=	std::min((size_t)SOTA_CHUNK_SIZE, image.size() - offset);
+		memset(message, 0, 10);
+		message[0]	=	CMD_PROGRAM_FLASH_ISP;
+		message[1]	=	chunk >> 8;
+		message[2]	=	chunk & 0xFF;
+		memcpy(message + 10, &image[offset], chunk);
+		stream_add(client, stream, message, 10 + chunk);
+	}
+	message[0]	=	CMD_COMMIT_IMAGE;
+	put_be32(message + 1, image.size());
+	put_be32(message + 5, crc);
+	stream_add(client, stream, message, 9);
+	message[0]	=	CMD_LEAVE_PROGMODE_ISP;
+	message[1]	=	message[2]	=	0;
+	stream_add(client, stream, message, 3);
+
+	put_be32(&area[SOTA_STAGING_OFFSET_MAGIC], SOTA_STAGING_MAGIC);
+	put_be32(&area[SOTA_STAGING_OFFSET_LENGTH], stream.size());
+	put_be32(&area[SOTA_STAGING_OFFSET_CRC], sota_crc32(stream.data(), stream.size()));
+	area[SOTA_STAGING_OFFSET_STATE]	=	SOTA_STAGING_STATE_READY;
+	if (corrupt)
+	{
+		stream[stream.size() / 2]	^=	0x01;		//*	a write cut short by a reset
+	}
+	area.insert(area.end(), stream.begin(), stream.end());
+	return area;
+}
+
+//*****************************************************************************
+/*
+ * a staged stream is replayed at boot without a host and marked consumed;
+ * one whose CRC32 does not match is left alone
+ */
+static bool test_spiflash(void)
+{
+std::vector<uint8_t>	image	=	image_random(0x5F1A5, TEST_AREA / 2);
+std::vector<uint8_t>	expect	=	flash_pattern();
+std::vector<uint8_t>	area;
+std::vector<uint8_t>	flash;
+test_link_t				test;
+int						pass;
+
+	for (pass=0; pass<2; pass++)
+	{
+		area	=	staging_area(image, pass == 0);
+		if (!part_reset() || !file_write(spiFlashFile, area))
+		{
+			return false;
+		}
+		//*	a bad stream leaves the bootloader waiting for a host, a replay ends in the application
+		if (!test.open())
+		{
+			if (pass == 1)
+			{
+				failure.clear();
+			}
+			else
+			{
+				return false;
+			}
+		}
+		test.close();
+		if (!file_read(spiFlashFile, area, SPIFLASH_PAGE_SIZE) || !file_read(flashFile, flash, HOST_FLASH_SIZE))
+		{
+			return false;
+		}
+		if (pass == 0)
+		{
+			if (area[SOTA_STAGING_OFFSET_STATE] != SOTA_STAGING_STATE_READY)
+			{
+				return fail("a stream with a bad CRC32 was marked 0x%02X", area[SOTA_STAGING_OFFSET_STATE]);
+			}
+			if (memcmp(flash.data(), expect.data(), TEST_AREA) != 0)
+			{
+				return fail("a stream with a bad CRC32 was replayed");
+			}
+		}
+		else if (area[SOTA_STAGING_OFFSET_STATE] != SOTA_STAGING_STATE_CONSUMED)
+		{
+			return fail("the replayed stream is still marked 0x%02X", area[SOTA_STAGING_OFFSET_STATE]);
+		}
+	}
+	memcpy(expect.data(), image.data(), image.size());
+	if (memcmp(flash.data(), expect.data(), TEST_AREA) != 0)
+	{
+		for (size_t ii=0; ii<TEST_AREA; ii++)
+		{
+			if (flash[ii] != expect[ii])
+			{
+				return fail("after the replay flash 0x%05zX is 0x%02X, expected 0x%02X", ii, flash[ii], expect[ii]);
+			}
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	Faults on the link
+
+//*	frames by their number after arm(), and one byte of the answers
+struct test_fault_link_t : public sota_link_t
+{
+	sota_link_t		*link;
+	bool			armed;
+	unsigned int	frame;
+	unsigned int	corruptFrame;			//*	one bit flipped in the middle
+	unsigned int	dropFrame;				//*	never arrives
+	unsigned int	repeatFrame;			//*	arrives twice
+	uint64_t		received;
+	uint64_t		corruptAnswerByte;		//*	counted from arm()
+
+	test_fault_link_t(sota_link_t *link, unsigned int corruptFrame, unsigned int dropFrame, unsigned int repeatFrame,
+						uint64_t corruptAnswerByte)
+		: link(link), armed(false), frame(0), corruptFrame(corruptFrame), dropFrame(dropFrame), repeatFrame(repeatFrame),
+		  received(0), corruptAnswerByte(corruptAnswerByte) {}
+
+	void			arm(void)	{ armed = true; }
+
+	virtual bool send(const uint8_t *data, size_t length)
+	{
+		std::vector<uint8_t>	copy(data, data + length);
+
+		if (!armed)
+		{
+			return link->send(data, length);
+		}
+		frame++;
+		if (frame == dropFrame)
+		{
+			return true;
+		}
+		if (frame == corruptFrame)
+		{
+			copy[length / 2]	^=	0x10;
+		}
+		if ((frame == repeatFrame) && !link->send(copy.data(), length))
+		{
+			return false;
+		}
+		return link->send(copy.data(), length);
+	}
+
+	virtual int receive(uint8_t *data, size_t length, int timeoutMs)
+	{
+		int	n	=	link->receive(data, length, timeoutMs);
+
+		if (armed && (n > 0))
+		{
+			if ((corruptAnswerByte >= received) && (corruptAnswerByte < (received + n)))
+			{
+				data[corruptAnswerByte - received]	^=	0x10;
+			}
+			received	+=	n;
+		}
+		return n;
+	}
+};
+
+//*****************************************************************************
+/*
+ * an upload that loses a frame, gets one damaged, one twice and one answer
+ * damaged must still complete by sending frames again, with and without a
+ * session, in lock step and with frames in flight
+ */
+static bool test_faults(void)
+{
+std::vector<uint8_t>	image	=	image_random(0xFA017, TEST_AREA);
+std::vector<uint8_t>	expect	=	flash_pattern();
+std::string				error;
+sota_fd_link_t			*link;
+sota_client_t			*client;
+test_fault_link_t		*faults;
+unsigned int			window;
+int						pass;
+bool					ok;
+
+	memcpy(expect.data(), image.data(), image.size());
+	for (pass=0; pass<4; pass++)
+	{
+		window	=	(pass & 1) ? 4 : 1;
+		if (!part_reset() || !(link = sota_fd_link_t::spawn(hostProgram, error)))
+		{
+			return fail("%s", error.c_str());
+		}
+		faults	=	new test_fault_link_t(link, 5, 12, 20, 30 * 20 + 10);
+		client	=	new sota_client_t(faults);
+		client->set_timeout(200);
+		ok		=	client->connect(1, pass >= 2);
+		faults->arm();
+		ok		=	ok && client->upload(image, window, false);
+		if (!ok)
+		{
+			fail("%s, window %u: %s", (pass >= 2) ? "CMD_AUTH" : "CMD_AUTH_FAST", window, client->error().c_str());
+		}
+		else if (verbose)
+		{
+			printf("    window %u%s: %llu frames sent again\n", window, (pass >= 2) ? ", no session" : "",
+					(unsigned long long)client->stats().retransmits);
+		}
+		delete client;
+		delete faults;
+		delete link;
+		if (!ok || !flash_check(expect))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	the first answer to every frame is lost, the one to its repeat arrives
+struct test_answer_drop_link_t : public sota_link_t
+{
+	sota_link_t						*link;
+	std::set<std::vector<uint8_t> >	sent;
+	unsigned int					dropsPending;	//*	answers still to lose
+	unsigned int					dropped;
+	bool							dropping;		//*	inside an answer being lost
+	unsigned int					header;			//*	start byte and size still to come
+	unsigned int					remaining;		//*	bytes of the answer still to come
+
+	test_answer_drop_link_t(sota_link_t *link)
+		: link(link), dropsPending(0), dropped(0), dropping(false), header(0), remaining(0) {}
+
+	virtual bool send(const uint8_t *data, size_t length)
+	{
+		if (sent.insert(std::vector<uint8_t>(data, data + length)).second)
+		{
+			dropsPending++;
+		}
+		return link->send(data, length);
+	}
+
+	virtual int receive(uint8_t *data, size_t length, int timeoutMs)
+	{
+		int	n;
+		int	kept;
+
+		do
+		{
+			if ((n = link->receive(data, length, timeoutMs)) <= 0)
+			{
+				return n;
+			}
+			kept	=	0;
+			for (int ii=0; ii<n; ii++)
+			{
+				if ((header == 0) && (remaining == 0))
+				{
+					//*	an answer starts
+					header		=	3;
+					dropping	=	(dropsPending > 0);
+					if (dropping)
+					{
+						dropsPending--;
+						dropped++;
+					}
+				}
+				if (header > 0)
+				{
+					header--;
+					if (header < 2)
+					{
+						remaining	=	(remaining << 8) | data[ii];
+					}
+				}
+				else
+				{
+					remaining--;
+				}
+				if (!dropping)
+				{
+					data[kept++]	=	data[ii];
+				}
+			}
+		} while (kept == 0);
+		return kept;
+	}
+};
+
+//*****************************************************************************
+/*
+ * every command loses its first answer, the handshakes included: the
+ * bootloader has to send the same answer again for the repeat without
+ * running the command twice, or the handshake counter, the session and
+ * the upload would move on under the host
+ */
+static bool test_answers(void)
+{
+std::vector<uint8_t>	image	=	image_random(0xA115, TEST_AREA / 8);	//*	every lost answer costs a timeout
+std::string				error;
+sota_fd_link_t			*link;
+sota_client_t			*client;
+test_answer_drop_link_t	*drops;
+unsigned int			window;
+int						pass;
+bool					ok;
+
+	for (pass=0; pass<3; pass++)
+	{
+		window	=	(pass == 1) ? 4 : 1;
+		if (!part_reset() || !(link = sota_fd_link_t::spawn(hostProgram, error)))
+		{
+			return fail("%s", error.c_str());
+		}
+		drops	=	new test_answer_drop_link_t(link);
+		client	=	new sota_client_t(drops);
+		client->set_timeout(100);
+		ok		=	client->connect(1, pass == 2) && client->upload(image, window, true)
+					&& client->verify(0, image.data(), image.size());
+		if (!ok)
+		{
+			fail("%s, window %u: %s", (pass == 2) ? "CMD_AUTH" : "CMD_AUTH_FAST", window, client->error().c_str());
+		}
+		else if (verbose)
+		{
+			printf("    window %u%s: %u answers lost, %llu frames sent again\n", window, (pass == 2) ? ", no session" : "",
+					drops->dropped, (unsigned long long)client->stats().retransmits);
+		}
+		delete client;
+		delete drops;
+		delete link;
+		if (!ok)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+//*	Test list
+
+static const struct
+{
+	const char	*name;
+	bool		(*run)(void);
+	bool		needsKey;			//*	-k
+} tests[]	=	{
+	{ "shuffled",		test_shuffled,		false },
+	{ "descending",		test_descending,	false },
+	{ "sparse",			test_sparse,		false },
+	{ "resume",			test_resume,		false },
+	{ "resume_frames",	test_resume_frames,	false },
+	{ "interrupted",	test_interrupted,	false },
+	{ "staged",			test_staged,		false },
+	{ "auth",			test_auth,			false },
+	{ "spiflash",		test_spiflash,		false },
+	{ "faults",			test_faults,		false },
+	{ "answers",		test_answers,		false },
+	{ "signed",			test_signed,		true },
+};
+
+//*****************************************************************************
+static void usage(void)
+{
+	fprintf(stderr, "usage: sota_test -x host/sota_host [-P pagesize] [-k key] [-v] [test ...]\ntests:");
+	for (size_t ii=0; ii<sizeof(tests)/sizeof(tests[0]); ii++)
+	{
+		fprintf(stderr, " %s", tests[ii].name);
+	}
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+//*****************************************************************************
+int main(int argc, char *argv[])
+{
+char	scratch[]	=	"/tmp/sota_test.XXXXXX";
+int		failed		=	0;
+int		run			=	0;
+bool	selected;
+int		opt;
+int		ii;
+std::string	error;
+
+	while ((opt = getopt(argc, argv, "x:P:k:v")) != -1)
+	{
+		switch (opt)
+		{
+			case 'x':	hostProgram	=	optarg;						break;
+			case 'P':	pageSize	=	strtoul(optarg, NULL, 10);	break;
+			case 'k':	signKeyFile	=	optarg;						break;
+			case 'v':	verbose		=	true;						break;
+			default:	usage();
+		}
+	}
+	if (!hostProgram || (pageSize < 2) || (pageSize & (pageSize - 1)))
+	{
+		usage();
+	}
+	if (signKeyFile && !sota_sign_key_load(signKeyFile, signKey, error))
+	{
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	if (!mkdtemp(scratch))
+	{
+		perror(scratch);
+		return 1;
+	}
+	flashFile	=	std::string(scratch) + "/flash.bin";
+	eepromFile	=	std::string(scratch) + "/eeprom.bin";
+	setenv("SOTA_HOST_FLASH", flashFile.c_str(), 1);
+	spiFlashFile	=	std::string(scratch) + "/spiflash.bin";
+	setenv("SOTA_HOST_EEPROM", eepromFile.c_str(), 1);
+	setenv("SOTA_HOST_SPIFLASH", spiFlashFile.c_str(), 1);
+
+	for (size_t tt=0; tt<sizeof(tests)/sizeof(tests[0]); tt++)
+	{
+		selected	=	(optind == argc);
+		for (ii=optind; ii<argc; ii++)
+		{
+			selected	|=	(strcmp(argv[ii], tests[tt].name) == 0);
+		}
+		if (!selected)
+		{
+			continue;
+		}
+		if (tests[tt].needsKey && !signKeyFile)
+		{
+			printf("%-20s skipped, no -k key\n", tests[tt].name);
+			continue;
+		}
+		failure.clear();
+		run++;
+		if (tests[tt].run())
+		{
+			printf("%-20s ok\n", tests[tt].name);
+		}
+		else
+		{
+			printf("%-20s FAILED: %s\n", tests[tt].name, failure.c_str());
+			failed++;
+		}
+	}
+	printf("%s, page size %u: %d of %d tests failed\n", hostProgram, pageSize, failed, run);
+
+	unlink(flashFile.c_str());
+	unlink(eepromFile.c_str());
+	rmdir(scratch);
+	return failed;
+}
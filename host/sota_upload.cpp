@@ -0,0 +1,490 @@
+//**************************************************************************
+//*
+//* Title:		SOTA upload from the command line
+//* Filename:		sota_upload.cpp
+//*
+//* Uploads an application to stk500boot.c over a serial port, a pty or a
+//* pipe to the host build, commits it and starts it, then prints what the
+//* upload cost. The reference client for the benchmarks (make bench_client).
+//*
+//*	sota_upload -p /dev/ttyUSB0 [-b baud] [options] image
+//*	sota_upload -x host/sota_host [options] image
+//*
+//*	-w	frames in flight, 1 against the AVR build (it polls its UART)
+//*	-c	first CMD_AUTH_FAST counter, retried above the device counter
+//*	-L	CMD_AUTH/CMD_AUTH_SECOND_PHASE instead of CMD_AUTH_FAST
+//*	-n	upload only, no CMD_COMMIT_IMAGE and no start
+//*	-A	stage the image in slot B (ENABLE_DUAL_SLOT) and CMD_ACTIVATE_SLOT it,
+//*		the application stays intact until the slot copy
+//*	-r	CMD_RESUME first and send only the pages the device still needs
+//*	-P	SPM_PAGESIZE of the device for -r, 256 by default
+//*	-V	CMD_VERIFY_IMAGE after the upload, the CRC32 of the flash where the
+//*		image went (slot B with -A -n) against that of the image
+//*	-k	sign the image with the RSA-2048 key in that file, the text of
+//*		openssl rsa -text -noout, and send CMD_IMAGE_SIGNATURE before the
+//*		commit (ENABLE_IMAGE_SIGNATURE)
+//*	-K	print the image_key.h of the key in that file for stk500boot.c and exit:
+//*		openssl genrsa 2048 | openssl rsa -text -noout > release_key.txt
+//*		host/sota_upload -K release_key.txt > image_key.h
+//*	-D	with -x, drop the link after every that many frames sent, then
+//*		start the host build again and resume (implies -r), to measure
+//*		what a flaky link costs
+//*	-d	add that many ms of round trip time to the link, half each way,
+//*		to see what the handshake costs on a slow network (make bench_connect)
+//*	-s	print CMD_GET_STATS of the bootloader (ENABLE_STATS) afterwards
+//*	-S	software AES even where the CPU has AES-NI
+//*	-t	answer timeout in ms
+//*	-q	only the result line
+//*
+//* The image is an Intel HEX file (.hex), a raw binary, or a size in bytes
+//* for that many pseudo random bytes, the images sota_bench uploads.
+//*
+//**************************************************************************
+
+#include	"sota_client.h"
+#include	"../command.h"
+
+#include	<algorithm>
+#include	<cinttypes>
+#include	<deque>
+#include	<cstdio>
+#include	<cstdlib>
+#include	<cstring>
+#include	<unistd.h>
+
+#define	DEVICE_PHASES	7
+
+static const char	*phaseNames[DEVICE_PHASES]	=	{ "idle", "receive", "decrypt", "parse", "spm", "encrypt", "transmit" };
+
+//*****************************************************************************
+static double to_ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+//*****************************************************************************
+static uint64_t get_be(const uint8_t *p, int size)
+{
+uint64_t	value	=	0;
+
+	while (size--)
+	{
+		value	=	(value << 8) | *p++;
+	}
+	return value;
+}
+
+//*****************************************************************************
+/*
+ * the CMD_GET_STATS answer, laid out as in stats.lua
+ */
+static void device_stats_print(sota_client_t &client)
+{
+static const uint8_t	request[2]	=	{ CMD_GET_STATS, 0 };
+uint8_t					answer[SOTA_FRAME_MAX];
+const uint8_t			*cycles		=	answer + 3 + 4 + 4 + 4 + 6 + 1;
+const uint8_t			*entropy;
+uint64_t				phase[DEVICE_PHASES];
+uint64_t				total		=	0;
+int						length;
+int						ii;
+
+	length	=	client.command(request, sizeof(request), answer);
+	if ((length < (3 + 4 + 4 + 4 + 6 + 1 + DEVICE_PHASES * 8)) || (answer[1] != STATUS_CMD_OK) || (answer[2] != 1))
+	{
+		printf("  device: no CMD_GET_STATS, build the bootloader with ENABLE_STATS for the breakdown\n");
+		return;
+	}
+	for (ii=0; ii<DEVICE_PHASES; ii++)
+	{
+		phase[ii]	=	get_be(cycles + ii * 8, 8);
+		total		+=	phase[ii];
+	}
+	printf("  device: %" PRIu64 " frames, %" PRIu64 " checksum errors, %" PRIu64 " cycles at %" PRIu64 " Hz\n  device:",
+			get_be(answer + 7, 4), get_be(answer + 15, 2), total, get_be(answer + 3, 4));
+	for (ii=0; ii<DEVICE_PHASES; ii++)
+	{
+		printf(" %s %.1f%%", phaseNames[ii], total ? (100.0 * phase[ii] / total) : 0.0);
+	}
+	printf("\n");
+	if (length >= (3 + 4 + 4 + 4 + 6 + 1 + DEVICE_PHASES * 8 + 12))
+	{
+		//*	ENABLE_ENTROPY_POOL
+		entropy	=	cycles + DEVICE_PHASES * 8;
+		printf("  device: first CMD_AUTH challenge %.3f ms after reset with %" PRIu64 " entropy samples, health tests dropped %" PRIu64
+				" samples, %" PRIu64 " repetition count and %" PRIu64 " adaptive proportion failures\n",
+				1000.0 * get_be(entropy, 4) / get_be(answer + 3, 4), get_be(entropy + 4, 2), get_be(entropy + 6, 2),
+				get_be(entropy + 8, 2), get_be(entropy + 10, 2));
+	}
+}
+
+//*****************************************************************************
+/*
+ * a link that goes dead after a number of frames, every send is one frame
+ */
+class drop_link_t : public sota_link_t
+{
+public:
+					drop_link_t(sota_link_t *link, unsigned int frames) : link(link), framesLeft(frames) {}
+	virtual bool	send(const uint8_t *data, size_t length)
+					{
+						if (framesLeft == 0)
+						{
+							return false;
+						}
+						framesLeft--;
+						return link->send(data, length);
+					}
+	virtual int		receive(uint8_t *data, size_t length, int timeoutMs)	{ return link->receive(data, length, timeoutMs); }
+	virtual double	rate(void) const										{ return link->rate(); }
+	bool			dropped(void) const										{ return framesLeft == 0; }
+
+private:
+	sota_link_t		*link;
+	unsigned int	framesLeft;
+};
+
+//*****************************************************************************
+/*
+ * a link with latency: everything sent or received is held back for half
+ * the round trip time, as on a long network path, and the line rate stays
+ * that of the link underneath
+ */
+class delay_link_t : public sota_link_t
+{
+public:
+					delay_link_t(sota_link_t *link, unsigned int rttMs) : link(link), oneWayNs(rttMs * 500000ULL) {}
+	virtual bool	send(const uint8_t *data, size_t length)
+					{
+						outgoing.push_back(delayed_t(sota_now_ns() + oneWayNs, data, length));
+						return forward();
+					}
+	virtual int		receive(uint8_t *data, size_t length, int timeoutMs);
+	virtual double	rate(void) const										{ return link->rate(); }
+
+private:
+	struct delayed_t
+	{
+		uint64_t				due;
+		std::vector<uint8_t>	bytes;
+
+		delayed_t(uint64_t due, const uint8_t *data, size_t length) : due(due), bytes(data, data + length) {}
+	};
+
+	bool			forward(void);
+
+	sota_link_t				*link;
+	uint64_t				oneWayNs;
+	std::deque<delayed_t>	outgoing;
+	std::deque<delayed_t>	incoming;
+};
+
+//*****************************************************************************
+/*
+ * pass on what is due to the device
+ */
+bool delay_link_t::forward(void)
+{
+	while (!outgoing.empty() && (outgoing.front().due <= sota_now_ns()))
+	{
+		if (!link->send(outgoing.front().bytes.data(), outgoing.front().bytes.size()))
+		{
+			return false;
+		}
+		outgoing.pop_front();
+	}
+	return true;
+}
+
+//*****************************************************************************
+int delay_link_t::receive(uint8_t *data, size_t length, int timeoutMs)
+{
+uint8_t		buffer[512];
+uint64_t	deadline	=	sota_now_ns() + timeoutMs * 1000000ULL;
+uint64_t	now;
+uint64_t	wake;
+size_t		count;
+int			n;
+
+	for (;;)
+	{
+		if (!forward())
+		{
+			return -1;
+		}
+		now	=	sota_now_ns();
+		if (!incoming.empty() && (incoming.front().due <= now))
+		{
+			count	=	std::min(length, incoming.front().bytes.size());
+			memcpy(data, incoming.front().bytes.data(), count);
+			incoming.front().bytes.erase(incoming.front().bytes.begin(), incoming.front().bytes.begin() + count);
+			if (incoming.front().bytes.empty())
+			{
+				incoming.pop_front();
+			}
+			return count;
+		}
+		if (now >= deadline)
+		{
+			return 0;
+		}
+		//*	listen until the next thing falls due
+		wake	=	deadline;
+		if (!outgoing.empty())
+		{
+			wake	=	std::min(wake, outgoing.front().due);
+		}
+		if (!incoming.empty())
+		{
+			wake	=	std::min(wake, incoming.front().due);
+		}
+		n	=	link->receive(buffer, sizeof(buffer), (wake > now) ? (int)((wake - now + 999999) / 1000000) : 0);
+		if (n < 0)
+		{
+			return -1;
+		}
+		if (n > 0)
+		{
+			incoming.push_back(delayed_t(sota_now_ns() + oneWayNs, buffer, n));
+		}
+	}
+}
+
+//*****************************************************************************
+static void usage(void)
+{
+	fprintf(stderr,	"usage: sota_upload -p port [-b baud] [-w window] [-c counter] [-t ms] [-P pagesize] [-d rtt] [-k key] [-ALnrsSVq] image\n"
+					"       sota_upload -x host/sota_host [-w window] [-c counter] [-t ms] [-P pagesize] [-d rtt] [-D frames] [-k key] [-ALnrsSVq] image\n"
+					"       sota_upload -K key > image_key.h\n"
+					"an image is an Intel HEX file (.hex), a raw binary file or a size in bytes\n");
+	exit(2);
+}
+
+//*****************************************************************************
+int main(int argc, char *argv[])
+{
+const char				*port		=	NULL;
+const char				*program	=	NULL;
+unsigned long			baudRate	=	115200;
+unsigned int			window		=	1;
+unsigned int			pageSize	=	256;
+unsigned int			dropEvery	=	0;
+unsigned int			rttMs		=	0;
+unsigned int			drops		=	0;
+uint32_t				counter		=	1;
+int						timeoutMs	=	2000;
+bool					legacy		=	false;
+bool					commit		=	true;
+bool					resume		=	false;
+bool					staged		=	false;
+bool					deviceStats	=	false;
+bool					verify		=	false;
+bool					quiet		=	false;
+const char				*keyFile	=	NULL;
+const char				*headerKey	=	NULL;
+sota_sign_key_t			key;
+uint8_t					signature[SOTA_SIGNATURE_SIZE];
+std::vector<uint8_t>	image;
+std::vector<bool>		missing;
+std::string				error;
+sota_fd_link_t			*link;
+drop_link_t				*dropLink	=	NULL;
+delay_link_t			*delayLink	=	NULL;
+sota_link_t				*top;
+sota_client_t			*client;
+uint64_t				start;
+uint64_t				total;
+uint64_t				sentBefore	=	0;		//*	image bytes sent over links that dropped
+uint64_t				lastResumed	=	0;
+uint64_t				wireBefore	=	0;
+uint64_t				firstConnect	=	0;
+uint64_t				down;
+double					busy;
+bool					ok;
+int						opt;
+
+	while ((opt = getopt(argc, argv, "p:b:x:w:c:t:P:D:d:k:K:ALnrsSVq")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':	port		=	optarg;							break;
+			case 'b':	baudRate	=	strtoul(optarg, NULL, 10);		break;
+			case 'x':	program		=	optarg;							break;
+			case 'w':	window		=	strtoul(optarg, NULL, 10);		break;
+			case 'c':	counter		=	strtoul(optarg, NULL, 0);		break;
+			case 't':	timeoutMs	=	strtol(optarg, NULL, 10);		break;
+			case 'P':	pageSize	=	strtoul(optarg, NULL, 0);		break;
+			case 'D':	dropEvery	=	strtoul(optarg, NULL, 10);		break;
+			case 'd':	rttMs		=	strtoul(optarg, NULL, 10);		break;
+			case 'k':	keyFile		=	optarg;							break;
+			case 'K':	headerKey	=	optarg;							break;
+			case 'A':	staged		=	true;							break;
+			case 'L':	legacy		=	true;							break;
+			case 'n':	commit		=	false;							break;
+			case 'r':	resume		=	true;							break;
+			case 's':	deviceStats	=	true;							break;
+			case 'S':	sota_aes_t::hardware_disable();					break;
+			case 'V':	verify		=	true;							break;
+			case 'q':	quiet		=	true;							break;
+			default:	usage();
+		}
+	}
+	if (headerKey)
+	{
+		if (!sota_sign_key_load(headerKey, key, error))
+		{
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		sota_sign_key_header(key, stdout);
+		return 0;
+	}
+	if (((port != NULL) == (program != NULL)) || ((argc - optind) != 1) || (window < 1) || (window > SOTA_WINDOW_MAX)
+		|| (pageSize == 0) || (dropEvery && !program))
+	{
+		usage();
+	}
+	resume	|=	(dropEvery != 0);
+	if (!sota_image_load(argv[optind], image, error))
+	{
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	if (keyFile)
+	{
+		if (!sota_sign_key_load(keyFile, key, error))
+		{
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		sota_image_sign(key, image.data(), image.size(), signature);
+	}
+
+	start	=	sota_now_ns();
+	for (;;)
+	{
+		link	=	port ? sota_fd_link_t::open_serial(port, baudRate, error) : sota_fd_link_t::spawn(program, error);
+		if (!link)
+		{
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		top		=	link;
+		if (rttMs)
+		{
+			top	=	delayLink	=	new delay_link_t(top, rttMs);
+		}
+		if (dropEvery)
+		{
+			top	=	dropLink	=	new drop_link_t(top, dropEvery);
+		}
+		client	=	new sota_client_t(top);
+		client->set_timeout(timeoutMs);
+		client->set_signature(keyFile ? signature : NULL);
+		ok		=	client->connect(counter, legacy)
+					&& (!staged || client->select_slot(1))
+					&& (!resume || client->resume(image, pageSize, missing))
+					&& client->upload(image, window, commit, resume ? &missing : NULL);
+		if (!firstConnect)
+		{
+			firstConnect	=	client->stats().connectNs;
+		}
+		if (ok || !dropLink || !dropLink->dropped())
+		{
+			break;
+		}
+		//*	the link dropped, give up unless that connection got a page through
+		if (client->stats().payload == 0)
+		{
+			fprintf(stderr, "%s: no progress with the link dropping every %u frames\n", argv[optind], dropEvery);
+			return 1;
+		}
+		sentBefore	+=	client->stats().dataSent;
+		wireBefore	+=	client->stats().wireOut + client->stats().wireIn;
+		drops++;
+		delete client;
+		delete dropLink;
+		delete delayLink;
+		delete link;
+	}
+	total	=	sota_now_ns() - start;
+	if (ok && verify)
+	{
+		ok	=	client->verify(client->image_base(), image.data(), image.size());
+	}
+	if (ok && deviceStats)
+	{
+		device_stats_print(*client);
+	}
+	if (ok && commit)
+	{
+		ok	=	client->leave();
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], client->error().c_str());
+	}
+
+	const sota_stats_t	&stats	=	client->stats();
+	double				upload	=	stats.uploadNs ? (stats.uploadNs / 1e9) : 1;
+
+	lastResumed	=	stats.resumed;
+	printf("%-12s %7zu bytes  connect %8.3f ms  %4" PRIu64 " frames %7.3f ms/frame (%.3f..%.3f)  total %9.3f ms  %7.2f kB/s%s\n",
+			argv[optind], image.size(), to_ms(stats.connectNs),
+			stats.chunks, to_ms(stats.chunks ? (stats.rttSumNs / stats.chunks) : 0),
+			to_ms(stats.rttMinNs == UINT64_MAX ? 0 : stats.rttMinNs), to_ms(stats.rttMaxNs),
+			to_ms(total), stats.payload / 1024.0 / upload, ok ? "" : "  FAILED");
+	if (!quiet)
+	{
+		printf("  host: %s auth, window %u, AES %s %.3f ms, wire out %" PRIu64 " in %" PRIu64 " bytes, commit %.3f ms",
+				stats.session ? "CMD_AUTH_FAST session" : "CMD_AUTH", stats.window,
+				sota_aes_t::hardware() ? "AES-NI" : "software", to_ms(stats.aesNs),
+				stats.wireOut, stats.wireIn, to_ms(stats.commitNs));
+		busy	=	(link->rate() > 0) ? (100.0 * (stats.wireOut + stats.wireIn) / (link->rate() * (total / 1e9))) : 0;
+		if (busy > 100)
+		{
+			printf(", faster than %lu baud (a pty?)", baudRate);
+		}
+		else if (busy > 0)
+		{
+			printf(", link %.0f%% busy", busy);
+		}
+		printf("\n");
+		if (rttMs)
+		{
+			printf("  link: %u ms round trip added, connect took %.2f round trips\n", rttMs, to_ms(firstConnect) / rttMs);
+		}
+		if (ok && keyFile)
+		{
+			printf("  signature: CMD_IMAGE_SIGNATURE over %zu bytes checked, %.3f ms\n", image.size(), to_ms(stats.signNs));
+		}
+		if (ok && verify)
+		{
+			printf("  verify: CRC32 of %zu bytes at 0x%05X matches, %.3f ms\n", image.size(), client->image_base(), to_ms(stats.verifyNs));
+		}
+		if (stats.retransmits)
+		{
+			printf("  %" PRIu64 " frames sent again after no answer came in time\n", stats.retransmits);
+		}
+		if (ok && commit)
+		{
+			//*	in place the application is gone from the first page written on
+			down	=	staged ? stats.commitNs : (total - firstConnect);
+			printf("  application down %.3f ms (%s)\n", to_ms(down),
+					staged ? "CMD_ACTIVATE_SLOT copy of the staged image" : "programmed in place, upload and commit");
+		}
+		if (resume)
+		{
+			printf("  resume: %u drops, %" PRIu64 " bytes sent before the last one, %" PRIu64 " already on the device at the last"
+					" connect, %" PRIu64 " bytes (%.1f%%) sent again, %" PRIu64 " bytes on the wire in all\n",
+					drops, sentBefore, lastResumed, sentBefore + stats.dataSent - image.size(),
+					100.0 * (sentBefore + stats.dataSent - image.size()) / image.size(),
+					wireBefore + stats.wireOut + stats.wireIn);
+		}
+	}
+	delete client;
+	delete dropLink;
+	delete delayLink;
+	delete link;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+//**************************************************************************
+//*
+//* Title:		Image signature key
+//* Filename:		image_key.h
+//*
+//* The RSA-2048 public key (e = 65537) stk500boot.c checks CMD_IMAGE_SIGNATURE
+//* against with ENABLE_IMAGE_SIGNATURE, written by host/sota_upload -K.
+//*
+//* This one is the development key of host/image_key_dev.txt, whose private
+//* half is public in this repository. Anything that ships needs a key of
+//* its own, kept wherever releases are signed:
+//*	openssl genrsa 2048 | openssl rsa -text -noout > release_key.txt
+//*	host/sota_upload -K release_key.txt > image_key.h
+//*
+//**************************************************************************
+
+#ifndef _IMAGE_KEY_H_
+#define _IMAGE_KEY_H_
+
+//*	modulus n, big endian
+static const unsigned char	imageKeyModulus[256]	=	{
+	0xc4, 0x58, 0x5b, 0xcb, 0x98, 0x08, 0x92, 0x9b, 0x9e, 0xa0, 0x01, 0x2a, 0x49, 0x88, 0x0d, 0x66,
+	0xff, 0x94, 0x06, 0x3c, 0x6f, 0x7c, 0x3c, 0xc2, 0x81, 0x9e, 0x06, 0xa4, 0x89, 0x24, 0x56, 0x73,
+	0xc0, 0xf4, 0x44, 0xb4, 0xbf, 0x4e, 0x73, 0x0a, 0x31, 0x4a, 0x7c, 0x90, 0x70, 0x80, 0xbd, 0xa9,
+	0x7e, 0x43, 0x3f, 0xb1, 0x0c, 0x93, 0x22, 0x01, 0x5d, 0x8c, 0x21, 0x91, 0x52, 0x50, 0xb3, 0x96,
+	0x17, 0x2a, 0xc9, 0x7d, 0x0a, 0xf9, 0x38, 0x7d, 0x11, 0x59, 0x79, 0xb6, 0x5a, 0xea, 0x56, 0x79,
+	0x25, 0xe9, 0xb8, 0x53, 0x3b, 0xb2, 0x3b, 0x49, 0x54, 0x52, 0xeb, 0xd6, 0xcf, 0x55, 0xb3, 0x96,
+	0xe7, 0x77, 0xbd, 0xe4, 0x6b, 0x98, 0xc6, 0xe5, 0x45, 0x91, 0x98, 0xe0, 0xa8, 0x8f, 0xa3, 0xfd,
+	0x3a, 0x2a, 0x67, 0xb6, 0xe2, 0x74, 0x70, 0xf5, 0x23, 0x36, 0x95, 0xa5, 0xe4, 0x1c, 0xe2, 0x2f,
+	0x32, 0x77, 0xe5, 0x49, 0xe6, 0x33, 0x71, 0x63, 0x58, 0x43, 0xa5, 0x4d, 0x91, 0x9c, 0x50, 0x99,
+	0xd9, 0x95, 0x57, 0xfd, 0x1c, 0x30, 0x31, 0x7f, 0x3c, 0x16, 0x05, 0xa3, 0x38, 0x22, 0x8d, 0xf6,
+	0xc6, 0x65, 0xb1, 0xf3, 0xda, 0x04, 0xa3, 0x3e, 0x33, 0x9c, 0xb0, 0x9a, 0xfc, 0x78, 0x09, 0xc3,
+	0xe0, 0x15, 0x85, 0xfb, 0x4c, 0xae, 0xea, 0x0f, 0xaa, 0x17, 0xf0, 0x89, 0xbb, 0x61, 0xe4, 0x49,
+	0x6b, 0xec, 0xbb, 0x0d, 0x89, 0x4a, 0x70, 0x6d, 0x3e, 0x47, 0x5a, 0x2a, 0x89, 0xa0, 0x5c, 0xfb,
+	0x74, 0x92, 0x12, 0x49, 0xa0, 0x60, 0x1d, 0xe5, 0x41, 0x4a, 0x90, 0x3a, 0x66, 0x88, 0xff, 0x89,
+	0x6a, 0x65, 0xb0, 0xee, 0x12, 0x1c, 0xf1, 0xb6, 0xd4, 0x8f, 0x9f, 0x6e, 0x0a, 0x20, 0x8d, 0x56,
+	0x03, 0xc7, 0x30, 0x29, 0x39, 0x4b, 0x09, 0x59, 0xca, 0x89, 0x87, 0xdf, 0x55, 0x3d, 0x96, 0x4f };
+
+//*	R^2 mod n with R = 2^2048, takes numbers into Montgomery form
+static const unsigned char	imageKeyRR[256]	=	{
+	0x52, 0xa2, 0xfa, 0x7a, 0xb4, 0x25, 0x6c, 0x29, 0xd8, 0xfb, 0x37, 0xa0, 0xe5, 0x13, 0xf0, 0x2f,
+	0xc7, 0xf2, 0xa9, 0x05, 0x8d, 0x0c, 0x64, 0x97, 0x95, 0x69, 0x74, 0x9c, 0xc6, 0xf6, 0x81, 0x20,
+	0x89, 0xf2, 0x44, 0x61, 0xd6, 0x10, 0xc6, 0xd5, 0x3b, 0x2a, 0xe5, 0xc0, 0x66, 0x1c, 0x0d, 0x3e,
+	0x4b, 0xdf, 0x29, 0x1a, 0xbb, 0xb3, 0x62, 0x14, 0x97, 0xc3, 0xce, 0x2d, 0xe4, 0x0c, 0x79, 0x04,
+	0x56, 0xb9, 0xf3, 0x73, 0x31, 0x16, 0x14, 0x2e, 0x5d, 0x5b, 0xe9, 0xe3, 0x84, 0xb4, 0xd3, 0xe3,
+	0x17, 0x80, 0xc7, 0xbf, 0x69, 0x0e, 0x23, 0xbe, 0x3a, 0x29, 0xfb, 0x04, 0x9e, 0x85, 0xa1, 0x54,
+	0x21, 0x54, 0x77, 0xd4, 0xaf, 0xeb, 0x28, 0x7f, 0x37, 0xef, 0x5f, 0x89, 0x2e, 0xc0, 0x20, 0x0a,
+	0x29, 0x10, 0x01, 0xcf, 0x9d, 0x81, 0x2a, 0x38, 0x98, 0x03, 0xd9, 0x11, 0xdd, 0x78, 0xf5, 0xad,
+	0xb2, 0xc4, 0xd4, 0xc9, 0x8f, 0xc4, 0x3a, 0xcc, 0x89, 0xfc, 0x2d, 0xf9, 0xfb, 0x78, 0x62, 0x1b,
+	0x49, 0x14, 0x1b, 0x15, 0xe3, 0x58, 0x15, 0xd4, 0x3b, 0xa6, 0x32, 0x4e, 0xd2, 0x4b, 0x77, 0x42,
+	0xf0, 0x36, 0x33, 0xe5, 0xa0, 0x14, 0xdf, 0xa4, 0xf3, 0x20, 0x49, 0x02, 0xeb, 0xc1, 0xbe, 0x7a,
+	0x27, 0xad, 0x54, 0x70, 0x28, 0xb6, 0x89, 0x46, 0x2e, 0xbd, 0x31, 0xc2, 0xd3, 0x85, 0xa1, 0xcc,
+	0x42, 0xe9, 0x8a, 0xc0, 0xc8, 0x80, 0x81, 0x3c, 0x95, 0x03, 0x10, 0xbf, 0xad, 0x9f, 0x88, 0x4a,
+	0x68, 0xab, 0xd5, 0x5f, 0x02, 0x61, 0x48, 0xd7, 0x35, 0x36, 0xe8, 0xe7, 0xcf, 0xab, 0xca, 0x8a,
+	0x5b, 0x34, 0x91, 0x90, 0x5c, 0x57, 0x4c, 0xf7, 0x62, 0x9a, 0x52, 0x5b, 0x0f, 0x60, 0x0f, 0xf0,
+	0xca, 0x38, 0x1a, 0x58, 0x4a, 0x93, 0x18, 0x6c, 0x2f, 0x13, 0x65, 0x6b, 0x97, 0x18, 0x0c, 0x51 };
+
+#endif	//	_IMAGE_KEY_H_
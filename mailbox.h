@@ -0,0 +1,67 @@
+//**************************************************************************
+//*
+//* Title:		Application to bootloader mailbox
+//* Filename:		mailbox.h
+//*
+//* Shared by the bootloader and the application. The application fills the
+//* mailbox at the top of the RAM and resets through the watchdog, RAM keeps
+//* its contents over that reset. The bootloader finds the request next to
+//* the WDRF check and starts the update at once:
+//*	- no boot_state wait,
+//*	- the UART at the baud rate the application agreed on with the host,
+//*	- with ENABLE_SESSION_KEYS a session from the nonce the application
+//*	  agreed on with the host, so no authentication round trip either.
+//*
+//* The application must keep its stack below the mailbox, link it with
+//*	-Wl,--defsym=__stack=<SOTA_MAILBOX_ADDRESS - 1>
+//*
+//**************************************************************************
+
+#ifndef _MAILBOX_H_
+#define _MAILBOX_H_
+
+#include	<inttypes.h>
+#ifndef HOST_BUILD
+	#include	<avr/io.h>
+#endif
+
+#define	SOTA_MAILBOX_MAGIC			0x4D424F58UL	// "MBOX"
+#define	SOTA_MAILBOX_NONCE_SIZE		16
+
+// flags
+#define	SOTA_MAILBOX_ENTER_UPDATE	0x01			// stay in the bootloader, no wait
+#define	SOTA_MAILBOX_SESSION		0x02			// nonce holds a session nonce
+
+typedef struct
+{
+	uint32_t	magic;								// SOTA_MAILBOX_MAGIC while a request is pending
+	uint8_t		flags;
+	uint8_t		baudSelect;							// value for the UART baud rate register, 0 keeps BAUDRATE
+	uint8_t		nonce[SOTA_MAILBOX_NONCE_SIZE];
+	uint8_t		check;								// sota_mailbox_check() of the bytes above
+} __attribute__ ((packed)) sota_mailbox_t;			// no padding on the host build either
+
+#ifdef HOST_BUILD
+	//*	host/hal_host.c, kept in the file SOTA_HOST_MAILBOX over a restart
+	extern sota_mailbox_t	halHostMailbox;
+	#define	SOTA_MAILBOX			((volatile sota_mailbox_t *)&halHostMailbox)
+#else
+	#define	SOTA_MAILBOX_ADDRESS	(RAMEND + 1 - sizeof(sota_mailbox_t))
+	#define	SOTA_MAILBOX			((volatile sota_mailbox_t *)SOTA_MAILBOX_ADDRESS)
+#endif
+
+//*	RAM holds garbage after power up, the check keeps it from passing as a request
+static inline uint8_t sota_mailbox_check(volatile sota_mailbox_t *mailbox)
+{
+	volatile uint8_t	*p		=	(volatile uint8_t *)mailbox;
+	uint8_t				check	=	0xA5;
+	uint8_t				ii;
+
+	for (ii=0; ii<(sizeof(sota_mailbox_t) - 1); ii++)
+	{
+		check	=	((check << 1) | (check >> 7)) ^ p[ii];
+	}
+	return check;
+}
+
+#endif	//	_MAILBOX_H_
@@ -0,0 +1,209 @@
+//**************************************************************************
+//*
+//* Title:		SPI NOR flash access and SOTA staging area layout
+//* Filename:		spiflash.h
+//*
+//* Shared by the bootloader and the application side staging library
+//* (app/sota_staging.c), so both agree on pins, opcodes and layout. The
+//* host build (make host) gets the five low level calls from host/hal_host.c.
+//*
+//* Staging area, starting at SPIFLASH_STAGING_BASE:
+//*	page 0:	header, see SOTA_STAGING_* below
+//*	page 1..:	SOTA frame stream exactly as received over the radio,
+//*		SOTA_MESSAGE_START, size high, size low, encrypted packet, ...
+//*
+//* The application writes the stream and then the header with state
+//* SOTA_STAGING_STATE_READY. On the next reset the bootloader checks the
+//* CRC32, replays the stream through its normal packet parser and programs
+//* SOTA_STAGING_STATE_CONSUMED into the header when done.
+//*
+//* The stream is replayed without the authentication handshake, it has to
+//* start after CMD_AUTH_SECOND_PHASE and include the byte the bootloader reads
+//* after every frame.
+//*
+//**************************************************************************
+
+#ifndef _SPIFLASH_H_
+#define _SPIFLASH_H_
+
+#include	<inttypes.h>
+
+// *****************[ staging area layout ]***************************
+
+#ifndef SPIFLASH_STAGING_BASE
+	#define SPIFLASH_STAGING_BASE			0x000000UL	// must be sector aligned
+#endif
+
+#define SPIFLASH_PAGE_SIZE					256
+#define SPIFLASH_SECTOR_SIZE				4096UL
+
+#define SOTA_STAGING_MAGIC					0x534F5441UL	// "SOTA"
+#define SOTA_STAGING_HEADER_SIZE			13
+#define SOTA_STAGING_STREAM					(SPIFLASH_STAGING_BASE + SPIFLASH_PAGE_SIZE)
+
+// header fields, multi byte values are big endian
+#define SOTA_STAGING_OFFSET_MAGIC			0	// 4 bytes
+#define SOTA_STAGING_OFFSET_LENGTH			4	// 4 bytes, length of the frame stream
+#define SOTA_STAGING_OFFSET_CRC				8	// 4 bytes, CRC32 (zlib) of the frame stream
+#define SOTA_STAGING_OFFSET_STATE			12	// 1 byte
+
+// states only ever clear bits, so they can be programmed without an erase
+#define SOTA_STAGING_STATE_EMPTY			0xFF
+#define SOTA_STAGING_STATE_READY			0x7F
+#define SOTA_STAGING_STATE_CONSUMED			0x00
+
+// *****************[ JEDEC SPI NOR opcodes ]***************************
+
+#define SPIFLASH_CMD_READ					0x03
+#define SPIFLASH_CMD_PAGE_PROGRAM			0x02
+#define SPIFLASH_CMD_SECTOR_ERASE			0x20
+#define SPIFLASH_CMD_WRITE_ENABLE			0x06
+#define SPIFLASH_CMD_READ_STATUS			0x05
+
+#define SPIFLASH_STATUS_BUSY				0x01
+
+#ifdef HOST_BUILD
+// *****************[ simulated part ]***************************
+
+//*	host/hal_host.c answers like a JEDEC SPI NOR flash kept in SOTA_HOST_SPIFLASH
+#define SPIFLASH_HOST_SIZE		0x100000UL
+
+void			spiflash_init(void);
+void			spiflash_release(void);
+void			spiflash_select(void);
+void			spiflash_deselect(void);
+unsigned char	spiflash_transfer(unsigned char data);
+#else
+#include	<avr/io.h>
+
+// *****************[ pins ]***************************
+
+#if defined(__AVR_ATmega64__) || defined(__AVR_ATmega128__) || defined(__AVR_ATmega640__) \
+	|| defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega2561__) \
+	|| defined(__AVR_AT90USB1287__)
+	#define SPI_DDR			DDRB
+	#define SPI_SS			PB0
+	#define SPI_SCK			PB1
+	#define SPI_MOSI		PB2
+#elif defined(__AVR_ATmega16__) || defined(__AVR_ATmega32__) || defined(__AVR_ATmega1284P__) \
+	|| defined(__AVR_ATmega162__) || defined(__AVR_ATmega8515__) || defined(__AVR_ATmega8535__)
+	#define SPI_DDR			DDRB
+	#define SPI_SS			PB4
+	#define SPI_SCK			PB7
+	#define SPI_MOSI		PB5
+#elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega169__)
+	#define SPI_DDR			DDRB
+	#define SPI_SS			PB2
+	#define SPI_SCK			PB5
+	#define SPI_MOSI		PB3
+#else
+	#error "no SPI definition for MCU available"
+#endif
+
+// chip select of the flash, defaults to the hardware SS pin
+#ifndef SPIFLASH_CS_PORT
+	#define SPIFLASH_CS_PORT	PORTB
+	#define SPIFLASH_CS_DDR		DDRB
+	#define SPIFLASH_CS_PIN		SPI_SS
+#endif
+
+// *****************[ low level access ]***************************
+
+static inline void spiflash_select(void)
+{
+	SPIFLASH_CS_PORT	&=	~(1 << SPIFLASH_CS_PIN);
+}
+
+static inline void spiflash_deselect(void)
+{
+	SPIFLASH_CS_PORT	|=	(1 << SPIFLASH_CS_PIN);
+}
+
+static inline unsigned char spiflash_transfer(unsigned char data)
+{
+	SPDR	=	data;
+	while (!(SPSR & (1 << SPIF)))
+	{
+		// wait for the byte to shift out
+	}
+	return SPDR;
+}
+
+//*	SPI master, mode 0, F_CPU/2
+static inline void spiflash_init(void)
+{
+	SPIFLASH_CS_PORT	|=	(1 << SPIFLASH_CS_PIN);
+	SPIFLASH_CS_DDR		|=	(1 << SPIFLASH_CS_PIN);
+	SPI_DDR				|=	(1 << SPI_SS) | (1 << SPI_SCK) | (1 << SPI_MOSI);
+	SPCR				=	(1 << SPE) | (1 << MSTR);
+	SPSR				=	(1 << SPI2X);
+}
+
+//*	give the SPI back in reset state
+static inline void spiflash_release(void)
+{
+	SPCR				=	0;
+	SPSR				=	0;
+	SPI_DDR				&=	~((1 << SPI_SS) | (1 << SPI_SCK) | (1 << SPI_MOSI));
+	SPIFLASH_CS_DDR		&=	~(1 << SPIFLASH_CS_PIN);
+	SPIFLASH_CS_PORT	&=	~(1 << SPIFLASH_CS_PIN);
+}
+#endif	//	HOST_BUILD
+
+static inline void spiflash_command(unsigned char command, uint32_t flashAddress)
+{
+	spiflash_transfer(command);
+	spiflash_transfer(flashAddress >> 16);
+	spiflash_transfer(flashAddress >> 8);
+	spiflash_transfer(flashAddress);
+}
+
+//*	start a sequential read, every spiflash_transfer(0xff) returns the next byte until deselect
+static inline void spiflash_read_begin(uint32_t flashAddress)
+{
+	spiflash_select();
+	spiflash_command(SPIFLASH_CMD_READ, flashAddress);
+}
+
+static inline void spiflash_wait_ready(void)
+{
+	spiflash_select();
+	spiflash_transfer(SPIFLASH_CMD_READ_STATUS);
+	while (spiflash_transfer(0xff) & SPIFLASH_STATUS_BUSY)
+	{
+		// wait for program or erase to finish
+	}
+	spiflash_deselect();
+}
+
+static inline void spiflash_write_enable(void)
+{
+	spiflash_select();
+	spiflash_transfer(SPIFLASH_CMD_WRITE_ENABLE);
+	spiflash_deselect();
+}
+
+//*	program up to one flash page, the range must not cross a page boundary
+static inline void spiflash_program(uint32_t flashAddress, const unsigned char *data, unsigned int length)
+{
+	spiflash_write_enable();
+	spiflash_select();
+	spiflash_command(SPIFLASH_CMD_PAGE_PROGRAM, flashAddress);
+	while (length--)
+	{
+		spiflash_transfer(*data++);
+	}
+	spiflash_deselect();
+	spiflash_wait_ready();
+}
+
+static inline void spiflash_sector_erase(uint32_t flashAddress)
+{
+	spiflash_write_enable();
+	spiflash_select();
+	spiflash_command(SPIFLASH_CMD_SECTOR_ERASE, flashAddress);
+	spiflash_deselect();
+	spiflash_wait_ready();
+}
+
+#endif	//	_SPIFLASH_H_
@@ -0,0 +1,104 @@
+#!/usr/bin/lua
+
+-- Renders the CMD_GET_STATS answer of a bootloader built with ENABLE_STATS.
+-- The answer body (command byte first, as hex) is read from the command line
+-- or from stdin, e.g.
+--   lua stats.lua 72 00 01 00 f4 24 00 ...
+
+local io = require("io")
+
+local phase_names = { "idle", "receive", "decrypt", "parse", "spm", "encrypt", "transmit" }
+
+local text
+if #arg > 0 then
+  text = table.concat(arg, " ")
+else
+  text = io.read("*a")
+end
+
+local bytes = {}
+for hex in string.gmatch(text, "%x%x") do
+  table.insert(bytes, tonumber(hex, 16))
+end
+
+if #bytes < 3 or bytes[1] ~= 0x72 then
+  print("Not a CMD_GET_STATS answer")
+  return 1
+end
+if bytes[2] ~= 0x00 then
+  print("CMD_GET_STATS failed, the session is not authenticated")
+  return 1
+end
+if bytes[3] ~= 1 then
+  print("Unknown stats version " .. bytes[3])
+  return 1
+end
+
+local pos = 4
+local function take(size)
+  local value = 0
+  for _ = 1, size do
+    if not bytes[pos] then
+      print("Answer too short")
+      os.exit(1)
+    end
+    value = value * 256 + bytes[pos]
+    pos = pos + 1
+  end
+  return value
+end
+
+local f_cpu = take(4)
+local frames = take(4)
+local received = take(4)
+local checksum_errors = take(2)
+local sequence_errors = take(2)
+local retransmits = take(2)
+local phase_count = take(1)
+
+local cycles = {}
+local total = 0
+for idx = 1, phase_count do
+  cycles[idx] = take(8)
+  total = total + cycles[idx]
+end
+
+print(string.format("frames received   %d (%d bytes)", frames, received))
+print(string.format("checksum errors   %d", checksum_errors))
+print(string.format("sequence errors   %d", sequence_errors))
+print(string.format("retransmits       %d", retransmits))
+print("")
+print(string.format("%-10s %14s %12s %7s", "phase", "cycles", "ms", "share"))
+for idx = 1, phase_count do
+  local name = phase_names[idx] or ("phase " .. (idx - 1))
+  local share = 0
+  if total > 0 then
+    share = 100 * cycles[idx] / total
+  end
+  print(string.format("%-10s %14.0f %12.3f %6.1f%%", name, cycles[idx], 1000 * cycles[idx] / f_cpu, share))
+end
+print(string.format("%-10s %14.0f %12.3f", "total", total, 1000 * total / f_cpu))
+if frames > 0 then
+  local busy = total - cycles[1]
+  print("")
+  print(string.format("per frame %.3f ms busy, %.1f bytes/s while busy", 1000 * busy / f_cpu / frames,
+    busy > 0 and received * f_cpu / busy or 0))
+end
+
+-- ENABLE_ENTROPY_POOL appends the pool after the phases
+if pos <= #bytes then
+  local nonce_cycles = take(4)
+  local nonce_samples = take(2)
+  local rejected = take(2)
+  local rct_failures = take(2)
+  local apt_failures = take(2)
+  print("")
+  if nonce_cycles > 0 then
+    print(string.format("entropy pool      first CMD_AUTH challenge %.3f ms after reset, %d samples in the pool",
+      1000 * nonce_cycles / f_cpu, nonce_samples))
+  else
+    print("entropy pool      no CMD_AUTH challenge drawn yet")
+  end
+  print(string.format("health tests      %d samples dropped, %d repetition count and %d adaptive proportion failures",
+    rejected, rct_failures, apt_failures))
+end
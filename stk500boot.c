@@ -102,13 +102,7 @@ LICENSE:
 
 
 #include	<inttypes.h>
-#include	<avr/io.h>
-#include	<avr/interrupt.h>
-#include	<avr/boot.h>
-#include	<avr/pgmspace.h>
-#include	<util/delay.h>
-#include	<avr/eeprom.h>
-#include	<avr/common.h>
+#include	"hal.h"
 #include	<stdlib.h>
 #include	"command.h"
 #include	<string.h>
@@ -129,13 +123,6 @@ const unsigned char key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xa
 #endif
 */
 
-#ifndef EEWE
-	#define EEWE    1
-#endif
-#ifndef EEMWE
-	#define EEMWE   2
-#endif
-
 //#define	_DEBUG_SERIAL_
 //#define	_DEBUG_WITH_LEDS_
 
@@ -148,6 +135,93 @@ const unsigned char key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xa
 #define	REMOVE_CMD_SPI_MULTI				// disable processing of SPI_MULTI commands, Remark this line for AVRDUDE <Worapoht>
 //
 
+/*
+ * Optional SOTA features. They are off by default because not every board
+ * target has been built with them against its boot section; turn them on
+ * here or with SOTA_FEATURES in the Makefile and check the result with
+ * make sizes, which fails a board whose code no longer fits:
+ *	make sizes SOTA_FEATURES="-DENABLE_FAST_AUTH -DENABLE_RESUME"
+ */
+//#define	ENABLE_IMAGE_VERIFY					// CMD_VERIFY_IMAGE, on-device CRC32 digest of the programmed image
+//#define	ENABLE_VERIFY_SHA256				// CMD_VERIFY_IMAGE also offers SHA-256 (about 2K bytes more code)
+//#define	ENABLE_IMAGE_SIGNATURE				// hash pages while programming, boot only after the CMD_IMAGE_SIGNATURE check (RSA-2048, image_key.h)
+//#define	ENABLE_RESUME						// CMD_RESUME, page completion map kept in EEPROM across link drops and resets
+//#define	ENABLE_DUAL_SLOT					// stage images in a second slot and activate them by page copy (>= 128K flash)
+//#define	ENABLE_APP_TRAILER					// refuse to boot an image whose length/CRC32 trailer does not match, result cached in EEPROM
+//#define	ENABLE_FAST_AUTH					// CMD_AUTH_FAST one round trip handshake, CMD_AUTH_TICKET session resumption
+//#define	ENABLE_SESSION_KEYS					// per session link key and chained IVs after CMD_AUTH_FAST / CMD_AUTH_TICKET
+//#define	ENABLE_ENTROPY_POOL					// CMD_AUTH challenges from timer jitter and ADC noise gathered while waiting
+//#define	ENABLE_MAILBOX						// the application can request an update through a RAM mailbox, see mailbox.h
+//#define	ENABLE_INLINE_PROGRAM				// decrypt CMD_PROGRAM_FLASH_ISP block by block straight into the SPM page buffer
+//#define	ENABLE_READ_BULK					// CMD_READ_FLASH_BULK, stream a flash range as answers to one request
+//#define	ENABLE_SPIFLASH_STAGING				// replay a SOTA stream the application left in external SPI flash, see spiflash.h
+//#define	ENABLE_STATS						// CMD_GET_STATS, link counters and Timer1 cycles per phase, see stats.lua
+//#define	ENABLE_TRACE						// CMD_GET_TRACE, Timer1 stamped hot path events in a RAM ring, see trace.lua
+
+#ifdef HOST_BUILD
+	//*	no noise sources or LED on the workstation, host/hal_host.c keeps the mailbox in a file
+	#undef	ENABLE_ENTROPY_POOL
+	#undef	REMOVE_BOOTLOADER_LED
+	#define	REMOVE_BOOTLOADER_LED
+#endif
+#if defined(ENABLE_DUAL_SLOT) && (FLASHEND < 0x1FFFF)
+	#undef	ENABLE_DUAL_SLOT				//*	two slots do not leave room for a useful application
+#endif
+
+#if defined(ENABLE_IMAGE_SIGNATURE) || defined(ENABLE_DUAL_SLOT) || defined(ENABLE_SPIFLASH_STAGING) || defined(ENABLE_APP_TRAILER)
+	#undef	ENABLE_IMAGE_VERIFY
+	#define	ENABLE_IMAGE_VERIFY
+#endif
+#ifdef ENABLE_SESSION_KEYS
+	#undef	ENABLE_FAST_AUTH
+	#define	ENABLE_FAST_AUTH
+#endif
+#ifdef ENABLE_IMAGE_SIGNATURE
+	#undef	ENABLE_IMAGE_VERIFY
+	#define	ENABLE_IMAGE_VERIFY
+	#undef	ENABLE_VERIFY_SHA256
+	#define	ENABLE_VERIFY_SHA256
+#endif
+#if defined(ENABLE_STATS) || defined(ENABLE_TRACE)
+	#define	ENABLE_CYCLE_CLOCK				//*	Timer1 extended to a 32 bit cycle counter
+#endif
+
+#ifdef ENABLE_SPIFLASH_STAGING
+	#include	"spiflash.h"
+#endif
+#ifdef ENABLE_MAILBOX
+	#include	"mailbox.h"
+#endif
+
+#ifdef ENABLE_MAILBOX
+	#define	BOOT_STACK_TOP		(SOTA_MAILBOX_ADDRESS - 1)	//*	the stack must not run over the mailbox
+#else
+	#define	BOOT_STACK_TOP		RAMEND
+#endif
+
+#ifdef ENABLE_IMAGE_SIGNATURE
+// public key images are signed against, the private key never comes near
+// the device, so reading one out does not let anybody sign images
+#include "image_key.h"
+#endif
+#ifdef ENABLE_SESSION_KEYS
+// link key and CBC chains of the current session, see session_begin()
+unsigned char	sessionKey[16];
+unsigned char	rxIv[16];
+unsigned char	txIv[16];
+unsigned char	sessionNonce[16];	// what session_start() derives the next session from
+unsigned char	sessionActive	=	0;
+unsigned char	sessionPending	=	0;	// session_begin() ran, the session starts once its answer is out
+
+	#define	LINK_KEY	(sessionActive ? sessionKey : key)
+	#define	LINK_RX_IV	(sessionActive ? rxIv : iv)
+	#define	LINK_TX_IV	(sessionActive ? txIv : iv)
+#else
+	#define	LINK_KEY	key
+	#define	LINK_RX_IV	iv
+	#define	LINK_TX_IV	iv
+#endif
+
 
 
 //************************************************************************
@@ -283,6 +357,50 @@ const unsigned char key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xa
 
 #define APP_END  (FLASHEND -(2*BOOTSIZE) + 1)
 
+#define	APP_PAGE_COUNT		(APP_END / SPM_PAGESIZE)
+#define	APP_PAGE_MAP_SIZE	((APP_PAGE_COUNT + 7) / 8)		// one bit per application page
+
+/*
+ * EEPROM cells owned by the bootloader, allocated downwards from E2END
+ * so they stay clear of the application's EEPROM data
+ */
+#define	EE_IMAGE_STATUS			(E2END)					// IMAGE_STATUS_AUTHENTIC once the image signature verified
+#define	EE_RESUME_IMAGE_ID		(EE_IMAGE_STATUS - 4)		// 4 bytes, image the completion map belongs to
+#define	EE_RESUME_MAP			(EE_RESUME_IMAGE_ID - APP_PAGE_MAP_SIZE)	// a set bit marks a page still to be sent
+#define	EE_ACTIVATE_PAGES		(EE_RESUME_MAP - 2)		// 2 bytes, number of staged pages to copy into slot A
+#define	EE_ACTIVATE_STATUS		(EE_ACTIVATE_PAGES - 1)	// ACTIVATE_PENDING while that copy is unfinished
+#define	EE_AUTH_COUNTER			(EE_ACTIVATE_STATUS - 4)	// 4 bytes, last counter accepted by CMD_AUTH_FAST
+#define	EE_SESSION_TICKET		(EE_AUTH_COUNTER - 16)	// 16 bytes, ticket CMD_AUTH_TICKET expects next
+#define	EE_ENTROPY_SEED			(EE_SESSION_TICKET - 16)	// 16 bytes, pool seed carried over to the next boot, or the last device nonce
+#define	EE_APP_VERIFIED			(EE_ENTROPY_SEED - 1)	// APP_VERIFIED once the trailer CRC matched the flash
+#define	EE_UPLOAD_STATUS		(EE_APP_VERIFIED - 1)	// UPLOAD_IN_PROGRESS from the first page written to the commit
+
+#define	IMAGE_STATUS_AUTHENTIC		0x5A
+#define	IMAGE_STATUS_UNCHECKED	0x00
+#define	ACTIVATE_PENDING		0xA5
+#define	APP_VERIFIED			0x3C
+#define	UPLOAD_IN_PROGRESS		0x69
+
+/*
+ * Dual slot staging: slot A at 0 is the application that runs, slot B in
+ * the upper half of the application section receives the new image
+ */
+#define	SLOT_SIZE				((APP_END / 2) & ~((address_t)SPM_PAGESIZE - 1))
+#define	SLOT_B_BASE				SLOT_SIZE
+
+/*
+ * Application trailer in the last page of the image area (slot A when
+ * staging), written once an upload is complete or by host/hexmerge -t:
+ *	APP_TRAILER_MAGIC, image length, CRC32 of the image, all 4 bytes little endian
+ */
+#ifdef ENABLE_DUAL_SLOT
+	#define	APP_IMAGE_END		SLOT_SIZE
+#else
+	#define	APP_IMAGE_END		APP_END
+#endif
+#define	APP_TRAILER				(APP_IMAGE_END - SPM_PAGESIZE)	// images end below this page
+#define	APP_TRAILER_MAGIC		0x41544F53UL					// "SOTA"
+
 /*
  * Signature bytes are not available in avr-gcc io_xxx.h
  */
@@ -316,91 +434,13 @@ const unsigned char key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xa
 	#define SIGNATURE_BYTES  0x1e9405
 #elif defined (__AVR_AT90USB1287__)
 	#define SIGNATURE_BYTES  0x1e9782
+#elif defined (HOST_BUILD)
+	#define SIGNATURE_BYTES  0x1E9801		//*	the simulated part is laid out like an ATmega2560
 #else
 	#error "no signature definition for MCU available"
 #endif
 
 
-#if defined(_BOARD_ROBOTX_) || defined(__AVR_AT90USB1287__) || defined(__AVR_AT90USB1286__)
-	#define	UART_BAUD_RATE_LOW			UBRR1L
-	#define	UART_STATUS_REG				UCSR1A
-	#define	UART_CONTROL_REG			UCSR1B
-	#define	UART_ENABLE_TRANSMITTER		TXEN1
-	#define	UART_ENABLE_RECEIVER		RXEN1
-	#define	UART_TRANSMIT_COMPLETE		TXC1
-	#define	UART_RECEIVE_COMPLETE		RXC1
-	#define	UART_DATA_REG				UDR1
-	#define	UART_DOUBLE_SPEED			U2X1
-
-#elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega16__) || defined(__AVR_ATmega32__) \
-	|| defined(__AVR_ATmega8515__) || defined(__AVR_ATmega8535__)
-	/* ATMega8 with one USART */
-	#define	UART_BAUD_RATE_LOW			UBRRL
-	#define	UART_STATUS_REG				UCSRA
-	#define	UART_CONTROL_REG			UCSRB
-	#define	UART_ENABLE_TRANSMITTER		TXEN
-	#define	UART_ENABLE_RECEIVER		RXEN
-	#define	UART_TRANSMIT_COMPLETE		TXC
-	#define	UART_RECEIVE_COMPLETE		RXC
-	#define	UART_DATA_REG				UDR
-	#define	UART_DOUBLE_SPEED			U2X
-
-#elif defined(__AVR_ATmega64__) || defined(__AVR_ATmega128__) || defined(__AVR_ATmega162__) \
-	 || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega2561__)
-	/* ATMega with two USART, use UART0 */
-	#define	UART_BAUD_RATE_LOW			UBRR0L
-	#define	UART_STATUS_REG				UCSR0A
-	#define	UART_CONTROL_REG			UCSR0B
-	#define	UART_ENABLE_TRANSMITTER		TXEN0
-	#define	UART_ENABLE_RECEIVER		RXEN0
-	#define	UART_TRANSMIT_COMPLETE		TXC0
-	#define	UART_RECEIVE_COMPLETE		RXC0
-	#define	UART_DATA_REG				UDR0
-	#define	UART_DOUBLE_SPEED			U2X0
-#elif defined(UBRR0L) && defined(UCSR0A) && defined(TXEN0)
-	/* ATMega with two USART, use UART0 */
-	#define	UART_BAUD_RATE_LOW			UBRR0L
-	#define	UART_STATUS_REG				UCSR0A
-	#define	UART_CONTROL_REG			UCSR0B
-	#define	UART_ENABLE_TRANSMITTER		TXEN0
-	#define	UART_ENABLE_RECEIVER		RXEN0
-	#define	UART_TRANSMIT_COMPLETE		TXC0
-	#define	UART_RECEIVE_COMPLETE		RXC0
-	#define	UART_DATA_REG				UDR0
-	#define	UART_DOUBLE_SPEED			U2X0
-#elif defined(UBRRL) && defined(UCSRA) && defined(UCSRB) && defined(TXEN) && defined(RXEN)
-	//* catch all
-	#define	UART_BAUD_RATE_LOW			UBRRL
-	#define	UART_STATUS_REG				UCSRA
-	#define	UART_CONTROL_REG			UCSRB
-	#define	UART_ENABLE_TRANSMITTER		TXEN
-	#define	UART_ENABLE_RECEIVER		RXEN
-	#define	UART_TRANSMIT_COMPLETE		TXC
-	#define	UART_RECEIVE_COMPLETE		RXC
-	#define	UART_DATA_REG				UDR
-	#define	UART_DOUBLE_SPEED			U2X
-#else
-	#error "no UART definition for MCU available"
-#endif
-
-
-
-/*
- * Macro to calculate UBBR from XTAL and baudrate
- */
-#if defined(__AVR_ATmega32__) && UART_BAUDRATE_DOUBLE_SPEED
-	#define UART_BAUD_SELECT(baudRate,xtalCpu) ((xtalCpu / 4 / baudRate - 1) / 2)
-#elif defined(__AVR_ATmega32__)
-	#define UART_BAUD_SELECT(baudRate,xtalCpu) ((xtalCpu / 8 / baudRate - 1) / 2)
-#elif UART_BAUDRATE_DOUBLE_SPEED
-	#define UART_BAUD_SELECT(baudRate,xtalCpu) (((float)(xtalCpu))/(((float)(baudRate))*8.0)-1.0+0.5)
-#else
-	#define UART_BAUD_SELECT(baudRate,xtalCpu) (((float)(xtalCpu))/(((float)(baudRate))*16.0)-1.0+0.5)
-#endif
-
-
-
-
 /*
  * States used in the receive state machine
  */
@@ -413,6 +453,10 @@ const unsigned char key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xa
 #define	ST_GET_CHECK	6
 #define	ST_PROCESS		7
 
+//*	sequence numbers this close to the expected one are frames of the same
+//*	upload arriving late or early, they are dropped without an answer
+#define	SEQ_WINDOW		16
+
 /*
  * States used in the encrypted command packet stage.
  */
@@ -421,15 +465,6 @@ const unsigned char key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xa
  #define	SOTA_PACKET_RETRIEVE_PROCESSING		2
  #define	SOTA_PACKET_RETRIEVE_FINISHED		3
 
-/*
- * use 16bit address variable for ATmegas with <= 64K flash
- */
-#if defined(RAMPZ)
-	typedef uint32_t address_t;
-#else
-	typedef uint16_t address_t;
-#endif
-
 /*
  * function prototypes
  */
@@ -455,7 +490,9 @@ int	myNumber;
 	theChar	=	0x30 + (myNumber % 10);
 	sendchar(theChar );
 }
+#ifdef ENABLE_MONITOR
 static unsigned char recchar(void);
+#endif
 //Burak
 #define Nb 4
 // The number of 32 bit words in a key.
@@ -487,6 +524,9 @@ static unsigned char RoundKey[176];
 // The Key input to the AES Program
 static const unsigned char* Key;
 
+// The key RoundKey was expanded from, KeyExpansion only runs when it changes
+static const unsigned char* expandedKey;
+
 // #if defined(CBC) && CBC
   // Initial Vector used only for CBC mode
   static unsigned char* Iv;
@@ -867,38 +907,32 @@ static void InvCipher(void)
   AddRoundKey(0);
 }
 
-static void BlockCopy(unsigned char* output, const unsigned char* input)
+// Point Key at newKey, the schedule is kept while the key stays the same
+static void key_select(const unsigned char* newKey)
 {
-  unsigned char i;
-  for (i=0;i<16;++i)
+  if (newKey != expandedKey)
   {
-    output[i] = input[i];
+    Key = newKey;
+    KeyExpansion();
+    expandedKey = newKey;
   }
 }
-static void aes_decrypt(unsigned char* output, unsigned char* input, unsigned int length)
+
+// CBC decrypt on the link key, starting from chain value iv
+static void aes_decrypt_on(unsigned char* output, unsigned char* input, unsigned int length, const unsigned char* iv)
 {
 	uintptr_t i;
 
-  uint8_t extra = length % BLOCKLEN; /* Remaining bytes in the last non-full block */
-
-  // Skip the key expansion if key is passed as 0
-  if (0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
+  key_select(LINK_KEY);
 	// sendchar(0x16);
 	// PrintDecInt(length,10);
 	// sendchar(0x17);
-  // If iv is passed as 0, we continue to encrypt without re-setting the Iv
-  if (iv != 0)
-  {
-    Iv = (uint8_t*)iv;
-  }
+  Iv = (uint8_t*)iv;
 	// sendchar(0x18);
 	// PrintDecInt(length,10);
 	// sendchar(0x19);
-  for (i = 0; i < length; i += BLOCKLEN)
+  // CBC only covers whole blocks, a trailing partial block is left alone
+  for (i = 0; (i + BLOCKLEN) <= length; i += BLOCKLEN)
   {
     memcpy(output, input, BLOCKLEN);
     state = (state_t*)output;
@@ -911,32 +945,23 @@ static void aes_decrypt(unsigned char* output, unsigned char* input, unsigned in
 	// sendchar(0x20);
 	// PrintDecInt(length,10);
 	// sendchar(0x21);
-  if (extra)
-  {
-    memcpy(output, input, extra);
-    state = (state_t*)output;
-    InvCipher();
-  }
+}
 
+// Without a session every packet starts from the constant iv, within one
+// from the last block of the packet taken before, see frame_taken()
+static void aes_decrypt(unsigned char* output, unsigned char* input, unsigned int length)
+{
+  aes_decrypt_on(output, input, length, LINK_RX_IV);
 }
 
 static void aes_encrypt(unsigned char* output, unsigned char* input, unsigned int length){
 	uintptr_t i;
-  uint8_t extra = length % 16; /* Remaining bytes in the last non-full block */
-
-  // Skip the key expansion if key is passed as 0
-  if (0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
 
-  if (iv != 0)
-  {
-    Iv = (uint8_t*)iv;
-  }
+  key_select(LINK_KEY);
+  Iv = (uint8_t*)LINK_TX_IV;
 
-  for (i = 0; i < length; i += 16)
+  // whole blocks only, send_response() pads the answer to a multiple of 16
+  for (i = 0; (i + 16) <= length; i += 16)
   {
     XorWithIv(input);
     memcpy(output, input, 16);
@@ -947,22 +972,261 @@ static void aes_encrypt(unsigned char* output, unsigned char* input, unsigned in
     output += 16;
     //printf("Step %d - %d", i/16, i);
   }
+#ifdef ENABLE_SESSION_KEYS
+  if (sessionActive && (length >= 16))
+  {
+    memcpy(txIv, Iv, 16);
+  }
+#endif
+}
+
+
+#ifdef ENABLE_IMAGE_VERIFY
+/*****************************************************************************/
+/* Image digests                                                             */
+/*****************************************************************************/
+// CRC32 (IEEE 802.3, same as zlib) computed a nibble at a time,
+// a 16 entry table is a good trade between speed and RAM on an 8 bit core.
+static const uint32_t crc32Table[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
 
-  if (extra)
+static uint32_t crc32_update(uint32_t crc, unsigned char data)
+{
+  crc = crc32Table[(crc ^ data) & 0x0F] ^ (crc >> 4);
+  crc = crc32Table[(crc ^ (data >> 4)) & 0x0F] ^ (crc >> 4);
+  return crc;
+}
+
+#ifdef ENABLE_VERIFY_SHA256
+// SHA-256 (FIPS 180-4). The message schedule is kept as a rolling 16 word
+// window so the whole context fits in about 110 bytes of RAM.
+typedef struct
+{
+  uint32_t      h[8];
+  unsigned char block[64];
+  uint32_t      length;     // message length in bytes
+  unsigned char fill;       // bytes in block
+} sha256_ctx_t;
+
+static const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#define ROTR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress(sha256_ctx_t* ctx)
+{
+  uint32_t w[16];
+  uint32_t a, b, c, d, e, f, g, h, t1, t2;
+  unsigned char i;
+
+  for (i = 0; i < 16; ++i)
   {
-    memcpy(output, input, extra);
-    state = (state_t*)output;
-    Cipher();
+    w[i] = ((uint32_t)ctx->block[i * 4] << 24) | ((uint32_t)ctx->block[i * 4 + 1] << 16)
+         | ((uint32_t)ctx->block[i * 4 + 2] << 8) | ctx->block[i * 4 + 3];
+  }
+
+  a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+  e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+
+  for (i = 0; i < 64; ++i)
+  {
+    if (i >= 16)
+    {
+      uint32_t w15 = w[(i + 1) & 0x0F];
+      uint32_t w2  = w[(i + 14) & 0x0F];
+      w[i & 0x0F] += (ROTR32(w15, 7) ^ ROTR32(w15, 18) ^ (w15 >> 3))
+                   + w[(i + 9) & 0x0F]
+                   + (ROTR32(w2, 17) ^ ROTR32(w2, 19) ^ (w2 >> 10));
+    }
+    t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i & 0x0F];
+    t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+  ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+static void sha256_init(sha256_ctx_t* ctx)
+{
+  ctx->h[0] = 0x6a09e667; ctx->h[1] = 0xbb67ae85; ctx->h[2] = 0x3c6ef372; ctx->h[3] = 0xa54ff53a;
+  ctx->h[4] = 0x510e527f; ctx->h[5] = 0x9b05688c; ctx->h[6] = 0x1f83d9ab; ctx->h[7] = 0x5be0cd19;
+  ctx->length = 0;
+  ctx->fill = 0;
+}
+
+static void sha256_update(sha256_ctx_t* ctx, unsigned char data)
+{
+  ctx->block[ctx->fill++] = data;
+  ctx->length++;
+  if (ctx->fill == 64)
+  {
+    sha256_compress(ctx);
+    ctx->fill = 0;
+  }
+}
+
+// Pads the message and writes the 32 byte big endian digest.
+static void sha256_final(sha256_ctx_t* ctx, unsigned char* digest)
+{
+  uint32_t bits = ctx->length << 3;
+  unsigned char i;
+
+  ctx->block[ctx->fill++] = 0x80;
+  if (ctx->fill > 56)
+  {
+    while (ctx->fill < 64)
+      ctx->block[ctx->fill++] = 0;
+    sha256_compress(ctx);
+    ctx->fill = 0;
+  }
+  while (ctx->fill < 60)
+    ctx->block[ctx->fill++] = 0;
+  ctx->block[60] = bits >> 24;
+  ctx->block[61] = bits >> 16;
+  ctx->block[62] = bits >> 8;
+  ctx->block[63] = bits;
+  sha256_compress(ctx);
+
+  for (i = 0; i < 32; ++i)
+  {
+    digest[i] = ctx->h[i >> 2] >> (24 - 8 * (i & 3));
+  }
+}
+#endif	//	ENABLE_VERIFY_SHA256
+#endif	//	ENABLE_IMAGE_VERIFY
+
+#ifdef ENABLE_IMAGE_SIGNATURE
+/*****************************************************************************/
+/* Image signatures                                                          */
+/*****************************************************************************/
+// RSA-2048 PKCS#1 v1.5 with SHA-256 and e = 65537, what openssl dgst -sha256
+// -sign makes. Numbers are big endian as they come over the link. The
+// Montgomery products take one byte of a at a time into two carry chains,
+// the 8x8 bit multiply of the AVR, in about 770 bytes of stack.
+#define RSA_BYTES 256
+
+// SHA-256 DigestInfo of EMSA-PKCS1-v1_5 (RFC 8017 section 9.2)
+static const unsigned char sha256DigestInfo[19] = {
+  0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+
+static unsigned char rsaN0Inv;    // -1/n mod 256
+
+// out = a * b / 2^2048 mod n
+static void rsa_mont_mul(unsigned char* out, const unsigned char* a, const unsigned char* b)
+{
+  unsigned char t[RSA_BYTES + 1];   // least significant byte first
+  unsigned int i, j;
+  uint16_t carry, reduce;
+  unsigned char ai, m;
+
+  memset(t, 0, sizeof(t));
+  for (i = 0; i < RSA_BYTES; ++i)
+  {
+    // t = (t + a[i] * b + m * n) / 256, m makes the low byte 0
+    ai = a[RSA_BYTES - 1 - i];
+    carry = t[0] + (uint16_t)ai * b[RSA_BYTES - 1];
+    m = (unsigned char)carry * rsaN0Inv;
+    reduce = (carry & 0xFF) + (uint16_t)m * imageKeyModulus[RSA_BYTES - 1];
+    carry >>= 8;
+    reduce >>= 8;
+    for (j = 1; j < RSA_BYTES; ++j)
+    {
+      carry += t[j] + (uint16_t)ai * b[RSA_BYTES - 1 - j];
+      reduce += (carry & 0xFF) + (uint16_t)m * imageKeyModulus[RSA_BYTES - 1 - j];
+      t[j - 1] = reduce;
+      carry >>= 8;
+      reduce >>= 8;
+    }
+    carry += t[RSA_BYTES] + reduce;
+    t[RSA_BYTES - 1] = carry;
+    t[RSA_BYTES] = carry >> 8;
+  }
+
+  // t < 2n, subtract n once unless that borrows
+  reduce = 0;
+  for (j = 0; j < RSA_BYTES; ++j)
+  {
+    reduce = (uint16_t)t[j] - imageKeyModulus[RSA_BYTES - 1 - j] - reduce;
+    out[RSA_BYTES - 1 - j] = reduce;
+    reduce = (reduce >> 8) & 1;
+  }
+  if (reduce > t[RSA_BYTES])
+  {
+    for (j = 0; j < RSA_BYTES; ++j)
+    {
+      out[RSA_BYTES - 1 - j] = t[j];
+    }
   }
 }
 
+// digest is the SHA-256 of the image, signature s must satisfy
+// s^65537 mod n = 00 01 FF .. FF 00 DigestInfo digest
+static unsigned char image_signature_valid(const unsigned char* digest, const unsigned char* signature)
+{
+  unsigned char x[RSA_BYTES];
+  unsigned char y[RSA_BYTES];
+  unsigned char expected, diff = 0;
+  unsigned int i;
+
+  // s < n
+  for (i = 0; (i < RSA_BYTES) && (signature[i] == imageKeyModulus[i]); ++i)
+    ;
+  if ((i == RSA_BYTES) || (signature[i] > imageKeyModulus[i]))
+  {
+    return 0;
+  }
+
+  // Newton's iteration, an odd n is its own inverse mod 8
+  rsaN0Inv = imageKeyModulus[RSA_BYTES - 1];
+  for (i = 0; i < 2; ++i)
+  {
+    rsaN0Inv *= 2 - imageKeyModulus[RSA_BYTES - 1] * rsaN0Inv;
+  }
+  rsaN0Inv = -rsaN0Inv;
+
+  rsa_mont_mul(x, signature, imageKeyRR);     // s R
+  for (i = 0; i < 16; i += 2)
+  {
+    rsa_mont_mul(y, x, x);
+    rsa_mont_mul(x, y, y);                    // s^65536 R after the last one
+  }
+  rsa_mont_mul(y, x, signature);
+
+  for (i = 0; i < RSA_BYTES; ++i)
+  {
+    if (i < 2)
+      expected = i;
+    else if (i < RSA_BYTES - 52)
+      expected = 0xFF;
+    else if (i == RSA_BYTES - 52)
+      expected = 0x00;
+    else if (i < RSA_BYTES - 32)
+      expected = sha256DigestInfo[i - (RSA_BYTES - 51)];
+    else
+      expected = digest[i - (RSA_BYTES - 32)];
+    diff |= y[i] ^ expected;
+  }
+  return (diff == 0);
+}
+#endif
 
 //Burak
 /*
  * since this bootloader is not linked against the avr-gcc crt1 functions,
  * to reduce the code size, we need to provide our own initialization
  */
-void __jumpMain	(void) __attribute__ ((naked)) __attribute__ ((section (".init9")));
+#ifndef HOST_BUILD
+void __jumpMain	(void) __attribute__ ((naked)) __attribute__ ((used)) __attribute__ ((section (".init9")));
 #include <avr/sfr_defs.h>
 
 //#define	SPH_REG	0x3E
@@ -974,20 +1238,21 @@ void __jumpMain(void)
 //*	July 17, 2010	<MLS> Added stack pointer initialzation
 //*	the first line did not do the job on the ATmega128
 
-	asm volatile ( ".set __stack, %0" :: "i" (RAMEND) );
+	asm volatile ( ".set __stack, %0" :: "i" (BOOT_STACK_TOP) );
 
 //*	set stack pointer to top of RAM
 
-	asm volatile ( "ldi	16, %0" :: "i" (RAMEND >> 8) );
+	asm volatile ( "ldi	16, %0" :: "i" (BOOT_STACK_TOP >> 8) );
 	asm volatile ( "out %0,16" :: "i" (AVR_STACK_POINTER_HI_ADDR) );
 
-	asm volatile ( "ldi	16, %0" :: "i" (RAMEND & 0x0ff) );
+	asm volatile ( "ldi	16, %0" :: "i" (BOOT_STACK_TOP & 0x0ff) );
 	asm volatile ( "out %0,16" :: "i" (AVR_STACK_POINTER_LO_ADDR) );
 
 	asm volatile ( "clr __zero_reg__" );									// GCC depends on register r1 set to 0
 	asm volatile ( "out %0, __zero_reg__" :: "I" (_SFR_IO_ADDR(SREG)) );	// set SREG to 0
 	asm volatile ( "jmp main");												// jump to main()
 }
+#endif
 
 
 //*****************************************************************************
@@ -996,7 +1261,7 @@ void delay_ms(unsigned int timedelay)
 	unsigned int i;
 	for (i=0;i<timedelay;i++)
 	{
-		_delay_ms(0.5);
+		hal_delay_us(500);
 	}
 }
 
@@ -1008,90 +1273,930 @@ void delay_ms(unsigned int timedelay)
  */
 static void sendchar(char c)
 {
-	UART_DATA_REG	=	c;										// prepare transmission
-	while (!(UART_STATUS_REG & (1 << UART_TRANSMIT_COMPLETE)));	// wait until byte sent
-	UART_STATUS_REG |= (1 << UART_TRANSMIT_COMPLETE);			// delete TXCflag
+	hal_uart_put(c);
 }
 
 
 //************************************************************************
 static int	Serial_Available(void)
 {
-	return(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE));	// wait for data
+	return(hal_uart_available());	// wait for data
 }
 
 
+#ifdef ENABLE_MONITOR
 //*****************************************************************************
 /*
  * Read single byte from USART, block if no data available
  */
 static unsigned char recchar(void)
 {
-	while (!(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE)))
+	return hal_uart_get();
+}
+#endif
+
+//*****************************************************************************
+/*
+ * EEPROM write queue
+ * Bytes to be programmed are queued and written from the EEPROM ready
+ * interrupt, so the bootloader can go back to receiving while a write cycle
+ * (about 3.4 ms per byte) is in progress. Bytes that already hold the
+ * requested value are skipped without a write cycle.
+ */
+#ifdef HOST_BUILD
+//*****************************************************************************
+/*
+ * the simulated EEPROM takes every byte at once
+ */
+static void eeprom_queue_write(uint16_t eeAddress, unsigned char data)
+{
+	hal_host_eeprom_write(eeAddress, data);
+}
+
+//*****************************************************************************
+static void eeprom_queue_flush(void)
+{
+}
+#else
+#define	EEPROM_QUEUE_SIZE	32		// must be a power of two
+
+struct
+{
+	uint16_t		address;
+	unsigned char	data;
+} eepromQueue[EEPROM_QUEUE_SIZE];
+
+volatile unsigned char	eepromQueueHead	=	0;	// written by the main loop only
+volatile unsigned char	eepromQueueTail	=	0;	// written by the interrupt only
+
+//*****************************************************************************
+ISR(EE_READY_vect)
+{
+	while (eepromQueueTail != eepromQueueHead)
 	{
-		// wait for data
+		unsigned char	tail	=	eepromQueueTail;
+		unsigned char	data	=	eepromQueue[tail].data;
+
+		EEARL	=	eepromQueue[tail].address;
+		EEARH	=	eepromQueue[tail].address >> 8;
+		eepromQueueTail	=	(tail + 1) & (EEPROM_QUEUE_SIZE - 1);
+
+		EECR	|=	(1<<EERE);			// Read EEPROM
+		if (EEDR != data)
+		{
+			EEDR	=	data;
+			EECR	|=	(1<<EEMWE);		// start write, interrupts are off in here
+			EECR	|=	(1<<EEWE);
+			return;
+		}
 	}
-	return UART_DATA_REG;
+	EECR	&=	~(1<<EERIE);			// queue drained
 }
 
-#define	MAX_TIME_COUNT	(F_CPU >> 1)
 //*****************************************************************************
-static unsigned char recchar_timeout(void)
+/*
+ * queue one EEPROM byte, waits only while the queue is full
+ */
+static void eeprom_queue_write(uint16_t eeAddress, unsigned char data)
 {
-uint32_t count = 0;
+	unsigned char	head	=	eepromQueueHead;
+	unsigned char	next	=	(head + 1) & (EEPROM_QUEUE_SIZE - 1);
 
-	while (!(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE)))
+	while (next == eepromQueueTail)
 	{
-		// wait for data
-		count++;
-		if (count > MAX_TIME_COUNT)
+		// wait for the interrupt to make room
+	}
+	eepromQueue[head].address	=	eeAddress;
+	eepromQueue[head].data		=	data;
+	eepromQueueHead				=	next;
+	EECR	|=	(1<<EERIE);
+}
+
+//*****************************************************************************
+/*
+ * wait until every queued EEPROM byte has been written
+ * must be called before SPM and before reading the EEPROM directly
+ */
+static void eeprom_queue_flush(void)
+{
+	while (EECR & ((1<<EERIE) | (1<<EEWE)))
+	{
+		// wait for the queue to drain
+	}
+}
+#endif	//	HOST_BUILD
+
+#ifdef ENABLE_ENTROPY_POOL
+/*
+ * Entropy pool, filled while the bootloader waits for the host anyway.
+ * Timer1 runs free from the CPU clock. The watchdog runs from its own RC
+ * oscillator and interrupts every 16 ms, the timer value it catches carries
+ * the jitter between both clocks. The low bits of ADC conversions add noise.
+ * Every sample passes the two health tests of NIST SP 800-90B 4.4 before it
+ * is stirred into the pool: the repetition count test catches a source
+ * stuck on one value, the adaptive proportion test one that keeps coming
+ * back to a value. Both cutoffs assume 4 bits of entropy per sample and
+ * give a false alarm once in 2^20 samples. The seed saved by the previous
+ * boot is mixed in first, so even the first nonce after reset differs from
+ * the last. CMD_GET_STATS reports the test results and how long the pool
+ * collected before the first nonce.
+ */
+#define	ENTROPY_POOL_SIZE		16
+#define	ENTROPY_RCT_CUTOFF		6		//*	identical samples in a row that mark a stuck source
+#define	ENTROPY_APT_WINDOW		512		//*	samples per adaptive proportion test
+#define	ENTROPY_APT_CUTOFF		62		//*	the first sample of a window seen this often marks a biased source
+#define	ENTROPY_SOURCE_TIMER	0
+#define	ENTROPY_SOURCE_ADC		1
+
+unsigned char		entropyPool[ENTROPY_POOL_SIZE];
+unsigned char		entropyIndex		=	0;
+unsigned char		entropyLast[2];
+unsigned char		entropyRepeat[2];
+unsigned char		entropyAptSample[2];
+unsigned char		entropyAptCount[2];
+uint16_t			entropyAptIndex[2];
+unsigned char		entropyNonceCount	=	0;
+volatile uint16_t	entropySamples		=	0;	//*	samples stirred into the pool
+volatile uint16_t	entropyRejected		=	0;	//*	samples dropped by the health tests
+volatile uint16_t	entropyRctFailures	=	0;	//*	runs the repetition count test cut off
+volatile uint16_t	entropyAptFailures	=	0;	//*	windows the adaptive proportion test failed
+
+//*****************************************************************************
+/*
+ * health test a sample and stir it into the pool, interrupts must be off
+ */
+static void entropy_add(unsigned char source, unsigned char sample)
+{
+unsigned char	c;
+
+	//*	adaptive proportion test, the rest of a failed window is dropped
+	if (entropyAptIndex[source] == 0)
+	{
+		entropyAptSample[source]	=	sample;
+		entropyAptCount[source]		=	0;
+	}
+	if (++entropyAptIndex[source] == ENTROPY_APT_WINDOW)
+	{
+		entropyAptIndex[source]	=	0;
+	}
+	if ((sample == entropyAptSample[source]) && (entropyAptCount[source] < ENTROPY_APT_CUTOFF))
+	{
+		if (++entropyAptCount[source] == ENTROPY_APT_CUTOFF)
 		{
-		unsigned int	data;
-		#if (FLASHEND > 0x10000)
-			data	=	pgm_read_word_far(0);	//*	get the first word of the user program
-		#else
-			data	=	pgm_read_word_near(0);	//*	get the first word of the user program
-		#endif
-			if (data != 0xffff)					//*	make sure its valid before jumping to it.
+			entropyAptFailures++;
+		}
+	}
+	if (entropyAptCount[source] >= ENTROPY_APT_CUTOFF)
+	{
+		entropyRejected++;
+		return;
+	}
+
+	//*	repetition count test
+	if (sample == entropyLast[source])
+	{
+		if (++entropyRepeat[source] >= ENTROPY_RCT_CUTOFF)
+		{
+			if (entropyRepeat[source] == ENTROPY_RCT_CUTOFF)
 			{
-				asm volatile(
-						"clr	r30		\n\t"
-						"clr	r31		\n\t"
-						"ijmp	\n\t"
-						);
+				entropyRctFailures++;
 			}
-			count	=	0;
+			entropyRepeat[source]	=	ENTROPY_RCT_CUTOFF;
+			entropyRejected++;
+			return;
 		}
 	}
-	return UART_DATA_REG;
+	else
+	{
+		entropyLast[source]		=	sample;
+		entropyRepeat[source]	=	0;
+	}
+	c							=	entropyPool[entropyIndex];
+	entropyPool[entropyIndex]	=	((c << 1) | (c >> 7)) ^ sample;
+	entropyIndex				=	(entropyIndex + 1) & (ENTROPY_POOL_SIZE - 1);
+	entropySamples++;
 }
-unsigned char getData(unsigned int* boot_state)
-{
-  unsigned char c;
-  if (*boot_state==1)
-  {
-    *boot_state	=	0;
-    c			=	UART_DATA_REG;
-  }
-  else
-  {
-  //	c	=	recchar();
-    c	=	recchar_timeout();
 
-  }
-  return c;
+#ifdef WDIE
+//*****************************************************************************
+ISR(WDT_vect)
+{
+	entropy_add(ENTROPY_SOURCE_TIMER, TCNT1);
 }
+#endif
 
+//*****************************************************************************
+/*
+ * load the saved seed and start the sources
+ */
+static void entropy_init(void)
+{
+unsigned char	ii;
 
-//*	for watch dog timer startup
-void (*app_start)(void) = 0x0000;
-// static unsigned char in[]  = {
-// 	0x7B,0x17,0x19,0x77,0xB7,0xA4,0x8D,0x72,0x24,0x58,0x12,0x6B,0x10,0x02,0x13,0x5F,
-// 	0x91,0x76,0xC6,0x46,0xB4,0x30,0xEA,0xD1,0x47,0xBE,0x8D,0xC8,0x8B,0x28,0xCD,0x04,
-// 	0x09,0x20,0xEE,0x44,0x41,0xFD,0xBC,0xED,0x8F,0x37,0x0F,0x99,0x55,0x05,0x99,0xCE,
-// 	0x19,0xBD,0x0A,0xDC,0xC6,0x0C,0xD4,0x69,0x3C,0x1E,0x93,0x55,0xD0,0x70,0x8C,0x44,
-// 	0xCB,0x8E,0xFB,0x7E,0x92,0x28,0xB2,0xB5,0xEB,0xE8,0xE8,0xC6,0xA1,0xDE,0x96,0x41,
-// 	0x0E,0x35,0x38,0xF7,0x2F,0x16,0xFD,0x6A,0xD0,0xEE,0xBE,0x8D,0x24,0x0D,0x20,0xB7,
+	for (ii=0; ii<ENTROPY_POOL_SIZE; ii++)
+	{
+		entropyPool[ii]	=	hal_eeprom_read_byte(EE_ENTROPY_SEED + ii);
+	}
+	TCCR1B	=	(1 << CS10);											//*	Timer1 free running at F_CPU
+	ADMUX	=	(1 << REFS0);											//*	AVcc reference, channel 0
+	ADCSRA	=	(1 << ADEN) | (1 << ADSC) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+#ifdef WDIE
+	__asm__ __volatile__ ("wdr");
+	WDTCSR	=	(1 << WDCE) | (1 << WDE);
+	WDTCSR	=	(1 << WDIE);											//*	interrupt only, 16 ms
+#endif
+}
+
+//*****************************************************************************
+/*
+ * called from the wait loops, takes a finished ADC conversion and starts the next
+ */
+static void entropy_poll(void)
+{
+unsigned char	sample;
+
+	if (!(ADCSRA & (1 << ADSC)))
+	{
+		sample	=	ADCL;					//*	ADCL first, it locks the result until ADCH is read
+		sample	^=	ADCH;
+	#ifndef WDIE
+		sample	^=	TCNT1;					//*	no watchdog interrupt, the poll timing has to do
+	#endif
+		__asm__ __volatile__ ("cli");
+		entropy_add(ENTROPY_SOURCE_ADC, sample);
+		__asm__ __volatile__ ("sei");
+		ADCSRA	|=	(1 << ADSC);
+	}
+}
+
+//*****************************************************************************
+/*
+ * condition the pool through AES into a nonce, the pool moves on by a value
+ * nobody sees and the first nonce of a boot leaves a new seed in EEPROM
+ */
+static void entropy_nonce(unsigned char *nonce, unsigned char length)
+{
+unsigned char	block[ENTROPY_POOL_SIZE];
+unsigned char	ii;
+
+	__asm__ __volatile__ ("cli");
+	memcpy(block, entropyPool, ENTROPY_POOL_SIZE);
+	__asm__ __volatile__ ("sei");
+	block[ENTROPY_POOL_SIZE - 1]	^=	++entropyNonceCount;	//*	never the same input twice
+
+	key_select(key);
+	state	=	(state_t*)block;
+	Cipher();
+	memcpy(nonce, block, length);
+
+	Cipher();
+	__asm__ __volatile__ ("cli");
+	for (ii=0; ii<ENTROPY_POOL_SIZE; ii++)
+	{
+		entropyPool[ii]	^=	block[ii];
+	}
+	__asm__ __volatile__ ("sei");
+	if (entropyNonceCount == 1)
+	{
+		for (ii=0; ii<ENTROPY_POOL_SIZE; ii++)
+		{
+			eeprom_queue_write(EE_ENTROPY_SEED + ii, block[ii]);
+		}
+	}
+}
+
+//*****************************************************************************
+/*
+ * stop the sources, the application gets Timer1, the ADC and the watchdog in reset state
+ */
+static void entropy_stop(void)
+{
+#ifdef WDIE
+	__asm__ __volatile__ ("wdr");
+	WDTCSR	=	(1 << WDCE) | (1 << WDE);
+	WDTCSR	=	0;
+#endif
+	TCCR1B	=	0;
+	TCNT1	=	0;
+	ADCSRA	=	0;
+	ADMUX	=	0;
+}
+#endif
+
+#if defined(ENABLE_CYCLE_CLOCK) && defined(HOST_BUILD)
+/*
+ * Cycle clock for ENABLE_STATS and ENABLE_TRACE, the host counts nanoseconds
+ */
+	#define	cycle_clock_init()
+	#define	cycle_clock_now()		hal_host_cycles()
+	#define	cycle_clock_stop()
+#elif defined(ENABLE_CYCLE_CLOCK)
+/*
+ * Cycle clock for ENABLE_STATS and ENABLE_TRACE.
+ * Timer1 runs free from the CPU clock (shared with the entropy pool), its
+ * overflow interrupt extends it to 32 bits.
+ */
+#ifdef TIMSK1
+	#define	CYCLE_TIMSK			TIMSK1
+	#define	CYCLE_TIFR			TIFR1
+#else
+	#define	CYCLE_TIMSK			TIMSK
+	#define	CYCLE_TIFR			TIFR
+#endif
+
+volatile uint16_t	cycleOverflow	=	0;
+
+//*****************************************************************************
+ISR(TIMER1_OVF_vect)
+{
+	cycleOverflow++;
+}
+
+//*****************************************************************************
+static void cycle_clock_init(void)
+{
+	TCCR1B		=	(1 << CS10);				//*	Timer1 free running at F_CPU
+	CYCLE_TIMSK	|=	(1 << TOIE1);
+}
+
+//*****************************************************************************
+/*
+ * CPU cycles since cycle_clock_init(), wraps after 2^32
+ */
+static uint32_t cycle_clock_now(void)
+{
+uint16_t	high;
+uint16_t	low;
+
+	__asm__ __volatile__ ("cli");
+	high	=	cycleOverflow;
+	low		=	TCNT1;
+	if ((CYCLE_TIFR & (1 << TOV1)) && (low < 0x8000))
+	{
+		high++;									//*	overflowed, the interrupt has not run yet
+	}
+	__asm__ __volatile__ ("sei");
+	return ((uint32_t)high << 16) | low;
+}
+
+//*****************************************************************************
+/*
+ * the application gets Timer1 in reset state
+ */
+static void cycle_clock_stop(void)
+{
+	CYCLE_TIMSK	&=	~(1 << TOIE1);
+	TCCR1B		=	0;
+	TCNT1		=	0;
+	CYCLE_TIFR	=	(1 << TOV1);
+}
+#endif
+
+#ifdef ENABLE_STATS
+/*
+ * Performance counters, read with CMD_GET_STATS.
+ * Every phase is timed exclusive of the phases nested in it, e.g. the SPM
+ * time of an inline programmed frame is not counted again under decrypt,
+ * so the phases add up to the time spent in the bootloader loop.
+ */
+#define	STATS_VERSION			1
+#define	STATS_IDLE				0		//*	waiting for the next frame to start
+#define	STATS_RECEIVE			1		//*	frame size and payload bytes
+#define	STATS_DECRYPT			2		//*	aes_decrypt() or program_page_inline()
+#define	STATS_PARSE				3		//*	STK500 envelope and command execution
+#define	STATS_SPM				4		//*	page erase and write
+#define	STATS_ENCRYPT			5		//*	aes_encrypt() of the answer
+#define	STATS_TRANSMIT			6		//*	sending the answer frame
+#define	STATS_PHASES			7
+
+typedef struct
+{
+	uint32_t	framesReceived;
+	uint32_t	bytesReceived;						//*	SOTA frames including the 3 byte header
+	uint16_t	checksumErrors;						//*	STK500 envelopes with a bad checksum
+	uint16_t	sequenceErrors;						//*	unexpected sequence numbers
+	uint16_t	retransmits;						//*	the previous sequence number again
+	uint64_t	cycles[STATS_PHASES];
+#ifdef ENABLE_ENTROPY_POOL
+	uint32_t	entropyCycles;						//*	boot to the first CMD_AUTH challenge
+	uint16_t	entropyNonceSamples;				//*	samples in the pool by then
+#endif
+} stats_t;
+
+typedef struct
+{
+	uint32_t	start;
+	uint32_t	nested;
+} stats_timer_t;
+
+stats_t				stats;
+uint32_t			statsNested		=	0;	//*	cycles already given to some phase
+
+	#define	STATS_TIMER(timer)			stats_timer_t timer
+	#define	STATS_START(timer)			stats_start(&timer)
+	#define	STATS_STOP(phase, timer)	stats_stop(phase, &timer)
+	#define	STATS_COUNT(counter, n)		stats.counter += (n)
+
+//*****************************************************************************
+static void stats_start(stats_timer_t *timer)
+{
+	timer->start	=	cycle_clock_now();
+	timer->nested	=	statsNested;
+}
+
+//*****************************************************************************
+/*
+ * give the cycles since stats_start() to phase, minus those the nested phases took
+ */
+static void stats_stop(unsigned char phase, stats_timer_t *timer)
+{
+uint32_t	elapsed	=	cycle_clock_now() - timer->start;
+
+	elapsed					-=	statsNested - timer->nested;
+	stats.cycles[phase]		+=	elapsed;
+	statsNested				+=	elapsed;
+}
+
+//*****************************************************************************
+/*
+ * big endian, like every other number in the protocol
+ */
+static unsigned char *stats_put(unsigned char *dest, uint64_t value, unsigned char size)
+{
+unsigned char	*end	=	dest + size;
+
+	while (size--)
+	{
+		dest[size]	=	value & 0xFF;
+		value		>>=	8;
+	}
+	return end;
+}
+
+//*****************************************************************************
+/*
+ * CMD_GET_STATS answer after command and status, returns its length.
+ * With ENABLE_ENTROPY_POOL the entropy pool follows the phases, readers
+ * that stop after the phases still read version 1.
+ */
+static unsigned int stats_report(unsigned char *dest)
+{
+unsigned char	*p	=	dest;
+unsigned char	ii;
+#ifdef ENABLE_ENTROPY_POOL
+uint16_t		health[3];
+#endif
+
+	*p++	=	STATS_VERSION;
+	p		=	stats_put(p, F_CPU, 4);
+	p		=	stats_put(p, stats.framesReceived, 4);
+	p		=	stats_put(p, stats.bytesReceived, 4);
+	p		=	stats_put(p, stats.checksumErrors, 2);
+	p		=	stats_put(p, stats.sequenceErrors, 2);
+	p		=	stats_put(p, stats.retransmits, 2);
+	*p++	=	STATS_PHASES;
+	for (ii=0; ii<STATS_PHASES; ii++)
+	{
+		p	=	stats_put(p, stats.cycles[ii], 8);
+	}
+#ifdef ENABLE_ENTROPY_POOL
+	__asm__ __volatile__ ("cli");
+	health[0]	=	entropyRejected;
+	health[1]	=	entropyRctFailures;
+	health[2]	=	entropyAptFailures;
+	__asm__ __volatile__ ("sei");
+	p		=	stats_put(p, stats.entropyCycles, 4);
+	p		=	stats_put(p, stats.entropyNonceSamples, 2);
+	for (ii=0; ii<3; ii++)
+	{
+		p	=	stats_put(p, health[ii], 2);
+	}
+#endif
+	return p - dest;
+}
+
+#else
+	#define	STATS_TIMER(timer)
+	#define	STATS_START(timer)
+	#define	STATS_STOP(phase, timer)
+	#define	STATS_COUNT(counter, n)
+#endif
+
+#ifdef ENABLE_TRACE
+/*
+ * Trace ring, Timer1 stamped events of the hot path kept in RAM and drained
+ * with CMD_GET_TRACE. When the host does not drain it in time the oldest
+ * events are overwritten and counted as lost.
+ */
+#ifndef TRACE_DEPTH
+	#define	TRACE_DEPTH			32				//*	events, a power of 2
+#endif
+#define	TRACE_VERSION			1
+#define	TRACE_RECORD_SIZE		7				//*	stamp(4) event(1) arg(2) in the CMD_GET_TRACE answer
+
+#define	TRACE_FRAME_START		0x01			//*	SOTA_MESSAGE_START received
+#define	TRACE_FRAME_END			0x02			//*	last byte received, arg frame size
+#define	TRACE_DECRYPT_DONE		0x03
+#define	TRACE_PARSE_DONE		0x04			//*	command executed, arg command
+#define	TRACE_PAGE_ERASE		0x05			//*	arg page number
+#define	TRACE_PAGE_WRITE		0x06			//*	arg page number
+#define	TRACE_PAGE_DONE			0x07			//*	arg page number
+#define	TRACE_RESPONSE_SENT		0x08			//*	last byte handed to the UART, arg frame size
+
+typedef struct
+{
+	uint32_t	stamp;
+	uint8_t		event;
+	uint16_t	arg;
+} trace_event_t;
+
+trace_event_t	traceRing[TRACE_DEPTH];
+unsigned char	traceHead		=	0;		//*	next event written
+unsigned char	traceCount		=	0;		//*	events not yet drained
+uint16_t		traceLost		=	0;		//*	events overwritten before they were drained
+
+	#define	TRACE(event, arg)			trace_event(event, arg)
+
+//*****************************************************************************
+static void trace_event(unsigned char event, uint16_t arg)
+{
+trace_event_t	*entry	=	&traceRing[traceHead];
+
+	entry->stamp	=	cycle_clock_now();
+	entry->event	=	event;
+	entry->arg		=	arg;
+	traceHead		=	(traceHead + 1) & (TRACE_DEPTH - 1);
+	if (traceCount < TRACE_DEPTH)
+	{
+		traceCount++;
+	}
+	else
+	{
+		traceLost++;
+	}
+}
+
+//*****************************************************************************
+/*
+ * CMD_GET_TRACE answer after command and status, the oldest events that
+ * fit into maxLength are moved out of the ring, returns the answer length
+ */
+static unsigned int trace_report(unsigned char *dest, unsigned int maxLength)
+{
+unsigned char	*p			=	dest;
+unsigned char	count		=	traceCount;
+unsigned char	index;
+trace_event_t	*entry;
+
+	if (count > ((maxLength - 9) / TRACE_RECORD_SIZE))
+	{
+		count	=	(maxLength - 9) / TRACE_RECORD_SIZE;
+	}
+	*p++	=	TRACE_VERSION;
+	*p++	=	(F_CPU >> 24) & 0xFF;
+	*p++	=	(F_CPU >> 16) & 0xFF;
+	*p++	=	(F_CPU >> 8) & 0xFF;
+	*p++	=	F_CPU & 0xFF;
+	*p++	=	traceLost >> 8;
+	*p++	=	traceLost & 0xFF;
+	*p++	=	traceCount - count;					//*	events left for the next CMD_GET_TRACE
+	*p++	=	count;
+	index	=	(traceHead - traceCount) & (TRACE_DEPTH - 1);
+	traceCount	-=	count;
+	traceLost	=	0;
+	while (count--)
+	{
+		entry	=	&traceRing[index];
+		*p++	=	entry->stamp >> 24;
+		*p++	=	entry->stamp >> 16;
+		*p++	=	entry->stamp >> 8;
+		*p++	=	entry->stamp & 0xFF;
+		*p++	=	entry->event;
+		*p++	=	entry->arg >> 8;
+		*p++	=	entry->arg & 0xFF;
+		index	=	(index + 1) & (TRACE_DEPTH - 1);
+	}
+	return p - dest;
+}
+#else
+	#define	TRACE(event, arg)
+#endif
+
+//*****************************************************************************
+/*
+ * hand the interrupt system back in reset state before starting the application
+ */
+static void bootloader_cleanup(void)
+{
+	eeprom_queue_flush();
+#ifdef ENABLE_SPIFLASH_STAGING
+	spiflash_release();
+#endif
+	hal_irq_disable();
+#ifdef ENABLE_ENTROPY_POOL
+	entropy_stop();
+#endif
+#ifdef ENABLE_CYCLE_CLOCK
+	cycle_clock_stop();
+#endif
+	hal_vectors_app();
+}
+
+#ifdef ENABLE_APP_TRAILER
+#define	APP_CHECK_UNKNOWN	0
+#define	APP_CHECK_GOOD		1
+#define	APP_CHECK_BAD		2
+
+unsigned char	appCheck			=	APP_CHECK_UNKNOWN;	//*	result of the last trailer check
+unsigned char	appCacheCleared		=	0;
+
+//*****************************************************************************
+/*
+ * read a little endian 32 bit value from the flash
+ */
+static uint32_t read_flash_uint32(address_t flashAddress)
+{
+uint32_t		value	=	0;
+unsigned char	ii;
+
+	for (ii=4; ii>0; ii--)
+	{
+		value	=	(value << 8) | hal_flash_read_byte(flashAddress + ii - 1);
+	}
+	return value;
+}
+
+//*****************************************************************************
+/*
+ * CRC32 of the first length bytes of the flash starting at base
+ */
+static uint32_t flash_crc32(address_t base, uint32_t length)
+{
+uint32_t	crc	=	0xFFFFFFFF;
+
+	while (length--)
+	{
+		crc	=	crc32_update(crc, hal_flash_read_byte(base++));
+	}
+	return ~crc;
+}
+
+//*****************************************************************************
+/*
+ * write the trailer page, trailerPage is APP_TRAILER in the slot it belongs to
+ */
+static void app_trailer_write(address_t trailerPage, uint32_t length, uint32_t crc)
+{
+	eeprom_queue_flush();				// an EEPROM write would wipe the page buffer
+	hal_flash_page_fill(trailerPage,		APP_TRAILER_MAGIC & 0xffff);
+	hal_flash_page_fill(trailerPage + 2,	APP_TRAILER_MAGIC >> 16);
+	hal_flash_page_fill(trailerPage + 4,	length & 0xffff);
+	hal_flash_page_fill(trailerPage + 6,	length >> 16);
+	hal_flash_page_fill(trailerPage + 8,	crc & 0xffff);
+	hal_flash_page_fill(trailerPage + 10,	crc >> 16);
+	hal_flash_page_erase(trailerPage);		// the page buffer survives the erase
+	hal_flash_busy_wait();
+	hal_flash_page_write(trailerPage);
+	hal_flash_busy_wait();
+	hal_flash_rww_enable();
+}
+
+//*****************************************************************************
+/*
+ * the application area is about to change, its trailer no longer vouches
+ * for it and nothing boots until CMD_COMMIT_IMAGE or the slot activation
+ * finished the upload
+ */
+static void app_image_changed(void)
+{
+	appCheck	=	APP_CHECK_UNKNOWN;
+	if (!appCacheCleared)
+	{
+		eeprom_queue_write(EE_APP_VERIFIED, 0xff);
+		eeprom_queue_write(EE_UPLOAD_STATUS, UPLOAD_IN_PROGRESS);
+		appCacheCleared	=	1;
+	}
+}
+
+//*****************************************************************************
+/*
+ * check the image against its trailer, only after an upload does this read
+ * the whole image, afterwards the EEPROM cache answers. An image without a
+ * trailer is unchecked and boots, one whose trailer does not match (an upload
+ * that stopped half way over a trailered image) does not
+ */
+static unsigned char app_image_verified(void)
+{
+uint32_t	length;
+
+	if (appCheck == APP_CHECK_UNKNOWN)
+	{
+		appCheck	=	APP_CHECK_GOOD;
+		eeprom_queue_flush();
+		if (hal_eeprom_read_byte(EE_APP_VERIFIED) == APP_VERIFIED)
+		{
+			//*	checked on an earlier boot
+		}
+		else if (read_flash_uint32(APP_TRAILER) == APP_TRAILER_MAGIC)
+		{
+			length	=	read_flash_uint32(APP_TRAILER + 4);
+			if ((length <= APP_TRAILER) && (flash_crc32(0, length) == read_flash_uint32(APP_TRAILER + 8)))
+			{
+				eeprom_queue_write(EE_APP_VERIFIED, APP_VERIFIED);
+				appCacheCleared	=	0;
+			}
+			else
+			{
+				appCheck	=	APP_CHECK_BAD;
+			}
+		}
+	}
+	return (appCheck == APP_CHECK_GOOD);
+}
+#endif
+
+//*****************************************************************************
+/*
+ * decide whether the application may be started
+ */
+static unsigned char app_is_bootable(void)
+{
+unsigned int	data;
+	data	=	hal_flash_read_word(0);	//*	get the first word of the user program
+	if (data == 0xffff)					//*	make sure its valid before jumping to it.
+	{
+		return 0;
+	}
+#ifdef ENABLE_APP_TRAILER
+	//*	a half programmed image does not match the trailer left from the last one,
+	//*	and without one it is still marked in progress
+	if (!app_image_verified())
+	{
+		return 0;
+	}
+	eeprom_queue_flush();
+	if (hal_eeprom_read_byte(EE_UPLOAD_STATUS) == UPLOAD_IN_PROGRESS)
+	{
+		return 0;
+	}
+#endif
+#ifdef ENABLE_DUAL_SLOT
+	//*	slot A is half copied, the copy is finished before anything runs
+	eeprom_queue_flush();
+	if (hal_eeprom_read_byte(EE_ACTIVATE_STATUS) == ACTIVATE_PENDING)
+	{
+		return 0;
+	}
+#endif
+#ifdef ENABLE_IMAGE_SIGNATURE
+	//*	only an image whose signature checked out may run
+	eeprom_queue_flush();
+	if (hal_eeprom_read_byte(EE_IMAGE_STATUS) != IMAGE_STATUS_AUTHENTIC)
+	{
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+#ifdef ENABLE_SPIFLASH_STAGING
+uint32_t	stagingRemaining	=	0;	//*	bytes of the staged stream still to be replayed
+
+//*****************************************************************************
+/*
+ * read a big endian 32 bit value from the running SPI flash read
+ */
+static uint32_t spiflash_read_uint32(void)
+{
+uint32_t		value	=	0;
+unsigned char	ii;
+
+	for (ii=0; ii<4; ii++)
+	{
+		value	=	(value << 8) | spiflash_transfer(0xff);
+	}
+	return value;
+}
+
+//*****************************************************************************
+/*
+ * check for a complete stream in the staging area and start reading it,
+ * returns 1 if getData() now delivers the staged stream instead of the UART
+ */
+static unsigned char staging_begin(void)
+{
+uint32_t	magic;
+uint32_t	length;
+uint32_t	crc;
+uint32_t	streamCrc;
+uint32_t	ii;
+
+	spiflash_init();
+	spiflash_read_begin(SPIFLASH_STAGING_BASE);
+	magic	=	spiflash_read_uint32();
+	length	=	spiflash_read_uint32();
+	crc		=	spiflash_read_uint32();
+	if ((magic != SOTA_STAGING_MAGIC) || (spiflash_transfer(0xff) != SOTA_STAGING_STATE_READY) || (length == 0) || (length > 0x1000000UL))
+	{
+		spiflash_deselect();
+		return 0;
+	}
+	spiflash_deselect();
+
+	//*	the application may have been reset half way through writing it
+	streamCrc	=	0xFFFFFFFF;
+	spiflash_read_begin(SOTA_STAGING_STREAM);
+	for (ii=0; ii<length; ii++)
+	{
+		streamCrc	=	crc32_update(streamCrc, spiflash_transfer(0xff));
+	}
+	spiflash_deselect();
+	if (~streamCrc != crc)
+	{
+		return 0;
+	}
+
+	spiflash_read_begin(SOTA_STAGING_STREAM);
+	stagingRemaining	=	length;
+	return 1;
+}
+
+//*****************************************************************************
+/*
+ * stop replaying and mark the staged stream as used, so it runs only once
+ */
+static void staging_finish(void)
+{
+unsigned char	state	=	SOTA_STAGING_STATE_CONSUMED;
+
+	stagingRemaining	=	0;
+	spiflash_deselect();
+	spiflash_program(SPIFLASH_STAGING_BASE + SOTA_STAGING_OFFSET_STATE, &state, 1);
+}
+#endif
+
+#define	MAX_TIME_COUNT	(F_CPU >> 1)
+//*****************************************************************************
+static unsigned char recchar_timeout(void)
+{
+uint32_t count = 0;
+
+	while (!hal_uart_available())
+	{
+		// wait for data
+	#ifdef ENABLE_ENTROPY_POOL
+		entropy_poll();
+	#endif
+		count++;
+		if (count > MAX_TIME_COUNT)
+		{
+			if (app_is_bootable())
+			{
+				bootloader_cleanup();
+				hal_start_application();
+			}
+			count	=	0;
+		}
+	}
+	return hal_uart_get();
+}
+unsigned char getData(unsigned int* boot_state)
+{
+  unsigned char c;
+#ifdef ENABLE_SPIFLASH_STAGING
+  if (stagingRemaining)
+  {
+    //*	staged stream first, the radio link is not touched while it lasts
+    c	=	spiflash_transfer(0xff);
+    if (--stagingRemaining == 0)
+    {
+      staging_finish();
+    }
+    return c;
+  }
+#endif
+  if (*boot_state==1)
+  {
+    *boot_state	=	0;
+    c			=	hal_uart_get();
+  }
+  else
+  {
+  //	c	=	recchar();
+    c	=	recchar_timeout();
+
+  }
+  return c;
+}
+
+
+// static unsigned char in[]  = {
+// 	0x7B,0x17,0x19,0x77,0xB7,0xA4,0x8D,0x72,0x24,0x58,0x12,0x6B,0x10,0x02,0x13,0x5F,
+// 	0x91,0x76,0xC6,0x46,0xB4,0x30,0xEA,0xD1,0x47,0xBE,0x8D,0xC8,0x8B,0x28,0xCD,0x04,
+// 	0x09,0x20,0xEE,0x44,0x41,0xFD,0xBC,0xED,0x8F,0x37,0x0F,0x99,0x55,0x05,0x99,0xCE,
+// 	0x19,0xBD,0x0A,0xDC,0xC6,0x0C,0xD4,0x69,0x3C,0x1E,0x93,0x55,0xD0,0x70,0x8C,0x44,
+// 	0xCB,0x8E,0xFB,0x7E,0x92,0x28,0xB2,0xB5,0xEB,0xE8,0xE8,0xC6,0xA1,0xDE,0x96,0x41,
+// 	0x0E,0x35,0x38,0xF7,0x2F,0x16,0xFD,0x6A,0xD0,0xEE,0xBE,0x8D,0x24,0x0D,0x20,0xB7,
 // 	0x0E,0x6C,0xC2,0x66,0xCC,0xDE,0x04,0xE5,0xA5,0xCD,0x9F,0x85,0xE6,0x59,0xB3,0x78,
 // 	0xA9,0x1E,0xB5,0x25,0xE8,0x27,0x9E,0x1B,0x28,0x86,0x41,0x48,0x2F,0x5A,0x8D,0x20,
 // 	0x2A,0x74,0x1B,0xE8,0x6E,0x02,0xE4,0xD0,0x71,0x48,0xD2,0x41,0x0F,0x61,0x83,0xEC,
@@ -1103,111 +2208,927 @@ void (*app_start)(void) = 0x0000;
 // 	0xB4,0x91,0x09,0xDD,0xA6,0x53,0x07,0x73,0x47,0x3C,0x0E,0x5E,0x13,0x69,0xE9,0x99,
 // 	0x4F,0x4E,0x61,0x4A,0xA3,0xF7,0x27,0x2F,0xD4,0x8B,0x00,0x27,0xAF,0x22,0x44,0xD4};
 
- unsigned char	receivedPacket[288] ={
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
-	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04
+ unsigned char	receivedPacket[288] ={
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04
+
+};
+
+ unsigned char aes_buffer[288] = {
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03 };
+
+	// unsigned char dummyArray[256] = {
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
+	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87};
+
+//*****************************************************************************
+
+	unsigned char authenticationPreSharedToken[4] = {0x53, 0xef, 0x34,0x23};
+        // unsigned char authenticationSecretKey[4] = {0x45,0xaf,0x32,0x21};
+ 	unsigned char isAuthenticated = 0;
+	unsigned int  packetSize = 0;
+	unsigned char	seqNum			=	0x00;
+	unsigned char   isLeave = 0;
+	unsigned char	msgParseState;
+
+
+	unsigned char	c, *p;
+  union {
+	uint32_t  authenticationNumber;
+	uint8_t authBytes[4];
+}authenticationNumber;
+
+union {
+uint32_t  secretKey;
+uint8_t secretKeyBytes[4];
+}secretKey;
+
+union {
+uint32_t  randomGeneratedKey;
+uint8_t randomGeneratedKeyBytes[4];
+}randomGeneratedKey;
+
+address_t		address			=	0;
+
+/*
+ * Answer cache, the last answer as it went out. A frame that is the last
+ * one taken again byte for byte lost its answer on the way: that answer
+ * goes out again unchanged and the command does not run a second time.
+ */
+unsigned char	answerCache[sizeof(aes_buffer)];
+unsigned int	answerCacheSize	=	0;
+unsigned char	frameTail[BLOCKLEN];		// last cipher block of the last frame taken
+unsigned int	frameTailSize	=	0;		// and its size, 0 before the first
+
+/*
+ * Erase tracking, one bit per application flash page.
+ * A bit is set once its page has been erased in the current session, so pages
+ * can be programmed in any order (retransmits, sparse or delta images) and
+ * every page is erased exactly once before it is first written.
+ */
+unsigned char	pageEraseMap[APP_PAGE_MAP_SIZE];
+
+//*****************************************************************************
+/*
+ * erase the flash page containing pageAddress, unless it has already been
+ * erased in this session or lies outside the application section
+ */
+static void erase_page_once(address_t pageAddress)
+{
+	unsigned int	page	=	pageAddress / SPM_PAGESIZE;
+	unsigned char	mask	=	1 << (page & 7);
+
+	// erase only main section (bootloader protection)
+	if ((pageAddress < APP_END) && !(pageEraseMap[page >> 3] & mask))
+	{
+		TRACE(TRACE_PAGE_ERASE, page);
+		hal_flash_page_erase(pageAddress);	// Perform page erase
+		hal_flash_busy_wait();			// Wait until the memory is erased.
+		pageEraseMap[page >> 3]	|=	mask;
+	}
+}
+
+address_t		slotOffset		=	0;		// added to flash addresses, SLOT_B_BASE while staging
+
+#ifdef ENABLE_RESUME
+/*
+ * Resumable uploads, RAM copy of the EEPROM page completion map.
+ * Tracking starts once CMD_RESUME named the image being uploaded, so plain
+ * uploads cost no EEPROM writes.
+ */
+unsigned char	resumeMap[APP_PAGE_MAP_SIZE];
+unsigned char	resumeActive	=	0;
+unsigned char	pageFillMask[SPM_PAGESIZE / 16];	//*	words of fillPage written so far, one bit each
+address_t		fillPage;
+
+//*****************************************************************************
+/*
+ * record a programmed page in the persistent completion map, once all of
+ * its words came; a page written in several frames is done with the last one
+ */
+static void resume_page_done(address_t pageAddress)
+{
+	unsigned int	page	=	(pageAddress - slotOffset) / SPM_PAGESIZE;	//*	pages of the image, wherever it is staged
+	unsigned char	mask	=	1 << (page & 7);
+	unsigned char	ii;
+
+	if (pageAddress != fillPage)
+	{
+		return;
+	}
+	for (ii=0; ii<sizeof(pageFillMask); ii++)
+	{
+		if (pageFillMask[ii] != 0xff)
+		{
+			return;						//*	part of the page is still to come
+		}
+	}
+	if (resumeActive && (page < APP_PAGE_COUNT) && (resumeMap[page >> 3] & mask))
+	{
+		resumeMap[page >> 3]	&=	~mask;
+		eeprom_queue_write(EE_RESUME_MAP + (page >> 3), resumeMap[page >> 3]);
+	}
+}
+#endif
+
+/*
+ * Page assembler, program data may start anywhere and span several pages.
+ * Words collect in the SPM page buffer until the data moves on to another
+ * page or page_commit() is called, then that page is erased (once per
+ * session) and written. Unfilled words of the buffer stay 0xFF.
+ */
+address_t		assemblyPage;
+unsigned char	assemblyPending	=	0;
+
+//*****************************************************************************
+/*
+ * write the page collected in the SPM page buffer
+ */
+static void page_commit(void)
+{
+	if (assemblyPending)
+	{
+		STATS_TIMER(spmTimer);
+
+		STATS_START(spmTimer);
+		erase_page_once(assemblyPage);
+		TRACE(TRACE_PAGE_WRITE, assemblyPage / SPM_PAGESIZE);
+		hal_flash_page_write(assemblyPage);
+		hal_flash_busy_wait();
+		hal_flash_rww_enable();				// Re-enable the RWW section
+		TRACE(TRACE_PAGE_DONE, assemblyPage / SPM_PAGESIZE);
+		STATS_STOP(STATS_SPM, spmTimer);
+	#ifdef ENABLE_RESUME
+		resume_page_done(assemblyPage);
+	#endif
+		assemblyPending	=	0;
+	}
+}
+
+//*****************************************************************************
+/*
+ * end of the flash an upload may write: the image area in place, slot B
+ * while staging
+ */
+static address_t slot_end(void)
+{
+	return slotOffset ? (SLOT_B_BASE + SLOT_SIZE) : APP_IMAGE_END;
+}
+
+//*****************************************************************************
+/*
+ * put one word into the page buffer, committing the previous page first
+ * when the word belongs to another one
+ * returns 0 for a word past the end of the slot, which is not written
+ */
+static unsigned char page_fill_word(address_t flashAddress, unsigned int data)
+{
+	address_t	page	=	flashAddress & ~((address_t)SPM_PAGESIZE - 1);
+#ifdef ENABLE_RESUME
+	unsigned char	word;
+#endif
+
+	if (page >= slot_end())
+	{
+		return 0;
+	}
+	if (assemblyPending && (page != assemblyPage))
+	{
+		page_commit();
+	}
+	if (!assemblyPending)
+	{
+	#ifdef ENABLE_APP_TRAILER
+		if (page < APP_IMAGE_END)
+		{
+			app_image_changed();
+		}
+	#endif
+		eeprom_queue_flush();			// an EEPROM write would wipe the page buffer
+		assemblyPage	=	page;
+		assemblyPending	=	1;
+	}
+#ifdef ENABLE_RESUME
+	if (page != fillPage)
+	{
+		memset(pageFillMask, 0, sizeof(pageFillMask));
+		fillPage	=	page;
+	}
+	word	=	(flashAddress & (SPM_PAGESIZE - 1)) >> 1;
+	pageFillMask[word >> 3]	|=	1 << (word & 7);
+#endif
+	hal_flash_page_fill(flashAddress, data);
+	return 1;
+}
+
+#ifdef ENABLE_DUAL_SLOT
+unsigned char	stagedImageVerified	=	0;
+
+//*****************************************************************************
+/*
+ * copy one page of the staged image from slot B into slot A
+ */
+static void slot_copy_page(address_t pageAddress)
+{
+	address_t		source	=	pageAddress + SLOT_B_BASE;
+	unsigned int	offset;
+	unsigned int	data;
+	STATS_TIMER(spmTimer);
+
+	STATS_START(spmTimer);
+	for (offset = 0; offset < SPM_PAGESIZE; offset += 2)
+	{
+		data	=	hal_flash_read_word(source + offset);
+		hal_flash_page_fill(pageAddress + offset, data);
+	}
+	TRACE(TRACE_PAGE_ERASE, pageAddress / SPM_PAGESIZE);
+	hal_flash_page_erase(pageAddress);		// the page buffer survives the erase
+	hal_flash_busy_wait();
+	TRACE(TRACE_PAGE_WRITE, pageAddress / SPM_PAGESIZE);
+	hal_flash_page_write(pageAddress);
+	hal_flash_busy_wait();
+	hal_flash_rww_enable();
+	TRACE(TRACE_PAGE_DONE, pageAddress / SPM_PAGESIZE);
+	STATS_STOP(STATS_SPM, spmTimer);
+}
+
+//*****************************************************************************
+/*
+ * copy the staged image into slot A
+ * The pending record in EEPROM makes the copy restartable, if power fails
+ * half way it is simply done again on the next reset, slot B is unchanged.
+ */
+static void slot_activate(unsigned int pageCount)
+{
+	unsigned int	page;
+
+#ifdef ENABLE_APP_TRAILER
+	app_image_changed();
+#endif
+	eeprom_queue_write(EE_ACTIVATE_PAGES, pageCount & 0xff);
+	eeprom_queue_write(EE_ACTIVATE_PAGES + 1, pageCount >> 8);
+	eeprom_queue_write(EE_ACTIVATE_STATUS, ACTIVATE_PENDING);
+	eeprom_queue_flush();				// no SPM while the EEPROM is written
+
+	for (page = 0; page < pageCount; page++)
+	{
+		slot_copy_page((address_t)page * SPM_PAGESIZE);
+	}
+#ifdef ENABLE_APP_TRAILER
+	slot_copy_page(APP_TRAILER);
+	eeprom_queue_write(EE_UPLOAD_STATUS, 0xff);
+#endif
+
+	eeprom_queue_write(EE_ACTIVATE_STATUS, 0xff);
+	eeprom_queue_flush();
+}
+
+//*****************************************************************************
+/*
+ * finish an activation that was interrupted by a reset
+ */
+static void slot_finish_activation(void)
+{
+	unsigned int	pageCount;
+
+	if (hal_eeprom_read_byte(EE_ACTIVATE_STATUS) == ACTIVATE_PENDING)
+	{
+		pageCount	=	hal_eeprom_read_byte(EE_ACTIVATE_PAGES) | (hal_eeprom_read_byte(EE_ACTIVATE_PAGES + 1) << 8);
+		if (pageCount <= (SLOT_SIZE / SPM_PAGESIZE))
+		{
+			slot_activate(pageCount);
+		}
+	}
+}
+#endif
+
+#ifdef ENABLE_IMAGE_SIGNATURE
+/*
+ * Streaming image hash, pages are hashed as they are programmed so the
+ * signature check at the end only has to look at the digest.
+ * Out of order writes break the stream and the digest is then recomputed
+ * from flash when the signature arrives.
+ */
+sha256_ctx_t	imageHash;
+address_t		imageHashAddress;
+unsigned char	imageHashInOrder;
+unsigned char	imageMarkedUnchecked;
+
+//*****************************************************************************
+static void image_hash_reset(void)
+{
+	sha256_init(&imageHash);
+	imageHashAddress	=	0;
+	imageHashInOrder	=	1;
+	imageMarkedUnchecked	=	0;
+}
+
+//*****************************************************************************
+static void image_hash_data(address_t dataAddress, const unsigned char *data, unsigned int size)
+{
+	if (!imageMarkedUnchecked && (slotOffset == 0))
+	{
+		//*	a new image is being written, it is not bootable until its signature checks out again
+		eeprom_queue_write(EE_IMAGE_STATUS, IMAGE_STATUS_UNCHECKED);
+		imageMarkedUnchecked	=	1;
+	}
+	if (dataAddress != imageHashAddress)
+	{
+		imageHashInOrder	=	0;
+	}
+	if (imageHashInOrder)
+	{
+		imageHashAddress	+=	size;
+		while (size--)
+		{
+			sha256_update(&imageHash, *data++);
+		}
+	}
+}
+#endif
+
+//*****************************************************************************
+/*
+ * send the answer in the cache, the last one encrypted
+ */
+static void answer_send(void)
+{
+STATS_TIMER(sendTimer);
 
-};
+	STATS_START(sendTimer);
+	sendchar(SOTA_MESSAGE_START);
+	sendchar((answerCacheSize>>8)&0xFF);
+	sendchar(answerCacheSize&0x00FF);
+	for (unsigned int i=0; i<answerCacheSize; i++)
+	{
+		sendchar(answerCache[i]);
+	}
+	TRACE(TRACE_RESPONSE_SENT, answerCacheSize);
+	STATS_STOP(STATS_TRANSMIT, sendTimer);
+}
 
- unsigned char aes_buffer[288] = {
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
-	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03 };
+//*****************************************************************************
+/*
+ * wrap a message into the STK500 envelope, encrypt it and send it as one
+ * SOTA frame, the sequence number is left to the caller
+ */
+static void send_response(unsigned char *message, unsigned int length)
+{
+unsigned int	index			=	0;
+unsigned int	residualNumber;
+unsigned int	responseSize;
+unsigned char	checksum;
+unsigned char	c;
+STATS_TIMER(sendTimer);
+
+	receivedPacket[index++]	=	MESSAGE_START;
+	checksum				=	MESSAGE_START^0;
+	receivedPacket[index++]	=	seqNum;
+	checksum				^=	seqNum;
+
+	c						=	((length>>8)&0xFF);
+	receivedPacket[index++]	=	c;
+	checksum				^=	c;
+
+	c						=	length&0x00FF;
+	receivedPacket[index++]	=	c;
+	checksum				^=	c;
+
+	residualNumber	=	(length+6) % 16;
+	responseSize	=	((length+(16-residualNumber)+6));
+	if (residualNumber != 0)
+	{
+		for (unsigned int excessiveNumberIndex = (length+6); excessiveNumberIndex<responseSize; excessiveNumberIndex++)
+		{
+			receivedPacket[excessiveNumberIndex]	=	0xff;
+		}
+	}
 
-	// unsigned char dummyArray[256] = {
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87,
-	// 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87, 0x87};
+	receivedPacket[index++]	=	TOKEN;
+	checksum				^=	TOKEN;
+	while (length)
+	{
+		c						=	*message++;
+		receivedPacket[index++]	=	c;
+		checksum				^=	c;
+		length--;
+	}
+	receivedPacket[index++]	=	checksum;
+
+#ifdef ENABLE_SPIFLASH_STAGING
+	if (stagingRemaining)		//*	nobody listens to answers of a staged stream
+	{
+		return;
+	}
+#endif
+	STATS_START(sendTimer);
+	aes_encrypt(answerCache, receivedPacket, responseSize);
+	answerCacheSize	=	responseSize;
+	STATS_STOP(STATS_ENCRYPT, sendTimer);
+	answer_send();
+}
+
+#ifdef ENABLE_FAST_AUTH
+/*
+ * One round trip authentication. The host sends a counter above the last one
+ * the device accepted together with
+ *	mac = AES_k(token[4] | counter[4] (big endian) | CMD_AUTH_FAST | 0 ...)
+ * so a recorded request is worthless once it has been used. A failed request
+ * is answered with the device counter, a host that lost track retries once;
+ * it changes nothing, a session already up stays up.
+ *
+ * A successful handshake also sets the session ticket to AES_k(mac). After a
+ * link drop the host proves itself by sending the ticket with CMD_AUTH_TICKET,
+ * without knowing the counter. Every use replaces the ticket by AES_k(ticket),
+ * which the host computes as well, so a ticket works only once.
+ *
+ * With ENABLE_SESSION_KEYS either handshake is answered with a fresh device
+ * nonce as well, the session key depends on both sides, see session_begin().
+ */
 
 //*****************************************************************************
+static void auth_encrypt_block(unsigned char *block)
+{
+	key_select(key);
+	state	=	(state_t*)block;
+	Cipher();
+}
 
-	unsigned char authenticationPreSharedToken[4] = {0x53, 0xef, 0x34,0x23};
-        // unsigned char authenticationSecretKey[4] = {0x45,0xaf,0x32,0x21};
- 	unsigned char isAuthenticated = 0;
-	unsigned int  packetSize = 0;
-	unsigned char	seqNum			=	0x00;
-	unsigned char   isLeave = 0;
-	unsigned char	msgParseState;
+//*****************************************************************************
+static uint32_t auth_stored_counter(void)
+{
+uint32_t		counter	=	0;
+unsigned char	ii;
+
+	eeprom_queue_flush();
+	for (ii=0; ii<4; ii++)
+	{
+		counter	=	(counter << 8) | hal_eeprom_read_byte(EE_AUTH_COUNTER + ii);
+	}
+	if (counter == 0xFFFFFFFF)		//*	erased EEPROM
+	{
+		counter	=	0;
+	}
+	return counter;
+}
+
+//*****************************************************************************
+static void auth_store_ticket(unsigned char *ticket)
+{
+unsigned char	ii;
+
+	auth_encrypt_block(ticket);
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		eeprom_queue_write(EE_SESSION_TICKET + ii, ticket[ii]);
+	}
+}
+
+#ifdef ENABLE_SESSION_KEYS
+//*****************************************************************************
+/*
+ * a value the device never handed out before, for the session key
+ */
+static void device_nonce(unsigned char *nonce)
+{
+#ifdef ENABLE_ENTROPY_POOL
+	entropy_nonce(nonce, BLOCKLEN);
+#else
+	unsigned char	ii;
+
+	//*	no noise sources, the last nonce through the key gives the next
+	eeprom_queue_flush();
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		nonce[ii]	=	hal_eeprom_read_byte(EE_ENTROPY_SEED + ii);
+	}
+	auth_encrypt_block(nonce);
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		eeprom_queue_write(EE_ENTROPY_SEED + ii, nonce[ii]);
+	}
+#endif
+}
+
+//*****************************************************************************
+/*
+ * prepare the session for a value only this handshake produced, the host's
+ * nonce and, unless deviceNonce is NULL, a fresh one of the device's that
+ * the handshake answers with. That answer still goes out on the link the
+ * request came in on, session_start() takes over once it is sent. The
+ * mailbox passes no deviceNonce, the application made its nonce fresh.
+ */
+static void session_begin(const unsigned char *nonce, unsigned char *deviceNonce)
+{
+unsigned char	ii;
+
+	if (deviceNonce != NULL)
+	{
+		device_nonce(deviceNonce);
+	}
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		sessionNonce[ii]	=	nonce[ii] ^ ((deviceNonce != NULL) ? deviceNonce[ii] : 0);
+	}
+	sessionPending	=	1;
+}
+
+//*****************************************************************************
+/*
+ * derive the session link key prepared by session_begin(),
+ *	sessionKey	= AES_k(nonce ^ deviceNonce ^ 0x36 ...)
+ *	rxIv		= AES_sessionKey(01 00 ...), host to device chain
+ *	txIv		= AES_sessionKey(02 00 ...), device to host chain
+ * the next answer is the first frame sent with it. From then on each frame
+ * the device takes moves rxIv on to its last block and the answers chain
+ * on from there, see frame_taken(); a frame that is lost or damaged moves
+ * nothing, so the host sends the same bytes again.
+ */
+static void session_start(void)
+{
+unsigned char	ii;
+
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		sessionKey[ii]	=	sessionNonce[ii] ^ 0x36;
+	}
+	auth_encrypt_block(sessionKey);
+	expandedKey	=	0;				//*	sessionKey holds a new key now
+	memset(rxIv, 0, BLOCKLEN);
+	memset(txIv, 0, BLOCKLEN);
+	rxIv[0]		=	1;
+	txIv[0]		=	2;
+	key_select(sessionKey);
+	state	=	(state_t*)rxIv;
+	Cipher();
+	state	=	(state_t*)txIv;
+	Cipher();
+	sessionActive	=	1;
+	sessionPending	=	0;
+}
+
+//*****************************************************************************
+/*
+ * the host has dropped the session, it has to authenticate again
+ */
+static void session_end(void)
+{
+	sessionActive	=	0;
+	isAuthenticated	=	0;
+}
+
+//*****************************************************************************
+/*
+ * the decrypted frame in aes_buffer starts with a valid envelope head
+ */
+static unsigned char frame_head(unsigned char seq)
+{
+	return ((aes_buffer[0] == MESSAGE_START) && (aes_buffer[1] == seq) && (aes_buffer[4] == TOKEN));
+}
+#endif
+
+
+//*****************************************************************************
+/*
+ * check a CMD_AUTH_FAST request, message points behind the command byte,
+ * deviceNonce gets the device's part of the session and may overlap message
+ */
+static unsigned char auth_fast(const unsigned char *message, unsigned char *deviceNonce)
+{
+unsigned char	block[BLOCKLEN];
+uint32_t		counter	=	((uint32_t)message[0]<<24) | ((uint32_t)message[1]<<16) | ((uint32_t)message[2]<<8) | message[3];
+unsigned char	diff	=	0;
+unsigned char	ii;
+
+	if ((counter <= auth_stored_counter()) || (counter == 0xFFFFFFFF))
+	{
+		return 0;
+	}
+	memset(block, 0, BLOCKLEN);
+	memcpy(block, authenticationPreSharedToken, 4);
+	memcpy(block + 4, message, 4);
+	block[8]	=	CMD_AUTH_FAST;
+	auth_encrypt_block(block);
+
+	for (ii=0; ii<BLOCKLEN; ii++)		//*	constant time compare
+	{
+		diff	|=	block[ii] ^ message[4 + ii];
+	}
+	if (diff != 0)
+	{
+		return 0;
+	}
+	for (ii=0; ii<4; ii++)
+	{
+		eeprom_queue_write(EE_AUTH_COUNTER + ii, message[ii]);
+	}
+#ifdef ENABLE_SESSION_KEYS
+	session_begin(block, deviceNonce);
+#endif
+	auth_store_ticket(block);
+	return 1;
+}
+
+//*****************************************************************************
+/*
+ * check a CMD_AUTH_TICKET request and move on to the next ticket,
+ * deviceNonce gets the device's part of the session and may overlap ticket
+ */
+static unsigned char auth_ticket(const unsigned char *ticket, unsigned char *deviceNonce)
+{
+unsigned char	stored[BLOCKLEN];
+unsigned char	diff	=	0;
+unsigned char	erased	=	0xFF;
+unsigned char	ii;
+
+	eeprom_queue_flush();
+	for (ii=0; ii<BLOCKLEN; ii++)
+	{
+		stored[ii]	=	hal_eeprom_read_byte(EE_SESSION_TICKET + ii);
+		erased		&=	stored[ii];
+		diff		|=	stored[ii] ^ ticket[ii];
+	}
+	if ((diff != 0) || (erased == 0xFF))
+	{
+		return 0;
+	}
+#ifdef ENABLE_SESSION_KEYS
+	session_begin(stored, deviceNonce);
+#endif
+	auth_store_ticket(stored);
+	return 1;
+}
+#endif
+
+unsigned char	updateRequested	=	0;	//*	stay in the bootloader even though the application could start
+
+#ifdef ENABLE_MAILBOX
+//*****************************************************************************
+/*
+ * look for an update request the application left before its watchdog reset
+ */
+static unsigned char mailbox_take(void)
+{
+volatile sota_mailbox_t	*mailbox	=	SOTA_MAILBOX;
+
+	if ((mailbox->magic != SOTA_MAILBOX_MAGIC) || (mailbox->check != sota_mailbox_check(mailbox)))
+	{
+		return 0;
+	}
+	mailbox->magic	=	0;				//*	one request, one update
+	return (mailbox->flags & SOTA_MAILBOX_ENTER_UPDATE) != 0;
+}
+
+//*****************************************************************************
+/*
+ * take over the link settings the application agreed on with the host
+ */
+static void mailbox_apply(void)
+{
+volatile sota_mailbox_t	*mailbox	=	SOTA_MAILBOX;
+unsigned char			nonce[SOTA_MAILBOX_NONCE_SIZE];
+unsigned char			ii;
+
+	if (mailbox->baudSelect != 0)
+	{
+		hal_uart_init(mailbox->baudSelect);
+	}
+	for (ii=0; ii<SOTA_MAILBOX_NONCE_SIZE; ii++)
+	{
+		nonce[ii]			=	mailbox->nonce[ii];
+		mailbox->nonce[ii]	=	0;
+	}
+#ifdef ENABLE_SESSION_KEYS
+	if (mailbox->flags & SOTA_MAILBOX_SESSION)
+	{
+		//*	the application authenticated the host already
+		session_begin(nonce, NULL);
+		session_start();
+		isAuthenticated	=	1;
+	}
+#endif
+}
+#endif
+
+//*****************************************************************************
+/*
+ * the frame in receivedPacket holds a complete message and gets answered.
+ * Its last block tells a repeat of it, which gets the cached answer. Under
+ * a session the next frame chains on from that block and so does the
+ * answer, a frame the device never took leaves both chains where they were.
+ */
+static void frame_taken(void)
+{
+	memcpy(frameTail, receivedPacket + packetSize - BLOCKLEN, BLOCKLEN);
+	frameTailSize	=	packetSize;
+#ifdef ENABLE_SESSION_KEYS
+	if (sessionActive)
+	{
+		memcpy(rxIv, frameTail, BLOCKLEN);
+		memcpy(txIv, rxIv, BLOCKLEN);
+	}
+#endif
+}
+
+#ifdef ENABLE_INLINE_PROGRAM
+#define	INLINE_DATA_OFFSET	15		//*	envelope (5) and CMD_PROGRAM_FLASH_ISP parameters (10) before the data
+
+unsigned char	inlineProgrammed	=	0;	//*	the packet in receivedPacket was handled by program_page_inline()
 
+//*****************************************************************************
+/*
+ * fast path for CMD_PROGRAM_FLASH_ISP, every decrypted 16 byte block goes
+ * straight into the SPM page buffer, nothing passes through aes_buffer or
+ * msgBuffer. The buffer is filled before the page erase, which the SPM
+ * allows, so a bad checksum only needs the buffer dropped again. Frames
+ * that span pages take the normal path, they are checked before writing.
+ * returns 0 if the packet is something else or damaged and has to take the
+ * normal path
+ */
+static unsigned char program_page_inline(unsigned int length, unsigned char *answer)
+{
+unsigned char	block[BLOCKLEN];
+unsigned char	*cipher	=	receivedPacket;
+unsigned int	msgLength;
+unsigned int	size;
+unsigned int	checksumIndex;
+unsigned int	n;
+unsigned char	checksum	=	0;
+unsigned char	lowByte		=	0;
+unsigned char	c;
+unsigned char	i;
+address_t		fillAddress	=	address;
+address_t		tempaddress	=	address + slotOffset;
+#ifdef ENABLE_IMAGE_SIGNATURE
+unsigned char	runStart;
+address_t		hashAddress	=	address;
+#endif
+
+	if ((length < (2 * BLOCKLEN)) || (length % BLOCKLEN))
+	{
+		return 0;
+	}
+	key_select(LINK_KEY);
+	Iv	=	(uint8_t*)LINK_RX_IV;
+
+	memcpy(block, cipher, BLOCKLEN);
+	state	=	(state_t*)block;
+	InvCipher();
+	XorWithIv(block);
+	Iv		=	cipher;
+	cipher	+=	BLOCKLEN;
+
+	msgLength	=	(block[2] << 8) | block[3];
+	size		=	(block[6] << 8) | block[7];
+	if ((block[0] != MESSAGE_START) || (block[1] != seqNum) || (block[4] != TOKEN) || (block[5] != CMD_PROGRAM_FLASH_ISP)
+		|| (size == 0) || (size & 1) || (((tempaddress & (SPM_PAGESIZE - 1)) + size) > SPM_PAGESIZE) || (tempaddress >= slot_end())
+		|| (msgLength != (size + 10)) || ((msgLength + 6) > length))
+	{
+		return 0;
+	}
+
+#ifdef ENABLE_IMAGE_SIGNATURE
+	image_hash_data(address, block, 0);		//*	queues the unchecked mark before the page buffer is used
+#endif
+
+	checksumIndex	=	5 + msgLength;
+	n				=	0;
+	while (1)
+	{
+	#ifdef ENABLE_IMAGE_SIGNATURE
+		runStart	=	BLOCKLEN;
+	#endif
+		for (i=0; (i<BLOCKLEN) && (n<checksumIndex); i++, n++)
+		{
+			c			=	block[i];
+			checksum	^=	c;
+			if (n >= INLINE_DATA_OFFSET)
+			{
+			#ifdef ENABLE_IMAGE_SIGNATURE
+				if (runStart == BLOCKLEN)
+				{
+					runStart	=	i;
+				}
+			#endif
+				if ((n - INLINE_DATA_OFFSET) & 1)
+				{
+					page_fill_word(tempaddress, (c << 8) | lowByte);
+					tempaddress	+=	2;
+					fillAddress	+=	2;
+				}
+				else
+				{
+					lowByte	=	c;
+				}
+			}
+		}
+	#ifdef ENABLE_IMAGE_SIGNATURE
+		if (runStart < i)
+		{
+			image_hash_data(hashAddress, block + runStart, i - runStart);
+			hashAddress	+=	i - runStart;
+		}
+	#endif
+		if (i < BLOCKLEN)
+		{
+			break;			//*	block[i] is the checksum
+		}
+		memcpy(block, cipher, BLOCKLEN);
+		state	=	(state_t*)block;
+		InvCipher();
+		XorWithIv(block);
+		Iv		=	cipher;
+		cipher	+=	BLOCKLEN;
+	}
 
-	unsigned char	c, *p;
-  union {
-	uint32_t  authenticationNumber;
-	uint8_t authBytes[4];
-}authenticationNumber;
+	if (block[i] != checksum)
+	{
+		hal_flash_rww_enable();			//*	drops the page buffer
+		assemblyPending	=	0;
+	#ifdef ENABLE_RESUME
+		memset(pageFillMask, 0, sizeof(pageFillMask));	//*	none of it reaches the flash
+	#endif
+	#ifdef ENABLE_IMAGE_SIGNATURE
+		imageHashInOrder	=	0;		//*	the stream already took the bad data, hash the flash instead
+	#endif
+		return 0;						//*	the normal path finds the damage again and drops the frame
+	}
 
-union {
-uint32_t  secretKey;
-uint8_t secretKeyBytes[4];
-}secretKey;
+	answer[0]	=	CMD_PROGRAM_FLASH_ISP;
 
-union {
-uint32_t  randomGeneratedKey;
-uint8_t randomGeneratedKeyBytes[4];
-}randomGeneratedKey;
+	page_commit();
+	address		=	fillAddress;
+	answer[1]	=	STATUS_CMD_OK;
+	return 1;
+}
+#endif
 
-address_t		address			=	0;
+#if defined(ENABLE_READ_BULK) || defined(ENABLE_TRACE)
+	#define	BULK_READ_CHUNK		256		//*	data bytes per CMD_READ_FLASH_BULK frame or CMD_GET_TRACE answer, fits receivedPacket
+#endif
 
 #define AUTHENTICATION
-#define SEQUENCE_NUMBER_ENFORCEMENT;
+#define SEQUENCE_NUMBER_ENFORCEMENT
 
 int main(void)
 {
 
-	unsigned int residualNumber = 0;
   unsigned char packetRetrieveState;
   packetRetrieveState = SOTA_PACKET_RETRIEVE_START;
   int packetRetrieveIndex = 0;
 
-	address_t		eraseAddress	=	0;
 	unsigned int	ii				=	0;
 	unsigned char	checksum		=	0;
 
 	unsigned int	msgLength		=	0;
+	unsigned int	requestLength	=	0;		//*	msgLength of the request, the answer reuses msgLength
 	unsigned char	msgBuffer[285];
 
 	secretKey.secretKeyBytes[0] = 0x45;
@@ -1221,8 +3142,6 @@ int main(void)
 	randomGeneratedKey.randomGeneratedKeyBytes[3] = 0x26;
 
 
-	unsigned int finalResponseSize;
-
 	unsigned int receivedPacketIndex = 0;
 
 	//unsigned char msgBuffer[290];
@@ -1235,30 +3154,34 @@ int main(void)
 	unsigned int	rcvdCharCntr	=	0;
 #endif
 
+#ifndef HOST_BUILD
 	//*	some chips dont set the stack properly
-	asm volatile ( ".set __stack, %0" :: "i" (RAMEND) );
-	asm volatile ( "ldi	16, %0" :: "i" (RAMEND >> 8) );
+	asm volatile ( ".set __stack, %0" :: "i" (BOOT_STACK_TOP) );
+	asm volatile ( "ldi	16, %0" :: "i" (BOOT_STACK_TOP >> 8) );
 	asm volatile ( "out %0,16" :: "i" (AVR_STACK_POINTER_HI_ADDR) );
-	asm volatile ( "ldi	16, %0" :: "i" (RAMEND & 0x0ff) );
+	asm volatile ( "ldi	16, %0" :: "i" (BOOT_STACK_TOP & 0x0ff) );
 	asm volatile ( "out %0,16" :: "i" (AVR_STACK_POINTER_LO_ADDR) );
+#endif
+	hal_init();
 
 #ifdef _FIX_ISSUE_181_
 	//************************************************************************
 	//*	Dec 29,	2011	<MLS> Issue #181, added watch dog timmer support
 	//*	handle the watch dog timer
-	uint8_t	mcuStatusReg;
-	mcuStatusReg	=	MCUSR;
-
-	__asm__ __volatile__ ("cli");
-	__asm__ __volatile__ ("wdr");
-	MCUSR	=	0;
-	WDTCSR	|=	_BV(WDCE) | _BV(WDE);
-	WDTCSR	=	0;
-	__asm__ __volatile__ ("sei");
 	// check if WDT generated the reset, if so, go straight to app
-	if (mcuStatusReg & _BV(WDRF))
+	if (hal_watchdog_disarm())
 	{
-		app_start();
+	#ifdef ENABLE_MAILBOX
+		//*	the application may have reset itself to ask for an update
+		updateRequested	=	mailbox_take();
+	#endif
+		//*	the trailer check may queue an EEPROM write, its interrupt must find our vectors
+		hal_vectors_boot();
+		if (!updateRequested && app_is_bootable())
+		{
+			bootloader_cleanup();
+			hal_start_application();
+		}
 	}
 	//************************************************************************
 #endif
@@ -1278,11 +3201,39 @@ int main(void)
 	 * Init UART
 	 * set baudrate and enable USART receiver and transmiter without interrupts
 	 */
-#if UART_BAUDRATE_DOUBLE_SPEED
-	UART_STATUS_REG		|=	(1 <<UART_DOUBLE_SPEED);
+	hal_uart_init(HAL_UART_BAUD_SELECT(BAUDRATE));
+#ifdef ENABLE_MAILBOX
+	if (updateRequested)
+	{
+		mailbox_apply();
+		boot_state	=	2;		//*	no wait, the host is already talking
+	}
+#endif
+	hal_uart_enable();
+
+	//*	use the boot section interrupt vectors, restored by bootloader_cleanup()
+	hal_vectors_boot();
+#ifdef ENABLE_ENTROPY_POOL
+	entropy_init();
+#endif
+#ifdef ENABLE_CYCLE_CLOCK
+	cycle_clock_init();
+#endif
+	hal_irq_enable();
+
+#ifdef ENABLE_DUAL_SLOT
+	slot_finish_activation();
+#endif
+
+#ifdef ENABLE_SPIFLASH_STAGING
+	if (staging_begin())
+	{
+		//*	the application fetched the image, the stream carries no handshake
+		isAuthenticated	=	1;
+		updateRequested	=	1;
+		boot_state		=	2;
+	}
 #endif
-	UART_BAUD_RATE_LOW	=	UART_BAUD_SELECT(BAUDRATE,F_CPU);
-	UART_CONTROL_REG	=	(1 << UART_ENABLE_RECEIVER) | (1 << UART_ENABLE_TRANSMITTER);
 
 	asm volatile ("nop");			// wait until port has changed
 
@@ -1291,7 +3242,10 @@ int main(void)
 	{
 		while ((!(Serial_Available())) && (boot_state == 0))		// wait for data
 		{
-			_delay_ms(0.001);
+			hal_delay_us(1);
+		#ifdef ENABLE_ENTROPY_POOL
+			entropy_poll();
+		#endif
 			boot_timer++;
 			if (boot_timer > boot_timeout)
 			{
@@ -1308,10 +3262,18 @@ int main(void)
 
 
 
-	if (boot_state==1)
+#ifdef ENABLE_IMAGE_SIGNATURE
+	image_hash_reset();
+#endif
+
+	//*	stay in the bootloader while there is no application it may start
+	if ((boot_state==1) || updateRequested || !app_is_bootable())
 	{
 		while (!isLeave)
 		{
+			STATS_TIMER(frameTimer);
+
+			STATS_START(frameTimer);
 			packetRetrieveIndex = 0;
 		  packetRetrieveState = SOTA_PACKET_RETRIEVE_START;
 		   while ( packetRetrieveState != SOTA_PACKET_RETRIEVE_FINISHED )
@@ -1322,6 +3284,9 @@ int main(void)
 		  	{
 		     if(c == SOTA_MESSAGE_START)
 		     {
+		       STATS_STOP(STATS_IDLE, frameTimer);
+		       STATS_START(frameTimer);
+		       TRACE(TRACE_FRAME_START, 0);
 		       packetRetrieveState = SOTA_PACKET_RETRIEVE_SIZE;
 		       }
 		     }
@@ -1338,6 +3303,12 @@ int main(void)
 						// sendchar(lowest);
 
 		       packetRetrieveState = SOTA_PACKET_RETRIEVE_PROCESSING;
+		       if ((packetSize == 0) || (packetSize > sizeof(receivedPacket)) || (packetSize % BLOCKLEN))
+		       {
+		         //*	no frame we could hold or decrypt, hunt for the next start byte
+		         //*	right away instead of waiting for the bytes of a bogus size
+		         packetRetrieveState = SOTA_PACKET_RETRIEVE_START;
+		       }
 
 		     }
 		     else if(packetRetrieveState == SOTA_PACKET_RETRIEVE_PROCESSING)
@@ -1352,6 +3323,10 @@ int main(void)
 		       packetRetrieveState = SOTA_PACKET_RETRIEVE_FINISHED;}
 		     }
 		   }
+			TRACE(TRACE_FRAME_END, packetSize);
+			STATS_STOP(STATS_RECEIVE, frameTimer);
+			STATS_COUNT(framesReceived, 1);
+			STATS_COUNT(bytesReceived, packetSize + 3);
 			//   sendchar(0x98);
 			//  for(int i=0; i<packetSize;i++)
 			//  sendchar(receivedPacket[i]);
@@ -1367,7 +3342,42 @@ int main(void)
 // PrintDecInt(packetSize,10);
 // sendchar(0x98);
 
+			if ((packetSize == frameTailSize) && (memcmp(receivedPacket + packetSize - BLOCKLEN, frameTail, BLOCKLEN) == 0))
+			{
+				//*	the last frame taken again, the host did not get its answer
+				STATS_COUNT(retransmits, 1);
+				answer_send();
+				continue;
+			}
+
+			STATS_START(frameTimer);
+#ifdef ENABLE_INLINE_PROGRAM
+		   inlineProgrammed	=	(isAuthenticated == 1) && program_page_inline(packetSize, msgBuffer);
+		   if (!inlineProgrammed)
+#endif
+		   {
 		   aes_decrypt(aes_buffer, receivedPacket, packetSize);
+#ifdef ENABLE_SESSION_KEYS
+		   if (sessionActive && !frame_head(seqNum))
+		   {
+			   sessionActive	=	0;
+			   aes_decrypt(aes_buffer, receivedPacket, packetSize);
+			   sessionActive	=	1;
+			   if (!frame_head(aes_buffer[1]))
+			   {
+				   //*	damaged, or a frame the chain moved past, the host repeats it
+				   STATS_COUNT(checksumErrors, 1);
+				   STATS_STOP(STATS_DECRYPT, frameTimer);
+				   continue;
+			   }
+			   //*	not sent under the session key, the host lost the session and starts over
+			   session_end();
+		   }
+#endif
+		   }
+			TRACE(TRACE_DECRYPT_DONE, 0);
+			STATS_STOP(STATS_DECRYPT, frameTimer);
+			STATS_START(frameTimer);
   // sendchar(0x34);
 
 
@@ -1380,7 +3390,15 @@ int main(void)
 
 			 receivedPacketIndex = 0;
 			msgParseState	=	ST_START;
-			while (msgParseState != ST_PROCESS )
+#ifdef ENABLE_INLINE_PROGRAM
+			if (inlineProgrammed)
+			{
+				msgParseState	=	ST_PROCESS;		//*	msgBuffer already holds the answer
+			}
+#endif
+			//*	always walks the whole frame and never past it, a malformed frame
+			//*	costs the same wherever it breaks
+			while (receivedPacketIndex < packetSize)
 			{
 				c = aes_buffer[receivedPacketIndex];
 				  // sendchar(c);
@@ -1404,8 +3422,17 @@ int main(void)
 							msgParseState	=	ST_MSG_SIZE_1;
 							checksum		^=	c;
 						}
+						else if ((unsigned char)(c - seqNum + SEQ_WINDOW) <= (2 * SEQ_WINDOW))
+						{
+							//*	a late duplicate, or ahead of a frame that got lost, dropped
+							//*	so the host sends again from the lost one
+							STATS_COUNT(sequenceErrors, 1);
+							msgParseState	=	ST_START;
+							receivedPacketIndex	=	packetSize;
+						}
 						else
 						{
+							STATS_COUNT(sequenceErrors, 1);
 							sendchar(0x99);
 							sendchar(c);
 							sendchar(0x98);
@@ -1440,6 +3467,10 @@ int main(void)
 						msgLength		|=	c;
 						msgParseState	=	ST_GET_TOKEN;
 						checksum		^=	c;
+						if ((msgLength == 0) || (msgLength > sizeof(msgBuffer)))
+						{
+							msgParseState	=	ST_START;		//*	would overrun msgBuffer
+						}
 						break;
 					}
 
@@ -1477,13 +3508,25 @@ int main(void)
 						}
 						else
 						{
+							STATS_COUNT(checksumErrors, 1);
 							msgParseState	=	ST_START;
 						}
 						break;
 					}
+
+					case ST_PROCESS:
+						break;					//*	message complete, the rest is padding
 				}	//	switch
 				receivedPacketIndex++;
-			}	//	while(msgParseState)
+			}	//	while(receivedPacketIndex)
+			if (msgParseState != ST_PROCESS)
+			{
+				//*	no complete message in the frame, dropped without an answer,
+				//*	the host repeats it after its timeout
+				STATS_STOP(STATS_PARSE, frameTimer);
+				continue;
+			}
+			frame_taken();
 			/*
 			 * Now process the STK500 commands, see Atmel Appnote AVR068
 			 */
@@ -1503,6 +3546,12 @@ union{
 // sendchar(msgBuffer[0]);
 // sendchar(0x98);
 
+		#ifdef ENABLE_TRACE
+			unsigned char	traceCommand	=	msgBuffer[0];	//*	the answer overwrites it
+		#endif
+			//*	handlers check it against the fixed fields they read, beyond it
+			//*	msgBuffer still holds the bytes of the last command
+			requestLength	=	msgLength;
 			switch (msgBuffer[0])
 			{
 	// #ifndef AUTHENTICATION
@@ -1519,9 +3568,21 @@ union{
 						authenticationNumber.authBytes[3] = msgBuffer[4];
 
 						//PrintDecInt((uint32_t)msgBuffer[4]);
-						uint32_t number = (((uint32_t)msgBuffer[4])); // i dont have any idea why it's working.
 
 						authenticationNumber.authenticationNumber = authenticationNumber.authenticationNumber +  secretKey.secretKey;
+					#ifdef ENABLE_ENTROPY_POOL
+						//*	fresh challenge for CMD_AUTH_SECOND_PHASE
+						entropy_nonce(randomGeneratedKey.randomGeneratedKeyBytes, 4);
+					#ifdef ENABLE_STATS
+						if (stats.entropyCycles == 0)
+						{
+							__asm__ __volatile__ ("cli");
+							stats.entropyNonceSamples	=	entropySamples;
+							__asm__ __volatile__ ("sei");
+							stats.entropyCycles			=	cycle_clock_now();
+						}
+					#endif
+					#endif
 
 						msgBuffer[0] = STATUS_CMD_OK;
 						msgBuffer[1] = authenticationNumber.authBytes[0];
@@ -1561,12 +3622,19 @@ union{
 
 						randomGeneratedKey.randomGeneratedKey = randomGeneratedKey.randomGeneratedKey +  secretKey.secretKey;
 
+						//*	the token alone does not authenticate, the answer to the challenge has to match
 						if(randomGeneratedKey.randomGeneratedKey == authenticationNumber.authenticationNumber)
 						{
 							msgBuffer[0] = STATUS_CMD_OK;
+							msgLength = 1;
+							isAuthenticated = 1;
+						}
+						else
+						{
+							msgBuffer[1] = STATUS_CMD_FAILED;
+							msgLength = 2;
+							isAuthenticated = 0;
 						}
-						msgLength = 1;
-						isAuthenticated = 1;
 
 					}
 					else
@@ -1580,6 +3648,49 @@ union{
 				}
 
 
+			#ifdef ENABLE_FAST_AUTH
+				case CMD_AUTH_FAST:
+					{
+						uint32_t	storedCounter;
+
+						//*	a failed attempt leaves a session that is already up alone
+						msgBuffer[1]	=	STATUS_CMD_OK;
+						msgLength		=	2;
+						if ((requestLength >= 21) && auth_fast(msgBuffer + 1, msgBuffer + 2))
+						{
+							isAuthenticated	=	1;
+						#ifdef ENABLE_SESSION_KEYS
+							msgLength		=	2 + BLOCKLEN;	//*	the device nonce
+						#endif
+						}
+						else
+						{
+							//*	tell the host where the counter stands so it can retry
+							storedCounter	=	auth_stored_counter();
+							msgBuffer[1]	=	STATUS_CMD_FAILED;
+							msgBuffer[2]	=	storedCounter >> 24;
+							msgBuffer[3]	=	storedCounter >> 16;
+							msgBuffer[4]	=	storedCounter >> 8;
+							msgBuffer[5]	=	storedCounter;
+							msgLength		=	6;
+						}
+					}
+					break;
+
+				case CMD_AUTH_TICKET:
+					msgBuffer[1]	=	STATUS_CMD_FAILED;
+					msgLength		=	2;
+					if ((requestLength >= 17) && auth_ticket(msgBuffer + 1, msgBuffer + 2))
+					{
+						isAuthenticated	=	1;
+						msgBuffer[1]	=	STATUS_CMD_OK;
+					#ifdef ENABLE_SESSION_KEYS
+						msgLength		=	2 + BLOCKLEN;	//*	the device nonce
+					#endif
+					}
+					break;
+			#endif
+
 	// #endif
 	#ifndef REMOVE_CMD_SPI_MULTI
 				case CMD_SPI_MULTI:
@@ -1609,16 +3720,16 @@ union{
 						{
 						//*	Issue 544: 	stk500v2 bootloader doesn't support reading fuses
 						//*	I cant find the docs that say what these are supposed to be but this was figured out by trial and error
-						//	answerByte	=	boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
-						//	answerByte	=	boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+						//	answerByte	=	hal_fuse_read(HAL_FUSE_LOW);
+						//	answerByte	=	hal_fuse_read(HAL_FUSE_HIGH);
 						//	answerByte	=	boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
 							if (msgBuffer[4] == 0x50)
 							{
-								answerByte	=	boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+								answerByte	=	hal_fuse_read(HAL_FUSE_LOW);
 							}
 							else if (msgBuffer[4] == 0x58)
 							{
-								answerByte	=	boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+								answerByte	=	hal_fuse_read(HAL_FUSE_HIGH);
 							}
 							else
 							{
@@ -1698,7 +3809,7 @@ union{
 					break;
 
 				case CMD_LEAVE_PROGMODE_ISP:{
-	 if(isAuthenticated == 1){
+	 if((isAuthenticated == 1) && app_is_bootable()){
 					isLeave	=	1;
 					msgLength		=	2;
 					msgBuffer[1]	=	STATUS_CMD_OK;
@@ -1745,7 +3856,7 @@ union{
 				case CMD_READ_LOCK_ISP:
 					msgLength		=	4;
 					msgBuffer[1]	=	STATUS_CMD_OK;
-					msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_LOCK_BITS );
+					msgBuffer[2]	=	hal_fuse_read(HAL_LOCK_BITS);
 					msgBuffer[3]	=	STATUS_CMD_OK;
 					break;
 
@@ -1756,13 +3867,13 @@ union{
 						if ( msgBuffer[2] == 0x50 )
 						{
 							if ( msgBuffer[3] == 0x08 )
-								fuseBits	=	boot_lock_fuse_bits_get( GET_EXTENDED_FUSE_BITS );
+								fuseBits	=	hal_fuse_read(HAL_FUSE_EXTENDED);
 							else
-								fuseBits	=	boot_lock_fuse_bits_get( GET_LOW_FUSE_BITS );
+								fuseBits	=	hal_fuse_read(HAL_FUSE_LOW);
 						}
 						else
 						{
-							fuseBits	=	boot_lock_fuse_bits_get( GET_HIGH_FUSE_BITS );
+							fuseBits	=	hal_fuse_read(HAL_FUSE_HIGH);
 						}
 						msgLength		=	4;
 						msgBuffer[1]	=	STATUS_CMD_OK;
@@ -1777,8 +3888,8 @@ union{
 						unsigned char lockBits	=	msgBuffer[4];
 
 						lockBits	=	(~lockBits) & 0x3C;	// mask BLBxx bits
-						boot_lock_bits_set(lockBits);		// and program it
-						boot_spm_busy_wait();
+						hal_lock_bits_set(lockBits);		// and program it
+						hal_flash_busy_wait();
 
 						msgLength		=	3;
 						msgBuffer[1]	=	STATUS_CMD_OK;
@@ -1787,7 +3898,10 @@ union{
 					break;
 	#endif
 				case CMD_CHIP_ERASE_ISP:
-					eraseAddress	=	0;
+					memset(pageEraseMap, 0, sizeof(pageEraseMap));
+				#ifdef ENABLE_IMAGE_SIGNATURE
+					image_hash_reset();
+				#endif
 					msgLength		=	2;
 				//	msgBuffer[1]	=	STATUS_CMD_OK;
 					msgBuffer[1]	=	STATUS_CMD_FAILED;	//*	isue 543, return FAILED instead of OK
@@ -1796,7 +3910,7 @@ union{
 					case CMD_LOAD_ADDRESS:
 					{
 							if(isAuthenticated == 1){
-		#if defined(RAMPZ)
+		#ifdef HAL_FAR_FLASH
 						address	=	( ((address_t)(msgBuffer[1])<<24)|((address_t)(msgBuffer[2])<<16)|((address_t)(msgBuffer[3])<<8)|(msgBuffer[4]) )<<1;
 		#else
 						address	=	( ((msgBuffer[3])<<8)|(msgBuffer[4]) )<<1;		//convert word to byte address
@@ -1815,54 +3929,71 @@ union{
 					case CMD_PROGRAM_FLASH_ISP:
 					case CMD_PROGRAM_EEPROM_ISP:
 						{
+							#ifdef ENABLE_INLINE_PROGRAM
+								if (inlineProgrammed)
+								{
+									msgLength	=	2;
+									break;
+								}
+							#endif
 								if(isAuthenticated == 1){
 							unsigned int	size	=	((msgBuffer[1])<<8) | msgBuffer[2];
 							unsigned char	*p	=	msgBuffer+10;
 							// unsigned char *p = dummyArray;
 							unsigned int	data;
 							unsigned char	highByte, lowByte;
-							address_t		tempaddress	=	address;
+							unsigned char	status		=	STATUS_CMD_OK;
+							address_t		tempaddress	=	address + slotOffset;
 
-							if ( msgBuffer[0] == CMD_PROGRAM_FLASH_ISP )
+							//*	the data has to come with the request, past its end msgBuffer holds stale bytes
+							if ((size == 0) || (requestLength < 10) || (size > (requestLength - 10)))
 							{
-								// erase only main section (bootloader protection)
-								if (eraseAddress < APP_END )
-								{
-									boot_page_erase(eraseAddress);	// Perform page erase
-									boot_spm_busy_wait();		// Wait until the memory is erased.
-									eraseAddress += SPM_PAGESIZE;	// point to next page to be erase
-								}
+								status	=	STATUS_CMD_FAILED;
+							}
+							else if ( msgBuffer[0] == CMD_PROGRAM_FLASH_ISP )
+							{
+							#ifdef ENABLE_IMAGE_SIGNATURE
+								image_hash_data(address, p, size);
+							#endif
 
-								/* Write FLASH */
-								do {
+								/* Write FLASH, the frame may cover any number of pages */
+								while (size)
+								{
 									lowByte		=	*p++;
-									highByte 	=	*p++;
+									highByte	=	0xff;			// an odd byte count leaves the last high byte erased
+									if (size > 1)
+									{
+										highByte	=	*p++;
+										size--;
+									}
+									size--;
 
 									data		=	(highByte << 8) | lowByte;
-									boot_page_fill(address,data);
-
-									address	=	address + 2;	// Select next word in memory
-									size	-=	2;				// Reduce number of bytes to write by two
-								} while (size);					// Loop until all bytes written
-
-								boot_page_write(tempaddress);
-								boot_spm_busy_wait();
-								boot_rww_enable();				// Re-enable the RWW section
+									if (!page_fill_word(tempaddress, data))
+									{
+										status	=	STATUS_CMD_FAILED;	//*	past the end of the slot
+										break;
+									}
+
+									address		=	address + 2;	// Select next word in memory
+									tempaddress	=	tempaddress + 2;
+								}
+								page_commit();
 							}
 							else
 							{
 								//*	issue 543, this should work, It has not been tested.
 								uint16_t ii = address >> 1;
-								/* write EEPROM */
+								/* queue EEPROM writes, unchanged bytes are skipped */
 								while (size) {
-									eeprom_write_byte((uint8_t*)ii, *p++);
+									eeprom_queue_write(ii, *p++);
 									address+=2;						// Select next EEPROM byte
 									ii++;
 									size--;
 								}
 							}
 							msgLength		=	2;
-							msgBuffer[1]	=	STATUS_CMD_OK;
+							msgBuffer[1]	=	status;
 						}
 						else
 						{
@@ -1879,34 +4010,32 @@ union{
 						unsigned char	*p		=	msgBuffer+1;
 						msgLength				=	size+3;
 
+						//*	the EEPROM holds the key material and the counters behind the handshakes,
+						//*	the boot section its data image; the answer has to fit msgBuffer and,
+						//*	with header, checksum and padding, one frame of receivedPacket
+						if ((isAuthenticated != 1) || (requestLength < 3) || (size == 0)
+							|| (size > (sizeof(msgBuffer) - 3)) || ((size + 10) > sizeof(receivedPacket))
+							|| ((msgBuffer[0] == CMD_READ_FLASH_ISP) && ((address + slotOffset) > (APP_END - size))))
+						{
+							msgLength		=	2;
+							msgBuffer[1]	=	STATUS_CMD_FAILED;
+							break;
+						}
 						*p++	=	STATUS_CMD_OK;
 						if (msgBuffer[0] == CMD_READ_FLASH_ISP )
 						{
-							unsigned int data;
-
-							// Read FLASH
-							do {
-						//#if defined(RAMPZ)
-						#if (FLASHEND > 0x10000)
-								data	=	pgm_read_word_far(address);
-						#else
-								data	=	pgm_read_word_near(address);
-						#endif
-								*p++	=	(unsigned char)data;		//LSB
-								*p++	=	(unsigned char)(data >> 8);	//MSB
-								address	+=	2;							// Select next word in memory
-								size	-=	2;
-							}while (size);
+							// Read FLASH, words come out LSB first just like the flash bytes
+							hal_flash_read_block(address + slotOffset, p, size);
+							p		+=	size;
+							address	+=	size;
 						}
 						else
 						{
+							eeprom_queue_flush();			// let pending writes land first
 							/* Read EEPROM */
 							do {
-								EEARL	=	address;			// Setup EEPROM address
-								EEARH	=	((address >> 8));
+								*p++	=	hal_eeprom_read_byte(address);	// Send EEPROM data
 								address++;					// Select next EEPROM byte
-								EECR	|=	(1<<EERE);			// Read EEPROM
-								*p++	=	EEDR;				// Send EEPROM data
 								size--;
 							} while (size);
 						}
@@ -1914,75 +4043,317 @@ union{
 					}
 					break;
 
-				default:
-					msgLength		=	2;
-					msgBuffer[1]	=	STATUS_CMD_FAILED;
+			#ifdef ENABLE_READ_BULK
+				case CMD_READ_FLASH_BULK:
+					{
+						//*	stream a flash range as a run of answers to this one request,
+						//*	every frame carries BULK_READ_CHUNK bytes, a bare status frame ends it;
+						//*	a repeat gets that closing frame again, the host asks anew for what it missed
+						uint32_t	readAddress	=	((uint32_t)msgBuffer[1]<<24) | ((uint32_t)msgBuffer[2]<<16) | ((uint32_t)msgBuffer[3]<<8) | msgBuffer[4];
+						uint32_t	readLength	=	((uint32_t)msgBuffer[5]<<24) | ((uint32_t)msgBuffer[6]<<16) | ((uint32_t)msgBuffer[7]<<8) | msgBuffer[8];
+						unsigned int	chunk;
+
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
+
+						//*	the boot section stays unreadable, its data image holds the key
+						if ((isAuthenticated == 1) && (requestLength >= 9) && (readAddress <= APP_END) && (readLength <= (APP_END - readAddress)))
+						{
+							msgBuffer[1]	=	STATUS_CMD_OK;
+							while (readLength)
+							{
+								chunk	=	BULK_READ_CHUNK;
+								if (readLength < chunk)
+								{
+									chunk	=	readLength;
+								}
+								hal_flash_read_block(readAddress, msgBuffer + 2, chunk);
+								send_response(msgBuffer, chunk + 2);
+								readAddress	+=	chunk;
+								readLength	-=	chunk;
+							}
+						}
+					}
 					break;
-			}
+			#endif
 
-			/*
-			 * Now send answer message back
-			 */
+			#ifdef ENABLE_IMAGE_VERIFY
+				case CMD_VERIFY_IMAGE:
+					{
+						//*	digest the flash range on the device instead of reading it all back
+						unsigned char	verifyMode		=	msgBuffer[1];
+						uint32_t		verifyAddress	=	((uint32_t)msgBuffer[2]<<24) | ((uint32_t)msgBuffer[3]<<16) | ((uint32_t)msgBuffer[4]<<8) | msgBuffer[5];
+						uint32_t		verifyLength	=	((uint32_t)msgBuffer[6]<<24) | ((uint32_t)msgBuffer[7]<<16) | ((uint32_t)msgBuffer[8]<<8) | msgBuffer[9];
 
-			 // encryption kismi burada olmali
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
+
+						if ((isAuthenticated == 1) && (requestLength >= 10) && (verifyAddress <= APP_END) && (verifyLength <= (APP_END - verifyAddress)))
+						{
+							if (verifyMode == VERIFY_MODE_CRC32)
+							{
+								uint32_t	crc	=	0xFFFFFFFF;
 
-// aes_encrypt(receivedPacket, aes_buffer, packetSize);
-			receivedPacketIndex = 0;
+								while (verifyLength--)
+								{
+									crc	=	crc32_update(crc, hal_flash_read_byte(verifyAddress++));
+								}
+								crc				=	~crc;
+								msgBuffer[2]	=	crc >> 24;
+								msgBuffer[3]	=	crc >> 16;
+								msgBuffer[4]	=	crc >> 8;
+								msgBuffer[5]	=	crc;
+								msgBuffer[1]	=	STATUS_CMD_OK;
+								msgLength		=	6;
+							}
+						#ifdef ENABLE_VERIFY_SHA256
+							else if (verifyMode == VERIFY_MODE_SHA256)
+							{
+								sha256_ctx_t	sha;
 
-			receivedPacket[receivedPacketIndex++] = MESSAGE_START;
+								sha256_init(&sha);
+								while (verifyLength--)
+								{
+									sha256_update(&sha, hal_flash_read_byte(verifyAddress++));
+								}
+								sha256_final(&sha, msgBuffer+2);
+								msgBuffer[1]	=	STATUS_CMD_OK;
+								msgLength		=	34;
+							}
+						#endif
+						}
+					}
+					break;
+			#endif
 
-			checksum	=	MESSAGE_START^0;
-			receivedPacket[receivedPacketIndex++] = seqNum;
-			checksum	^=	seqNum;
+			#ifdef ENABLE_RESUME
+				case CMD_RESUME:
+					{
+						//*	report the pages of this image that still have to be sent
+						unsigned char	imageId[4];
+						unsigned int	jj;
 
-			c			=	((msgLength>>8)&0xFF);
-			receivedPacket[receivedPacketIndex++] = c;
-			checksum	^=	c;
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
 
-			c			=	msgLength&0x00FF;
-			receivedPacket[receivedPacketIndex++] = c;
-			checksum ^= c;
-			residualNumber = (msgLength+6) % 16;
+						if ((isAuthenticated == 1) && (requestLength >= 5))
+						{
+							eeprom_queue_flush();
+							hal_eeprom_read_block(imageId, EE_RESUME_IMAGE_ID, 4);
+							hal_eeprom_read_block(resumeMap, EE_RESUME_MAP, APP_PAGE_MAP_SIZE);
+							if (memcmp(imageId, msgBuffer+1, 4) != 0)
+							{
+								//*	a different image, start over with every page missing
+								for (jj = 0; jj < APP_PAGE_MAP_SIZE; jj++)
+								{
+									resumeMap[jj]	=	0xff;
+									eeprom_queue_write(EE_RESUME_MAP + jj, 0xff);
+								}
+								for (jj = 0; jj < 4; jj++)
+								{
+									eeprom_queue_write(EE_RESUME_IMAGE_ID + jj, msgBuffer[1 + jj]);
+								}
+							}
+							resumeActive	=	1;
 
-			finalResponseSize = ((msgLength+(16-residualNumber)+6));
+							memcpy(msgBuffer+2, resumeMap, APP_PAGE_MAP_SIZE);
+							msgBuffer[1]	=	STATUS_CMD_OK;
+							msgLength		=	2 + APP_PAGE_MAP_SIZE;
+						}
+					}
+					break;
+			#endif
 
-			if(residualNumber != 0)
-			{
+			#ifdef ENABLE_DUAL_SLOT
+				case CMD_SELECT_SLOT:
+					{
+						//*	0 programs the running image in place, 1 stages into slot B,
+						//*	the answer carries the flash address the slot starts at
+						unsigned char	slot	=	msgBuffer[1];
 
-				for(int excessiveNumberIndex = (msgLength+6); excessiveNumberIndex<finalResponseSize; excessiveNumberIndex++)
-				{
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
+						if ((isAuthenticated == 1) && (requestLength >= 2) && (slot <= 1))
+						{
+							slotOffset			=	slot ? SLOT_B_BASE : 0;
+							stagedImageVerified	=	0;
+							msgBuffer[1]		=	STATUS_CMD_OK;
+							msgBuffer[2]		=	(uint32_t)slotOffset >> 24;
+							msgBuffer[3]		=	(uint32_t)slotOffset >> 16;
+							msgBuffer[4]		=	slotOffset >> 8;
+							msgBuffer[5]		=	slotOffset;
+							msgLength			=	6;
+						}
+					}
+					break;
 
-					receivedPacket[excessiveNumberIndex] = 0xff;
-				}
+				case CMD_ACTIVATE_SLOT:
+					{
+						//*	check the staged image against the host's CRC32, then copy it into slot A
+						uint32_t		imageLength	=	((uint32_t)msgBuffer[1]<<24) | ((uint32_t)msgBuffer[2]<<16) | ((uint32_t)msgBuffer[3]<<8) | msgBuffer[4];
+						uint32_t		imageCrc	=	((uint32_t)msgBuffer[5]<<24) | ((uint32_t)msgBuffer[6]<<16) | ((uint32_t)msgBuffer[7]<<8) | msgBuffer[8];
+						uint32_t		crc			=	0xFFFFFFFF;
+						address_t		crcAddress;
+						unsigned char	imageOk;
 
-			}
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
 
-			receivedPacket[receivedPacketIndex++] = TOKEN;
-			checksum ^= TOKEN;
-			p	=	msgBuffer;
-			while ( msgLength )
-			{
-				c	=	*p++;
-				receivedPacket[receivedPacketIndex++] = c;
-				checksum ^=c;
-				msgLength--;
-			}
+						if ((isAuthenticated == 1) && (requestLength >= 9) && (imageLength <= APP_TRAILER))
+						{
+							for (crcAddress = 0; crcAddress < imageLength; crcAddress++)
+							{
+								crc	=	crc32_update(crc, hal_flash_read_byte(SLOT_B_BASE + crcAddress));
+							}
+							imageOk	=	(~crc == imageCrc);
+						#ifdef ENABLE_IMAGE_SIGNATURE
+							imageOk	&=	stagedImageVerified;
+						#endif
+							if (imageOk)
+							{
+							#ifdef ENABLE_APP_TRAILER
+								//*	copied along with the image
+								app_trailer_write(SLOT_B_BASE + APP_TRAILER, imageLength, imageCrc);
+							#endif
+								slot_activate((imageLength + SPM_PAGESIZE - 1) / SPM_PAGESIZE);
+							#ifdef ENABLE_IMAGE_SIGNATURE
+								eeprom_queue_write(EE_IMAGE_STATUS, IMAGE_STATUS_AUTHENTIC);
+							#endif
+								slotOffset		=	0;
+								msgBuffer[1]	=	STATUS_CMD_OK;
+							}
+						}
+					}
+					break;
+			#endif
 
-			receivedPacket[receivedPacketIndex++] = checksum;
-			seqNum++;
+			#ifdef ENABLE_APP_TRAILER
+				case CMD_COMMIT_IMAGE:
+					{
+						//*	the upload is complete, check it and leave the trailer that lets it boot
+						uint32_t	imageLength	=	((uint32_t)msgBuffer[1]<<24) | ((uint32_t)msgBuffer[2]<<16) | ((uint32_t)msgBuffer[3]<<8) | msgBuffer[4];
+						uint32_t	imageCrc	=	((uint32_t)msgBuffer[5]<<24) | ((uint32_t)msgBuffer[6]<<16) | ((uint32_t)msgBuffer[7]<<8) | msgBuffer[8];
 
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
+
+						if ((isAuthenticated == 1) && (requestLength >= 9) && (slotOffset == 0) && (imageLength <= APP_TRAILER)
+							&& (flash_crc32(0, imageLength) == imageCrc))
+						{
+							app_image_changed();
+							app_trailer_write(APP_TRAILER, imageLength, imageCrc);
+							eeprom_queue_write(EE_APP_VERIFIED, APP_VERIFIED);
+							eeprom_queue_write(EE_UPLOAD_STATUS, 0xff);
+							appCheck		=	APP_CHECK_GOOD;
+							appCacheCleared	=	0;
+							msgBuffer[1]	=	STATUS_CMD_OK;
+						}
+					}
+					break;
+			#endif
+
+			#ifdef ENABLE_IMAGE_SIGNATURE
+				case CMD_IMAGE_SIGNATURE:
+					{
+						uint32_t		imageLength	=	((uint32_t)msgBuffer[1]<<24) | ((uint32_t)msgBuffer[2]<<16) | ((uint32_t)msgBuffer[3]<<8) | msgBuffer[4];
+						unsigned char	digest[32];
+
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
+
+						if ((isAuthenticated == 1) && (requestLength >= (5 + RSA_BYTES)) && (imageLength <= APP_END))
+						{
+							if (!imageHashInOrder || (imageHash.length != imageLength))
+							{
+								//*	the stream did not cover exactly this image, hash it from flash
+								address_t	hashAddress;
+
+								sha256_init(&imageHash);
+								for (hashAddress = 0; hashAddress < imageLength; hashAddress++)
+								{
+									sha256_update(&imageHash, hal_flash_read_byte(slotOffset + hashAddress));
+								}
+							}
+							sha256_final(&imageHash, digest);
+							image_hash_reset();
+
+							if (image_signature_valid(digest, msgBuffer+5))
+							{
+							#ifdef ENABLE_DUAL_SLOT
+								if (slotOffset != 0)
+								{
+									//*	the staged image, slot A keeps its own status until activation
+									stagedImageVerified	=	1;
+								}
+								else
+							#endif
+								{
+									eeprom_queue_write(EE_IMAGE_STATUS, IMAGE_STATUS_AUTHENTIC);
+								}
+								msgBuffer[1]	=	STATUS_CMD_OK;
+							}
+						}
+					}
+					break;
+			#endif
+
+			#ifdef ENABLE_TRACE
+				case CMD_GET_TRACE:
+					msgLength		=	2;
+					msgBuffer[1]	=	STATUS_CMD_FAILED;
+
+					if (isAuthenticated == 1)
+					{
+						msgBuffer[1]	=	STATUS_CMD_OK;
+						msgLength		+=	trace_report(msgBuffer+2, BULK_READ_CHUNK);
+					}
+					break;
+			#endif
 
+			#ifdef ENABLE_STATS
+				case CMD_GET_STATS:
+					{
+						//*	msgBuffer[1] bit 0 clears the counters once they are read
+						unsigned char	clear	=	(requestLength >= 2) && (msgBuffer[1] & 0x01);
+
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
 
+						if (isAuthenticated == 1)
+						{
+							msgBuffer[1]	=	STATUS_CMD_OK;
+							msgLength		+=	stats_report(msgBuffer+2);
+							if (clear)
+							{
+								memset(&stats, 0, sizeof(stats));
+							}
+						}
+					}
+					break;
+			#endif
 
+				default:
+					msgLength		=	2;
+					msgBuffer[1]	=	STATUS_CMD_FAILED;
+					break;
+			}
 
+			/*
+			 * Now send answer message back
+			 */
 
+			 // encryption kismi burada olmali
 
-			aes_encrypt(aes_buffer, receivedPacket, finalResponseSize);
-			sendchar(SOTA_MESSAGE_START);
-			sendchar((finalResponseSize>>8)&0xFF);
-			sendchar(finalResponseSize&0x00FF);
-			for(int i =0; i<finalResponseSize; i++)
-			sendchar(aes_buffer[i]);
+			TRACE(TRACE_PARSE_DONE, traceCommand);
+			STATS_STOP(STATS_PARSE, frameTimer);
+			send_response(msgBuffer, msgLength);
+			seqNum++;
+		#ifdef ENABLE_SESSION_KEYS
+			if (sessionPending)
+			{
+				session_start();			//*	the handshake answer went out, the session takes over
+			}
+		#endif
 
 		#ifndef REMOVE_BOOTLOADER_LED
 			//*	<MLS>	toggle the LED
@@ -2036,15 +4407,16 @@ union{
 	 * Now leave bootloader
 	 */
 
-	UART_STATUS_REG	&=	0xfd;
-	boot_rww_enable();				// enable application section
-
-
-	asm volatile(
-			"clr	r30		\n\t"
-			"clr	r31		\n\t"
-			"ijmp	\n\t"
-			);
+	hal_uart_release();
+#ifdef ENABLE_SPIFLASH_STAGING
+	if (stagingRemaining)
+	{
+		staging_finish();
+	}
+#endif
+	bootloader_cleanup();
+	hal_flash_rww_enable();				// enable application section
+	hal_start_application();
 //	asm volatile ( "push r1" "\n\t"		// Jump to Reset vector in Application Section
 //					"push r1" "\n\t"
 //					"ret"	 "\n\t"
@@ -2297,12 +4669,12 @@ unsigned char fuseByte;
 #if defined(GET_LOW_FUSE_BITS)
 	//*	fuse settings
 	PrintFromPROGMEM(gTextMsg_FUSE_BYTE_LOW, 0);
-	fuseByte	=	boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+	fuseByte	=	hal_fuse_read(HAL_FUSE_LOW);
 	PrintHexByte(fuseByte);
 	PrintNewLine();
 
 	PrintFromPROGMEM(gTextMsg_FUSE_BYTE_HIGH, 0);
-	fuseByte	=	boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+	fuseByte	=	hal_fuse_read(HAL_FUSE_HIGH);
 	PrintHexByte(fuseByte);
 	PrintNewLine();
 
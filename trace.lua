@@ -0,0 +1,134 @@
+#!/usr/bin/lua
+
+-- Converts CMD_GET_TRACE answers of a bootloader built with ENABLE_TRACE into
+-- Chrome trace JSON (chrome://tracing, Perfetto). Every input line holds one
+-- answer body as hex, command byte first, in the order they were read:
+--   lua trace.lua < dumps.txt > trace.json
+
+local io = require("io")
+
+local FRAME_START = 0x01
+local FRAME_END = 0x02
+local DECRYPT_DONE = 0x03
+local PARSE_DONE = 0x04
+local PAGE_ERASE = 0x05
+local PAGE_WRITE = 0x06
+local PAGE_DONE = 0x07
+local RESPONSE_SENT = 0x08
+
+local LINK_TID = 1
+local SPM_TID = 2
+
+local events = {}
+local f_cpu
+local last_raw
+local wraps = 0
+
+-- the cycle counter wraps after 2^32, events arrive in order
+local function unwrap(raw)
+  if last_raw and raw < last_raw then
+    wraps = wraps + 1
+  end
+  last_raw = raw
+  return raw + wraps * 4294967296
+end
+
+local line_number = 0
+for line in io.lines() do
+  line_number = line_number + 1
+  local bytes = {}
+  for hex in string.gmatch(line, "%x%x") do
+    table.insert(bytes, tonumber(hex, 16))
+  end
+  if #bytes > 0 then
+    if #bytes < 11 or bytes[1] ~= 0x73 or bytes[2] ~= 0x00 or bytes[3] ~= 1 then
+      io.stderr:write("line " .. line_number .. ": not a CMD_GET_TRACE answer\n")
+      os.exit(1)
+    end
+    f_cpu = ((bytes[4] * 256 + bytes[5]) * 256 + bytes[6]) * 256 + bytes[7]
+    local lost = bytes[8] * 256 + bytes[9]
+    local count = bytes[11]
+    if lost > 0 then
+      table.insert(events, { lost = lost })
+    end
+    for idx = 0, count - 1 do
+      local base = 12 + idx * 7
+      if not bytes[base + 6] then
+        io.stderr:write("line " .. line_number .. ": answer too short\n")
+        os.exit(1)
+      end
+      local raw = ((bytes[base] * 256 + bytes[base + 1]) * 256 + bytes[base + 2]) * 256 + bytes[base + 3]
+      table.insert(events, {
+        stamp = unwrap(raw),
+        event = bytes[base + 4],
+        arg = bytes[base + 5] * 256 + bytes[base + 6],
+      })
+    end
+  end
+end
+
+if not f_cpu then
+  io.stderr:write("no CMD_GET_TRACE answers\n")
+  os.exit(1)
+end
+
+local out = {}
+local origin
+local function us(stamp)
+  return (stamp - origin) * 1000000 / f_cpu
+end
+
+local function span(name, tid, from, to, args)
+  if from and to then
+    table.insert(out, string.format('{"name":"%s","ph":"X","pid":1,"tid":%d,"ts":%.3f,"dur":%.3f%s}',
+      name, tid, us(from), (to - from) * 1000000 / f_cpu, args or ""))
+  end
+end
+
+-- the start of every span, a lost event block forgets them all
+local frame_start, frame_end, decrypt_done, parse_done, erase_start, write_start
+local last_stamp
+
+for _, e in ipairs(events) do
+  if e.lost then
+    if last_stamp then
+      table.insert(out, string.format('{"name":"%d events lost","ph":"i","s":"g","pid":1,"tid":%d,"ts":%.3f}',
+        e.lost, LINK_TID, us(last_stamp)))
+    end
+    frame_start, frame_end, decrypt_done, parse_done, erase_start, write_start = nil, nil, nil, nil, nil, nil
+  else
+    origin = origin or e.stamp
+    last_stamp = e.stamp
+    if e.event == FRAME_START then
+      frame_start = e.stamp
+    elseif e.event == FRAME_END then
+      span("receive", LINK_TID, frame_start, e.stamp, string.format(',"args":{"bytes":%d}', e.arg))
+      frame_end = e.stamp
+    elseif e.event == DECRYPT_DONE then
+      span("decrypt", LINK_TID, frame_end, e.stamp)
+      decrypt_done = e.stamp
+    elseif e.event == PARSE_DONE then
+      span(string.format("command 0x%02X", e.arg), LINK_TID, decrypt_done, e.stamp)
+      parse_done = e.stamp
+    elseif e.event == RESPONSE_SENT then
+      span("respond", LINK_TID, parse_done, e.stamp, string.format(',"args":{"bytes":%d}', e.arg))
+      frame_start, frame_end, decrypt_done, parse_done = nil, nil, nil, nil
+    elseif e.event == PAGE_ERASE then
+      erase_start = e.stamp
+    elseif e.event == PAGE_WRITE then
+      span("erase", SPM_TID, erase_start, e.stamp, string.format(',"args":{"page":%d}', e.arg))
+      erase_start = nil
+      write_start = e.stamp
+    elseif e.event == PAGE_DONE then
+      span("write", SPM_TID, write_start, e.stamp, string.format(',"args":{"page":%d}', e.arg))
+      write_start = nil
+    end
+  end
+end
+
+table.insert(out, '{"name":"thread_name","ph":"M","pid":1,"tid":1,"args":{"name":"link"}}')
+table.insert(out, '{"name":"thread_name","ph":"M","pid":1,"tid":2,"args":{"name":"spm"}}')
+
+io.write('{"traceEvents":[\n')
+io.write(table.concat(out, ",\n"))
+io.write('\n]}\n')